@@ -11,6 +11,7 @@
 #include "Patterns.h"
 #include "Debug.h"
 #include "bbm.h"
+#include "MovesSimd.h"
 
 ///////////////////////////////////////////
 // CBitBoard class
@@ -92,6 +93,16 @@ u4 CBitBoard::Hash() const {
    return d;
 }
 
+i8 CBitBoard::Hash64() const {
+   u4 a,b,c,d;
+   a=empty.u4s[0];
+   b=empty.u4s[1];
+   c=mover.u4s[0];
+   d=mover.u4s[1];
+   bobLookup(a,b,c,d);
+   return (i8(c)<<32)|d;
+}
+
 CBitBoard CBitBoard::MinimalReflection() const {
    CBitBoard result, temp;
    int i,j,k;
@@ -111,6 +122,51 @@ CBitBoard CBitBoard::MinimalReflection() const {
    return result;
 }
 
+// MinimalReflection() of n boards at once, e.g. all children of a node.
+//	The boards are split into arrays of empty and mover bits and every step is done for the
+//	whole array before the next one, so the compiler can run the loops in SIMD registers.
+//	Same order of flips and comparisons as MinimalReflection(), so the results are the same.
+void CBitBoard::MinimalReflections(const CBitBoard* boards, int n, CBitBoard* minReflections) {
+   enum { nChunk=32 };
+   u64 tEmpty[nChunk], tMover[nChunk], rEmpty[nChunk], rMover[nChunk];
+   int i,j,k,iBoard,iStart,nBoards;
+
+   for (iStart=0; iStart<n; iStart+=nChunk) {
+      nBoards=n-iStart<nChunk ? n-iStart : nChunk;
+      for (iBoard=0; iBoard<nBoards; iBoard++) {
+         rEmpty[iBoard]=tEmpty[iBoard]=boards[iStart+iBoard].empty.bits;
+         rMover[iBoard]=tMover[iBoard]=boards[iStart+iBoard].mover.bits;
+      }
+      for (i=0; i<2; i++) {
+         for (j=0; j<2; j++) {
+            for (k=0; k<2; k++) {
+               for (iBoard=0; iBoard<nBoards; iBoard++) {
+                  // temp<result, as in operator<, without a branch
+                  bool fLess=(tMover[iBoard]<rMover[iBoard]) || (tMover[iBoard]==rMover[iBoard] && tEmpty[iBoard]<rEmpty[iBoard]);
+                  u64 mask=0-(u64)fLess;
+                  rEmpty[iBoard]^=(rEmpty[iBoard]^tEmpty[iBoard])&mask;
+                  rMover[iBoard]^=(rMover[iBoard]^tMover[iBoard])&mask;
+                  tEmpty[iBoard]=FlipVertical64(tEmpty[iBoard]);
+                  tMover[iBoard]=FlipVertical64(tMover[iBoard]);
+               }
+            }
+            for (iBoard=0; iBoard<nBoards; iBoard++) {
+               tEmpty[iBoard]=FlipHorizontal64(tEmpty[iBoard]);
+               tMover[iBoard]=FlipHorizontal64(tMover[iBoard]);
+            }
+         }
+         for (iBoard=0; iBoard<nBoards; iBoard++) {
+            tEmpty[iBoard]=FlipDiagonal64(tEmpty[iBoard]);
+            tMover[iBoard]=FlipDiagonal64(tMover[iBoard]);
+         }
+      }
+      for (iBoard=0; iBoard<nBoards; iBoard++) {
+         minReflections[iStart+iBoard].empty.bits=rEmpty[iBoard];
+         minReflections[iStart+iBoard].mover.bits=rMover[iBoard];
+      }
+   }
+}
+
 void CBitBoard::Print(bool fBlackMove) const {
    FPrint(stdout, fBlackMove);
 }
@@ -271,13 +327,48 @@ int CBitBoard::TerminalValue() const {
 //	c - color of this row
 //	e - empty of this row
 
-// use dima's assembly language routines for mobility?
+// use dima's assembly language routines for mobility? They're MMX, so only on 32-bit x86.
+//	Elsewhere moves come from native 64-bit shifts, see NativeMoves().
+//	Either way, CPUs with AVX2 use the SIMD kernels in MovesSimd.cpp instead.
+#if defined(_MSC_VER) && defined(_M_IX86)
 #define DIMA 1
+#else
+#define DIMA 0
+#endif
 const __int64 nega_one=0xffffffffffffffff;
 #define CHECK 0
 
+#if !DIMA
+// follow runs of o discs from the p discs in the direction of increasing/decreasing square
+//	number. A run is at most 6 discs long.
+static inline u64 MovesUp(u64 p, u64 o, int d) {
+   u64 t=o&(p<<d);
+   t|=o&(t<<d); t|=o&(t<<d); t|=o&(t<<d); t|=o&(t<<d); t|=o&(t<<d);
+   return t<<d;
+}
+
+static inline u64 MovesDown(u64 p, u64 o, int d) {
+   u64 t=o&(p>>d);
+   t|=o&(t>>d); t|=o&(t>>d); t|=o&(t>>d); t|=o&(t>>d); t|=o&(t>>d);
+   return t>>d;
+}
+
+// legal moves for the player with discs p against discs o, all 8 directions
+static inline u64 NativeMoves(u64 p, u64 o) {
+   // a run that moves sideways can't include the a or h column, or it would wrap to the next row
+   const u64 oh=o&0x7E7E7E7E7E7E7E7EULL;
+   u64 moves;
+
+   moves =MovesUp(p, oh, 1)|MovesDown(p, oh, 1);
+   moves|=MovesUp(p, o, 8)|MovesDown(p, o, 8);
+   moves|=MovesUp(p, oh, 7)|MovesDown(p, oh, 7);
+   moves|=MovesUp(p, oh, 9)|MovesDown(p, oh, 9);
+   return moves&~(p|o);
+}
+#endif // !DIMA
+
 bool CBitBoard::CalcMoves(CMoves& moves) const {
-#if (CHECK || !DIMA)
+#if CHECK
    int nrow, srow;
    u4 ae, aw, a;
    u4 blackRowMoves, c, e, be, bw, b;
@@ -320,37 +411,42 @@ bool CBitBoard::CalcMoves(CMoves& moves) const {
    }
    moves.Set(blackMoves);
 
-#endif // (CHECK || !DIMA)
+#endif // CHECK
 
-#if (CHECK || DIMA)
-   const i8 moverBits=mover.i8s;
-   const i8 emptyBits=empty.i8s;
-   // calculate opponent bits
-   i8 opponentBits;
    i8 movesi8;
-   __asm {
-      movq	mm1,	moverBits;		// my bits
-      por		mm1,	emptyBits;		// empties
-      pxor	mm1,	nega_one;		// opponent bits
-      movq	 opponentBits, mm1;
-   }
-   DimaMoves(moverBits,opponentBits);
-   __asm {
-      movq movesi8, mm0;
-      emms;
+#if SIMD_MOVES
+   // AVX2 or AVX-512, if this CPU has them
+   if (pSimdMoves)
+      movesi8=pSimdMoves(mover.bits, ~(mover.bits|empty.bits));
+   else
+#endif // SIMD_MOVES
+   {
+#if DIMA
+      const i8 moverBits=mover.i8s;
+      const i8 emptyBits=empty.i8s;
+      // calculate opponent bits
+      i8 opponentBits;
+      __asm {
+         movq	mm1,	moverBits;		// my bits
+         por		mm1,	emptyBits;		// empties
+         pxor	mm1,	nega_one;		// opponent bits
+         movq	 opponentBits, mm1;
+      }
+      DimaMoves(moverBits,opponentBits);
+      __asm {
+         movq movesi8, mm0;
+         emms;
+      }
+#else
+      movesi8=NativeMoves(mover.bits, ~(mover.bits|empty.bits));
+#endif // DIMA
    }
+
 #if CHECK
    _ASSERT(movesi8==blackMoves.i8s);
-#else
+#endif
    moves.Set(movesi8);
    return moves.HasMoves();
-#endif // CHECK
-#endif // (CHECK || DIMA)
-
-#if (CHECK || !DIMA)
-   // calc pass code
-   return (blackMoves.u4s[0] || blackMoves.u4s[1]);
-#endif
 }
 
 
@@ -366,7 +462,16 @@ void CBitBoard::Initialize() {
 // return the pass code: 0 = mover has a move, 1=mover has no move but opponent does, 2=no moves
 int CBitBoard::CalcMobility(u4& nMovesPlayer, u4& nMovesOpponent) const {
    int pass;
-   if (DIMA) {
+#if SIMD_MOVES
+   if (pSimdMoves) {
+      const u64 opponentBits=~(mover.bits|empty.bits);
+      nMovesPlayer=CountBits64(pSimdMoves(mover.bits, opponentBits));
+      nMovesOpponent=CountBits64(pSimdMoves(opponentBits, mover.bits));
+   }
+   else
+#endif // SIMD_MOVES
+   {
+#if DIMA
       const i8 moverBits=mover.i8s;
       const i8 emptyBits=empty.i8s;
       // calculate opponent bits
@@ -380,23 +485,24 @@ int CBitBoard::CalcMobility(u4& nMovesPlayer, u4& nMovesOpponent) const {
       nMovesPlayer = DimaMobility(moverBits,opponentBits);
       nMovesOpponent=DimaMobility(opponentBits,moverBits);
       __asm emms;
-      if (nMovesPlayer)
-         pass = 0;
-      else if (nMovesOpponent)
-         pass = 1;
-      else
-         pass = 2;
-#if (!CHECK)
-      return pass;
-#endif
+#else
+      const u64 opponentBits=~(mover.bits|empty.bits);
+      nMovesPlayer=CountBits64(NativeMoves(mover.bits, opponentBits));
+      nMovesOpponent=CountBits64(NativeMoves(opponentBits, mover.bits));
+#endif // DIMA
    }
+   if (nMovesPlayer)
+      pass = 0;
+   else if (nMovesOpponent)
+      pass = 1;
+   else
+      pass = 2;
+
 #if CHECK
    int passDima=pass;
    int nmpDima=nMovesPlayer;
    int nmoDima=nMovesOpponent;
-#endif
 
-#if (CHECK || !DIMA)
    CMoves moves;
 
    // old calcmobility function
@@ -469,7 +575,7 @@ int CBitBoard::CalcMobility(u4& nMovesPlayer, u4& nMovesOpponent) const {
    }
 #endif
 
-#endif // (CHECK || !DIMA)
+#endif // CHECK
    return pass;
 }
 
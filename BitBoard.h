@@ -35,6 +35,7 @@ public:
    void FlipDiagonal();
    CBitBoard Symmetry(int sym) const;
    CBitBoard MinimalReflection() const;
+   static void MinimalReflections(const CBitBoard* boards, int n, CBitBoard* minReflections);
 
    void InvertColors();
 
@@ -51,6 +52,8 @@ public:
 
    // statistics
    u4 Hash() const;
+   i8 Hash64() const;	// low 32 bits are Hash()
+   u4 FastHash() const;	// for in-memory tables, see below
    int NEmpty() const;
    void NDiscs(bool fBlackMove, int& nBlack, int& nWhite, int& nEmpty) const;
    int TerminalValue() const;
@@ -74,6 +77,18 @@ bool operator<(const CBitBoard& a, const CBitBoard& b);
 
 std::size_t hash_value(const CBitBoard& b);
 
+// Hash() can't change without changing the cache, and costs a few times as much as this.
+//	A multiply mixes both halves into the high bits.
+inline u4 CBitBoard::FastHash() const {
+   u64 h=(mover.bits^(empty.bits*0x9E3779B97F4A7C15ULL))*0xBF58476D1CE4E5B9ULL;
+   return u4((h^(h>>29))>>32);
+}
+
+class CBitBoardHash {
+public:
+   u4 operator()(const CBitBoard& b) const { return b.FastHash(); }
+};
+
 inline void CBitBoard::Impossible() {
    mover[0]=mover[1]=empty[0]=empty[1]=(u4)-1;
 }
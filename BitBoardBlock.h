@@ -22,17 +22,41 @@ public:
    }
 
    CBitBoardBlock() {};
-   CBitBoardBlock(const u8& b) { u4s[0]=b[0]; u4s[1]=b[1];};
+   CBitBoardBlock(const u8& b) { bits=b.bits;};
    void Clear();
    CBitBoardBlock Symmetry(int sym);
 
    void FlipHorizontal();
    void FlipVertical();
    void FlipDiagonal();
-
-private:
-   void FlipHorizontal32(u4& rows);
-   void FlipDiagonal32(u4& rows);
 };
 
-inline void CBitBoardBlock::Clear() {u4s[0]=u4s[1]=0;};
+inline void CBitBoardBlock::Clear() {bits=0;};
+
+// the flips on a raw u64. No branches or table lookups, so loops over arrays of boards vectorize.
+
+// the rows are the bytes, so a vertical flip is a byte swap
+inline u64 FlipVertical64(u64 bits) {
+   return ByteSwap64(bits);
+}
+
+// reverse the bits in each row
+inline u64 FlipHorizontal64(u64 bits) {
+   bits=((bits>>1)&0x5555555555555555ULL) | ((bits&0x5555555555555555ULL)<<1);
+   bits=((bits>>2)&0x3333333333333333ULL) | ((bits&0x3333333333333333ULL)<<2);
+   bits=((bits>>4)&0x0F0F0F0F0F0F0F0FULL) | ((bits&0x0F0F0F0F0F0F0F0FULL)<<4);
+   return bits;
+}
+
+// swap rows and columns: swap 4x4 blocks, then 2x2 blocks within them, then single squares
+inline u64 FlipDiagonal64(u64 bits) {
+   u64 t;
+
+   t=0x0F0F0F0F00000000ULL&(bits^(bits<<28));
+   bits^=t^(t>>28);
+   t=0x3333000033330000ULL&(bits^(bits<<14));
+   bits^=t^(t>>14);
+   t=0x5500550055005500ULL&(bits^(bits<<7));
+   bits^=t^(t>>7);
+   return bits;
+}
@@ -13,8 +13,11 @@
 #include "Games.h"
 #include "GDK/OsObjects.h"
 #include "Variation.h"
+#include "SearchThreads.h"
+#include "NodeStats.h"
 
 #include <boost/static_assert.hpp>
+#include <boost/thread/thread.hpp>
 
 #include <algorithm>
 #include <strstream>
@@ -25,6 +28,16 @@
 #include <time.h>
 #include <errno.h>
 
+#if defined(_WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 bool fPrintCorrections=true;
 
 namespace
@@ -185,6 +198,11 @@ char CBookValue::SolvedChar() const {
    else return vHeuristic>0?'W':'L';
 }
 
+bool CBookValue::operator==(const CBookValue& b) const {
+   return vHeuristic==b.vHeuristic && vBlack==b.vBlack && vWhite==b.vWhite
+      && fSet==b.fSet && fAssigned==b.fAssigned && fWLDSolved==b.fWLDSolved;
+}
+
 void CBookValue::Out(ostream& os, bool fReverse) const {
    if (fSet) {
       if (fReverse) {
@@ -392,6 +410,11 @@ CBookData::TLeafness CBookData::Leafness() const {
       return kULeaf;
 }
 
+bool CBookData::operator==(const CBookData& b) const {
+   return hi==b.hi && cutoff==b.cutoff && values==b.values
+      && nGames[0]==b.nGames[0] && nGames[1]==b.nGames[1] && fRoot==b.fRoot;
+}
+
 bool CBookData::IsMoreImportantThan(const CBookData& bd2) const {
    if (Leafness()>bd2.Leafness())
       return true;
@@ -400,6 +423,450 @@ bool CBookData::IsMoreImportantThan(const CBookData& bd2) const {
    return hi > bd2.hi;
 }
 
+////////////////////////////////////////////////////////////
+// Version 2 book files, see MapVersion2()
+////////////////////////////////////////////////////////////
+
+//	All fields of the header and records are fixed width so the file is the same on
+//	every platform.
+class CBookFileHeader {
+public:
+   int32_t nVersion;	// 2
+   uint32_t nRecordSize;	// sizeof(CBookRecord) of the program that wrote the file
+   uint32_t nRecords[nEmptyBookMax];	// number of records at each nEmpty
+};
+
+// the records start here so that they're aligned
+const size_t kBookHeaderSize=256;
+BOOST_STATIC_ASSERT(sizeof(CBookFileHeader)<=kBookHeaderSize);
+BOOST_STATIC_ASSERT(sizeof(CBitBoard)==16);
+
+#if defined(_WIN32)
+
+static const char* MapReadOnly(const char* fn, size_t& n) {
+   HANDLE hFile, hMapping;
+   LARGE_INTEGER size;
+   const char* p=0;
+
+   hFile=CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+   if (hFile==INVALID_HANDLE_VALUE)
+      return 0;
+   if (GetFileSizeEx(hFile, &size) && size.QuadPart>0) {
+      hMapping=CreateFileMappingA(hFile, 0, PAGE_READONLY, 0, 0, 0);
+      if (hMapping) {
+         p=(const char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+         CloseHandle(hMapping);
+         n=size_t(size.QuadPart);
+      }
+   }
+   CloseHandle(hFile);
+   return p;
+}
+
+static void Unmap(const char* p, size_t n) {
+   if (p)
+      UnmapViewOfFile(p);
+}
+
+// replace fnOld by fnNew
+static bool ReplaceBookFile(const char* fnNew, const char* fnOld) {
+   return MoveFileExA(fnNew, fnOld, MOVEFILE_REPLACE_EXISTING)!=0;
+}
+
+#else
+
+static const char* MapReadOnly(const char* fn, size_t& n) {
+   struct stat st;
+   void* p;
+   int fd;
+
+   fd=open(fn, O_RDONLY);
+   if (fd<0)
+      return 0;
+   p=MAP_FAILED;
+   if (fstat(fd, &st)==0 && st.st_size>0) {
+      n=size_t(st.st_size);
+      p=mmap(0, n, PROT_READ, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if (p==MAP_FAILED)
+      return 0;
+   // lookups jump all over the file, so readahead only wastes time
+   madvise(p, n, MADV_RANDOM);
+   return (const char*)p;
+}
+
+static void Unmap(const char* p, size_t n) {
+   if (p)
+      munmap((void*)p, n);
+}
+
+static bool ReplaceBookFile(const char* fnNew, const char* fnOld) {
+   return rename(fnNew, fnOld)==0;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////
+// Writing the book
+//	The whole book is written to bookname.tmp, flushed to disk, and then renamed over the
+//	book file, so a crash or a full disk never leaves a half-written book behind.
+//
+//	Stored, joined and corrected positions are also appended to bookname.journal as they
+//	arrive, one checksummed record per position, and replayed when the book is loaded.
+//	Stores are flushed to disk one at a time; joins and corrections come in batches and
+//	are flushed at the end of each batch (SyncJournal()). When a write starts the
+//	journal becomes bookname.journal.old, which is deleted once the new book file is in
+//	place; positions stored during the write go into a new journal.
+//
+//	Mirror() runs the write in a background thread so the search isn't held up. The
+//	thread gets a copy of the changed positions and its own mapping of the book file,
+//	so the book can go on changing while it runs.
+////////////////////////////////////////////////////////////
+
+static const char* const kJournal=".journal";
+static const char* const kJournalOld=".journal.old";
+
+class CJournalRecord {
+public:
+   CBookRecord record;
+   uint32_t check;	// of record, so that a record torn by a crash is noticed
+
+   uint32_t Checksum() const {
+      const u1* p=(const u1*)&record;
+      uint32_t h=2166136261u;
+      for (size_t i=0; i<sizeof(record); i++)
+         h=(h^p[i])*16777619u;
+      return h;
+   }
+};
+
+// flush fp all the way to the disk
+static bool SyncFile(FILE* fp) {
+   if (fflush(fp)!=0)
+      return false;
+#if defined(_WIN32)
+   return _commit(_fileno(fp))==0;
+#else
+   return fsync(fileno(fp))==0;
+#endif
+}
+
+// append the contents of fnFrom to fnTo
+static bool AppendFile(const char* fnFrom, const char* fnTo) {
+   FILE *fpFrom, *fpTo;
+   char buf[4096];
+   size_t n;
+   bool fOK;
+
+   fpFrom=fopen(fnFrom, "rb");
+   if (!fpFrom)
+      return false;
+   fpTo=fopen(fnTo, "ab");
+   fOK=fpTo!=0;
+   while (fOK && (n=fread(buf, 1, sizeof(buf), fpFrom))>0)
+      fOK=fwrite(buf, 1, n, fpTo)==n;
+   if (fpTo)
+      fOK=SyncFile(fpTo) && fclose(fpTo)==0 && fOK;
+   fclose(fpFrom);
+   return fOK;
+}
+
+class CBookSnapshot {
+public:
+   CBookSnapshot() : fOK(false), fDone(false), mapped(0), nMapped(0) {}
+   ~CBookSnapshot() {
+      if (thread)
+         thread->join();
+      Unmap(mapped, nMapped);
+   }
+
+   void Write();
+
+   std::string fnTemp;
+   int pruneHeight;
+   std::vector<CBookRecord> changed[nEmptyBookMax];	// these take precedence over the mapped records
+   bool fOK;
+   volatile bool fDone;
+   std::shared_ptr<boost::thread> thread;
+
+   // the book file, if the book was mapped
+   const char* mapped;
+   size_t nMapped;
+   const CBookRecord* records[nEmptyBookMax];
+   u4 nRecords[nEmptyBookMax];
+};
+
+// merge the mapped records with the changed positions into fnTemp
+void CBookSnapshot::Write() {
+   CBookFileHeader header;
+   FILE* fp;
+   int nEmpty;
+
+   fp=fopen(fnTemp.c_str(), "wb");
+   if (!fp) {
+      cerr << "WARNING: Error opening book file " << fnTemp << " for writing (errno " << errno << ")\n";
+      fDone=true;
+      return;
+   }
+
+   // the counts aren't known until the records are written, the header is rewritten at the end
+   memset(&header, 0, sizeof(header));
+   header.nVersion=2;
+   header.nRecordSize=sizeof(CBookRecord);
+   std::vector<char> headerBlock(kBookHeaderSize, 0);
+   fOK=fwrite(&headerBlock[0], kBookHeaderSize, 1, fp)==1;
+
+   for (nEmpty=(std::max)(pruneHeight, 0); fOK && nEmpty<nEmptyBookMax; nEmpty++) {
+      std::sort(changed[nEmpty].begin(), changed[nEmpty].end());
+      const CBookRecord* pm=mapped?records[nEmpty]:0;
+      const CBookRecord* pmEnd=mapped?pm+nRecords[nEmpty]:0;
+      std::vector<CBookRecord>::const_iterator pc=changed[nEmpty].begin();
+      while (fOK && (pm!=pmEnd || pc!=changed[nEmpty].end())) {
+         const CBookRecord* pr;
+         if (pc==changed[nEmpty].end() || (pm!=pmEnd && *pm<*pc))
+            pr=pm++;
+         else {
+            if (pm!=pmEnd && pm->board==pc->board)
+               pm++;
+            pr=&*pc++;
+         }
+         fOK=fwrite(pr, sizeof(CBookRecord), 1, fp)==1;
+         header.nRecords[nEmpty]++;
+      }
+   }
+
+   memcpy(&headerBlock[0], &header, sizeof(header));
+   fOK=fOK && fseek(fp, 0, SEEK_SET)==0 && fwrite(&headerBlock[0], kBookHeaderSize, 1, fp)==1 && SyncFile(fp);
+   if (fclose(fp)!=0)
+      fOK=false;
+   if (!fOK) {
+      cerr << "WARNING: Error writing to book file " << fnTemp << " (errno " << errno << ")\n";
+      remove(fnTemp.c_str());
+   }
+   fDone=true;
+}
+
+// append a stored position to the journal. Without fSync it's only on disk after SyncJournal()
+void CBook::Journal(const CBitBoard& minReflection, const CBookData& bd, bool fSync) {
+   CJournalRecord jr;
+
+   if (!save_when_closing || bookname.empty())
+      return;
+   if (!fpJournal) {
+      fpJournal=fopen((bookname+kJournal).c_str(), "ab");
+      if (!fpJournal) {
+         cerr << "WARNING: Can't open book journal " << bookname << kJournal << " (errno " << errno << ")\n";
+         return;
+      }
+   }
+   memset(&jr, 0, sizeof(jr));
+   jr.record.board=minReflection;
+   jr.record.data=bd;
+   jr.check=jr.Checksum();
+   if (fwrite(&jr, sizeof(jr), 1, fpJournal)!=1 || (fSync && !SyncFile(fpJournal)))
+      cerr << "WARNING: Error writing to book journal " << bookname << kJournal << " (errno " << errno << ")\n";
+}
+
+// store the positions from a journal. A damaged record ends the journal
+void CBook::ReplayJournal(const std::string& fn) {
+   CJournalRecord jr;
+   FILE* fp;
+   int n;
+
+   fp=fopen(fn.c_str(), "rb");
+   if (!fp)
+      return;
+   for (n=0; fread(&jr, sizeof(jr), 1, fp)==1 && jr.check==jr.Checksum(); n++)
+      Entry(jr.record.board, CountBits(jr.record.board.empty))=jr.record.data;
+   fclose(fp);
+   fprintf(stderr, "Replayed %d positions from %s\n", n, fn.c_str());
+}
+
+// start a new journal. The old one is kept until the positions in it are in the book file
+void CBook::RotateJournal() {
+   std::string fn(bookname+kJournal), fnOld(bookname+kJournalOld);
+   FILE* fp;
+
+   if (fpJournal) {
+      fclose(fpJournal);
+      fpJournal=0;
+   }
+   fp=fopen(fn.c_str(), "rb");
+   if (!fp)
+      return;
+   fclose(fp);
+   // an old journal is still there if the last write failed; it's still needed
+   fp=fopen(fnOld.c_str(), "rb");
+   if (!fp) {
+      if (rename(fn.c_str(), fnOld.c_str())!=0)
+         cerr << "WARNING: Can't rename book journal " << fn << " (errno " << errno << ")\n";
+   }
+   else {
+      fclose(fp);
+      if (AppendFile(fn.c_str(), fnOld.c_str()))
+         remove(fn.c_str());
+   }
+}
+
+// start writing the book in the background. Return false if there's nothing to write
+bool CBook::StartCompaction(int pruneHeight) {
+   BookType::const_iterator i;
+   int nEmpty;
+
+   if (compaction || bookname.empty())
+      return false;
+
+   // a mapped book with no changes is already on disk
+   if (mapped) {
+      for (nEmpty=0; nEmpty<nEmptyBookMax && entries[nEmpty].empty(); nEmpty++)
+         ;
+      if (nEmpty==nEmptyBookMax)
+         return false;
+   }
+
+   std::shared_ptr<CBookSnapshot> snapshot(new CBookSnapshot);
+   snapshot->fnTemp=bookname+".tmp";
+   snapshot->pruneHeight=pruneHeight;
+
+   // if the book isn't mapped this copies the whole book, which still beats writing it here
+   for (nEmpty=(std::max)(pruneHeight, 0); nEmpty<nEmptyBookMax; nEmpty++) {
+      std::vector<CBookRecord>& changed=snapshot->changed[nEmpty];
+      changed.resize(entries[nEmpty].size());
+      size_t iChanged=0;
+      for (i=entries[nEmpty].begin(); i!=entries[nEmpty].end(); i++, iChanged++) {
+         changed[iChanged].board=i->first;
+         changed[iChanged].data=i->second;
+      }
+   }
+
+   // the thread maps the book itself, so this book can unmap its copy while the thread runs
+   if (mapped) {
+      snapshot->mapped=MapReadOnly(bookname.c_str(), snapshot->nMapped);
+      if (snapshot->mapped && snapshot->nMapped==nMapped) {
+         for (nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++) {
+            snapshot->records[nEmpty]=(const CBookRecord*)(snapshot->mapped+((const char*)records[nEmpty]-mapped));
+            snapshot->nRecords[nEmpty]=nRecords[nEmpty];
+         }
+      }
+      else {
+         cerr << "WARNING: Can't map book file " << bookname << " to write it (errno " << errno << ")\n";
+         return false;
+      }
+   }
+
+   RotateJournal();
+   TrimChanges();
+   tLastWrite=time(0);
+   compaction=snapshot;
+   // compaction keeps the snapshot alive until FinishCompaction() has joined the thread
+   snapshot->thread.reset(new boost::thread(&CBookSnapshot::Write, snapshot.get()));
+   return true;
+}
+
+// Drop the oldest changes once there are more of them than positions in the book. Then a
+//	delta of the whole list would be bigger than the book, so a reader that is that far
+//	behind gets the whole book instead. The changes left keep their numbers.
+void CBook::TrimChanges() {
+   std::size_t nPositions=0, nDrop;
+   int nEmpty;
+
+   for (nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++)
+      nPositions+=nRecords[nEmpty]+entries[nEmpty].size();
+   if (changes.size()<=nPositions)
+      return;
+   nDrop=changes.size()-nPositions/2;
+   changes.erase(changes.begin(), changes.begin()+nDrop);
+   iFirstChange+=nDrop;
+}
+
+// wait for the background write and put the new file in place
+void CBook::FinishCompaction() {
+   bool fWasMapped;
+
+   if (!compaction)
+      return;
+   std::shared_ptr<CBookSnapshot> snapshot;
+   snapshot.swap(compaction);
+   snapshot->thread->join();
+   snapshot->thread.reset();
+   Unmap(snapshot->mapped, snapshot->nMapped);
+   snapshot->mapped=0;
+   if (!snapshot->fOK)
+      return;
+
+   // on Windows a mapped file can't be replaced, so release ours first and map the new one.
+   //	The changed positions stay in entries; they match the new file.
+   fWasMapped=mapped!=0;
+   Unmap(mapped, nMapped);
+   mapped=0;
+   if (!ReplaceBookFile(snapshot->fnTemp.c_str(), bookname.c_str()))
+      cerr << "WARNING: Can't replace book file " << bookname << ", the new book is in " << snapshot->fnTemp << " (errno " << errno << ")\n";
+   else {
+      remove((bookname+kJournalOld).c_str());
+      tLastWrite=time(0);
+   }
+   if (fWasMapped && !MapVersion2(bookname.c_str()))
+      ReadErr();
+}
+
+void CBook::WriteVersion2(int pruneHeight) {
+   FinishCompaction();
+   if (StartCompaction(pruneHeight))
+      FinishCompaction();
+}
+
+////////////////////////////////////////////////////////////
+// Locking
+//	CorrectAll() and the expansion client's workers use the book from several threads.
+//	A correcting thread holds the book's mutex while it works and releases it for its
+//	searches (CBookUnlock); the search takes it again for each Load(), Store...() and book
+//	move (CBookLock).
+//	The locks nest, so the functions that lock can call each other.
+//	The lookups (FindMinimal() etc.) don't lock; a walk of the book that runs while other
+//	threads store, such as the draw count, holds a CWalkLock for the whole walk.
+//	A thread only ever holds the lock of one book.
+////////////////////////////////////////////////////////////
+
+static TLS int nBookLocks=0;	// number of CBookLocks this thread has open
+
+class CBookLock {
+public:
+   CBookLock(boost::mutex& amutex) : mutex(amutex) { if (nBookLocks++==0) mutex.lock(); }
+   ~CBookLock() { if (--nBookLocks==0) mutex.unlock(); }
+private:
+   boost::mutex& mutex;
+};
+
+CBook::CWalkLock::CWalkLock(const CBook& book) : mutex(book.mutex) {
+   if (nBookLocks++==0)
+      mutex.lock();
+}
+
+CBook::CWalkLock::~CWalkLock() {
+   if (--nBookLocks==0)
+      mutex.unlock();
+}
+
+class CBookUnlock {
+public:
+   CBookUnlock(boost::mutex& amutex) : mutex(amutex), nLocks(nBookLocks) {
+      if (nLocks) {
+         nBookLocks=0;
+         mutex.unlock();
+      }
+   }
+   ~CBookUnlock() {
+      if (nLocks) {
+         mutex.lock();
+         nBookLocks=nLocks;
+      }
+   }
+private:
+   boost::mutex& mutex;
+   int nLocks;
+};
+
 ////////////////////////////////////////////////////////////
 // CBook
 ////////////////////////////////////////////////////////////
@@ -482,7 +949,10 @@ void CBook::ReadErr() {
 CBook::CBook(const char* filename)
    : tLastWrite(time(0)),
      nHashErr(0),
-     save_when_closing(true)
+     save_when_closing(true),
+     iFirstChange(0),
+     fpJournal(0),
+     nLoads(0)
 {
    Init(filename);
 }
@@ -490,7 +960,10 @@ CBook::CBook(const char* filename)
 CBook::CBook(const char* filename, no_save_type)
    : tLastWrite(time(0)),
      nHashErr(0),
-     save_when_closing(false)
+     save_when_closing(false),
+     iFirstChange(0),
+     fpJournal(0),
+     nLoads(0)
 {
    Init(filename);
 }
@@ -502,6 +975,14 @@ void CBook::Init(const char* filename)
    FILE* fp;
    int nVersion;
 
+   nLoads++;
+   mapped=0;
+   nMapped=0;
+   for (int nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++) {
+      records[nEmpty]=0;
+      nRecords[nEmpty]=0;
+   }
+
    if (filename) {
       fp=fopen(filename,"rb");
       if (!fp) {
@@ -521,19 +1002,29 @@ void CBook::Init(const char* filename)
             cerr << "WARNING: Book " << filename << " is empty, either restore a backup or delete the file\n";
             _exit(-3);
          }
+         else if (nVersion==2) {
+            fclose(fp);
+            fp=0;
+            if (!MapVersion2(filename))
+               ReadErr();
+         }
          else {
             if (nVersion!=1)
                ReadVersion0(fp);
             else
                ReadVersion1(fp);
          }
-         fclose(fp);
+         if (fp)
+            fclose(fp);
 
          fprintf(stderr, "Done\n");
       }
    }
    if (filename) {
       bookname=filename;
+      // positions stored since the book file was last written
+      ReplayJournal(bookname+kJournalOld);
+      ReplayJournal(bookname+kJournal);
    }
    else
       bookname.erase(0,-1);
@@ -545,7 +1036,26 @@ CBook::~CBook() {
       Write();
       std::cerr << "Done\n";
    }
+   FinishCompaction();
+   if (fpJournal)
+      fclose(fpJournal);
+   Unmap(mapped, nMapped);
+}
+
+void CBook::Reopen(const char* filename) {
+   FinishCompaction();
+   if (fpJournal) {
+      fclose(fpJournal);
+      fpJournal=0;
+   }
+   Unmap(mapped, nMapped);
+   for (int nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++)
+      entries[nEmpty].clear();
+   changes.clear();
+   iFirstChange=0;
+   Init(filename);
 }
+
 int CBook::NEmptyMin()  const {
    return hSolverStart+1;
 }
@@ -555,19 +1065,29 @@ void CBook::Mirror() {
    Mirror(0);
 }
 
+//	The write happens in the background; stored positions are safe in the journal meanwhile.
 void CBook::Mirror(int pruneHeight) {
-   if (time(0)>=tLastWrite+25*60) {
-      std::cout << "Writing book " << bookname << "..." << std::flush;
-      Write(pruneHeight);
-      std::cout << "Done" << std::endl;
+   CBookLock lock(mutex);
+
+   if (compaction) {
+      if (compaction->fDone) {
+         FinishCompaction();
+         std::cout << "Wrote book " << bookname << std::endl;
+      }
+   }
+   else if (time(0)>=tLastWrite+25*60) {
+      if (StartCompaction(pruneHeight))
+         std::cout << "Writing book " << bookname << " in the background" << std::endl;
+      else
+         tLastWrite=time(0);
    }
 }
 
 int CBook::GetPruneHeight() const
 {
    int pruneHeight = 0;
-   if( pComputer ) {
-      pruneHeight = pComputer->book_pcp ? pComputer->book_pcp->PerfectSolve() : 0;
+   if( CPlayerComputerPtr computer = Computer() ) {
+      pruneHeight = computer->book_pcp ? computer->book_pcp->PerfectSolve() : 0;
    }
    // three perfect solved nodes, or a maximum at 24 empty
    return (std::min)(24, (std::max)(pruneHeight-2, 0));
@@ -575,6 +1095,7 @@ int CBook::GetPruneHeight() const
 
 void CBook::Prune(int pruneHeight)
 {
+   Unpack();
    for (int nEmpties=0; nEmpties<pruneHeight; nEmpties++)
       entries[nEmpties].clear();
 }
@@ -589,7 +1110,7 @@ void CBook::Write() {
 }
 
 void CBook::Write(int pruneHeight) {
-   WriteVersion1(pruneHeight);
+   WriteVersion2(pruneHeight);
 }
 
 void CBook::WriteErr() {
@@ -620,6 +1141,7 @@ void CBook::WriteVersion1(int pruneHeight) {
 
    if (bookname.empty())
       return;
+   Unpack();
 
    fp=fopen(bookname.c_str(),"wb");
    if (!fp) {
@@ -687,11 +1209,93 @@ void CBook::ReadVersion1(FILE* fp) {
    _ASSERT(nHashErr==0);
 }
 
+////////////////////////////////////////////////////////////
+// Version 2 books
+//	A header followed by the records for each nEmpty in turn, each run sorted by board.
+//	The file is mapped read-only and searched in place, so loading takes no time
+//	and processes using the same book share its pages.
+//	The file is replaced, never rewritten in place, so other processes can keep their mapping.
+////////////////////////////////////////////////////////////
+
+// map a version 2 book. return false if the file is damaged
+bool CBook::MapVersion2(const char* filename) {
+   const CBookFileHeader* header;
+   size_t nExpected;
+   int nEmpty;
+
+   mapped=MapReadOnly(filename, nMapped);
+   if (!mapped)
+      return false;
+
+   header=(const CBookFileHeader*)mapped;
+   nExpected=kBookHeaderSize;
+   if (nMapped>=kBookHeaderSize && header->nVersion==2 && header->nRecordSize==sizeof(CBookRecord)) {
+      for (nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++) {
+         records[nEmpty]=(const CBookRecord*)(mapped+nExpected);
+         nRecords[nEmpty]=header->nRecords[nEmpty];
+         nExpected+=size_t(nRecords[nEmpty])*sizeof(CBookRecord);
+      }
+      if (nExpected==nMapped)
+         return true;
+   }
+
+   Unmap(mapped, nMapped);
+   mapped=0;
+   return false;
+}
+
+// copy the mapped records into entries and unmap the file
+void CBook::Unpack() const {
+   int nEmpty;
+   u4 i;
+
+   if (!mapped)
+      return;
+
+   for (nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++) {
+      // entries already holds the changed positions, insert() leaves them alone
+      for (i=0; i<nRecords[nEmpty]; i++)
+         entries[nEmpty].insert(std::make_pair(records[nEmpty][i].board, records[nEmpty][i].data));
+      records[nEmpty]=0;
+      nRecords[nEmpty]=0;
+   }
+   Unmap(mapped, nMapped);
+   mapped=0;
+   nMapped=0;
+}
+
+const CBookRecord* CBook::FindMapped(const CBitBoard& board, int nEmpty) const {
+   const CBookRecord* begin=records[nEmpty];
+   const CBookRecord* end=begin+nRecords[nEmpty];
+   CBookRecord key;
+   const CBookRecord* p;
+
+   key.board=board;
+   p=std::lower_bound(begin, end, key);
+   if (p==end || !(p->board==board))
+      return 0;
+   return p;
+}
+
+// the data for a position, copying it out of the mapping if needed so it can be changed.
+//	Creates an empty entry if the position isn't in the book.
+CBookData& CBook::Entry(const CBitBoard& minReflection, int nEmpty) {
+   BookType& bt=entries[nEmpty];
+   BookType::iterator i=bt.find(minReflection);
+
+   if (i!=bt.end())
+      return i->second;
+
+   const CBookRecord* pr=mapped?FindMapped(minReflection, nEmpty):0;
+   return bt.insert(std::make_pair(minReflection, pr?pr->data:CBookData())).first->second;
+}
+
 void CBook::WriteVersion0() {
    BookType::const_iterator i;
    FILE* fp;
    int nEmpties;
 
+   Unpack();
    if (!bookname.empty()) {
       fp=fopen(bookname.c_str(),"wb");
       if (!fp)
@@ -723,22 +1327,28 @@ const CBookData* CBook::FindMinimal(const CBitBoard& board, int nEmpty) const {
    if (nEmpty>=nEmptyBookMax)
       return 0;
    i=entries[nEmpty].find(board);
-   if (i==entries[nEmpty].end())
-      return 0;
+   if (i==entries[nEmpty].end()) {
+      const CBookRecord* pr=mapped?FindMapped(board, nEmpty):0;
+      return pr?&pr->data:0;
+   }
    else {
       QSSERT((*i).second.Hi().height<=nEmpty);
       return &((*i).second);
    }
 }
 
+// the caller may change the data, so a mapped position is copied into entries
 CBookData* CBook::FindMinimal(const CBitBoard& board, int nEmpty) {
    BookType::iterator i;
 
    if (nEmpty>=nEmptyBookMax)
       return 0;
    i=entries[nEmpty].find(board);
-   if (i==entries[nEmpty].end())
+   if (i==entries[nEmpty].end()) {
+      if (mapped && FindMapped(board, nEmpty))
+         return &Entry(board, nEmpty);
       return 0;
+   }
    else {
       QSSERT((*i).second.Hi().height<=nEmpty);
       return &((*i).second);
@@ -763,14 +1373,53 @@ CBookData* CBook::FindAnyReflection(const CBitBoard& board, int nEmpty) {
 
 // read a value from the book
 
-bool CBook::Load(const CBitBoard& board, CHeightInfo hi, CValue alpha, CValue beta, CValue& value) {
+// minimal reflections found by PrepareProbes(), so Load() doesn't have to find them again.
+//	Direct-mapped on the board's hash; a newer probe just replaces an older one.
+class CReflection {
+public:
+   CBitBoard board, minReflection;
+};
+
+enum { nReflections=64 };
+static TLS CReflection reflections[nReflections];
+
+static CBitBoard CachedMinimalReflection(const CBitBoard& board) {
+   const CReflection& r=reflections[board.FastHash()&(nReflections-1)];
+
+   return r.board==board ? r.minReflection : board.MinimalReflection();
+}
+
+void CBook::PrepareProbes(const CBitBoard* boards, int n, CBitBoard* minReflections) const {
+   CBookLock lock(mutex);
+   CBitBoard mrs[nReflections];
+   int i, iStart, nBoards, nEmpty;
+
+   for (iStart=0; iStart<n; iStart+=nReflections) {
+      nBoards=n-iStart<nReflections ? n-iStart : nReflections;
+      CBitBoard* pmrs=minReflections ? minReflections+iStart : mrs;
+      CBitBoard::MinimalReflections(boards+iStart, nBoards, pmrs);
+      for (i=0; i<nBoards; i++) {
+         const CBitBoard& board=boards[iStart+i];
+         CReflection& r=reflections[board.FastHash()&(nReflections-1)];
+         r.board=board;
+         r.minReflection=pmrs[i];
+         // mapped records are found by a binary search, there's no one place to prefetch
+         nEmpty=CountBits(board.empty);
+         if (nEmpty<nEmptyBookMax)
+            entries[nEmpty].prefetch(pmrs[i]);
+      }
+   }
+}
+
+bool CBook::Load(const CBitBoard& board, CHeightInfo hi, CValue alpha, CValue beta, CValue& value) const {
    return Load(board, hi, alpha, beta, value, CountBits(board.empty));
 }
 
-bool CBook::Load(const CBitBoard& board, CHeightInfo hi, CValue alpha, CValue beta, CValue& value, int nEmpty) {
-   CBookData* bd;
+bool CBook::Load(const CBitBoard& board, CHeightInfo hi, CValue alpha, CValue beta, CValue& value, int nEmpty) const {
+   CBookLock lock(mutex);
+   const CBookData* bd;
 
-   bd=FindAnyReflection(board, nEmpty);
+   bd=FindMinimal(CachedMinimalReflection(board), nEmpty);
 
    // no data, return false
    if (bd==NULL)
@@ -803,14 +1452,56 @@ bool CBook::Load(const CBitBoard& board, CHeightInfo hi, CValue alpha, CValue be
    return false;
 }
 
+bool CBook::GetData(const CBitBoard& board, CBookData& bd) const {
+   CBookLock lock(mutex);
+   const CBookData* pbd=FindAnyReflection(board);
+
+   if (pbd)
+      bd=*pbd;
+   return pbd!=0;
+}
+
+// a move from a book position and the position after it
+class CSubnode {
+public:
+   CMove move;
+   CQPosition pos;
+   int pass;
+   CBitBoard minReflection;
+};
+
+// the positions after each of the moves. The book entries of all of them are prefetched
+//	together, so the caller's lookups don't wait for memory one at a time.
+static void GetSubnodes(const CBook& book, const CQPosition& pos, CMoves moves, vector<CSubnode>& subnodes) {
+   CSubnode subnode;
+   CMoves submoves;
+   vector<CBitBoard> boards, minReflections;
+   size_t i;
+
+   subnodes.clear();
+   for (subnode.move.Set(-1); moves.GetNext(subnode.move);) {
+      subnode.pos=pos;
+      subnode.pos.MakeMove(subnode.move);
+      subnode.pass=subnode.pos.CalcMovesAndPass(submoves);
+      subnodes.push_back(subnode);
+      boards.push_back(subnode.pos.BitBoard());
+   }
+   if (boards.empty())
+      return;
+   minReflections.resize(boards.size());
+   book.PrepareProbes(&boards[0], int(boards.size()), &minReflections[0]);
+   for (i=0; i<subnodes.size(); i++)
+      subnodes[i].minReflection=minReflections[i];
+}
+
 bool CBook::GetRandomMove(const CQPosition& pos, const CSearchInfo& si, CMVK& mvk) const {
+   CBookLock lock(mutex);
    vector<CMVPS> mvs;
    CMVPS mv;
-   CMove move;
-   CMoves moves, submoves;
-   int pass;
+   CMoves moves;
+   vector<CSubnode> subnodes;
+   size_t i;
    const CBookData *bd, *sbd;
-   CQPosition subpos;
    u4 fPrintLevel=si.PrintBookLevel();
 
    pos.CalcMoves(moves);
@@ -825,15 +1516,15 @@ bool CBook::GetRandomMove(const CQPosition& pos, const CSearchInfo& si, CMVK& mv
    int vContempt=fSolved?0:si.vContempt;
 
    // Check subnodes in turn to see if they're in book
-   for (move.Set(-1); moves.GetNext(move);) {
-      subpos=pos;
-      subpos.MakeMove(move);
-      pass=subpos.CalcMovesAndPass(submoves);
-      sbd=FindAnyReflection(subpos.BitBoard());
+   GetSubnodes(*this, pos, moves, subnodes);
+   for (i=0; i<subnodes.size(); i++) {
+      const CQPosition& subpos=subnodes[i].pos;
+      int pass=subnodes[i].pass;
+      sbd=FindMinimal(subnodes[i].minReflection);
 
       // If subnode is in book, add it to the list.
       if (sbd) {
-         mv.move=move;
+         mv.move=subnodes[i].move;
          mv.value=sbd->Values().VMover(subpos.BlackMove(), vContempt, pass);
          if (!pass)
             mv.value=-mv.value;
@@ -917,12 +1608,12 @@ bool CBook::GetRandomMove(const CQPosition& pos, const CSearchInfo& si, CMVK& mv
 }
 
 bool CBook::GetEdmundMove(const CBitBoard& board, bool fBlackMove, CMoveValue& mv, bool fPrintEdmund, bool timeOut1, bool timeOut2) const {
+   CBookLock lock(mutex);
    vector<CMoveValue> mvs;
-   CMove move;
-   CMoves submoves;
-   int pass;
+   vector<CSubnode> subnodes;
+   size_t i;
    const CBookData *bd, *sbd;
-   CQPosition pos(board, fBlackMove), subpos;
+   CQPosition pos(board, fBlackMove);
    CMoveValue mvBestPlayed;
    CMoves moves;
 
@@ -936,15 +1627,15 @@ bool CBook::GetEdmundMove(const CBitBoard& board, bool fBlackMove, CMoveValue& m
    mvBestPlayed.value=-kInfinity;
 
    pos.CalcMoves(moves);
-   for (move.Set(-1); moves.GetNext(move);) {
-      subpos=pos;
-      subpos.MakeMove(move);
-      pass=subpos.CalcMovesAndPass(submoves);
-      sbd=FindAnyReflection(subpos.BitBoard());
+   GetSubnodes(*this, pos, moves, subnodes);
+   for (i=0; i<subnodes.size(); i++) {
+      const CQPosition& subpos=subnodes[i].pos;
+      int pass=subnodes[i].pass;
+      sbd=FindMinimal(subnodes[i].minReflection);
 
       // If subnode is in book, add it to the list.
       if (sbd) {
-         mv.move=move;
+         mv.move=subnodes[i].move;
          mv.value=sbd->Values().vHeuristic;
          if (!pass)
             mv.value=-mv.value;
@@ -1004,6 +1695,7 @@ int CBook::NEdmundNodes() const {
    BookType::const_iterator i;
    CMoveValue mv;
 
+   Unpack();
    for (nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++) {
       int nGamesNempty = 0;
       for (i=entries[nEmpty].begin(); i!=entries[nEmpty].end(); i++) {
@@ -1023,9 +1715,10 @@ int CBook::NEdmundNodes() const {
 
 void CBook::PlayEdmundGame(const CBitBoard& bbNormalized, bool fBlackMove, CMoveValue& mv, Timer<double>& timer) {
    char sBoard[NN+1];
-   CCalcParamsPtr temp_pcp = pComputer->search_pcp;
-   pComputer->search_pcp = pComputer->book_pcp;
-   CGame game(pComputer, pComputer);
+   CPlayerComputerPtr computer = Computer();
+   CCalcParamsPtr temp_pcp = computer->search_pcp;
+   computer->search_pcp = computer->book_pcp;
+   CGame game(computer, computer);
    CQPosition pos(bbNormalized, fBlackMove);
    game.Initialize(pos.GetSBoard(sBoard), pos.BlackMove());
    CSGMoveListItem mli;
@@ -1035,7 +1728,7 @@ void CBook::PlayEdmundGame(const CBitBoard& bbNormalized, bool fBlackMove, CMove
    game.Update(mli);
 
    if (!game.GameOver()) game.Play(timer);
-   pComputer->search_pcp = temp_pcp;
+   computer->search_pcp = temp_pcp;
 }
 
 // Store a node in the book
@@ -1051,8 +1744,9 @@ void CBook::PlayEdmundGames() {
    BookType::iterator i;
    CMoveValue mv;
 
+   Unpack();
    Timer<double> outer_timer;
-   bool s26 = pComputer->cd.sCalcParams=="s26";
+   bool s26 = Computer()->cd.sCalcParams=="s26";
    int played = 0;
    int n_max_played;
    if( rand()%2 ) {
@@ -1103,45 +1797,92 @@ void CBook::JoinBook(const CBook& book2)
 {
    int nEmpty;
    BookType::const_iterator i;
-   CBookData* pbd;
 
+   book2.Unpack();
    for (nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++) {
-      for (i=book2.entries[nEmpty].begin(); i!=book2.entries[nEmpty].end(); i++) {
-         pbd=FindMinimal((*i).first);
-         const CBookData& bd2=(*i).second;
-         if (pbd==NULL || bd2.IsMoreImportantThan(*pbd) ) {
-            entries[nEmpty][(*i).first]=(*i).second;
-         }
-         if (pbd!=NULL && pbd->IsBranch() && bd2.IsBranch() && pbd->Hi()==bd2.Hi() && bd2.Cutoff() < pbd->Cutoff())
-            pbd->cutoff=bd2.cutoff;
-      }
+      for (i=book2.entries[nEmpty].begin(); i!=book2.entries[nEmpty].end(); i++)
+         JoinEntry((*i).first, nEmpty, (*i).second);
+   }
+   SyncJournal();
+}
+
+bool CBook::JoinEntry(const CBitBoard& minReflection, int nEmpty, const CBookData& bd2)
+{
+   CBookLock lock(mutex);
+   // the const lookup doesn't copy a mapped position unless it changes
+   const CBookData* pbdOld=static_cast<const CBook*>(this)->FindMinimal(minReflection, nEmpty);
+   bool fChanged=false;
+
+   if (pbdOld==NULL || bd2.IsMoreImportantThan(*pbdOld)) {
+      Entry(minReflection, nEmpty)=bd2;
+      fChanged=true;
+   }
+   else if (pbdOld->IsBranch() && bd2.IsBranch() && pbdOld->Hi()==bd2.Hi() && bd2.Cutoff() < pbdOld->Cutoff()) {
+      Entry(minReflection, nEmpty).cutoff=bd2.cutoff;
+      fChanged=true;
+   }
+   if (fChanged) {
+      changes.push_back(minReflection);
+      Journal(minReflection, Entry(minReflection, nEmpty), false);
    }
+   return fChanged;
+}
+
+std::size_t CBook::NChanges() const {
+   CBookLock lock(mutex);
+   return iFirstChange+changes.size();
+}
+
+std::size_t CBook::FirstChange() const {
+   CBookLock lock(mutex);
+   return iFirstChange;
+}
+
+bool CBook::ChangesSince(std::size_t iFrom, std::vector<CBitBoard>& changed, std::size_t& iTo) const {
+   CBookLock lock(mutex);
+
+   iTo=iFirstChange+changes.size();
+   if (iFrom<iFirstChange || iFrom>iTo)
+      return false;
+   changed.insert(changed.end(), changes.begin()+(iFrom-iFirstChange), changes.end());
+   return true;
+}
+
+void CBook::SyncJournal() {
+   CBookLock lock(mutex);
+
+   if (fpJournal && !SyncFile(fpJournal))
+      cerr << "WARNING: Error writing to book journal " << bookname << kJournal << " (errno " << errno << ")\n";
 }
 
 void CBook::StoreLeaf(const CBitBoard& board, CHeightInfo hi, CValue value) {
+   CBookLock lock(mutex);
    // calculate minimal reflection, nEmpty, fWLD
    int nEmpty = CountBits(board.empty);
    CBitBoard minReflection = board.MinimalReflection();
-   CBookData& bd = entries[nEmpty][minReflection];
+   CBookData& bd = Entry(minReflection, nEmpty);
 
    // assign value if we can, or mark unassigned if we should
    QSSERT(hi.Valid());
    bd.StoreLeaf(hi, nEmpty, value, boni);
    QSSERT(bd.Hi().height>0);
-   updated.push_back(std::make_pair(board, bd));
+   changes.push_back(minReflection);
+   Journal(minReflection, bd);
 }
 
 void CBook::StoreRoot(const CBitBoard& board, CHeightInfo hi, CValue value, CValue vCutoff, bool fFull) {
+   CBookLock lock(mutex);
    // calculate minimal reflection, nEmpty, fWLD
    int nEmpty = CountBits(board.empty);
    CBitBoard minReflection = board.MinimalReflection();
-   CBookData& bd = entries[nEmpty][minReflection];
+   CBookData& bd = Entry(minReflection, nEmpty);
 
    // assign value if we can, or mark unassigned if we should
    QSSERT(hi.Valid());
    bd.StoreRoot(hi, nEmpty, value, vCutoff, fFull, boni);
    QSSERT(bd.Hi().height>0);
-   updated.push_back(std::make_pair(board, bd));
+   changes.push_back(minReflection);
+   Journal(minReflection, bd);
 }
 
 bool CBook::SetBoni(const CBoni& aBoni) {
@@ -1153,8 +1894,27 @@ bool CBook::SetBoni(const CBoni& aBoni) {
    return changed;
 }
 
+// The computer whose parameters this thread corrects with. The expansion client's workers
+//	each correct with their own computer, and swap its calc params while they play a line,
+//	so a thread keeps the computer it set. Threads that set none use the last one set.
+static TLS const CBook* pBookComputer=0;	// book the thread set a computer for
+static TLS std::weak_ptr<CPlayerComputer> computerThread;
+
 void CBook::SetComputer(CPlayerComputerPtr apComputer) {
-   pComputer=apComputer;
+   {
+      CBookLock lock(mutex);
+      pComputer=apComputer;
+   }
+   pBookComputer=this;
+   computerThread=apComputer;
+}
+
+CPlayerComputerPtr CBook::Computer() const {
+   if (pBookComputer==this) {
+      if (CPlayerComputerPtr computer=computerThread.lock())
+         return computer;
+   }
+   return pComputer;
 }
 
 // correction and assignment
@@ -1164,11 +1924,12 @@ void CBook::CorrectAll(int& nSearches) {
    int nEmpty;
    CQPosition pos;
 
-   if( !pComputer ) {
+   if( !Computer() ) {
       std::cerr << "ERROR: No computer set, can not correct all." << std::endl;
       return;
    }
-   bool s26 = pComputer->cd.sCalcParams=="s26";
+   bool s26 = Computer()->cd.sCalcParams=="s26";
+   Unpack();
    for (nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++) {
       BookType& bookType = entries[nEmpty];
 
@@ -1186,20 +1947,52 @@ void CBook::CorrectAll(int& nSearches) {
          const int n_max_searches = 400;
          std::vector<double> times;
 
-         std::size_t nPosition = 0;
-         for (BookType::iterator i=bookType.begin(); i!=bookType.end(); i++) {
-            if( (++nPosition%10000)==0 ) {
-               std::cout << '.' << std::flush;
-            }
-            pos.Initialize((*i).first,true);
-            CorrectPosition(pos, &((*i).second), nSearches);
-            Mirror();
-         }
+         // positions only depend on positions with fewer empties, so the positions
+         //	at this level can be corrected in parallel
+         std::size_t iNext = 0;
+         int nThreads = SINGLE_THREADED_SEARCH ? 1 : (std::max)(nSearchThreads, 1);
+         std::vector<std::shared_ptr<boost::thread> > threads;
+         CSearchContext context;
+         CPlayerComputerPtr computer = Computer();
+         for (int i=1; i<nThreads; i++)
+            threads.push_back(std::shared_ptr<boost::thread>(new boost::thread(&CBook::CorrectLevel, this, nEmpty, boost::ref(iNext), boost::ref(nSearches), context, computer)));
+         CorrectLevel(nEmpty, iNext, nSearches, context, computer);
+         for (std::size_t i=0; i<threads.size(); i++)
+            threads[i]->join();
+         SyncJournal();
          std::cout << std::endl;
       }
    }
 }
 
+// correct the positions at nEmpty, taking the next one from iNext. Runs in several threads at once,
+//	all with the search context and computer of the thread that called CorrectAll()
+void CBook::CorrectLevel(int nEmpty, std::size_t& iNext, int& nSearches, const CSearchContext& context, CPlayerComputerPtr computer) {
+   CQPosition pos;
+   BookType& bookType = entries[nEmpty];
+   bool fSoloSearchOld = fSoloSearch;
+
+   fSoloSearch = true;
+   context.Apply();
+   SetComputer(computer);
+   {
+      CBookLock lock(mutex);
+
+      // this reaches positions added at this level while we work, too
+      while (iNext<bookType.size()) {
+         BookType::iterator i(&bookType, iNext++);
+         if( (iNext%10000)==0 ) {
+            std::cout << '.' << std::flush;
+         }
+         pos.Initialize((*i).first,true);
+         CorrectPosition(pos, &((*i).second), nSearches);
+         Mirror();
+      }
+   }
+   fSoloSearch = fSoloSearchOld;
+   WipeNodeStats();
+}
+
 void CBook::CorrectPosition(CQPosition pos, int& nSearches) {
    CBookData* bd=FindAnyReflection(pos.BitBoard());
    if (bd)
@@ -1236,6 +2029,7 @@ void CBook::EndgameError(const CQPosition& pos, const CBookData* bd, const CBook
 
 void CBook::CorrectPosition(CQPosition pos, CBookData* bd, int& nSearches) {
    int nEmpty=pos.NEmpty();
+   const CBookData bdOld(*bd);
 
    QSSERT(bd->Hi().height!=0);
 
@@ -1243,12 +2037,12 @@ void CBook::CorrectPosition(CQPosition pos, CBookData* bd, int& nSearches) {
    // this could potentially result in a branch node being solved.
    bd->CorrectBranchness();
    if (bd->IsBranch() || bd->IsSolved()) {
-      CHeightInfo hiMin = pComputer->book_pcp->MinHeight(nEmpty);
+      CHeightInfo hiMin = Computer()->book_pcp->MinHeight(nEmpty);
       if (bd->Hi() < hiMin)
          IncreaseHeight(pos, bd, hiMin, nSearches);
    }
 
-   CSearchInfo si(pComputer->cd.iPruneMidgame, pComputer->cd.iPruneEndgame,
+   CSearchInfo si(Computer()->cd.iPruneMidgame, Computer()->cd.iPruneEndgame,
                   0, 0, kNeedMove +kNeedValue, 1e6, 0);
 
    // For branch nodes, get the max of the subnodes values
@@ -1272,7 +2066,10 @@ void CBook::CorrectPosition(CQPosition pos, CBookData* bd, int& nSearches) {
             Initialize(pos.BitBoard(), pos.BlackMove());
             if (fPrintCorrections)
                cout << "\n" << pos.NEmpty() << " search to get cutoff down\n";
-            IterativeValue(movesNonbook, cp, si, mvk);
+            {
+               CBookUnlock unlock(mutex);
+               IterativeValue(movesNonbook, cp, si, mvk);
+            }
             nSearches++;
          }
       }
@@ -1291,6 +2088,14 @@ void CBook::CorrectPosition(CQPosition pos, CBookData* bd, int& nSearches) {
 
 
    QSSERT(nEmpty==59||bd->Values().IsSetAndAssigned());
+
+   // most corrections confirm what's there; only real changes are numbered and journalled
+   CBookLock lock(mutex);
+   if (*bd!=bdOld) {
+      CBitBoard minReflection=pos.BitBoard().MinimalReflection();
+      changes.push_back(minReflection);
+      Journal(minReflection, *bd, false);
+   }
 }
 
 // iGameType is 0 for private games, 1 for public games, -1 to not include the game in the game count
@@ -1306,6 +2111,8 @@ void CBook::CorrectGame(const COsGame& game,
    CMoves moves;
    CBookData *bd;
    CNodeStats nsStart, nsEnd;
+   // the expansion client corrects games in several threads at once, see CBookLock
+   CBookLock lock(mutex);
 
    nsStart.Read();
 
@@ -1338,15 +2145,18 @@ void CBook::CorrectGame(const COsGame& game,
                cout << "\n" << pos.NEmpty() << " search because node not in book\n";
             }
             Initialize(pos.BitBoard(), pos.BlackMove());
-            CSearchInfo si(pComputer->cd.iPruneMidgame,
-                           pComputer->cd.iPruneEndgame,
+            CSearchInfo si(Computer()->cd.iPruneMidgame,
+                           Computer()->cd.iPruneEndgame,
                            0,
                            0,
                            kNeedValue,
                            15*60,
                            0);
 
-            IterativeValue(moves, *(pComputer->book_pcp), si, mvk);
+            {
+               CBookUnlock unlock(mutex);
+               IterativeValue(moves, *(Computer()->book_pcp), si, mvk);
+            }
             nSearches++;
             bd=FindAnyReflection(pos.BitBoard());
             QSSERT(bd);
@@ -1355,8 +2165,12 @@ void CBook::CorrectGame(const COsGame& game,
             if (fPrintCorrections)
                cout << "OLD: " << *bd << "\n";
          }
-         if (iGameType>=0)
+         if (iGameType>=0) {
+            CBitBoard minReflection=pos.BitBoard().MinimalReflection();
             bd->IncrementGameCount(iGameType);
+            changes.push_back(minReflection);
+            Journal(minReflection, *bd, false);
+         }
          CorrectPosition(pos, bd, nSearches);
          // only edmund if we have been searching less than 12 hours
          timer.elapsed();
@@ -1371,7 +2185,10 @@ void CBook::CorrectGame(const COsGame& game,
          if (fEdmundAfter && timer.last()<12*3600) {
             CMoveValue mv;
             if (GetEdmundMove(pos.BitBoard(), pos.BlackMove(), mv, true, true, true/*timer.last()>1800, timer.last()>7200*/)) {
-               PlayEdmundGame(pos.BitBoard(), pos.BlackMove(), mv, timer);
+               {
+                  CBookUnlock unlock(mutex);
+                  PlayEdmundGame(pos.BitBoard(), pos.BlackMove(), mv, timer);
+               }
                CorrectPosition(pos,bd,nSearches);
             }
          }
@@ -1379,6 +2196,7 @@ void CBook::CorrectGame(const COsGame& game,
             cout << "NEW: " << *bd << "\n";
       }
    }
+   SyncJournal();
    nsEnd.Read();
 
    if (fPrintCorrections) {
@@ -1430,15 +2248,18 @@ void CBook::IncreaseHeight(CQPosition pos, CBookData* bd, CHeightInfo hi, int& n
          cout << "\n" << pos.NEmpty() << " search increased-height leaf node ("
               << bd->Hi() << "->" << hi << ")\n";
       }
-      CSearchInfo si(pComputer->cd.iPruneMidgame,
-                     pComputer->cd.iPruneEndgame,
+      CSearchInfo si(Computer()->cd.iPruneMidgame,
+                     Computer()->cd.iPruneEndgame,
                      0,
                      0,
                      kNeedValue,
                      1e6,
                      0);
 
-      IterativeValue(moves, cp, si, mvk);
+      {
+         CBookUnlock unlock(mutex);
+         IterativeValue(moves, cp, si, mvk);
+      }
       nSearches++;
 
       bd->SetRoot(fRoot);
@@ -1459,11 +2280,10 @@ void CBook::IncreaseHeight(CQPosition pos, CBookData* bd, CHeightInfo hi, int& n
 //	bvUleaf - book value of the best "unsolved leaf" node
 void CBook::MaxSubnodeValues(const CQPosition& pos, CBookData* bd,
                              CBookValue& bv, CBookValue& bvUleaf, CMoves& movesNonbook, int& nSearches) {
-   CMoves moves, submoves;
-   CMove move;
-   int pass;
+   CMoves moves;
+   vector<CSubnode> subnodes;
+   size_t i;
    CBookData *sbd;
-   CQPosition posSub;
 
    if (!pos.CalcMoves(moves)) {
       QSSERT(0);
@@ -1475,10 +2295,12 @@ void CBook::MaxSubnodeValues(const CQPosition& pos, CBookData* bd,
    bv.MinValues();
    bvUleaf.MinValues();
 
-   while (moves.GetNext(move)) {
-      posSub=pos;
-      posSub.MakeMove(move);
-      pass=posSub.CalcMovesAndPass(submoves);
+   // look subnodes up when they're used: increasing the height of one can change the others
+   GetSubnodes(*this, pos, moves, subnodes);
+   for (i=0; i<subnodes.size(); i++) {
+      const CQPosition& posSub=subnodes[i].pos;
+      int pass=subnodes[i].pass;
+      sbd=0;
 
       // terminal subnode:
       if (pass==2) {
@@ -1487,7 +2309,7 @@ void CBook::MaxSubnodeValues(const CQPosition& pos, CBookData* bd,
 
       // nonterminal subnode:
       else {
-         sbd=FindAnyReflection(posSub.BitBoard());
+         sbd=FindMinimal(subnodes[i].minReflection);
 
          // book subnode:
          if (sbd) {
@@ -1504,7 +2326,7 @@ void CBook::MaxSubnodeValues(const CQPosition& pos, CBookData* bd,
          }
       }
       if (pass==2 || sbd)
-         movesNonbook.Delete(move);
+         movesNonbook.Delete(subnodes[i].move);
    }
 }
 
@@ -1553,22 +2375,36 @@ CBookPtr CBook::ExtractPositions(const VariationCollection& games) const
 std::size_t CBook::Positions() const
 {
    std::size_t nSize = 0;
-   for( int nEmpties=0; nEmpties<nEmptyBookMax; nEmpties++ )
-      nSize+=entries[nEmpties].size();
+   for( int nEmpties=0; nEmpties<nEmptyBookMax; nEmpties++ ) {
+      nSize+=nRecords[nEmpties];
+      // changed positions that are also in the mapping were counted already
+      for (BookType::const_iterator i=entries[nEmpties].begin(); i!=entries[nEmpties].end(); i++)
+         if (!mapped || !FindMapped(i->first, nEmpties))
+            nSize++;
+   }
 
    return nSize;
 }
 
+std::size_t CBook::MemoryUsed() const
+{
+   std::size_t nBytes = 0;
+   for( int nEmpties=0; nEmpties<nEmptyBookMax; nEmpties++ )
+      nBytes+=entries[nEmpties].MemoryUsed();
+   return nBytes;
+}
+
 CBookPtr CBook::GetAddedOrUpdated() const
 {
+   CBookLock lock(mutex);
    CBookPtr book(new CBook(0));
 
-   foreach( Updated::value_type entry, updated ) {
-      CBitBoard board = entry.first;
-      CBookData data = entry.second;
-      int empty = board.NEmpty();
-      CBitBoard minimal = board.MinimalReflection();
-      book->entries[empty][minimal] = data;
+   // the changes are minimal reflections, and a position changed twice is copied once
+   foreach( const CBitBoard& minimal, changes ) {
+      int empty = minimal.NEmpty();
+      const CBookData* data = FindMinimal(minimal, empty);
+      if( data )
+         book->entries[empty][minimal] = *data;
    }
 
    return book;
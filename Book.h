@@ -14,12 +14,11 @@
 #include "BitBoard.h"
 #include "Timing.h"
 #include "timer.h"
-#include "unordered_map_serialization.h"
+#include "FlatMap.h"
 #include "Fwd.h"
 
-#include <boost/unordered_map.hpp>
 #include <boost/serialization/map.hpp>
-#include <boost/pool/pool_alloc.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <map>
 
@@ -95,6 +94,8 @@ public:
    bool IsSetAndAssigned() const;
    CValue VMover(bool fBlackMove) const;
    CValue VMover(bool fBlackMove, int vContempt, int nPass) const;
+   bool operator==(const CBookValue& b) const;
+   bool operator!=(const CBookValue& b) const { return !(*this==b); }
 
    // I/O
    void Out(std::ostream& os, bool fReverse=0) const;
@@ -127,6 +128,8 @@ public:
    const CBookValue& Values() const;
 
    bool IsMoreImportantThan(const CBookData& bd2) const;
+   bool operator==(const CBookData& b) const;
+   bool operator!=(const CBookData& b) const { return !(*this==b); }
 
    void Out(std::ostream& os, bool fReverse=0) const;
 
@@ -157,7 +160,7 @@ private:
    CHeightInfo hi;
    CValue cutoff;
    CBookValue values;
-   u4 nGames[2];
+   uint32_t nGames[2];	// fixed width, CBookData is in book files
 
    bool fRoot;	// true if has been the root of a search tree => branch or solved
 
@@ -169,6 +172,17 @@ private:
 
 inline std::ostream& operator<<(std::ostream& os, const CBookData& bd) { bd.Out(os); return os; }
 
+// a position and its data, as stored in version 2 book files
+class CBookRecord {
+public:
+   CBitBoard board;	// minimal reflection
+   CBookData data;
+
+   bool operator<(const CBookRecord& b) const { return board<b.board; }
+};
+
+class CBookSnapshot;
+
 class CBookType {
 public:
    char bookName[200];
@@ -191,6 +205,8 @@ public:
    CBook(const char* filename);
    CBook(const char* filename, no_save_type);
    ~CBook();
+   // forget the positions in memory and load the book from filename
+   void Reopen(const char* filename);
 
    bool SetBoni(const CBoni& aBoni);
    void SetComputer(CPlayerComputerPtr pComputer);
@@ -204,9 +220,26 @@ public:
    const CBookData* FindAnyReflection(const CBitBoard& board, int nEmpty) const;
    /* */ CBookData* FindAnyReflection(const CBitBoard& board, int nEmpty);
 
+   // Holds the book's lock, as the routines that change the book take it, so that the
+   //	Find...() routines above, which don't lock, can walk the book while other threads
+   //	store positions. Threads the holder waits for may use the Find...() routines too,
+   //	but nothing that locks. See "Locking" in Book.cpp.
+   class CWalkLock {
+   public:
+      CWalkLock(const CBook& book);
+      ~CWalkLock();
+   private:
+      boost::mutex& mutex;
+   };
+
    // load info from book. return TRUE if found
-   bool Load(const CBitBoard& board, CHeightInfo hi, CValue alpha, CValue beta, CValue& value);
-   bool Load(const CBitBoard& board, CHeightInfo hi, CValue alpha, CValue beta, CValue& value, int nEmpty);
+   bool Load(const CBitBoard& board, CHeightInfo hi, CValue alpha, CValue beta, CValue& value) const;
+   bool Load(const CBitBoard& board, CHeightInfo hi, CValue alpha, CValue beta, CValue& value, int nEmpty) const;
+   // start loading the entries of n positions, e.g. all children of a node, for Load()s or
+   //	FindMinimal()s shortly after. Fills in their minimal reflections if minReflections isn't null.
+   void PrepareProbes(const CBitBoard* boards, int n, CBitBoard* minReflections=0) const;
+   // copy of a position's data in any reflection. Safe while other threads add positions
+   bool GetData(const CBitBoard& board, CBookData& bd) const;
    bool GetRandomMove(const CQPosition& pos, const CSearchInfo& si, CMVK& mvk) const;
    bool GetEdmundMove(const CBitBoard& board, bool fBlackMove, CMoveValue& mv, bool fPrintEdmund, bool timeOut1, bool timeOut2) const;
    int NEdmundNodes() const;
@@ -225,10 +258,12 @@ public:
    void Write();
    void WriteVersion0();
    void WriteVersion1(int pruneHeight);
+   void WriteVersion2(int pruneHeight);
 
    void ReadErr();
    void ReadVersion0(FILE* fp);
    void ReadVersion1(FILE* fp);
+   bool MapVersion2(const char* filename);
 
    // Correction and assignment
    void CorrectAll(int& nSearches);
@@ -244,52 +279,18 @@ public:
    void PlayEdmundGames();
    void JoinBook(const char* fn);
    void JoinBook(const CBook& book);
-
-   template<typename T,
-           typename UserAllocator=boost::default_user_allocator_new_delete>
-   class fixed_fast_pool_allocator : public boost::fast_pool_allocator<T,UserAllocator>
-   {
-      typedef boost::fast_pool_allocator<T,UserAllocator> super;
-   public:
-      template<typename U>
-      struct rebind
-      {
-         typedef fixed_fast_pool_allocator<U, UserAllocator> other;
-      };
-      fixed_fast_pool_allocator()
-      {}
-      fixed_fast_pool_allocator(const fixed_fast_pool_allocator&x)
-         : super(x)
-      {}
-      template<typename U>
-      fixed_fast_pool_allocator(const fixed_fast_pool_allocator<U,UserAllocator>& x)
-         : super(x)
-      {}
-      bool release_memory() const
-      {
-         return boost::singleton_pool<boost::fast_pool_allocator_tag, sizeof(T)>::release_memory();
-      }
-   }; 
-   template<typename UserAllocator>
-   class fixed_fast_pool_allocator<void,UserAllocator>
-   {
-   public:
-      typedef void* pointer;
-      typedef const void* const_pointer;
-      typedef void value_type;
-      template<typename U> struct rebind
-      {
-         typedef fixed_fast_pool_allocator<U, UserAllocator> other;
-      };
-   };
+   // join one position as JoinBook() does. Return true if the book changed.
+   //	The position is journalled but not flushed to disk, call SyncJournal() after a batch
+   bool JoinEntry(const CBitBoard& minReflection, int nEmpty, const CBookData& bd);
+   void SyncJournal();
 
    // data
-   typedef fixed_fast_pool_allocator<std::pair<CBitBoard, CBookData>> FastPoolAlloc;
-   typedef boost::unordered_map<CBitBoard, CBookData/*, boost::hash<CBitBoard>, std::equal_to<CBitBoard>, FastPoolAlloc*/> BookType;
+   typedef CFlatMap<CBitBoard, CBookData, CBitBoardHash> BookType;
 
    template<class Archive>
    void serialize(Archive& archive, const unsigned int version)
    {
+      Unpack();
       for( int i=0; i<nEmptyBookMax; i++ ) {
          archive & entries[i];
       }
@@ -306,13 +307,58 @@ public:
    void Prune();
 
    CBookPtr ExtractPositions(const VariationCollection& games) const;
+   // the positions in the change list (see NChanges()), with their data as it is now
    CBookPtr GetAddedOrUpdated() const;
 
    std::size_t Positions() const;
+   std::size_t MemoryUsed() const;	// bytes allocated for positions held in memory
+
+   // call fn(minReflection, data) for each position with nEmpty empties. A mapped book stays mapped.
+   template<class TFn>
+   void ForEachPosition(int nEmpty, TFn fn) const {
+      BookType::const_iterator i;
+
+      for (i=entries[nEmpty].begin(); i!=entries[nEmpty].end(); i++)
+         fn(i->first, i->second);
+      if (mapped) {
+         for (u4 j=0; j<nRecords[nEmpty]; j++) {
+            const CBookRecord& record=records[nEmpty][j];
+            if (entries[nEmpty].find(record.board)==entries[nEmpty].end())
+               fn(record.board, record.data);
+         }
+      }
+   }
+
+   // Positions whose data was stored, corrected or joined, as minimal reflections, oldest first.
+   //	Lets results computed from the book, such as the draw counts, be brought up to date
+   //	without walking the whole book again, and numbers the changes a book delta sends
+   //	(see BookDelta.h). Reopening the book empties the list.
+   //	Changes keep their numbers, but once the list is longer than the book the oldest
+   //	are dropped (see TrimChanges()); FirstChange() is the oldest one left.
+   std::size_t NChanges() const;
+   std::size_t FirstChange() const;
+   // Change(i) doesn't lock the book, use it only while nothing else changes the book.
+   const CBitBoard& Change(std::size_t i) const { return changes[i-iFirstChange]; }
+   // Copy the changes from iFrom on and set iTo to NChanges(), all under the book's lock.
+   //	Returns false, and copies nothing, if change iFrom was dropped or doesn't exist yet.
+   bool ChangesSince(std::size_t iFrom, std::vector<CBitBoard>& changed, std::size_t& iTo) const;
+   // number of times the book has been loaded. Results from an earlier load are out of date.
+   int NLoads() const { return nLoads; }
 
 private:
 
-   BookType entries[nEmptyBookMax];
+   // Version 2 books are mapped read-only and searched in place, see MapVersion2().
+   //	While a book is mapped, entries holds only the positions that were changed or added
+   //	since loading, and they take precedence over the mapped records.
+   //	Anything that walks the whole book calls Unpack() first, which copies the mapped
+   //	records into entries and unmaps the file. That doesn't change the book's contents,
+   //	so const routines may do it too. Writing merges the mapped records with entries
+   //	and doesn't need it.
+   mutable BookType entries[nEmptyBookMax];
+   mutable const char* mapped;	// start of the mapping, or 0 if the book isn't mapped
+   mutable size_t nMapped;	// size of the mapping in bytes
+   mutable const CBookRecord* records[nEmptyBookMax];	// mapped records for each nEmpty, sorted
+   mutable u4 nRecords[nEmptyBookMax];
    std::string bookname;
    static std::map<CBookType, CBookPtr> bookList;
    CBoni boni;
@@ -320,13 +366,43 @@ private:
    time_t tLastWrite;
    int nHashErr;
    /*const*/ bool save_when_closing;
-   typedef std::vector<std::pair<CBitBoard, CBookData> > Updated;
-   Updated updated;
+   std::vector<CBitBoard> changes;
+   std::size_t iFirstChange;	// number of changes[0]
+
+   // Stored positions are appended to a journal next to the book file as they arrive,
+   //	so a crash loses nothing that was stored. Mirror() writes the whole book in a
+   //	background thread, after which the journal entries it contains are deleted.
+   //	See StartCompaction().
+   FILE* fpJournal;	// open for append, or 0 until the first position is journalled
+   std::shared_ptr<CBookSnapshot> compaction;	// background write in progress, if any
+
+   int nLoads;	// see NLoads()
+
+   // CorrectAll() corrects each level in several threads, and the expansion client corrects
+   //	several games at once. They hold this while they work on the book and release it
+   //	while they search; the searches take it for each book access.
+   //	See CBookLock in Book.cpp.
+   mutable boost::mutex mutex;
 
    void AddData(CBitBoard bitboard, const CBookData& bd);
    void Init(const char* filename);
+   void Unpack() const;
+   const CBookRecord* FindMapped(const CBitBoard& board, int nEmpty) const;
+   CBookData& Entry(const CBitBoard& minReflection, int nEmpty);
    void Mirror(int pruneHeight);
    void Write(int pruneHeight);
+   // the book owns its mapping and journal, see Reopen()
+   CBook(const CBook&);
+   void operator=(const CBook&);
+
+   void Journal(const CBitBoard& minReflection, const CBookData& bd, bool fSync=true);
+   void ReplayJournal(const std::string& fn);
+   void RotateJournal();
+   bool StartCompaction(int pruneHeight);
+   void TrimChanges();
+   void FinishCompaction();
+   void CorrectLevel(int nEmpty, size_t& iNext, int& nSearches, const CSearchContext& context, CPlayerComputerPtr computer);
+   CPlayerComputerPtr Computer() const;
    void IncreaseHeight(CQPosition pos, CBookData* bd, CHeightInfo hi, int& nSearches);
    void MaxSubnodeValues(const CQPosition& pos,
                          CBookData* bd,
@@ -0,0 +1,262 @@
+// Copyright Daniel Lidstrom
+//	All Rights Reserved
+// This file is distributed subject to GNU GPL version 2. See the files
+// Copying.txt and GPL.txt for details.
+
+#include "PreCompile.h"
+#include "BookDelta.h"
+#include "Book.h"
+
+#include <boost/lexical_cast.hpp>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <string.h>
+
+namespace
+{
+   const char kMagic[4] = { 'N', 'T', 'B', 'D' };
+   const std::size_t kBatchSize = 4096;   // records per batch
+
+   class CBatchHeader
+   {
+   public:
+      uint32_t nRecords;   // 0 ends the delta
+      uint32_t nBytes;
+      uint32_t fCompressed;
+   };
+
+   void Write(std::ostream& os, const void* p, std::size_t n, CBookDeltaStats& stats)
+   {
+      os.write(static_cast<const char*>(p), n);
+      if( !os )
+         throw std::runtime_error("Error writing book delta.");
+      stats.nBytes += n;
+   }
+
+   void Read(std::istream& is, void* p, std::size_t n, CBookDeltaStats& stats)
+   {
+      is.read(static_cast<char*>(p), n);
+      if( std::size_t(is.gcount())!=n )
+         throw std::runtime_error("Book delta ended early, connection was probably broken.");
+      stats.nBytes += n;
+   }
+
+   // byte i of the records, xored with the same byte of the record before
+   inline unsigned char Xored(const unsigned char* p, std::size_t i)
+   {
+      return i<sizeof(CBookRecord) ? p[i] : p[i]^p[i-sizeof(CBookRecord)];
+   }
+
+   // xor each record with the one before, and store runs of zero bytes as a 0 and a count
+   void Compress(const std::vector<CBookRecord>& records, std::vector<char>& out)
+   {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(&records[0]);
+      const std::size_t n = records.size()*sizeof(CBookRecord);
+
+      out.clear();
+      for( std::size_t i=0; i<n; ) {
+         unsigned char c = Xored(p, i);
+         if( c ) {
+            out.push_back(char(c));
+            i++;
+         }
+         else {
+            std::size_t nZeros = 0;
+            while( i<n && nZeros<255 && Xored(p, i)==0 ) {
+               nZeros++;
+               i++;
+            }
+            out.push_back(0);
+            out.push_back(char(nZeros));
+         }
+      }
+   }
+
+   // undo Compress() into records, which has the right size. Return false if the data is damaged
+   bool Decompress(const std::vector<char>& in, std::vector<CBookRecord>& records)
+   {
+      unsigned char* p = reinterpret_cast<unsigned char*>(&records[0]);
+      const std::size_t n = records.size()*sizeof(CBookRecord);
+      std::size_t i = 0;
+
+      for( std::size_t j=0; j<in.size(); j++ ) {
+         unsigned char c = in[j];
+         std::size_t nRun = 1;
+         if( c==0 ) {
+            if( ++j==in.size() )
+               return false;
+            nRun = static_cast<unsigned char>(in[j]);
+         }
+         if( i+nRun>n )
+            return false;
+         for( ; nRun; nRun--, i++ )
+            p[i] = i<sizeof(CBookRecord) ? c : c^p[i-sizeof(CBookRecord)];
+      }
+      return i==n;
+   }
+
+   // collects positions and writes them a batch at a time
+   class CDeltaWriter
+   {
+   public:
+
+      CDeltaWriter(std::ostream& os, u4 idSource, std::size_t iNext, bool fCompress)
+         : os(os),
+           fCompress(fCompress)
+      {
+         CBookDeltaHeader header;
+         memset(&header, 0, sizeof(header));
+         memcpy(header.magic, kMagic, sizeof(kMagic));
+         header.nVersion = CBookDeltaHeader::kVersion;
+         header.flags = fCompress ? CBookDeltaHeader::kCompressed : 0;
+         header.idSource = idSource;
+         header.iNext = uint32_t(iNext);
+         Write(os, &header, sizeof(header), stats);
+         records.reserve(kBatchSize);
+      }
+
+      void Add(const CBitBoard& minReflection, const CBookData& data)
+      {
+         CBookRecord record;
+         // clear the padding, it goes on the wire
+         memset(&record, 0, sizeof(record));
+         record.board = minReflection;
+         record.data = data;
+         records.push_back(record);
+         stats.nPositions++;
+         if( records.size()==kBatchSize )
+            Flush();
+      }
+
+      // write the last batch and the end of the delta
+      CBookDeltaStats Finish()
+      {
+         if( !records.empty() )
+            Flush();
+         Flush();
+         os.flush();
+         return stats;
+      }
+
+   private:
+
+      void Flush()
+      {
+         CBatchHeader batch;
+         const void* p = records.empty() ? 0 : &records[0];
+
+         std::sort(records.begin(), records.end());
+         batch.nRecords = uint32_t(records.size());
+         batch.nBytes = uint32_t(records.size()*sizeof(CBookRecord));
+         batch.fCompressed = 0;
+         if( fCompress && !records.empty() ) {
+            Compress(records, compressed);
+            if( compressed.size()<batch.nBytes ) {
+               batch.nBytes = uint32_t(compressed.size());
+               batch.fCompressed = 1;
+               p = &compressed[0];
+            }
+         }
+         Write(os, &batch, sizeof(batch), stats);
+         if( batch.nBytes )
+            Write(os, p, batch.nBytes, stats);
+         records.clear();
+      }
+
+      std::ostream& os;
+      bool fCompress;
+      std::vector<CBookRecord> records;
+      std::vector<char> compressed;
+      CBookDeltaStats stats;
+   };
+}
+
+CBookDeltaStats WriteBookDelta(std::ostream& os,
+                               const CBook& book,
+                               u4 idSource,
+                               std::size_t iFrom,
+                               std::size_t iTo,
+                               std::size_t iNext,
+                               bool fCompress)
+{
+   CDeltaWriter writer(os, idSource, iNext, fCompress);
+   boost::unordered_set<CBitBoard, CBitBoardHash> sent;
+
+   for( std::size_t i=iFrom; i<iTo; i++ ) {
+      const CBitBoard& board = book.Change(i);
+      if( sent.insert(board).second ) {
+         // the position is gone if the book was pruned since
+         const CBookData* bd = book.FindMinimal(board);
+         if( bd )
+            writer.Add(board, *bd);
+      }
+   }
+   return writer.Finish();
+}
+
+CBookDeltaStats WriteBookFull(std::ostream& os,
+                              const CBook& book,
+                              u4 idSource,
+                              std::size_t iNext,
+                              bool fCompress)
+{
+   CDeltaWriter writer(os, idSource, iNext, fCompress);
+
+   for( int nEmpty=0; nEmpty<nEmptyBookMax; nEmpty++ ) {
+      book.ForEachPosition(nEmpty, [&writer](const CBitBoard& board, const CBookData& data) {
+         writer.Add(board, data);
+      });
+   }
+   return writer.Finish();
+}
+
+CBookDeltaStats ReadBookDelta(std::istream& is,
+                              CBook& book,
+                              int nEmptyMin,
+                              CBookDeltaHeader& header)
+{
+   CBookDeltaStats stats;
+   std::vector<CBookRecord> records;
+   std::vector<char> compressed;
+
+   Read(is, &header, sizeof(header), stats);
+   if( memcmp(header.magic, kMagic, sizeof(kMagic))!=0 )
+      throw std::runtime_error("Expected a book delta.");
+   if( header.nVersion!=CBookDeltaHeader::kVersion )
+      throw std::runtime_error("Unknown book delta version " + boost::lexical_cast<std::string>(header.nVersion) + ".");
+
+   for( ;; ) {
+      CBatchHeader batch;
+      Read(is, &batch, sizeof(batch), stats);
+      if( batch.nRecords==0 )
+         break;
+      if( batch.nRecords>kBatchSize || batch.nBytes==0 || batch.nBytes>2*batch.nRecords*sizeof(CBookRecord) )
+         throw std::runtime_error("Damaged book delta.");
+
+      records.resize(batch.nRecords);
+      if( batch.fCompressed ) {
+         compressed.resize(batch.nBytes);
+         Read(is, &compressed[0], batch.nBytes, stats);
+         if( !Decompress(compressed, records) )
+            throw std::runtime_error("Damaged book delta.");
+      }
+      else {
+         if( batch.nBytes!=batch.nRecords*sizeof(CBookRecord) )
+            throw std::runtime_error("Damaged book delta.");
+         Read(is, &records[0], batch.nBytes, stats);
+      }
+
+      // join the batch before reading the next one
+      foreach(const CBookRecord& record, records) {
+         int nEmpty = CountBits(record.board.empty);
+         stats.nPositions++;
+         if( nEmpty>=nEmptyMin && nEmpty<nEmptyBookMax && book.JoinEntry(record.board, nEmpty, record.data) )
+            stats.nJoined++;
+      }
+      book.SyncJournal();
+   }
+   return stats;
+}
@@ -0,0 +1,102 @@
+// $Id$
+// Copyright Daniel Lidstrom
+//	All Rights Reserved
+// This file is distributed subject to GNU GPL version 2. See the files
+// Copying.txt and GPL.txt for details.
+//! @file
+//! Book deltas, the positions one book sends another when they sync.
+//!
+//! A delta is a header followed by batches of fixed-size records, the
+//! same records as in a version 2 book file. Each batch starts with its
+//! record count and byte count, so the receiver joins the positions
+//! into its book as the batches arrive. An empty batch ends the delta.
+//!
+//! The sender numbers its changes: change i is CBook::Change(i). A
+//! delta holds the positions of a range of changes, and its header
+//! says which change the receiver should ask for next time. The
+//! header also carries an id of the sending book, so a receiver can
+//! tell when the sender has restarted and its numbers no longer apply.
+//! A receiver that asks for a change the sender has dropped from its
+//! list (CBook::FirstChange()) gets the whole book instead.
+//! Header fields are fixed width, so both ends agree on the layout.
+//!
+//! Batches may be compressed: each record is xored with the record
+//! before it, and runs of zero bytes are stored as a count. Records
+//! are sorted, so neighbouring boards share most of their bytes.
+//! @ingroup
+//!
+
+#if !defined(BOOKDELTA_H__20240312T1015)
+#define BOOKDELTA_H__20240312T1015
+
+#include "Fwd.h"
+#include "Utils.h"
+#include <iosfwd>
+
+//!
+//! Header of a delta on the wire.
+//!
+class CBookDeltaHeader
+{
+public:
+
+   enum { kVersion = 1 };
+   enum { kCompressed = 1 };   //!< flag: batches may be compressed
+
+   char magic[4];   //!< "NTBD"
+   uint32_t nVersion;
+   uint32_t flags;
+   uint32_t idSource;   //!< id of the sending book, 0 if it has none
+   uint32_t iNext;   //!< change the receiver should ask for next time
+};
+
+//!
+//! Counts from writing or reading a delta.
+//!
+class CBookDeltaStats
+{
+public:
+
+   CBookDeltaStats()
+      : nPositions(0),
+        nJoined(0),
+        nBytes(0)
+   {}
+
+   std::size_t nPositions;   //!< positions sent or received
+   std::size_t nJoined;   //!< positions that changed the receiving book
+   std::size_t nBytes;   //!< bytes on the wire
+};
+
+//!
+//! Write the positions of changes [iFrom, iTo) of the book.
+//! Positions that changed more than once are sent once, with their current data.
+//!
+CBookDeltaStats WriteBookDelta(std::ostream& os,
+                               const CBook& book,
+                               u4 idSource,
+                               std::size_t iFrom,
+                               std::size_t iTo,
+                               std::size_t iNext,
+                               bool fCompress);
+
+//!
+//! Write all positions of the book.
+//!
+CBookDeltaStats WriteBookFull(std::ostream& os,
+                              const CBook& book,
+                              u4 idSource,
+                              std::size_t iNext,
+                              bool fCompress);
+
+//!
+//! Read a delta and join its positions into the book as they arrive.
+//! Positions with fewer than nEmptyMin empties are skipped.
+//! Throws std::runtime_error if the stream doesn't hold a delta.
+//!
+CBookDeltaStats ReadBookDelta(std::istream& is,
+                              CBook& book,
+                              int nEmptyMin,
+                              CBookDeltaHeader& header);
+
+#endif
@@ -9,11 +9,26 @@
 #include "Debug.h"
 #include "Cache.h"
 #include "options.h"
+#include "SearchThreads.h"
+#include "Ticks.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__unix__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
 const bool printCacheStores=false;
 
 #define CACHE_STATS 0
 #if CACHE_STATS
-#define UPDATE_CACHE_STATS queries++; if (result) writes++;
+#define UPDATE_CACHE_STATS queries++; if (pe) writes++;
 #define UPDATE_CACHE_STATS2 readMoves++; if (result->data.Importance()>=Importance(height,aPrune,nEmpty)) readValues++;
 #else
 #define UPDATE_CACHE_STATS
@@ -295,220 +310,457 @@ ostream& CCacheData::OutData(ostream& os) const {
    return os;
 }
 
-void CCacheData::Clear() {
-   // store an impossible position to prevent collisions
-   board.Impossible();
-   // make stale to allow overwrites
-   SetStale();
-   // set other stuff to 0 for debugging purposes
-   height=iPrune=nEmpty=iFastestFirst=0;
-   lBound=uBound=0;
-}
-
-void CCacheData::Initialize(const CBitBoard& aBoard, int aheight, int aPrune, int nEmpty) {
-   board=aBoard;
+void CCacheData::Initialize(int aheight, int aPrune, int anEmpty) {
    height=aheight;
    iPrune=aPrune;
-   nEmpty=nEmpty;
-   fStale=false;
+   nEmpty=anEmpty;
    lBound=-kInfinity;
    uBound= kInfinity;
    bestMove.Set(-1);
    iFastestFirst=0;
 }
 
-void CCacheData::Initialize(const CBitBoard& aBoard, const CHABM& hab) {
-   board=aBoard;
+void CCacheData::Initialize(const CHABM& hab) {
    height=hab.height;
    iPrune=hab.iPrune;
    nEmpty=hab.nEmpty;
-   fStale=false;
    lBound=-kInfinity;
    uBound= kInfinity;
    bestMove.Set(-1);
    iFastestFirst=0;
 }
 
-void CCacheData::Print(bool blackMove) const {
-   board.Print(blackMove);
-   printf(fStale?"stale ":"nonstale ");
+void CCacheData::Print() const {
+   printf("generation %d ", int(generation));
    OutData(cout);
 }
 
 /////////////////////////////////////////////////
-// CCache class
+// Table allocation
+//	Nearly every probe of a big table lands on a different page, so with 4k pages
+//	the probes are dominated by TLB misses. Large pages cover the table with far
+//	fewer TLB entries. With several search threads on a NUMA machine the table is
+//	interleaved across the nodes so one memory controller doesn't serve every probe.
+//	Each step quietly falls back to ordinary memory if the OS won't do it.
+//	The memory comes back zeroed, like calloc.
 /////////////////////////////////////////////////
 
-CCache::CCache(u4 anbuckets) {
-   fprintf(stderr, "Creating cache with %d buckets (%d MB)\n",anbuckets, anbuckets*sizeof(CCacheData)>>20);
-   nBuckets=anbuckets;
-   mask=nBuckets-1;
-   buckets=new CCacheData[nBuckets];
-   QSSERT(buckets);
-   QSSERT((nBuckets&(nBuckets-1))==0);
+const size_t kLargePageSize=2<<20;
 
-   Clear();
-   ClearStats();
+#if defined(_WIN32)
+
+// large pages need the "Lock pages in memory" right, which must also be enabled in the token
+static bool EnableLockMemoryPrivilege() {
+   HANDLE hToken;
+   TOKEN_PRIVILEGES tp;
+   bool fOK;
+
+   if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES|TOKEN_QUERY, &hToken))
+      return false;
+   tp.PrivilegeCount=1;
+   tp.Privileges[0].Attributes=SE_PRIVILEGE_ENABLED;
+   fOK=LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) &&
+       AdjustTokenPrivileges(hToken, FALSE, &tp, 0, NULL, 0) && GetLastError()==ERROR_SUCCESS;
+   CloseHandle(hToken);
+   return fOK;
 }
 
-CCache::~CCache() {
-   delete[] buckets;
+static char* AllocateTable(size_t& n, bool& fLarge) {
+   char* p=0;
+   SIZE_T nLargePage=0;
+
+   // GetLargePageMinimum isn't in XP, which we still target
+   typedef SIZE_T (WINAPI *TGetLargePageMinimum)(void);
+   TGetLargePageMinimum pGetLargePageMinimum=(TGetLargePageMinimum)GetProcAddress(GetModuleHandleA("kernel32.dll"), "GetLargePageMinimum");
+   if (pGetLargePageMinimum)
+      nLargePage=pGetLargePageMinimum();
+
+   fLarge=false;
+   if (nLargePage && EnableLockMemoryPrivilege()) {
+      size_t nLarge=(n+nLargePage-1)&~(nLargePage-1);
+      p=(char*)VirtualAlloc(NULL, nLarge, MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES, PAGE_READWRITE);
+      if (p) {
+         n=nLarge;
+         fLarge=true;
+      }
+   }
+   if (!p)
+      p=(char*)VirtualAlloc(NULL, n, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+   return p;
+}
+
+static void FreeTable(char* p, size_t n) {
+   VirtualFree(p, 0, MEM_RELEASE);
 }
 
-void CCache::Clear() {
-   CCacheData* i;
+#elif defined(__unix__)
+
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+// spread the pages over all the NUMA nodes we're allowed to use.
+//	Called directly through syscall() so we don't need libnuma.
+static void Interleave(char* p, size_t n) {
+   const int kMPolInterleave=3;
+   const int kMPolFMemsAllowed=1<<2;
+   unsigned long nodes=0;
+   int mode;
 
-   for (i=buckets; i<buckets+nBuckets; i++)
-      i->Clear();
-   staleCount=0;
+   if (syscall(SYS_get_mempolicy, &mode, &nodes, sizeof(nodes)*8, 0, kMPolFMemsAllowed) || !(nodes&(nodes-1)))
+      return;
+   syscall(SYS_mbind, p, n, kMPolInterleave, &nodes, sizeof(nodes)*8, 0);
 }
+#else
+static void Interleave(char* p, size_t n) {}
+#endif
 
-int CCache::CopyData(const CCache& cache2) {
-   if (nBuckets!=cache2.nBuckets)
-      return -2;
-   else {
-      memcpy(buckets, cache2.buckets, nBuckets*sizeof(CCacheData));
-      return 0;
+static char* AllocateTable(size_t& n, bool& fLarge) {
+   char* p=(char*)MAP_FAILED;
+   size_t nLarge=(n+kLargePageSize-1)&~(kLargePageSize-1);
+
+   fLarge=false;
+
+   // explicit huge pages, if the administrator has reserved some
+#ifdef MAP_HUGETLB
+   p=(char*)mmap(NULL, nLarge, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+   if (p!=MAP_FAILED)
+      fLarge=true;
+#endif
+
+   // otherwise ask for transparent huge pages
+   if (p==MAP_FAILED) {
+      p=(char*)mmap(NULL, nLarge, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (p==MAP_FAILED)
+         return 0;
+#ifdef MADV_HUGEPAGE
+      fLarge=madvise(p, nLarge, MADV_HUGEPAGE)==0;
+#endif
    }
-}
+   n=nLarge;
 
-void CCache::SetStale() {
-   int i;
+   // pages aren't placed until they're touched, so this applies to the whole table
+   if (nSearchThreads>1)
+      Interleave(p, n);
+   return p;
+}
 
-   //cout << "+++ ";
-   for (i=0; i<nBuckets; i++)
-      buckets[i].SetStale();
+static void FreeTable(char* p, size_t n) {
+   munmap(p, n);
 }
 
-void CCache::PrintStats() const {
-   printf(" cache: %6ld queries, %6ld read moves, %6ld read values, %6ld writes\n",
-          queries, readMoves, readValues, writes);
+#else
+
+static char* AllocateTable(size_t& n, bool& fLarge) {
+   fLarge=false;
+   return (char*)calloc(n, 1);
 }
 
-void CCache::ClearStats() {
-   queries=readMoves=readValues=writes=0;
+static void FreeTable(char* p, size_t n) {
+   free(p);
 }
 
-// FindOld -- find an entry in the cache. If there is no entry return NULL.
-//	If there is an entry set its stale flag to false and return it.
-CCacheData* CCache::FindOld(const CBitBoard& board, u4 hash) {
-   CCacheData* result, *result2;
+#endif
 
-   hash&=nBuckets-1;
-   result=buckets+hash;
-   result2=buckets+(hash^1);
+/////////////////////////////////////////////////
+// Cache files
+//	The file is mapped shared, so the OS writes the table back to disk as it likes.
+//	Nothing needs flushing at exit: entries are checked against their keys, so a
+//	half-written entry is just a miss next time.
+//	The file stays open and locked while it's mapped. Another cache, in this process or
+//	another, that finds it locked keeps its table in memory rather than resize the file
+//	or share its generation.
+/////////////////////////////////////////////////
 
-   // is this position in cache?
-   if (result->board==board) {
-      result->SetStale(false);
-   }
-   else if (result2->board==board) {
-      result=result2;
-      result->SetStale(false);
+#if defined(_WIN32)
+
+// map the file fn, making it n bytes long. fResized is set if the file had a different size.
+//	hFile is the open, locked file, to pass to UnmapTableFile()
+static char* MapTableFile(const char* fn, size_t n, bool& fResized, intptr_t& hFile) {
+   HANDLE h, hMapping;
+   LARGE_INTEGER size;
+   char* p=0;
+
+   // no sharing, so the open fails while another cache has the file
+   h=CreateFileA(fn, GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (h==INVALID_HANDLE_VALUE)
+      return 0;
+   fResized=!GetFileSizeEx(h, &size) || size.QuadPart!=(LONGLONG)n;
+   hMapping=CreateFileMappingA(h, NULL, PAGE_READWRITE, DWORD(i8(n)>>32), DWORD(n), NULL);
+   if (hMapping) {
+      p=(char*)MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, n);
+      CloseHandle(hMapping);
    }
+   if (p)
+      hFile=intptr_t(h);
    else
-      result=0;
+      CloseHandle(h);
+   return p;
+}
 
-   return result;
+static void UnmapTableFile(char* p, size_t n, intptr_t hFile) {
+   UnmapViewOfFile(p);
+   CloseHandle(HANDLE(hFile));
 }
 
-// FindNew -- find an entry in the cache. If there is no entry create one, with height and iPrune preset.
-//	Return the cache entry.
-CCacheData* CCache::FindNew(const CBitBoard& board, u4 hash, int height, int aPrune, int anEmpty) {
-   CCacheData* result, *result2;
+#elif defined(__unix__)
 
-   hash&=nBuckets-1;
-   result=buckets+hash;
-   result2=buckets+(hash^1);
+static char* MapTableFile(const char* fn, size_t n, bool& fResized, intptr_t& hFile) {
+   struct stat st;
+   char* p;
+   int fd;
 
-   // is this position in cache?
-   if (result->board==board) {
-      result->SetStale(false);
-   }
-   else if (result2->board==board) {
-      result=result2;
-      result->SetStale(false);
+   fd=open(fn, O_RDWR|O_CREAT, 0644);
+   if (fd<0)
+      return 0;
+   // the lock goes with fd, so it's held until UnmapTableFile() closes it
+   if (flock(fd, LOCK_EX|LOCK_NB)) {
+      close(fd);
+      return 0;
    }
-
-   // This position isn't the one in the cache...
-   else if (result->fStale || result->Replaceable(height, aPrune, anEmpty)) {
-      result->Initialize(board, height, aPrune, anEmpty);
+   fResized=fstat(fd, &st) || size_t(st.st_size)!=n;
+   if (fResized && (ftruncate(fd, 0) || ftruncate(fd, n))) {
+      close(fd);
+      return 0;
    }
-   else if (result2->fStale || result2->Replaceable(height, aPrune, anEmpty)) {
-      result=result2;
-      result->Initialize(board, height, aPrune, anEmpty);
+   p=(char*)mmap(NULL, n, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+   if (p==MAP_FAILED) {
+      close(fd);
+      return 0;
    }
+   hFile=fd;
+   return p;
+}
 
-   else
-      result=0;
+static void UnmapTableFile(char* p, size_t n, intptr_t hFile) {
+   munmap(p, n);
+   close(int(hFile));
+}
 
-   UPDATE_CACHE_STATS;
+#else
 
-   return result;
+static char* MapTableFile(const char* fn, size_t n, bool& fResized, intptr_t& hFile) {
+   return 0;
 }
 
-// FindNew -- find an entry in the cache. If there is no entry create one, with height and iPrune preset.
-//	Return the cache entry.
-CCacheData* CCache::FindOrCreate(const CBitBoard& board, int hash, const CHABM& hab) {
-   CCacheData* result, *result2;
-   hash&=mask;
+static void UnmapTableFile(char* p, size_t n, intptr_t hFile) {
+}
 
-   result=buckets+hash;
-   result2=buckets+(hash^1);
+#endif
 
-   // is this position in cache?
-   if (result->board==board) {
-      result->SetStale(false);
-   }
-   else if (result2->board==board) {
-      result=result2;
-      result->SetStale(false);
-   }
+/////////////////////////////////////////////////
+// CCache class
+/////////////////////////////////////////////////
 
-   // This position isn't the one in the cache...
-   else if (result->fStale || result->Replaceable(hab)) {
-      result->Initialize(board, hab);
+CCache::CCache(u4 anbuckets) {
+   SetSize(anbuckets);
+   Allocate();
+   Clear(fBackgroundCacheClear);
+   ClearStats();
+}
+
+CCache::CCache(u4 anbuckets, const char* fn, u4 id) {
+   bool fResized;
+
+   SetSize(anbuckets);
+   nMemory=kCacheFileHeaderSize+nBuckets*sizeof(CCacheEntry);
+   memory=MapTableFile(fn, nMemory, fResized, hFile);
+   if (!memory) {
+      fprintf(stderr, "Can't map cache file %s or it's in use, keeping the cache in memory\n", fn);
+      Allocate();
+      Clear(fBackgroundCacheClear);
+      ClearStats();
+      return;
    }
-   else if (result2->fStale || result2->Replaceable(hab)) {
-      result=result2;
-      result->Initialize(board, hab);
+   fLargePages=false;
+   header=(CCacheFileHeader*)memory;
+   buckets=(CCacheEntry*)(memory+kCacheFileHeaderSize);
+
+   if (!fResized && !memcmp(header->sMagic, "NTCACHE", sizeof(header->sMagic)) && header->version==kCacheFileVersion
+       && header->id==id && header->nBuckets==nBuckets && header->generation>=1 && header->generation<=15) {
+      generation=header->generation;
+      fprintf(stderr, "Reusing cache file %s (%d MB)\n", fn, int(nMemory>>20));
    }
+   else {
+      // invalidate the header first, so a crash while clearing doesn't leave a valid-looking file
+      memset(header, 0, sizeof(*header));
+      ZeroTable();
+      header->version=kCacheFileVersion;
+      header->id=id;
+      header->nBuckets=nBuckets;
+      header->generation=generation;
+      memcpy(header->sMagic, "NTCACHE", sizeof(header->sMagic));
+      fprintf(stderr, "Creating cache file %s (%d MB)\n", fn, int(nMemory>>20));
+   }
+   ClearStats();
+}
+
+void CCache::SetSize(u4 anbuckets) {
+   QSSERT(sizeof(CCacheData)==sizeof(i8));
+   QSSERT(sizeof(CCacheEntry)*kClusterSize==64);
+   QSSERT(sizeof(CCacheFileHeader)<=kCacheFileHeaderSize);
+   QSSERT((anbuckets&(anbuckets-1))==0 && anbuckets>=kClusterSize);
+
+   nBuckets=anbuckets;
+   mask=nBuckets/kClusterSize-1;
+   generation=1;
+   header=0;
+   hFile=0;
+}
 
+void CCache::Allocate() {
+   // align the clusters to cache lines. The allocated memory is already a cleared table;
+   //	the clear just touches the pages so the search doesn't stall on page faults.
+   nMemory=nBuckets*sizeof(CCacheEntry)+63;
+   memory=AllocateTable(nMemory, fLargePages);
+   CHECKNEW(memory!=0);
+   buckets=(CCacheEntry*)((size_t(memory)+63)&~size_t(63));
+   fprintf(stderr, "Creating cache with %d buckets (%d MB%s)\n",nBuckets, int(nMemory>>20), fLargePages?", large pages":"");
+}
+
+CCache::~CCache() {
+   WaitForClear();
+   if (header)
+      UnmapTableFile(memory, nMemory, hFile);
    else
-      result=0;
+      FreeTable(memory, nMemory);
+}
 
-   UPDATE_CACHE_STATS;
+void CCache::Clear(bool fBackground) {
+   WaitForClear();
+   if (fBackground)
+      clearThread=boost::thread(&CCache::ZeroTable, this);
+   else
+      ZeroTable();
+}
 
-   return result;
+void CCache::WaitForClear() const {
+   if (clearThread.joinable())
+      clearThread.join();
 }
 
-// FindNew -- find an entry in the cache. If there is no entry return NULL.
-//	Return the cache entry.
-CCacheData* CCache::Find(const CBitBoard& board, const CHABM& hab) {
-   CCacheData* result, *result2;
-   int hash=board.Hash()&mask;
+void CCache::ZeroTable() {
+   memset(buckets, 0, nBuckets*sizeof(CCacheEntry));
+}
 
-   result=buckets+hash;
-   result2=buckets+(hash^1);
+int CCache::CopyData(const CCache& cache2) {
+   if (nBuckets!=cache2.nBuckets)
+      return -2;
+   else {
+      WaitForClear();
+      cache2.WaitForClear();
+      memcpy(buckets, cache2.buckets, nBuckets*sizeof(CCacheEntry));
+      generation=cache2.generation;
+      if (header)
+         header->generation=generation;
+      return 0;
+   }
+}
 
-   // is this position in cache?
-   if (result->board==board) {
-      result->SetStale(false);
+void CCache::SetStale() {
+   //cout << "+++ ";
+   generation=generation%15+1;
+   if (header)
+      header->generation=generation;
+}
+
+void CCache::PrintStats() const {
+   printf(" cache: %6ld queries, %6ld read moves, %6ld read values, %6ld writes\n",
+          queries, readMoves, readValues, writes);
+   if (nProbesTimed) {
+      double cycles=double(cyclesProbes)/nProbesTimed;
+      printf(" cache: %s pages, %.0f cycles (%.0f ns) per probe\n",
+             fLargePages?"large":"small", cycles, cycles/dGHz);
    }
-   else if (result2->board==board) {
-      result=result2;
-      result->SetStale(false);
+}
+
+void CCache::ClearStats() {
+   queries=readMoves=readValues=writes=0;
+   nProbesTimed=cyclesProbes=0;
+}
+
+// time one probe in this many. The timing is mostly the cache and TLB misses on the cluster
+const int kProbeSample=256;
+static TLS int nProbesSinceSample=0;
+
+// FindOld -- find an entry in the cache. If there is no entry return false.
+//	If there is an entry, copy it to cd, move it to the current generation and return true.
+bool CCache::FindOld(i8 hash, CCacheData& cd) {
+   if (++nProbesSinceSample<kProbeSample)
+      return Probe(hash, cd);
+
+   nProbesSinceSample=0;
+   i8 tStart=GetCycles();
+   bool fFound=Probe(hash, cd);
+   cyclesProbes+=GetCycles()-tStart;
+   nProbesTimed++;
+   return fFound;
+}
+
+bool CCache::Probe(i8 hash, CCacheData& cd) {
+   CCacheEntry* cluster=Cluster(hash);
+   int i;
+
+   for (i=0; i<kClusterSize; i++) {
+      if (cluster[i].Read(hash, cd)) {
+         if (Stale(cd)) {
+            cd.Generation(generation);
+            cluster[i].Write(hash, cd);
+         }
+         return true;
+      }
    }
+   return false;
+}
 
-   else
-      result=0;
+// Store -- store a search result in the cache.
+//	If the position isn't in its cluster, replace a stale entry if there is one; otherwise
+//	replace the least important entry in the cluster if it's less important than this one.
+//	The entry is read, updated and written back as a copy. If another thread writes the
+//	same entry in between, one of the writes is lost, which costs only search time.
+void CCache::Store(i8 hash, int height, int aPrune, int anEmpty, CMove bestMove, int iFastestFirst,
+                   CValue searchAlpha, CValue searchBeta, CValue& value) {
+   CCacheEntry* cluster=Cluster(hash);
+   CCacheEntry* pe=0;
+   CCacheData cd, cdOld;
+   int i, importance, importanceMin;
+
+   // is this position in cache?
+   for (i=0; i<kClusterSize; i++) {
+      if (cluster[i].Read(hash, cd)) {
+         pe=cluster+i;
+         break;
+      }
+   }
+
+   // This position isn't in the cache... find the entry to replace
+   if (!pe) {
+      importanceMin=INT_MAX;
+      for (i=0; i<kClusterSize; i++) {
+         cdOld=cluster[i].Data();
+         if (Stale(cdOld)) {
+            pe=cluster+i;
+            break;
+         }
+         importance=CCacheData::Importance(cdOld.height, cdOld.iPrune, cdOld.nEmpty);
+         if (importance<importanceMin) {
+            importanceMin=importance;
+            pe=cluster+i;
+         }
+      }
+      cdOld=pe->Data();
+      if (!Stale(cdOld) && !cdOld.Replaceable(height, aPrune, anEmpty))
+         pe=0;
+      else
+         cd.Initialize(height, aPrune, anEmpty);
+   }
 
    UPDATE_CACHE_STATS;
 
-   return result;
+   if (pe) {
+      cd.Generation(generation);
+      cd.Store(height, aPrune, anEmpty, bestMove, iFastestFirst, searchAlpha, searchBeta, value);
+      pe->Write(hash, cd);
+   }
 }
 
 void CCache::Prepare() {
    ::cache=this;
-   tSetStale=nBuckets*1E-7/dGHz;
 }
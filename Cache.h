@@ -16,14 +16,15 @@
 #include "off.h"
 #include "Debug.h"
 
+#include <boost/thread/thread.hpp>
+
 class CCacheData {
 public:
    CCacheData();
    CCacheData(CValue anLBound, CValue aUBound, int aHeight, int aPrune, int nEmpty);
 
-   void Clear();
-   void Initialize(const CBitBoard& board, int height, int iPrune, int nEmpty);
-   void Initialize(const CBitBoard& board, const CHABM& hab);
+   void Initialize(int height, int iPrune, int nEmpty);
+   void Initialize(const CHABM& hab);
    bool Loadable(int aheight, int aPrune, int nEmpty) const;
    bool Loadable(const CHABM& habm) const;
    bool Storeable(int aheight, int aPrune, int nEmpty) const;
@@ -34,10 +35,8 @@ public:
    static int Importance(const CHABM& habm);
 
    // misc
-   void SetStale(bool fNewStale=true);
-
-   // info
-   const CBitBoard& Board() const;
+   int Generation() const;
+   void Generation(int aGeneration);
 
    // moves
    CMove BestMove() const;
@@ -54,20 +53,16 @@ public:
    void Store(const CHABM& habm, int iffCache, CMoveValue& mv);
 
    // debugging
-   void Print(bool fBlackMove) const;
+   void Print() const;
    ostream& OutData(ostream& os) const;
 
-   bool operator<(const CCacheData& b) const;
-
 private:
-   CBitBoard board;
+   // packed into 8 bytes so an entry can be checked against its key in one word
    CValue lBound, uBound;
-   u1 height, iPrune, nEmpty;
-
+   u2 height:6, nEmpty:6, iPrune:4;
    CMove bestMove;
-   u1 iFastestFirst;
-
-   u1 fStale;
+   u1 iFastestFirst:4;
+   u1 generation:4;	// CCache generation when the entry was last used
 
    friend class CCache;
 };
@@ -76,29 +71,96 @@ inline CCacheData::CCacheData() {};
 inline CCacheData::CCacheData(CValue anLBound, CValue aUBound, int aHeight,int aPrune,int anEmpty) { lBound=anLBound; uBound=aUBound; height=aHeight; iPrune=aPrune; nEmpty=anEmpty; }
 inline CMove CCacheData::BestMove() const {return bestMove;}
 inline void CCacheData::BestMove(CMove newBestMove) {bestMove=newBestMove;}
-inline bool CCacheData::operator<(const CCacheData& b) const { return board<b.board;}
 inline ostream& operator<<(ostream& os, const CCacheData& cd) { return cd.OutData(os);}
-inline void CCacheData::SetStale(bool fNewStale) { fStale=fNewStale; }
-inline const CBitBoard& CCacheData::Board() const { return board; }
+inline int CCacheData::Generation() const { return generation; }
+inline void CCacheData::Generation(int aGeneration) { generation=aGeneration; }
+
+/////////////////////////////////////////////////
+// CCacheEntry - one slot in the cache
+//	The entry is identified by a 64-bit hash of the board rather than the board itself.
+//	The key is stored xor'd with the data, so an entry that is torn by two threads
+//	writing it at once doesn't match any position and is simply a miss.
+/////////////////////////////////////////////////
+
+class CCacheEntry {
+public:
+   bool Read(i8 hash, CCacheData& cd) const;
+   void Write(i8 hash, const CCacheData& cd);
+   CCacheData Data() const;
+
+   static i8 Word(const CCacheData& cd);
+
+private:
+   volatile i8 key;	// hash^Word(data)
+   volatile i8 data;
+};
+
+inline i8 CCacheEntry::Word(const CCacheData& cd) {
+   i8 word;
+   memcpy(&word, &cd, sizeof(word));
+   return word;
+}
+
+inline CCacheData CCacheEntry::Data() const {
+   CCacheData cd;
+   i8 word=data;
+   memcpy(&cd, &word, sizeof(cd));
+   return cd;
+}
+
+inline bool CCacheEntry::Read(i8 hash, CCacheData& cd) const {
+   i8 word=data;
+   if ((key^word)!=hash)
+      return false;
+   memcpy(&cd, &word, sizeof(cd));
+   return true;
+}
+
+inline void CCacheEntry::Write(i8 hash, const CCacheData& cd) {
+   i8 word=Word(cd);
+   key=hash^word;
+   data=word;
+}
 
 /////////////////////////////////////////////////
 // CCache class
+//	Entries are grouped in clusters that fill one cache line. A position can be stored
+//	in any entry of the cluster selected by its hash, so a lookup touches only one line.
+//	Threads share the cache without locks; see CCacheEntry.
+//
+//	Entries from earlier searches are stale: they can be replaced by anything. Rather than
+//	mark each entry, the cache bumps its generation and an entry is stale if its
+//	generation differs. A cleared (all-zero) entry has generation 0, which the cache never
+//	uses, so cleared entries are always stale.
 /////////////////////////////////////////////////
 
+const int kClusterSize=4;
+
+// Header of a cache file. The table follows at kCacheFileHeaderSize.
+//	A file is reused only if everything in the header matches; otherwise it's cleared.
+class CCacheFileHeader {
+public:
+   char sMagic[8];
+   u4 version;	// kCacheFileVersion
+   u4 id;	// identifies the evaluator that wrote the values, see CCache::CCache
+   u4 nBuckets;
+   u4 generation;
+};
+
+const int kCacheFileHeaderSize=4096;
+// change this when CCacheData, CCacheEntry or the hash function changes
+const u4 kCacheFileVersion=1;
+
 class CCache {
 public:
    CCache(u4 nBuckets);
+   // a cache kept in the file fn, so it survives between runs. id must change whenever
+   //	the values in the cache would (new coefficients or ProbCut cuts, for instance).
+   //	If the file can't be mapped, or another cache has it, the cache is kept in memory.
+   CCache(u4 nBuckets, const char* fn, u4 id);
    ~CCache();
 
-   // Negamax read/write routines
-   void Read(const CPosition& pos, int height, int iPrune, CValue& alpha, CValue& beta,
-             CValue& value, CMove& bestMove, CMoves& moves, CValue& uBound, CValue& lBound);
-   void Write(const CPosition& pos, int height, int iPrune, CValue& alpha, CValue& beta,
-              CValue& value, CMove& bestMove, CMoves& moves, CValue& uBound, CValue& lBound);
-
-   // Negamove read/write routines
-   void ReadMove(const CPosition& pos, CMove& bestMove);
-   void WriteMove(const CPosition& pos, int height, CMove& bestMove);
+   bool Persistent() const;
 
    // get ready to use it
    void Prepare();
@@ -107,19 +169,52 @@ public:
    int CopyData(const CCache& cache2);
 
    // Other
-   void SetStale();
+   void SetStale();	// make all entries stale. O(1)
    void PrintStats() const;
    void ClearStats();
-   void Clear();
-
-   CCacheData* FindOld(const CBitBoard& pos, u4 hash);
-   CCacheData* FindNew(const CBitBoard& pos, u4 hash, int height, int iPrune, int nEmpty);
-   CCacheData* FindOrCreate(const CBitBoard& pos, int hash, const CHABM& habm);
-   CCacheData* Find(const CBitBoard& pos, const CHABM& habm);
+   // zero the table. If fBackground, a helper thread does it and this returns immediately;
+   //	the search can use the cache meanwhile, it just finds less in it.
+   void Clear(bool fBackground=false);
+   void WaitForClear() const;
+
+   // find a position in the cache. If it's there, copy its data to cd and return true.
+   bool FindOld(i8 hash, CCacheData& cd);
+   // store a search result. If the position isn't in the cache, create an entry for it
+   //	if there's one in its cluster that can be replaced. See CCacheData::Store for value.
+   void Store(i8 hash, int height, int iPrune, int nEmpty, CMove bestMove, int iFastestFirst,
+              CValue searchAlpha, CValue searchBeta, CValue& value);
 private:
    i4 queries, readMoves, readValues, writes;
-   CCacheData* buckets;
+   // sampled probe timings. Updated without locks, so slightly off with several threads
+   i8 nProbesTimed, cyclesProbes;
+
+   CCacheEntry* Cluster(i8 hash) const;
+   bool Stale(const CCacheData& cd) const;
+   bool Probe(i8 hash, CCacheData& cd);
+   void ZeroTable();
+   void SetSize(u4 nBuckets);
+   void Allocate();
+
+   char* memory;	// as allocated; buckets is aligned to a cache line within it
+   size_t nMemory;	// bytes allocated
+   bool fLargePages;	// true if the table is backed by large pages
+   CCacheFileHeader* header;	// start of the file mapping if the cache is persistent, else NULL
+   intptr_t hFile;	// the mapped file, open and locked while it's mapped
+   CCacheEntry* buckets;
    u4 nBuckets;
-   u4 mask;	// nBuckets-1
-   int staleCount;
+   u4 mask;	// (number of clusters - 1)
+   int generation;	// 1-15
+   mutable boost::thread clearThread;
 };
+
+inline CCacheEntry* CCache::Cluster(i8 hash) const {
+   return buckets+(u4(hash)&mask)*kClusterSize;
+}
+
+inline bool CCache::Stale(const CCacheData& cd) const {
+   return cd.Generation()!=generation;
+}
+
+inline bool CCache::Persistent() const {
+   return header!=0;
+}
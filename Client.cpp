@@ -12,80 +12,145 @@
 #include "FetchCommand.h"
 #include "SyncCommand2.h"
 #include "Variation.h"
+#include "BookDelta.h"
+#include "SearchThreads.h"
+#include "NodeStats.h"
+#include "options.h"
 
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/format.hpp>
 #include <boost/asio.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/algorithm/string/trim.hpp>
 
-void expandLines(const std::string& lines_file,
-                 CPlayerComputerPtr computer,
-                 const std::string& server_address,
-                 const std::string& server_port)
+void setIdlePriority()
 {
-   fPrintCorrections = false;
-   int n_games = 0;
-   int expanded = 0;
-   int linesTotal = 0;
-   int linesDone = 0;
-   // count lines
-   {
-      std::ifstream in(lines_file.c_str());
-      if( in ) {
-         std::ostringstream stream;
-         stream << in.rdbuf();
-         std::string contents = stream.str();
-         linesTotal = std::count_if(contents.begin(), contents.end(), std::bind2nd(std::equal_to<char>(), '\n'));
-      }
+#if !defined(_DEBUG)
+   if( !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE) )
+      Log(std::cout) << "Could not change thread priority" << std::endl;
+#endif
+}
+
+// add the positions of one game to the book
+void expandGame(const std::string& line, CPlayerComputerPtr computer)
+{
+   std::istringstream in(line);
+   CGame game(computer, computer);
+   if( !(in >> game) )
+      return;
+
+   Timer<double> timer;
+   int nBlack;
+   int nWhite;
+   int nEmpty;
+   game.pos.board.GetPieceCounts(nBlack, nWhite, nEmpty);
+   int perfectSolve = computer->book_pcp->PerfectSolve();
+   // must expand perfectly solved nodes completely
+   if( nEmpty<=perfectSolve ) {
+      std::stringstream stream;
+      stream << game;
+      // adjust moves to add temporarily
+      int temp = nEmpty;
+      std::swap(computer->movesToAdd, temp);
+      // adjust to book_pcp temporarily
+      std::swap(computer->search_pcp, computer->book_pcp);
+      CGame game2(computer, computer);
+      stream >> game2;
+      game2.Play(timer);
+      // restore moves to add
+      std::swap(temp, computer->movesToAdd);
+      // restore to search_pcp
+      std::swap(computer->search_pcp, computer->book_pcp);
    }
-   std::ifstream in(lines_file.c_str());
-   if( !in ) {
-      throw std::runtime_error("Could not open " + lines_file);
+   else {
+      computer->AnalyzeGame(game, timer);
    }
+}
+
+// the games the expansion workers share
+struct expand_queue
+{
+   expand_queue(const std::vector<std::string>& games)
+      : games(games),
+        iNext(0),
+        nDone(0)
+   {}
 
+   const std::vector<std::string>& games;
+   boost::mutex mutex;   // protects everything below
+   std::size_t iNext;
+   int nDone;
    Timer<double> timer;
-   CGame game(computer, computer);
-   while( in >> game && timer.elapsed()<12*3600 ) {
+};
+
+// Expand games from the queue until none are left. Each worker has its own computer,
+// so its own cache and calc params; the computers share the book. Workers that run
+// beside others search solo, since the helper threads serve one search at a time.
+void expandWorker(CPlayerComputerPtr computer, expand_queue& queue, bool fSolo)
+{
+   setIdlePriority();
+   fSoloSearch = fSolo;
+   for( ;; ) {
+      std::size_t i;
+      {
+         boost::mutex::scoped_lock lock(queue.mutex);
+         if( queue.iNext>=queue.games.size() || queue.timer.elapsed()>=12*3600 )
+            break;
+         i = queue.iNext++;
+      }
       Log(std::cout)
          << "Analyzing game "
-         << ++n_games
+         << i+1
+         << " of "
+         << queue.games.size()
          << endl
          ;
-      int nBlack;
-      int nWhite;
-      int nEmpty;
-      game.pos.board.GetPieceCounts(nBlack, nWhite, nEmpty);
-      int perfectSolve = computer->book_pcp->PerfectSolve();
-      // must expand perfectly solved nodes completely
-      if( nEmpty<=perfectSolve ) {
-         std::stringstream stream;
-         stream << game;
-         // adjust moves to add temporarily
-         int temp = nEmpty;
-         std::swap(computer->movesToAdd, temp);
-         // adjust to book_pcp temporarily
-         std::swap(computer->search_pcp, computer->book_pcp);
-         CGame game2(computer, computer);
-         stream >> game2;
-         Timer<double> timer;
-         game2.Play(timer);
-         // restore moves to add
-         std::swap(temp, computer->movesToAdd);
-         // restore to search_pcp
-         std::swap(computer->search_pcp, computer->book_pcp);
-      }
-      else {
-         computer->AnalyzeGame(game, timer);
-      }
+      expandGame(queue.games[i], computer);
+
+      boost::mutex::scoped_lock lock(queue.mutex);
+      queue.nDone++;
       Log(std::cout)
          << "Expansion pace is "
-         << int(timer.elapsed()/n_games+0.5)
+         << int(queue.timer.elapsed()/queue.nDone+0.5)
          << " seconds per line"
          << std::endl
          ;
    }
-   if( computer->cd.sCalcParams=="s26" ) {
-      CBookPtr bp = computer->book.lock();
+   WipeNodeStats();
+}
+
+void expandLines(const std::string& lines_file,
+                 const std::vector<CPlayerComputerPtr>& computers)
+{
+   fPrintCorrections = false;
+   std::ifstream in(lines_file.c_str());
+   if( !in ) {
+      throw std::runtime_error("Could not open " + lines_file);
+   }
+   // one game per line
+   std::vector<std::string> games;
+   std::string line;
+   while( std::getline(in, line) ) {
+      if( !boost::algorithm::trim_copy(line).empty() )
+         games.push_back(line);
+   }
+
+   expand_queue queue(games);
+   if( computers.size()==1 ) {
+      expandWorker(computers[0], queue, fSoloSearch);
+   }
+   else {
+      std::vector<std::shared_ptr<boost::thread> > workers;
+      foreach(CPlayerComputerPtr computer, computers)
+         workers.push_back(std::shared_ptr<boost::thread>(new boost::thread(expandWorker, computer, boost::ref(queue), true)));
+      foreach(const std::shared_ptr<boost::thread>& worker, workers)
+         worker->join();
+   }
+
+   if( computers[0]->cd.sCalcParams=="s26" ) {
+      CBookPtr bp = computers[0]->book.lock();
       int searches;
       bp->CorrectAll(searches);
    }
@@ -111,19 +176,25 @@ void client_fetch(std::iostream& stream, const std::string& lines_file)
    Log(std::cout) << "Received " << n_lines << " lines." << std::endl;
 }
 
+FetchCommand client_fetch2(std::iostream& stream, CBook& book)
+{
+   Log(std::cout) << "Requesting work." << std::endl;
+   stream << FETCH2_COMMAND << " " << GetComputerNameAsString() << std::endl;
+   FetchCommand command(book);
+   boost::archive::binary_iarchive ia(stream);
+   ia >> command;
+   return command;
+}
+
 FetchCommand client_fetch2(std::iostream& stream,
                            CBook& book,
                            const std::string& lines_file)
 {
-   Log(std::cout) << "Requesting work." << std::endl;
-   stream << FETCH2_COMMAND << " " << GetComputerNameAsString() << std::endl;
    std::ofstream out(lines_file.c_str());
    if( !out )
       throw std::runtime_error("Could not open " + lines_file);
 
-   FetchCommand command(book);
-   boost::archive::binary_iarchive ia(stream);
-   ia >> command;
+   FetchCommand command = client_fetch2(stream, book);
 
    foreach(const std::string& game, command.GetGames()) {
       out << game << std::endl;
@@ -172,6 +243,86 @@ void client_sync3(std::iostream& stream, const SyncCommand2& syncCommand)
       ;
 }
 
+// where the client and the server are in each other's changes
+struct sync_state
+{
+   u4 idServerBook;   // 0 until the first sync
+   std::size_t iServer;   // next server change to ask for
+   std::size_t iSent;   // next change of our own to send
+
+   sync_state()
+      : idServerBook(0),
+        iServer(0),
+        iSent(0)
+   {}
+};
+
+void client_sync4(std::iostream& stream,
+                  CBook& book,
+                  const VariationCollection& variations,
+                  sync_state& state)
+{
+   stream << SYNC4_COMMAND << " " << GetComputerNameAsString() << " " << state.idServerBook << " " << state.iServer << std::endl;
+   Log(std::cout)
+      << "Sending changes..."
+      << std::endl
+      ;
+   std::size_t iTo = book.NChanges();
+   CBookDeltaStats sent;
+   // changes we haven't sent were dropped from the list, send the whole book
+   if( state.iSent<book.FirstChange() || state.iSent>iTo )
+      sent = WriteBookFull(stream, book, 0, iTo, true);
+   else
+      sent = WriteBookDelta(stream, book, 0, state.iSent, iTo, iTo, true);
+   {
+      boost::archive::binary_oarchive oa(stream);
+      oa << variations;
+   }
+   stream << std::flush;
+   Log(std::cout)
+      << boost::format("Done. Sent %1% positions (%2% bytes).")
+      % sent.nPositions % sent.nBytes
+      << std::endl
+      ;
+
+   Log(std::cout)
+      << "Receiving changes..."
+      << std::endl
+      ;
+   CBookDeltaHeader header;
+   CBookDeltaStats received = ReadBookDelta(stream, book, 0, header);
+   state.idServerBook = header.idSource;
+   state.iServer = header.iNext;
+   // the server has the positions it sent, don't send them back
+   state.iSent = book.NChanges();
+   Log(std::cout)
+      << boost::format("Done. Joined %1% of %2% positions (%3% bytes).")
+      % received.nJoined % received.nPositions % received.nBytes
+      << std::endl
+      ;
+}
+
+void client_merge2(std::iostream& stream, CBook& book, sync_state& state)
+{
+   stream << MERGE2_COMMAND << " " << GetComputerNameAsString() << " " << state.idServerBook << " " << state.iServer << std::endl;
+   Log(std::cout)
+      << "Receiving changes..."
+      << std::endl
+      ;
+   CBookDeltaHeader header;
+   CBookDeltaStats received = ReadBookDelta(stream, book, 0, header);
+   state.idServerBook = header.idSource;
+   state.iServer = header.iNext;
+   state.iSent = book.NChanges();
+   Log(std::cout)
+      << boost::format("Done. Joined %1% of %2% positions (%3% bytes).")
+      % received.nJoined % received.nPositions % received.nBytes
+      << std::endl
+      ;
+   int searches;
+   book.CorrectAll(searches);
+}
+
 void client_merge(std::iostream& stream, CBook& book)
 {
    stream << MERGE_COMMAND << " " << GetComputerNameAsString() << std::endl;
@@ -206,7 +357,8 @@ void client_merge(std::iostream& stream, CBook& book)
 int client(CComputerDefaults cd1,
            const std::string& server_address,
            const std::string& server_port,
-           bool isS26)
+           bool isS26,
+           int nWorkers)
 {
 #if !defined(_DEBUG)
    if( !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE) )
@@ -215,6 +367,17 @@ int client(CComputerDefaults cd1,
       Log(std::cout) << "Changed process priority to idle" << std::endl;
 #endif
 
+   if( SINGLE_THREADED_SEARCH )
+      nWorkers = 1;
+   nWorkers = std::max(nWorkers, 1);
+   if( nWorkers>1 ) {
+      // each worker has its own cache; they share the memory from parameters.txt,
+      // and the cache files would clash
+      maxCacheMem /= nWorkers;
+      fPersistentCache = false;
+      Log(std::cout) << "Expanding with " << nWorkers << " workers." << std::endl;
+   }
+
    cd1.fEdmundAfter = false;
    CPlayerComputerPtr computer;
    if( isS26 ) { // add all moves
@@ -230,7 +393,12 @@ int client(CComputerDefaults cd1,
       cerr << "ERR: You need a book to use Expand mode\n";
       return EXIT_FAILURE;
    }
+   // the workers' computers find the same book
+   std::vector<CPlayerComputerPtr> computers(1, computer);
+   for( int i=1; i<nWorkers; i++ )
+      computers.push_back(CPlayerComputer::Create(cd1, false));
    std::shared_ptr<SyncCommand2> syncCommand(new SyncCommand2(*bp));
+   sync_state sync;
 
    int success = EXIT_SUCCESS;
 
@@ -245,7 +413,7 @@ int client(CComputerDefaults cd1,
    STATE state = FETCH2;
    const std::string lines_file("lines.ggf");
    try {
-      expandLines(lines_file, computer, server_address, server_port);
+      expandLines(lines_file, computers);
       state = SYNC;//MERGE;
    }
    catch( std::exception& )
@@ -283,14 +451,9 @@ int client(CComputerDefaults cd1,
                case SYNC:
                {
                   //client_sync(stream, *bp);
-                  client_sync3(stream, *syncCommand);
+                  //client_sync3(stream, *syncCommand);
+                  client_sync4(stream, *bp, syncCommand->GetVariations(), sync);
                   bp->Write();
-                  const std::string bookname = bp->Bookname();
-                  const std::string oldBookname = bookname+".old";
-                  ::remove(oldBookname.c_str());
-                  ::rename(bookname.c_str(), oldBookname.c_str());
-                  *bp = CBook(bookname.c_str());
-                  bp->SetComputer(computer);
                } break;
                default: break;
                }
@@ -302,7 +465,7 @@ int client(CComputerDefaults cd1,
                case FETCH:
                case FETCH2:
                {
-                  expandLines(lines_file, computer, server_address, server_port);
+                  expandLines(lines_file, computers);
                   state = SYNC;
                } break;
                case SYNC:
@@ -329,6 +492,107 @@ int client(CComputerDefaults cd1,
    return success;
 }
 
+// timings from the simulated clients of LoadTest()
+struct load_stats
+{
+   load_stats()
+      : nSessions(0),
+        nFailed(0),
+        tTotal(0),
+        tLongest(0)
+   {}
+
+   void Add(double t)
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      nSessions++;
+      tTotal += t;
+      tLongest = std::max(tLongest, t);
+   }
+
+   void Fail()
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      nFailed++;
+   }
+
+   boost::mutex mutex;
+   int nSessions;
+   int nFailed;
+   double tTotal;
+   double tLongest;
+};
+
+// Fetch work, then sync the fetched positions back as if they had been
+// expanded. Sends real traffic, but only changes the server's variation queue.
+void simulated_client(const std::string& server_address,
+                      const std::string& server_port,
+                      int nRounds,
+                      load_stats& stats)
+{
+   using boost::asio::ip::tcp;
+
+   CBook book(0, no_save);
+   sync_state sync;
+   for( int i=0; i<nRounds; i++ ) {
+      try {
+         CBook work(0, no_save);
+         VariationCollection variations;
+         Timer<double> timer;
+         {
+            tcp::iostream stream(server_address, server_port);
+            if( !stream )
+               throw std::runtime_error("Could not connect to server.");
+            variations = client_fetch2(stream, work).GetVariations();
+         }
+         stats.Add(timer.elapsed());
+
+         book.JoinBook(work);
+         timer.start();
+         {
+            tcp::iostream stream(server_address, server_port);
+            if( !stream )
+               throw std::runtime_error("Could not connect to server.");
+            client_sync4(stream, book, variations, sync);
+         }
+         stats.Add(timer.elapsed());
+      }
+      catch( std::exception& ex ) {
+         std::cerr << ex.what() << std::endl;
+         stats.Fail();
+      }
+   }
+}
+
+int LoadTest(int argc, char** argv)
+{
+   if( argc<8 ) {
+      cerr << "Usage: " << argv[0] << " b11 sXX bound skip-count loadtest server-address server-port [clients] [rounds]" << std::endl;
+      return EXIT_FAILURE;
+   }
+   const std::string server_address(argv[6]);
+   const std::string server_port(argv[7]);
+   const int nClients = argc>8 ? atoi(argv[8]) : 50;
+   const int nRounds = argc>9 ? atoi(argv[9]) : 10;
+
+   load_stats stats;
+   std::vector<std::shared_ptr<boost::thread> > clients;
+   Timer<double> timer;
+   for( int i=0; i<nClients; i++ )
+      clients.push_back(std::shared_ptr<boost::thread>(new boost::thread(simulated_client, server_address, server_port, nRounds, boost::ref(stats))));
+   foreach(const std::shared_ptr<boost::thread>& client, clients)
+      client->join();
+   double elapsed = timer.elapsed();
+
+   Log(std::cout)
+      << boost::format("%1% clients, %2% sessions in %3$.1f s: %4$.2f sessions/s, mean %5$.2f s, longest %6$.2f s, %7% failed.")
+      % nClients % stats.nSessions % elapsed % (stats.nSessions/std::max(elapsed, 1e-6))
+      % (stats.tTotal/std::max(stats.nSessions, 1)) % stats.tLongest % stats.nFailed
+      << std::endl
+      ;
+   return stats.nFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int Client(int argc, char** argv, const CComputerDefaults& cd1)
 {
    int success = EXIT_SUCCESS;
@@ -348,7 +612,9 @@ int Client(int argc, char** argv, const CComputerDefaults& cd1)
          try {
             std::string server_port = argv[7];
             boost::lexical_cast<int>(server_port);
-            success = client(cd1, server_address, server_port, isS26);
+            // one expansion worker per search thread, unless given
+            int nWorkers = argc>8 ? boost::lexical_cast<int>(argv[8]) : nSearchThreads;
+            success = client(cd1, server_address, server_port, isS26, nWorkers);
          }
          catch( std::bad_cast& )
          {
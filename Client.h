@@ -23,4 +23,10 @@
 //!
 int Client(int argc, char** argv, const CComputerDefaults& cd1);
 
+//!
+//! Simulate many clients syncing with a server, and report the throughput.
+//! Run it against a test server: the clients take work off its queue.
+//!
+int LoadTest(int argc, char** argv);
+
 #endif
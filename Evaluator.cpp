@@ -31,16 +31,7 @@ CEvaluator* CEvaluator::FindEvaluator(char evaluatorType, char coeffSet) {
 
    ptr=evaluatorList.find(evaluatorInfo);
    if (ptr==evaluatorList.end()) {
-      switch(evaluatorType) {
-      case 'J': {
-         int nFiles= (coeffSet>='9')?10:6;
-         result=new CEvaluatorJ(FNBase(evaluatorType, coeffSet), nFiles);
-         break;
-      }
-      default:
-         QSSERT(0);
-      }
-      QSSERT(result);
+      result=Create(evaluatorType, coeffSet, fCompactCoeffs);
       evaluatorList[evaluatorInfo]=result;
    }
    else {
@@ -49,6 +40,22 @@ CEvaluator* CEvaluator::FindEvaluator(char evaluatorType, char coeffSet) {
    return result;
 }
 
+CEvaluator* CEvaluator::Create(char evaluatorType, char coeffSet, bool fCompact) {
+   CEvaluator* result=0;
+
+   switch(evaluatorType) {
+   case 'J': {
+      int nFiles= (coeffSet>='9')?10:6;
+      result=new CEvaluatorJ(FNBase(evaluatorType, coeffSet), nFiles, fCompact);
+      break;
+   }
+   default:
+      QSSERT(0);
+   }
+   QSSERT(result);
+   return result;
+}
+
 void CEvaluator::Clean() {
    map<CEvaluatorInfo, CEvaluator*>::iterator i;
    for (i=evaluatorList.begin(); i!=evaluatorList.end(); i++)
@@ -76,12 +83,71 @@ bool CEvaluator::Pos2Enabled() const {
    return false;
 }
 
+u4 CEvaluator::Fingerprint() const {
+   return 0;
+}
+
+//////////////////////////////////////////////////////
+// Compact J coefficients
+//////////////////////////////////////////////////////
+
+CCompactCoeffsJ::CCompactCoeffsJ() : packed(0), numbers(0), corners(0) {
+}
+
+void CCompactCoeffsJ::Set(const std::vector<TCoeff>& black) {
+   const int nPacked=coeffStartsJ[C2x4J];
+   const int nNumbers=nCoeffsJ-coeffStartsJ[M1J];
+   const int nCorners=coeffStartsJ[M1J]-coeffStartsJ[C2x5J];
+   int i;
+
+   // the corners are read 4 bytes at a time, so leave room after the last one
+   block.resize(nPacked+nNumbers+(nCorners+2)/2);
+   TCoeff* pPacked=&block[0];
+   TCoeff* pNumbers=pPacked+nPacked;
+   i2* pCorners=(i2*)(pNumbers+nNumbers);
+
+   for (i=0; i<nPacked; i++)
+      pPacked[i]=black[i];
+   for (i=0; i<nNumbers; i++)
+      pNumbers[i]=black[coeffStartsJ[M1J]+i];
+   for (i=0; i<nCorners; i++) {
+      TCoeff coeff=black[coeffStartsJ[C2x5J]+i];
+      if (coeff>0x7FFF)
+         coeff=0x7FFF;
+      else if (coeff<-0x7FFF)
+         coeff=-0x7FFF;
+      pCorners[i]=i2(coeff);
+   }
+
+   packed=pPacked;
+   numbers=pNumbers;
+   corners=pCorners;
+}
+
 //////////////////////////////////////////////////////
 // Pattern J evaluator
 //	Use 2x4, 2x5, edge+X patterns
 //////////////////////////////////////////////////////
 
-CEvaluatorJ::CEvaluatorJ(const char* fnBase, int nFiles) {
+// true if the white coefficients are the black coefficients with the colors swapped,
+//	as CCompactCoeffsJ needs
+static bool ColorSymmetricJ(const std::vector<TCoeff>* coeffs) {
+   int map, nConfigs, coeffStart, config;
+
+   for (map=0; map<M1J; map++) {
+      if (map==C2x4J)
+         continue;
+      nConfigs=mapsJ[map].NConfigs();
+      coeffStart=coeffStartsJ[map];
+      for (config=0; config<nConfigs; config++) {
+         if (coeffs[0][coeffStart+nConfigs-1-config]!=coeffs[1][coeffStart+config])
+            return false;
+      }
+   }
+   return true;
+}
+
+CEvaluatorJ::CEvaluatorJ(const char* fnBase, int nFiles, bool afCompact) {
    int map,  iFile, coeffStart, mover, packedCoeff, nLen;
    int nIDs, nConfigs, id, config, wconfig, cid, wcid;
    u2 configpm1, configpm2, mapsize;
@@ -89,6 +155,10 @@ CEvaluatorJ::CEvaluatorJ(const char* fnBase, int nFiles) {
    std::vector<float> rawCoeffs;
    TCoeff coeff;
    int iSubset, nSubsets, nEmpty;
+   size_t i;
+
+   fCompact=afCompact;
+   fingerprint=2166136261u;
 
    // some parameters are set based on the evaluator version number
    nLen=strlen(fnBase);
@@ -232,27 +302,89 @@ CEvaluatorJ::CEvaluatorJ(const char* fnBase, int nFiles) {
             }
          }
 
-         // Set the pcoeffs array and the fParameters
-         for (nEmpty=59-nSetWidth*iFile; nEmpty>=50-nSetWidth*iFile; nEmpty--) {
+         // fingerprint the coefficients as they will be used
+         for (mover=0; mover<2; mover++) {
+            const std::vector<TCoeff>& cf=coeffs[nSets][mover];
+            for (i=0; i<cf.size(); i++)
+               fingerprint=(fingerprint^u4(cf[i]))*16777619u;
+         }
+
+         // the empties that use this set. Set below, once all sets are read
+         for (nEmpty=59-nSetWidth*iFile; nEmpty>=50-nSetWidth*iFile && nEmpty>=0; nEmpty--) {
             // if this is a set of the wrong parity, do nothing
             if ((nEmpty&1)==iSubset)
                continue;
-            for (mover=0; mover<2; mover++) {
-               pcoeffs[nEmpty][mover]=coeffs[nSets][mover];
-            }
+            nEmptyToSet[nEmpty]=nSets;
          }
 
          nSets++;
       }
       fclose(fp);
    }
+
+   // Compact coefficients keep only black's table, so they need the white coefficients to be
+   //	black's with the colors swapped. That's checked in every build, it's a one-time cost;
+   //	coefficients that fail it are kept in the full format.
+   if (fCompact) {
+      for (iSubset=0; iSubset<nSets && fCompact; iSubset++) {
+         if (!ColorSymmetricJ(coeffs[iSubset])) {
+            fprintf(stderr, "Coefficients %s aren't color symmetric, not using compact coefficients\n", fnBase);
+            fCompact=false;
+         }
+      }
+   }
+
+   // compact coefficients replace the full tables
+   if (fCompact) {
+      for (iSubset=0; iSubset<nSets; iSubset++) {
+         compact[iSubset].Set(coeffs[iSubset][1]);
+         for (mover=0; mover<2; mover++)
+            std::vector<TCoeff>().swap(coeffs[iSubset][mover]);
+      }
+   }
+
+   // Set the pcoeffs array
+   for (nEmpty=0; nEmpty<60; nEmpty++) {
+      if (fCompact)
+         pcompact[nEmpty]=compact+nEmptyToSet[nEmpty];
+      else {
+         for (mover=0; mover<2; mover++)
+            pcoeffs[nEmpty][mover]=coeffs[nEmptyToSet[nEmpty]][mover];
+      }
+   }
+
+   // 16-bit corner coefficients evaluate differently if any were clipped, so keep compact caches apart
+   if (fCompact)
+      fingerprint=(fingerprint^1)*16777619u;
 }
 
 // pos2 evaluators
 CValue CEvaluatorJ::EvalMobs(u4 nMovesPlayer, u4 nMovesOpponent) const {
+   if (fCompact) {
+      CEvalLeaf leaf;
+      CValue value;
+      GetEvalLeaf(leaf, nMovesPlayer, nMovesOpponent);
+      ValueJBatchCompact(*pcompact[nEmpty_], &leaf, 1, nEmpty_, &value);
+      return value;
+   }
    return ValueJMobs(pcoeffs[nEmpty_], nMovesPlayer, nMovesOpponent);
 }
 
+void CEvaluatorJ::EvalMobsBatch(const CEvalLeaf* leaves, int n, int nEmpty, CValue* values) const {
+   if (fCompact)
+      ValueJBatchCompact(*pcompact[nEmpty], leaves, n, nEmpty, values);
+   else
+      ValueJBatch(pcoeffs[nEmpty], leaves, n, nEmpty, values);
+}
+
+bool CEvaluatorJ::Compact() const {
+   return fCompact;
+}
+
 bool CEvaluatorJ::Pos2Enabled() const {
    return true;
 }
+
+u4 CEvaluatorJ::Fingerprint() const {
+   return fingerprint;
+}
@@ -27,6 +27,19 @@ extern float multiplier;
 //////////////////////////////////
 // Evaluators
 /////////////////////////////////
+
+// What the evaluator needs to know about a position, captured so that several
+//	positions (typically the children of a node) can be valued together.
+//	Filled in by GetEvalLeaf() in Pos2.cpp.
+class CEvalLeaf {
+public:
+   enum { kNConfigs=36 };
+   u2 configs[kNConfigs];	// configs of the row, column and diagonal patterns
+   u1 nMovesPlayer, nMovesOpponent;
+   bool fBlackMove;	// player to move
+   bool fPass;	// the position is valued after a pass, so the value is negated
+};
+
 class CEvaluatorInfo {
 public:
    char evaluatorType, coeffSet;
@@ -42,6 +55,8 @@ inline bool operator<(const CEvaluatorInfo&a, const CEvaluatorInfo&b) {
 class CEvaluator {
 public:
    static CEvaluator* FindEvaluator(char evaluatorType, char coeffSet);
+   // a new evaluator, not shared through FindEvaluator(), e.g. to compare the coefficient formats
+   static CEvaluator* Create(char evaluatorType, char coeffSet, bool fCompact);
    static void Clean();
 
    // posG evaluators
@@ -50,12 +65,18 @@ public:
 
    // pos2 evaluators
    virtual CValue EvalMobs(u4 nMovesPlayer, u4 nMovesOpponent) const = 0;
+   // value n positions, each with nEmpty empties, from the point of view of each leaf's fBlackMove.
+   //	Same values as EvalMobs(), but the coefficient lookups overlap.
+   virtual void EvalMobsBatch(const CEvalLeaf* leaves, int n, int nEmpty, CValue* values) const = 0;
 
    // is pos2 allowed?
    virtual bool Pos2Enabled() const;
 
    virtual void Setup();
 
+   // changes when the coefficients change. Saved caches are checked against it
+   virtual u4 Fingerprint() const;
+
 protected:
    static map<CEvaluatorInfo, CEvaluator*> evaluatorList;
    static char* Filename(char evaluatorType, char coeffSet);
@@ -111,9 +132,37 @@ extern int coeffStartsJ[nMapsJ];
 extern int nCoeffsJ;
 extern TCoeff *mobsJ;
 
+// Compact coefficients for one game stage, in one block of memory (about 600k instead of 1.7M).
+//	There is one copy for both colors: white's coefficient for a pattern config is black's
+//	coefficient for the config with the colors swapped, nConfigs-1-config.
+//	Line and triangle coefficients keep the packed format (16-bit coefficient, pot mob bytes).
+//	2x5 and edge+2X coefficients are 16 bits. The 2x4 patterns are folded into the 2x5 patterns
+//	when loading, so they take no space.
+class CCompactCoeffsJ {
+public:
+   CCompactCoeffsJ();
+
+   // build from the full black coefficient table
+   void Set(const std::vector<TCoeff>& black);
+   // bytes used
+   size_t Size() const { return block.size()*sizeof(TCoeff); }
+
+   const TCoeff* packed;	// lines and triangles, indexed like the full table
+   const TCoeff* numbers;	// mobility, pot mobility and parity, indexed from coeffStartsJ[M1J]
+   const i2* corners;	// 2x5 and edge+2X, indexed from coeffStartsJ[C2x5J]
+
+private:
+   std::vector<TCoeff> block;
+
+   // the pointers point into block
+   CCompactCoeffsJ(const CCompactCoeffsJ&);
+   void operator=(const CCompactCoeffsJ&);
+};
+
 class CEvaluatorJ : public CEvaluator{
 public:
-   CEvaluatorJ(const char* fnBase, int nFiles);
+   // fCompact asks for compact coefficients, see Compact()
+   CEvaluatorJ(const char* fnBase, int nFiles, bool fCompact);
 
    // posG evaluators
    //virtual CValue Evaluate(CPositionG& pos);
@@ -121,16 +170,27 @@ public:
 
    // pos2 evaluators
    virtual CValue EvalMobs(u4 nMovesPlayer, u4 nMovesOpponent) const;
+   virtual void EvalMobsBatch(const CEvalLeaf* leaves, int n, int nEmpty, CValue* values) const;
 
    // is pos2 allowed?
    virtual bool Pos2Enabled() const;
 
+   virtual u4 Fingerprint() const;
+
+   // true if the coefficients are compact. Coefficients that can't be made compact stay full
+   bool Compact() const;
+
 private:
    std::vector<TCoeff> coeffs[60][2];
    std::vector<TCoeff> pcoeffs[60][2];
-   int	nEmptyToSet[60];
+   // used instead of coeffs if fCompact is set
+   CCompactCoeffsJ compact[60];
+   const CCompactCoeffsJ* pcompact[60];
+   bool fCompact;
+   int	nEmptyToSet[60];	// index into coeffs and compact
    u4  fParameters[60];
    int nSets;
+   u4 fingerprint;
 };
 
 ////////////////////////////////
@@ -32,15 +32,15 @@ void InitRFs() {
    }
 }
 
-void InitSDToPConfig() {
+void InitSDToIConfig() {
    int sq,dir;
 
    for(sq=0;sq<NN;sq++)
       for (dir=0;dir<4;dir++)
          if (sdToValue[sq][dir])
-            sdToPConfig[sq][dir]=&(configs[sdToPattern[sq][dir]]);
+            sdToIConfig[sq][dir]=sdToPattern[sq][dir];
          else
-            sdToPConfig[sq][dir]=&(configs[knPats]);
+            sdToIConfig[sq][dir]=knPats;
 
 }
 
@@ -48,7 +48,7 @@ void InitFastFlip() {
    InitFastFlipBase();
    fprintf(stderr,"Init fast flip...");
    InitRFs();
-   InitSDToPConfig();
+   InitSDToIConfig();
    InitConfigTranslate();
    fprintf(stderr,"Done\n");
 }
@@ -9,6 +9,6 @@
 
 void InitFastFlip();
 
-extern TConfig* sdToPConfig[NN][4];
+extern int sdToIConfig[NN][4];
 extern int *nEmptyToPCoeffsK[60];
 extern u2 config2x5Toconfig2x4[6561*9];
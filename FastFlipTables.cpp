@@ -16,12 +16,12 @@ using namespace std;
 CRowFlip rfs[knRFs+1];
 CRowFlip* isdcToPrf[knSDCs+1];
 int sdToPattern[NN][4],sdToValue[NN][4],sdToIndex[NN][4],patternToSize[knPats],patternIndexToSquare[knPats][N];
-TConfig* sdToPConfig[NN][4];
+int sdToIConfig[NN][4];
 vector<CUpdate> sqToUpdatesK[NN];
 
 const int directionToIncrement[4]={1,7,8,9};
-TConfig configs[knPats+1];
-CBitBoard bb;
+TLS TConfig configs[knPats+1];
+TLS CBitBoard bb;
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 // The sdToPattern table and sdToValue tables store which pattern is associated with a given
@@ -38,7 +38,7 @@ void AddPatterns(int sqBegin, int nSq, int direction, int& pattern) {
    increment=directionToIncrement[direction];
    for (sq=sqBegin, i=0; i<nSq; i++, sq+=increment) {
       sdToPattern[sq][direction]=pattern;
-      sdToPConfig[sq][direction]=configs+pattern;
+      sdToIConfig[sq][direction]=pattern;
       sdToValue[sq][direction]=value;
       sdToIndex[sq][direction]=i;
       patternIndexToSquare[pattern][i]=sq;
@@ -55,14 +55,14 @@ extern TFlipFunc* flipFuncsBB[1700][2];
 class CBitBoard;
 
 extern CRowFlip rfs[knRFs+1];	// extra is dummy function, nFlipped=0
-extern TConfig configs[knPats+1];	// extra is dummy pattern, config=0
-extern CBitBoard bb;
+extern TLS TConfig configs[knPats+1];	// extra is dummy pattern, config=0
+extern TLS CBitBoard bb;
 
 // tables used internally
 extern int sdToPattern[NN][4],sdToValue[NN][4],sdToIndex[NN][4],patternToSize[knPats],patternIndexToSquare[knPats][N];
 extern CRowFlip** colorsdcToPrf[2][NN][4];
 extern CRowFlip* isdcToPrf[knSDCs+1];
 extern const int directionToIncrement[4];
-extern TConfig* sdToPConfig[NN][4];
+extern int sdToIConfig[NN][4];	// index into configs; knPats (dummy) if unused
 
 void AddCToPrf(CRowFlip** cToPrf, int config, int sq, int dir);
@@ -0,0 +1,228 @@
+// Copyright Chris Welty
+//	All Rights Reserved
+// This file is distributed subject to GNU GPL version 2. See the files
+// Copying.txt and GPL.txt for details.
+
+// Flat hash map, used for the book entries
+
+#pragma once
+
+#include "Utils.h"
+#include <vector>
+#include <utility>
+#include <new>
+#include <boost/serialization/split_member.hpp>
+
+//////////////////////////////////////////////////////
+// CFlatMap
+//	Open-addressing hash map with the parts of the boost::unordered_map interface the book uses.
+//
+//	The values are stored in fixed-size chunks in insertion order and never move, so pointers
+//	and references to them stay valid until clear(), as with a node-based map. Iterators are
+//	indices into the chunks: they walk the map in insertion order, stay valid when
+//	elements are inserted, and reach the new elements too.
+//
+//	The index is an array of slots holding a value index and 32 bits of its hash, searched with
+//	linear probing. Slots with a different hash are skipped without touching the values,
+//	and growing the index doesn't need the values at all.
+//
+//	There is no erase(); the book never erases single positions.
+//
+//	THash::operator() returns a u4 hash of the key.
+//////////////////////////////////////////////////////
+
+template<class TKey, class TData, class THash>
+class CFlatMap {
+public:
+   typedef std::pair<TKey, TData> value_type;
+
+   CFlatMap() : n(0), mask(0) {}
+   CFlatMap(const CFlatMap& b) : n(0), mask(0) { *this=b; }
+   ~CFlatMap() { clear(); }
+
+   CFlatMap& operator=(const CFlatMap& b) {
+      if (this!=&b) {
+         clear();
+         for (size_t i=0; i<b.n; i++)
+            insert(b.Value(i));
+      }
+      return *this;
+   }
+
+   template<class TMap, class TValue>
+   class iterator_base {
+   public:
+      iterator_base() : map(0), i(0) {}
+      iterator_base(TMap* amap, size_t ai) : map(amap), i(ai) {}
+
+      TValue& operator*() const { return map->Value(i); }
+      TValue* operator->() const { return &map->Value(i); }
+      iterator_base& operator++() { i++; return *this; }
+      iterator_base operator++(int) { iterator_base result(*this); i++; return result; }
+      bool operator==(const iterator_base& b) const { return i==b.i; }
+      bool operator!=(const iterator_base& b) const { return i!=b.i; }
+
+      TMap* map;
+      size_t i;
+   };
+   typedef iterator_base<CFlatMap, value_type> iterator;
+   class const_iterator : public iterator_base<const CFlatMap, const value_type> {
+      typedef iterator_base<const CFlatMap, const value_type> super;
+   public:
+      const_iterator() {}
+      const_iterator(const CFlatMap* amap, size_t ai) : super(amap, ai) {}
+      const_iterator(const iterator& b) : super(b.map, b.i) {}
+
+      // so that iterators convert when compared
+      bool operator==(const const_iterator& b) const { return this->i==b.i; }
+      bool operator!=(const const_iterator& b) const { return this->i!=b.i; }
+   };
+
+   iterator begin() { return iterator(this, 0); }
+   iterator end() { return iterator(this, n); }
+   const_iterator begin() const { return const_iterator(this, 0); }
+   const_iterator end() const { return const_iterator(this, n); }
+
+   size_t size() const { return n; }
+   bool empty() const { return n==0; }
+
+   iterator find(const TKey& key) {
+      return iterator(this, Find(key, THash()(key)));
+   }
+   const_iterator find(const TKey& key) const {
+      return const_iterator(this, Find(key, THash()(key)));
+   }
+
+   // start loading the slot find(key) looks at first, for a find() a little later
+   void prefetch(const TKey& key) const {
+      if (!slots.empty())
+         Prefetch(&slots[THash()(key)&mask]);
+   }
+
+   std::pair<iterator, bool> insert(const value_type& v) {
+      u4 hash=THash()(v.first);
+      size_t i=Find(v.first, hash);
+      if (i!=n)
+         return std::make_pair(iterator(this, i), false);
+      Add(v, hash);
+      return std::make_pair(iterator(this, n-1), true);
+   }
+
+   TData& operator[](const TKey& key) {
+      u4 hash=THash()(key);
+      size_t i=Find(key, hash);
+      if (i==n)
+         i=Add(value_type(key, TData()), hash);
+      return Value(i).second;
+   }
+
+   void clear() {
+      size_t i;
+
+      for (i=0; i<n; i++)
+         Value(i).~value_type();
+      for (i=0; i<chunks.size(); i++)
+         ::operator delete(chunks[i]);
+      chunks.clear();
+      slots.clear();
+      n=0;
+      mask=0;
+   }
+
+   // bytes allocated by the map
+   size_t MemoryUsed() const {
+      return chunks.capacity()*sizeof(value_type*) + chunks.size()*kChunkSize*sizeof(value_type)
+         + slots.capacity()*sizeof(CSlot);
+   }
+
+   template<class Archive>
+   void save(Archive& archive, const unsigned int version) const {
+      size_t count=n;
+      archive & count;
+      for (size_t i=0; i<n; i++) {
+         archive & Value(i).first;
+         archive & Value(i).second;
+      }
+   }
+
+   template<class Archive>
+   void load(Archive& archive, const unsigned int version) {
+      size_t count;
+      value_type v;
+
+      clear();
+      archive & count;
+      for (size_t i=0; i<count; i++) {
+         archive & v.first;
+         archive & v.second;
+         insert(v);
+      }
+   }
+
+   BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+private:
+   // chunks are allocated raw and filled as values are added
+   enum { kChunkBits=10, kChunkSize=1<<kChunkBits };
+
+   class CSlot {
+   public:
+      u4 iValue;	// index of the value +1, 0 if the slot is empty
+      u4 hash;
+   };
+
+   std::vector<value_type*> chunks;	// values, kChunkSize per chunk
+   size_t n;	// number of values
+   std::vector<CSlot> slots;	// size is a power of 2, at most 3/4 full
+   size_t mask;	// slots.size()-1
+
+   value_type& Value(size_t i) { return chunks[i>>kChunkBits][i&(kChunkSize-1)]; }
+   const value_type& Value(size_t i) const { return chunks[i>>kChunkBits][i&(kChunkSize-1)]; }
+
+   // index of the value with the given key, or n if it isn't in the map
+   size_t Find(const TKey& key, u4 hash) const {
+      if (slots.empty())
+         return n;
+      for (size_t iSlot=hash&mask; slots[iSlot].iValue; iSlot=(iSlot+1)&mask) {
+         const CSlot& slot=slots[iSlot];
+         if (slot.hash==hash && Value(slot.iValue-1).first==key)
+            return slot.iValue-1;
+      }
+      return n;
+   }
+
+   // add a value that isn't in the map. Return its index
+   size_t Add(const value_type& v, u4 hash) {
+      if ((n+1)*4>slots.size()*3)
+         Grow();
+      if ((n>>kChunkBits)==chunks.size())
+         chunks.push_back(static_cast<value_type*>(::operator new(kChunkSize*sizeof(value_type))));
+      new(&Value(n)) value_type(v);
+      Link(n, hash);
+      return n++;
+   }
+
+   void Link(size_t i, u4 hash) {
+      size_t iSlot;
+
+      for (iSlot=hash&mask; slots[iSlot].iValue; iSlot=(iSlot+1)&mask)
+         ;
+      slots[iSlot].iValue=u4(i+1);
+      slots[iSlot].hash=hash;
+   }
+
+   // double the size of the index
+   void Grow() {
+      std::vector<CSlot> old;
+      size_t i;
+
+      old.swap(slots);
+      CSlot slotEmpty={0, 0};
+      slots.resize(old.empty()?16:old.size()*2, slotEmpty);
+      mask=slots.size()-1;
+      for (i=0; i<old.size(); i++) {
+         if (old[i].iValue)
+            Link(old[i].iValue-1, old[i].hash);
+      }
+   }
+};
@@ -40,6 +40,7 @@ class CPlayerComputer;
 typedef std::shared_ptr<CPlayerComputer> CPlayerComputerPtr;
 class CQPosition;
 class CSavedGame;
+class CSearchContext;
 class CSearchInfo;
 struct CWindow;
 struct Variation;
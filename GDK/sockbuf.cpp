@@ -159,6 +159,7 @@ int sockbuf::underflow() {
 		//else
 		//	setg(unbuf, unbuf-1, unbuf+1);
 		if (fplog) {
+			boost::mutex::scoped_lock lock(mutexLog);
 			if (loglast!=kLogRecv) {
 				loglast=kLogRecv;
 				fplog->write("[recv]",6);
@@ -179,6 +180,7 @@ int sockbuf::overflow(int c) {
 	bool fOK=nSend==nSent;
 
 	QSSERT(fOK);
+	boost::mutex::scoped_lock lock(mutexLog);
 	if (fplog) {
 		if (loglast!=kLogSend) {
 			loglast=kLogSend;
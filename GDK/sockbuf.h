@@ -11,6 +11,7 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <boost/thread/mutex.hpp>
 using namespace std;
 
 #ifdef _WIN32
@@ -53,6 +54,7 @@ protected:
 #endif
 	ofstream *fplog;
 	enum {kLogNone, kLogRecv, kLogSend} loglast;
+	boost::mutex mutexLog;	// one thread may receive while another sends
 	char buf[nBufSize*2];
 	int err;
 };
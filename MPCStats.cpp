@@ -11,22 +11,147 @@
 #include "Cache.h"
 #include "time.h"
 #include "Pos2.h"
+#include "SearchThreads.h"
+#include "NodeStats.h"
 
+#include <boost/thread/thread.hpp>
+#include <functional>
 #include <stdio.h>
 #include <math.h>
 
+//////////////////////////////////////////////////////////////////////
+// MPC fit
+//////////////////////////////////////////////////////////////////////
+
+CMPCFit::CMPCFit(const TCutPair* anCutLocs) {
+   memcpy(nCutLocs, anCutLocs, sizeof(nCutLocs));
+   memset(xx, 0, sizeof(xx));
+   memset(xy, 0, sizeof(xy));
+   memset(yy, 0, sizeof(yy));
+   memset(nDataPoints, 0, sizeof(nDataPoints));
+}
+
+// values[height] is the value of a search to that height, values[0] the static value
+void CMPCFit::Add(int nEmpty, const double* values, int nValues) {
+   int height, nCut, col;
+
+   if (nEmpty<0 || nEmpty>=60)
+      return;
+   for (height=0; height<nValues && height<kMaxMPCHeight; height++) {
+      for (nCut=0; nCut<2 && nCutLocs[height][nCut]; nCut++) {
+         col=nCutLocs[height][nCut];	// height to use in prediction
+         xx[height][nEmpty][nCut]+=values[col]*values[col];
+         xy[height][nEmpty][nCut]+=values[col]*values[height];
+         yy[height][nEmpty][nCut]+=values[height]*values[height];
+         nDataPoints[height][nEmpty][nCut]++;
+      }
+   }
+}
+
+CMPCFit& CMPCFit::operator+=(const CMPCFit& b) {
+   int height, nEmpty, nCut;
+
+   for (height=0; height<kMaxMPCHeight; height++) {
+      for (nEmpty=0; nEmpty<60; nEmpty++) {
+         for (nCut=0; nCut<2; nCut++) {
+            xx[height][nEmpty][nCut]+=b.xx[height][nEmpty][nCut];
+            xy[height][nEmpty][nCut]+=b.xy[height][nEmpty][nCut];
+            yy[height][nEmpty][nCut]+=b.yy[height][nEmpty][nCut];
+            nDataPoints[height][nEmpty][nCut]+=b.nDataPoints[height][nEmpty][nCut];
+         }
+      }
+   }
+   return *this;
+}
+
+// calculate cr and sd for each cut at each height up to hMax.
+//	sd is 0 if the cut has no check height
+void CMPCFit::Solve(int hMax, TCutData* crs, TCutData* sds) const {
+   int nEmpty, height, nCut, n;
+   double c, sigma;
+
+   QSSERT(hMax<kMaxMPCHeight);
+
+   for (nEmpty=0; nEmpty<60; nEmpty++) {
+      for (height=0; height<=hMax; height++) {
+         sds[height][nEmpty][0]=sds[height][nEmpty][1]=0;
+         crs[height][nEmpty][0]=crs[height][nEmpty][1]=0;
+
+         for (nCut=0; nCut<2 && nCutLocs[height][nCut]; nCut++) {
+            n=nDataPoints[height][nEmpty][nCut];
+            if (n>1) {
+               c=xy[height][nEmpty][nCut]/xx[height][nEmpty][nCut];
+               sigma=sqrt((yy[height][nEmpty][nCut]-xy[height][nEmpty][nCut]*xy[height][nEmpty][nCut]/xx[height][nEmpty][nCut])/(n-1));
+               if (n>20) {
+                  sds[height][nEmpty][nCut]=sigma;
+                  crs[height][nEmpty][nCut]=1/c;
+               }
+            }
+         }
+      }
+   }
+
+   // fill in paramters for elements without enough data points
+   for (height=0; height<=hMax; height++) {
+      for (nCut=0; nCut<2 && nCutLocs[height][nCut]; nCut++) {
+         c=sigma=0;
+         for (nEmpty=0; nEmpty<60; nEmpty++) {
+            if (sds[height][nEmpty][nCut]) {
+               sigma=sds[height][nEmpty][nCut];
+               c=crs[height][nEmpty][nCut];
+            }
+            else {
+               sds[height][nEmpty][nCut]=sigma;
+               crs[height][nEmpty][nCut]=c;
+            }
+         }
+      }
+   }
+}
+
+// write the fitted parameters, as CMPCStats uses them.
+//	format: a header line "1 hMax kStoneValue", then a line per cut:
+//	height, check height, and for each nEmpty from 0 to 59 the cr, sd and number of positions
+void CMPCFit::Write(FILE* fp, int hMax) const {
+   std::vector<TCutData> crs(hMax+1), sds(hMax+1);
+   int height, nCut, nEmpty;
+
+   Solve(hMax, &crs[0], &sds[0]);
+   fprintf(fp, "%d %d %d\n", 1, hMax, kStoneValue);
+   for (height=0; height<=hMax; height++) {
+      for (nCut=0; nCut<2 && nCutLocs[height][nCut]; nCut++) {
+         fprintf(fp, "%d %d", height, nCutLocs[height][nCut]);
+         for (nEmpty=0; nEmpty<60; nEmpty++)
+            fprintf(fp, "\t%.4f %.2f %d", crs[height][nEmpty][nCut], sds[height][nEmpty][nCut], nDataPoints[height][nEmpty][nCut]);
+         fprintf(fp, "\n");
+      }
+   }
+}
+
 //////////////////////////////////////////////////////////////////////
 // MPCStats class
 //////////////////////////////////////////////////////////////////////
 
-CMPCStats::CMPCStats(const char* fnStats, int anPrunes) {
+// a row of a stats file. values[height] is the value of the search to that height, values[0] the static value
+class CMPCRow {
+public:
+   int nEmpty;
+   vector<double> values;
+
+   void AddTo(CMPCFit& fit) const {
+      if (!values.empty())
+         fit.Add(nEmpty, &values[0], int(values.size()));
+   }
+};
+
+// read the rows of a stats file. Throw 0 if it can't be opened
+static void ReadStatsFile(const char* fnStats, int& hMax, vector<CMPCRow>& rows) {
    FILE* fpStats;
-   int nEmpty, nEmpties[kMaxTotPos], nPoints[kMaxTotPos];
-   double data[kMaxTotPos][kMaxMPCHeight];
+   double data[kMaxMPCHeight];
+   int nEmpty, nPoints;
    int separator;
-   int nRead, nRows, dummy, row, col, height, nCut, nDataPoints, iPrune, iVersion;
+   int nRead, dummy, row, col, iVersion;
    int iStartCol;
-   double xx, xy, yy, c, sigma;
 
    // open stats file
    fpStats=fopen(fnStats,"r");
@@ -41,6 +166,7 @@ CMPCStats::CMPCStats(const char* fnStats, int anPrunes) {
    nRead=fscanf(fpStats,"%d %d", &iVersion, &hMax);
    QSSERT(nRead==2);
    QSSERT(iVersion>=1 && iVersion<=3);
+   QSSERT(hMax<kMaxMPCHeight);
    iStartCol=(iVersion>1)?0:1;
 
    // get multiplier if MPC file was created with different kStoneValue
@@ -57,27 +183,19 @@ CMPCStats::CMPCStats(const char* fnStats, int anPrunes) {
       dMPCMultiplier = kStoneValue/10.0;
    }
 
-   // Initialize data
-   nPrunes=anPrunes;
-   nCutLocs=kMPCCuts;
-   sds=new TCutData*[nPrunes+1];
-   crs=new TCutData[hMax+1];
-   for (iPrune=0; iPrune<=nPrunes; iPrune++) {
-      sds[iPrune]=new TCutData[hMax+1];
-   }
-
    // repeatedly read in a row
    for (row=0, nRead=1; nRead>0 && row<kMaxTotPos; row++) {
-      nRead=fscanf(fpStats,"%d",&(nEmpties[row]));		nPoints[row]=0;
+      nRead=fscanf(fpStats,"%d",&nEmpty);		nPoints=0;
       if (EOF==fscanf(fpStats,"%c",&separator))
          break;
       if (separator=='\n') continue;
+      data[0]=0;
       for (col=iStartCol; nRead; col++) {
          if (col<=hMax) {
-            nRead=fscanf(fpStats,"%lf",&(data[row][col]));
+            nRead=fscanf(fpStats,"%lf",&(data[col]));
             if (nRead) {
-               nPoints[row]++;
-               data[row][col]*=dMPCMultiplier;
+               nPoints++;
+               data[col]*=dMPCMultiplier;
             }
          }
          else
@@ -85,74 +203,223 @@ CMPCStats::CMPCStats(const char* fnStats, int anPrunes) {
          fscanf(fpStats,"%c",&separator);
          if (separator=='\n') break;
       }
+
+      // data[col] is the value at height col, counting from iStartCol
+      CMPCRow mpcRow;
+      mpcRow.nEmpty=nEmpty;
+      mpcRow.values.assign(data, data+nPoints+iStartCol);
+      rows.push_back(mpcRow);
    }
-   nRows=row;
+
+   fclose(fpStats);
+}
+
+CMPCStats::CMPCStats(const char* fnStats, int anPrunes) {
+   vector<CMPCRow> rows;
+   CMPCFit fit;
+   size_t row;
+
+   ReadStatsFile(fnStats, hMax, rows);
+
+   // Initialize data
+   Allocate(anPrunes);
 
    // calculate parameters for each possible cut pair at each depth
-   for (nEmpty=0; nEmpty<60; nEmpty++) {
-      for (height=0; height<=hMax; height++) {
-         sds[0][height][nEmpty][0]=sds[0][height][nEmpty][1]=0;
+   for (row=0; row<rows.size(); row++)
+      rows[row].AddTo(fit);
+   fit.Solve(hMax, crs, sds[0]);
+   SetWidths();
 
-         for (nCut=0; nCut<2 && nCutLocs[height][nCut]; nCut++) {
-            col=nCutLocs[height][nCut];	// height to use in prediction
-            yy=xx=xy=nDataPoints=0;
-            for (row=0; row<nRows; row++) {
-               if (height<=nPoints[row] && nEmpties[row]==nEmpty) {
-                  xx+=data[row][col]*data[row][col];
-                  xy+=data[row][col]*data[row][height];
-                  yy+=data[row][height]*data[row][height];
-                  nDataPoints++;
+   //Print(fnStats);
+}
+
+CMPCStats::CMPCStats(const CMPCFit& fit, int ahMax, int anPrunes) {
+   hMax=ahMax;
+   QSSERT(hMax<kMaxMPCHeight);
+   Allocate(anPrunes);
+   memcpy(nCutLocs, fit.CutLocs(), sizeof(nCutLocs));
+   fit.Solve(hMax, crs, sds[0]);
+   SetWidths();
+}
+
+// for ReadTable()
+CMPCStats::CMPCStats(int anPrunes) {
+   hMax=0;
+   Allocate(anPrunes);
+}
+
+void CMPCStats::Allocate(int anPrunes) {
+   int iPrune;
+
+   QSSERT(anPrunes==0 || anPrunes==4 || anPrunes==5);
+   nPrunes=anPrunes;
+   memcpy(nCutLocs, kMPCCuts, sizeof(nCutLocs));
+   sds=new TCutData*[kMaxMPCPrunes+1];
+   crs=new TCutData[kMaxMPCHeight];
+   for (iPrune=0; iPrune<=kMaxMPCPrunes; iPrune++) {
+      sds[iPrune]=new TCutData[kMaxMPCHeight];
+   }
+   cuts=new CMPCCut[kMPCTableSize];
+}
+
+// sds[0] hold the original sds. sds[iPrune] will
+//	hold the original data multiplied by a width.
+//	All widths are set whatever nPrunes is, so that a table written from these stats suits any nPrunes
+void CMPCStats::SetWidths() {
+   int iPrune;
+
+   for (iPrune=kMaxMPCPrunes; iPrune>0; iPrune--)
+      Multiply(iPrune, kMPCWidths[iPrune]);
+}
+
+// copy crs and sds to the table MPCCheck reads.
+//	A cut without a check height or without data gets hCheck 0, and so do heights above hMax
+void CMPCStats::BuildTable() {
+   int iPrune, height, nEmpty, nCut;
+
+   for (iPrune=0; iPrune<=kMaxMPCPrunes; iPrune++) {
+      for (height=0; height<kMaxMPCHeight; height++) {
+         for (nEmpty=0; nEmpty<60; nEmpty++) {
+            for (nCut=0; nCut<2; nCut++) {
+               CMPCCut& cut=cuts[Index(iPrune, height, nEmpty)+nCut];
+               if (height<=hMax && nCutLocs[height][nCut] && sds[iPrune][height][nEmpty][nCut]) {
+                  cut.hCheck=nCutLocs[height][nCut];
+                  cut.cr=crs[height][nEmpty][nCut];
+                  cut.sdcr=sds[iPrune][height][nEmpty][nCut]*cut.cr;
                }
-            }
-            if (nDataPoints>1) {
-               c=xy/xx;
-               sigma=sqrt((yy-xy*xy/xx)/(nDataPoints-1));
-               if (nDataPoints>20) {
-                  sds[0][height][nEmpty][nCut]=sigma;
-                  crs[height][nEmpty][nCut]=1/c;
+               else {
+                  cut.hCheck=0;
+                  cut.sdcr=cut.cr=0;
                }
             }
          }
       }
    }
+}
 
-   // fill in paramters for elements without enough data points
-   for (height=0; height<=hMax; height++) {
-      for (nCut=0; nCut<2 && nCutLocs[height][nCut]; nCut++) {
-         c=sigma=0;
-         for (nEmpty=0; nEmpty<60; nEmpty++) {
-            if (sds[0][height][nEmpty][nCut]) {
-               sigma=sds[0][height][nEmpty][nCut];
-               c=crs[height][nEmpty][nCut];
-            }
-            else {
-               sds[0][height][nEmpty][nCut]=sigma;
-               crs[height][nEmpty][nCut]=c;
+//////////////////////////////////////////////////////////////////////
+// MPC table files
+//	The table as MPCCheck reads it, so loading it skips parsing the stats file and the fit.
+//	CalcMPCStats writes one beside the stats file, and GetMPCStats writes one the first time
+//	it loads a stats file that doesn't have one. The table records the size and checksum of
+//	the stats file it was built from, and a table that doesn't match the stats file is rebuilt.
+//	Tables are written to a temporary file and renamed into place, so a reader never sees
+//	half a table.
+//////////////////////////////////////////////////////////////////////
+
+BOOST_STATIC_ASSERT(sizeof(CMPCCut)==12);
+
+class CMPCTableHeader {
+public:
+   char magic[4];	// "NTMP"
+   int32_t nVersion;	// 2
+   int32_t hMax;
+   int32_t nStoneValue;	// kStoneValue of the program that wrote the table; sds are in its units
+   int32_t nCuts;	// kMPCTableSize of the program that wrote the table
+   uint32_t nStatsSize;	// size of the stats file the table was built from
+   uint32_t nStatsChecksum;	// and its checksum, see StatsFileChecksum()
+};
+
+static const char kMPCTableMagic[4]={'N','T','M','P'};
+
+// size and FNV-1a checksum of the stats file. Return false if it can't be read
+static bool StatsFileChecksum(const char* fnStats, uint32_t& nSize, uint32_t& nChecksum) {
+   FILE* fp;
+   u1 buf[4096];
+   size_t n, i;
+
+   fp=fopen(fnStats, "rb");
+   if (!fp)
+      return false;
+   nSize=0;
+   nChecksum=2166136261u;
+   while ((n=fread(buf, 1, sizeof(buf), fp))>0) {
+      nSize+=uint32_t(n);
+      for (i=0; i<n; i++)
+         nChecksum=(nChecksum^buf[i])*16777619u;
+   }
+   fclose(fp);
+   return true;
+}
+
+// return NULL if the file is missing, was written by a program with a different table,
+//	or wasn't built from the stats file as it is now
+CMPCStats* CMPCStats::ReadTable(const char* fnTable, const char* fnStats, int anPrunes) {
+   FILE* fp;
+   CMPCTableHeader header;
+   CMPCStats* mpcs=NULL;
+   int iPrune, height, nEmpty, nCut;
+   uint32_t nStatsSize, nStatsChecksum;
+
+   if (!StatsFileChecksum(fnStats, nStatsSize, nStatsChecksum))
+      return NULL;
+   fp=fopen(fnTable, "rb");
+   if (!fp)
+      return NULL;
+   if (fread(&header, sizeof(header), 1, fp)==1 && memcmp(header.magic, kMPCTableMagic, 4)==0 && header.nVersion==2
+       && header.nStoneValue==kStoneValue && header.nCuts==kMPCTableSize && header.hMax<kMaxMPCHeight
+       && header.nStatsSize==nStatsSize && header.nStatsChecksum==nStatsChecksum) {
+      mpcs=new CMPCStats(anPrunes);
+      mpcs->hMax=header.hMax;
+      if (fread(mpcs->cuts, sizeof(CMPCCut), kMPCTableSize, fp)==size_t(kMPCTableSize)) {
+         // recover the check heights, crs and sds so the widths can be changed.
+         //	A cut has hCheck 0 where it has no data
+         memset(mpcs->nCutLocs, 0, sizeof(mpcs->nCutLocs));
+         for (iPrune=0; iPrune<=kMaxMPCPrunes; iPrune++) {
+            for (height=0; height<kMaxMPCHeight; height++) {
+               for (nEmpty=0; nEmpty<60; nEmpty++) {
+                  for (nCut=0; nCut<2; nCut++) {
+                     const CMPCCut& cut=mpcs->cuts[Index(iPrune, height, nEmpty)+nCut];
+                     if (iPrune==0)
+                        mpcs->crs[height][nEmpty][nCut]=cut.cr;
+                     if (cut.hCheck)
+                        mpcs->nCutLocs[height][nCut]=cut.hCheck;
+                     mpcs->sds[iPrune][height][nEmpty][nCut]=cut.cr ? cut.sdcr/cut.cr : 0;
+                  }
+               }
             }
          }
       }
+      else {
+         delete mpcs;
+         mpcs=NULL;
+      }
    }
+   fclose(fp);
+   return mpcs;
+}
 
-   // sds[0] hold the original sds. sds[iPrune] will
-   //	hold the original data multiplied by a width.
-   switch(anPrunes) {
-   case 0:
-      break;
-   case 5:
-      Multiply(5, 0.7);
-   case 4:
-      Multiply(4, 1.0);
-      Multiply(3, 1.3);
-      Multiply(2, 1.7);
-      Multiply(1, 2.2);
-      break;
-   default:
-      QSSERT(0);
-   }
+// write the table, marked as built from the stats file fnStats
+bool CMPCStats::WriteTable(const char* fnTable, const char* fnStats) const {
+   FILE* fp;
+   CMPCTableHeader header;
+   bool fOK;
+   string fnTemp(string(fnTable)+".tmp");
 
-   fclose(fpStats);
+   memset(&header, 0, sizeof(header));
+   if (!StatsFileChecksum(fnStats, header.nStatsSize, header.nStatsChecksum))
+      return false;
+   memcpy(header.magic, kMPCTableMagic, 4);
+   header.nVersion=2;
+   header.hMax=hMax;
+   header.nStoneValue=kStoneValue;
+   header.nCuts=kMPCTableSize;
 
-   //Print(fnStats);
+   fp=fopen(fnTemp.c_str(), "wb");
+   if (!fp)
+      return false;
+   fOK=fwrite(&header, sizeof(header), 1, fp)==1
+      && fwrite(cuts, sizeof(CMPCCut), kMPCTableSize, fp)==size_t(kMPCTableSize);
+   fOK=fclose(fp)==0 && fOK;
+#if defined(_WIN32)
+   // rename() doesn't replace an existing file here
+   if (fOK)
+      remove(fnTable);
+#endif
+   fOK=fOK && rename(fnTemp.c_str(), fnTable)==0;
+   if (!fOK)
+      remove(fnTemp.c_str());
+   return fOK;
 }
 
 void CMPCStats::Print(const char* fnStats) {
@@ -172,30 +439,19 @@ void CMPCStats::Print(const char* fnStats) {
 }
 
 CMPCStats::~CMPCStats() {
+   int iPrune;
+
+   for (iPrune=0; iPrune<=kMaxMPCPrunes; iPrune++)
+      delete[] sds[iPrune];
    delete[] sds;
    delete[] crs;
-}
-
-// get hCheck, sd and cr for a cut. Return true if we should test, false if no test available.
-bool CMPCStats::GetParams(int height, int nEmpty, int nCut, int iPrune, int& hCheck, float& sd, float& cr) {
-   QSSERT(iPrune<=nPrunes);
-
-   hCheck=nCutLocs[height][nCut];
-   if (!hCheck)
-      return false;
-
-   sd=sds[iPrune][height][nEmpty][nCut];
-   if (!sd)
-      return false;
-
-   cr=crs[height][nEmpty][nCut];
-   return true;
+   delete[] cuts;
 }
 
 void CMPCStats::Multiply(int iPrune, double dMultiplier) {
    int nCut, height, nEmpty;
 
-   QSSERT(iPrune>0 && iPrune<=nPrunes);
+   QSSERT(iPrune>0 && iPrune<=kMaxMPCPrunes);
 
    for (nCut=0; nCut<2; nCut++) {
       for (height=0; height<=hMax; height++) {
@@ -204,13 +460,14 @@ void CMPCStats::Multiply(int iPrune, double dMultiplier) {
          }
       }
    }
+   BuildTable();
 }
 
 void CMPCStats::Multiply(int iPrune, double dMultiplier1, double dMultiplier2) {
    int nCut, height, nEmpty;
    double dMultiplier;
 
-   QSSERT(iPrune>0 && iPrune<=nPrunes);
+   QSSERT(iPrune>0 && iPrune<=kMaxMPCPrunes);
 
    for (nEmpty=0; nEmpty<60; nEmpty++) {
       dMultiplier=(nEmpty>30)?dMultiplier1:dMultiplier2;
@@ -220,6 +477,15 @@ void CMPCStats::Multiply(int iPrune, double dMultiplier1, double dMultiplier2) {
          }
       }
    }
+   BuildTable();
+}
+
+u4 CMPCStats::Fingerprint() const {
+   const u1* p=(const u1*)cuts;
+   u4 h=2166136261u;
+   for (size_t i=0; i<kMPCTableSize*sizeof(CMPCCut); i++)
+      h=(h^p[i])*16777619u;
+   return h;
 }
 
 int CMPCStats::NPrunes() const {
@@ -228,16 +494,14 @@ int CMPCStats::NPrunes() const {
 
 
 bool CMPCStats::Valid() const {
-   return nCutLocs && nPrunes;
+   return nPrunes!=0;
 }
 
-CMPCStats* CMPCStats::GetMPCStats(char evalType,char aCoeffSet, int aPrune) {
-   CMPCStats* mpcs;
+// file name of the evaluator's MPC stats, without the extension. Empty if it has none
+static string MPCStatsBase(char evalType, char aCoeffSet) {
    int hMaxMPC;
-   char fn[100];
    extern bool fCompareMode;
 
-   // find MPC stats
    switch(evalType) {
    case 'K':
    case 'J':
@@ -250,25 +514,130 @@ CMPCStats* CMPCStats::GetMPCStats(char evalType,char aCoeffSet, int aPrune) {
          case 'A':	hMaxMPC=25; break;
          }
       }
-      sprintf(fn,"%scoefficients/mpc%c%c_%d.txt",fnBaseDir, evalType,aCoeffSet,hMaxMPC);
-      try {
-         mpcs=new CMPCStats(fn, aPrune);
-      }
-      catch (int) {
-         mpcs=NULL;
-      }
       break;
    default:
+      return "";
+   }
+
+   ostringstream os;
+   os << fnBaseDir << "coefficients/mpc" << evalType << aCoeffSet << '_' << hMaxMPC;
+   return os.str();
+}
+
+CMPCStats* CMPCStats::GetMPCStats(char evalType,char aCoeffSet, int aPrune) {
+   CMPCStats* mpcs;
+   string fnBase;
+
+   // find MPC stats
+   fnBase=MPCStatsBase(evalType, aCoeffSet);
+   if (fnBase.empty()) {
       QSSERT(0);
       cout << "MPC stats unavailable! exiting\n";
       cerr << "MPC stats unavailable! exiting\n";
       _exit(-5);
-      break;
+   }
+
+   // the tuned table only if asked for, it was tuned at one prune level and search depth
+   if (fTunedMPC) {
+      mpcs=ReadTable((fnBase+".tuned.tbl").c_str(), (fnBase+".txt").c_str(), aPrune);
+      if (mpcs)
+         return mpcs;
+      cerr << "WARNING: " << fnBase << ".tuned.tbl is missing or out of date, using " << fnBase << ".txt\n";
+   }
+   mpcs=ReadTable((fnBase+".tbl").c_str(), (fnBase+".txt").c_str(), aPrune);
+   if (!mpcs) {
+      try {
+         mpcs=new CMPCStats((fnBase+".txt").c_str(), aPrune);
+         mpcs->WriteTable((fnBase+".tbl").c_str(), (fnBase+".txt").c_str());
+      }
+      catch (int) {
+         mpcs=NULL;
+      }
    }
 
    return mpcs;
 }
 
+//////////////////////////////////////////////////////////////////////
+// Calibration threads
+//	The captured positions are handed out in file order, one at a time, to a thread per computer.
+//	Each computer has its own cache; they share the evaluator. Results are written on the
+//	calling thread in file order, so the files don't depend on the number of threads.
+//////////////////////////////////////////////////////////////////////
+
+// the captured positions the calibration threads share
+class CCalibrationQueue {
+public:
+   CCalibrationQueue(const vector<CBitBoard>& abbs) : bbs(abbs), iNext(0), fDone(abbs.size(), false) {}
+
+   bool Next(size_t& i);
+   void Done(size_t i);
+   void WaitFor(size_t i);
+
+protected:
+   const vector<CBitBoard>& bbs;
+   boost::mutex mutex;	// protects everything below
+   boost::condition_variable cvDone;
+   size_t iNext;
+   vector<bool> fDone;
+};
+
+bool CCalibrationQueue::Next(size_t& i) {
+   boost::mutex::scoped_lock lock(mutex);
+
+   if (iNext>=bbs.size())
+      return false;
+   i=iNext++;
+   return true;
+}
+
+void CCalibrationQueue::Done(size_t i) {
+   boost::mutex::scoped_lock lock(mutex);
+
+   fDone[i]=true;
+   cvDone.notify_all();
+}
+
+void CCalibrationQueue::WaitFor(size_t i) {
+   boost::mutex::scoped_lock lock(mutex);
+
+   while (!fDone[i])
+      cvDone.wait(lock);
+}
+
+// analyze position i with the computer, which is computers[iComputer]
+typedef std::function<void(CPlayerComputerPtr computer, int iComputer, size_t i)> TCalibrate;
+
+// computers that run beside others search solo, since the helper threads serve one search at a time
+static void CalibrationWorker(CPlayerComputerPtr computer, int iComputer, CCalibrationQueue& queue, TCalibrate calibrate, bool fSolo) {
+   size_t i;
+
+   fSoloSearch=fSolo;
+   while (queue.Next(i)) {
+      calibrate(computer, iComputer, i);
+      queue.Done(i);
+   }
+   WipeNodeStats();
+}
+
+// analyze the positions on the computers' threads, and output each one on this thread, in order
+static void Calibrate(const vector<CPlayerComputerPtr>& computers, const vector<CBitBoard>& bbs,
+                      TCalibrate calibrate, std::function<void(size_t i)> output) {
+   CCalibrationQueue queue(bbs);
+   vector<std::shared_ptr<boost::thread> > workers;
+   size_t i;
+   bool fSolo=computers.size()>1;
+
+   for (i=0; i<computers.size(); i++)
+      workers.push_back(std::shared_ptr<boost::thread>(new boost::thread(CalibrationWorker, computers[i], int(i), boost::ref(queue), calibrate, fSolo)));
+   for (i=0; i<bbs.size(); i++) {
+      queue.WaitFor(i);
+      output(i);
+   }
+   for (i=0; i<workers.size(); i++)
+      workers[i]->join();
+}
+
 //////////////////////////////////////////////////////////////////////
 // Routines
 //////////////////////////////////////////////////////////////////////
@@ -276,70 +645,130 @@ CMPCStats* CMPCStats::GetMPCStats(char evalType,char aCoeffSet, int aPrune) {
 void AnalyzePosition(CPlayerComputerPtr computer, CQPosition& pos) {
    CMVK mvk;
 
-   cout << pos.NEmpty();
    computer->Clear();
 
    CSearchInfo si(0,0,0,0,kNeedMove+kNeedValue+kNeedMPCStats,1e6, 0);
 
    computer->GetChosen(pos, si, mvk);
-   printf("\n");
 }
 
-// preconditions: computer has no book
-void CalcMPCStats(CPlayerComputerPtr computer, int height) {
-   FILE* 	cpFile;
+// Write the MPC stats file for the computers' evaluator, the fit CMPCStats makes from it,
+//	and the table GetMPCStats loads.
+//	Each row of the stats file is the number of empties, the static value and the value of the
+//	search to each height.
+// preconditions: computers have no book
+void CalcMPCStats(const vector<CPlayerComputerPtr>& computers, int height) {
+   FILE* 	cpFile, *fpStats, *fpFit;
    CBitBoard bb;
-   int		nbbs[60], i, iPos;
-   const int iPosMin=159;	// start at this line, useful if stopping and restarting
-   CQPosition pos;
-   CCalcParamsPtr cpOld = computer->search_pcp;
+   int		nbbs[60], i;
+   size_t	iComputer;
+   vector<CBitBoard> bbs;
+   vector<CCalcParamsPtr> cpOlds;
    CHeightInfo hi(height, 0, false);
-   CCalcParamsFixedHeightPtr cp(new CCalcParamsFixedHeight(hi));
-   computer->search_pcp=cp;
-
-   // header info
-   cout << 3 << " " << height << " " << kStoneValue << "\n";
+   const int hFit=height<kMaxMPCHeight ? height : kMaxMPCHeight-1;
 
-   // clear computer's and params
-   computer->cd.iPruneMidgame=computer->cd.iPruneEndgame=0;
+   // search to a fixed height without pruning
+   for (iComputer=0; iComputer<computers.size(); iComputer++) {
+      CPlayerComputerPtr computer=computers[iComputer];
+      CCalcParamsFixedHeightPtr cp(new CCalcParamsFixedHeight(hi));
+      cpOlds.push_back(computer->search_pcp);
+      computer->search_pcp=cp;
+      computer->cd.iPruneMidgame=computer->cd.iPruneEndgame=0;
+   }
 
-   // clear position counts and init
+   // clear position counts
    for (i=0; i<60; i++)
       nbbs[i]=0;
-   iPos=0;
 
-   // read positions from file; analyze if we should
+   // read positions from file; keep the ones we should analyze
    string fn(fnBaseDir);
    fn+="captured.pos";
    if (cpFile=fopen(fn.c_str(),"rb")) {
       while (bb.Read(cpFile)) {
-         pos.Initialize(bb, true);
          if (nbbs[bb.NEmpty()]++ < kMaxPositions)
-            if (iPos++>=iPosMin)
-               AnalyzePosition(computer, pos);
+            bbs.push_back(bb);
       }
       fclose(cpFile);
    }
 
-   // restore computer's book and params
-   computer->search_pcp=cpOld;
+   ostringstream os;
+   os << fnBaseDir << "coefficients/mpc" << computers[0]->cd.cEval << computers[0]->cd.cCoeffSet << '_' << height;
+   string fnStats(os.str()+".txt"), fnFit(os.str()+".fit"), fnTable(os.str()+".tbl");
+   fpStats=fopen(fnStats.c_str(), "w");
+   if (fpStats) {
+      vector<vector<CValue> > rows(bbs.size());
+      vector<CMPCFit> fits(computers.size());
+      CMPCFit fit;
+
+      cout << "Analyzing " << bbs.size() << " positions with " << computers.size() << " computers\n";
+      fprintf(fpStats, "%d %d %d\n", 3, height, kStoneValue);
+      Calibrate(computers, bbs,
+                [&](CPlayerComputerPtr computer, int iComputer, size_t i) {
+                   CQPosition pos;
+                   pos.Initialize(bbs[i], true);
+                   pMPCValues=&rows[i];
+                   AnalyzePosition(computer, pos);
+                   pMPCValues=0;
+
+                   // the stats file is read up to its height
+                   vector<double> values(rows[i].begin(), rows[i].end());
+                   if (values.size()>size_t(hFit+1))
+                      values.resize(hFit+1);
+                   if (!values.empty())
+                      fits[iComputer].Add(pos.NEmpty(), &values[0], int(values.size()));
+                },
+                [&](size_t i) {
+                   fprintf(fpStats, "%d", bbs[i].NEmpty());
+                   for (size_t j=0; j<rows[i].size(); j++)
+                      fprintf(fpStats, "\t%d", rows[i][j]);
+                   fprintf(fpStats, "\n");
+                   fflush(fpStats);
+                   cout << "Position " << i+1 << "/" << bbs.size() << ", " << bbs[i].NEmpty() << " empties\n";
+                });
+      fclose(fpStats);
+
+      for (iComputer=0; iComputer<fits.size(); iComputer++)
+         fit+=fits[iComputer];
+      fpFit=fopen(fnFit.c_str(), "w");
+      if (fpFit) {
+         fit.Write(fpFit, hFit);
+         fclose(fpFit);
+      }
+      else
+         cerr << "can't write to file " << fnFit << "\n";
+      if (!CMPCStats(fit, hFit, kMaxMPCPrunes).WriteTable(fnTable.c_str(), fnStats.c_str()))
+         cerr << "can't write to file " << fnTable << "\n";
+      cout << "Wrote " << fnStats << ", " << fnFit << " and " << fnTable << "\n";
+   }
+   else
+      cerr << "can't write to file " << fnStats << "\n";
+
+   // restore computers' params
+   for (iComputer=0; iComputer<computers.size(); iComputer++)
+      computers[iComputer]->search_pcp=cpOlds[iComputer];
 }
 
 const char* fnCapture="captured.pos";
 const char* sPVFile="captured.pv";
 
+// value of a captured position, as CalcPosValues writes it
+class CPosValue {
+public:
+   CValue value;
+   int pass;
+   CMove move;
+};
+
 // save values of positions in a file
 //	 format:
 //	bitboard (white just moved),  value (to black), pass flag (0,1,2), best move (for mover)
 // precondition: no book (unless you want to add these positions to a book)
-void CalcPosValues(CPlayerComputerPtr computer, bool fAppend) {
+void CalcPosValues(const vector<CPlayerComputerPtr>& computers, bool fAppend) {
    FILE* fpCapture, *fpPV;
-   CQPosition pos;
    CMVK mvk;
-   CMoves moves;
-   int i, quantities[60], pass, nCalced, iAppend;
+   int i, quantities[60], pass, iAppend;
    CBitBoard bb;
-   time_t tStart;
+   vector<CBitBoard> bbs;
 
    if (fAppend) {
       // figure out what number to start on
@@ -374,67 +803,77 @@ void CalcPosValues(CPlayerComputerPtr computer, bool fAppend) {
    fn+=fnCapture;
    fpCapture=fopen(fn.c_str(), "rb");
    if (fpCapture) {
+      while (bb.Read(fpCapture)) {
+         if (bb.NEmpty()>60)
+            continue;
+         quantities[bb.NEmpty()]++;
+         bbs.push_back(bb);
+      }
+      fclose(fpCapture);
+
       string fn(fnBaseDir);
       fn+=sPVFile;
       fpPV=fopen(fn.c_str(), iAppend?"a+bc":"wbc");
       if (fpPV) {
-         for (nCalced=0; bb.Read(fpCapture); ) {
-            if (bb.NEmpty()>60)
-               continue;
+         vector<CPosValue> values(bbs.size());
 
-            quantities[bb.NEmpty()]++;
+         Calibrate(computers, bbs,
+                   [&](CPlayerComputerPtr computer, int iComputer, size_t i) {
+                      CQPosition pos;
+                      CMoves moves;
+                      CMVK mvk;
+                      CPosValue& pv=values[i];
 
-            // print progress
-            if (nCalced%200 == 0) {
-               fflush(fpPV);
-               if (nCalced%10000 == 0)
-                  fprintf(stderr, "\nPosition %dk ",nCalced/1000);
-               else
-                  fprintf(stderr, ".");
-            }
-            //printf("%d", bb.NEmpty());
+                      // already in the file
+                      if (i<size_t(iAppend))
+                         return;
 
-            if (nCalced>=iAppend) {
-               pos.Initialize(bb,true);
-               pass=pos.CalcMovesAndPass(moves);
+                      pos.Initialize(bbs[i],true);
+                      pv.pass=pos.CalcMovesAndPass(moves);
 
-               // if terminal position, calc value
-               if (pass==2) {
-                  mvk.value=-pos.TerminalValue();
-                  mvk.move.Set(-1);
-               }
+                      // if terminal position, calc value
+                      if (pv.pass==2) {
+                         pv.value=-pos.TerminalValue();
+                         pv.move.Set(-1);
+                      }
 
-               // nonterminal position, get value from computer
-               else {
-                  tStart=time(0);
+                      // nonterminal position, get value from computer
+                      else {
+                         CSearchInfo si(0,0,0,0,kNeedMove+kNeedValue,1e6, 0);
 
-                  CSearchInfo si(0,0,0,0,kNeedMove+kNeedValue,1e6, 0);
+                         computer->GetChosen(pos, si, mvk);
+                         pv.value=pv.pass==1 ? -mvk.value : mvk.value;
+                         pv.move=mvk.move;
+                      }
+                   },
+                   [&](size_t nCalced) {
+                      const CPosValue& pv=values[nCalced];
 
-                  computer->GetChosen(pos, si, mvk);
-                  if (pass==1)
-                     mvk.value=-mvk.value;
-                  //printf("NEmpty = %2d; value = %4d; move = ",pos.NEmpty(),mvk.value);
-                  //mvk.move.Print();
-                  //printf("; pass = %d; time = %2d\n",pass, time(0)-tStart);
-               }
+                      // print progress
+                      if (nCalced%200 == 0) {
+                         fflush(fpPV);
+                         if (nCalced%10000 == 0)
+                            fprintf(stderr, "\nPosition %dk ",int(nCalced/1000));
+                         else
+                            fprintf(stderr, ".");
+                      }
 
-               // write to file
-               if (!bb.Write(fpPV)
-                   || !fwrite(&mvk.value, sizeof(mvk.value), 1, fpPV)
-                   || !fwrite(&pass, sizeof(pass), 1, fpPV)
-                   || !fwrite(&mvk.move, sizeof(mvk.move), 1, fpPV)) {
-                  string fn(fnBaseDir);
-                  fn+=sPVFile;
-                  cerr << "can't write to file " << fn << "\n";
-                  QSSERT(0);
-                  _exit(1);
-               }
-            }
-            nCalced++;
-         }
+                      // write to file
+                      if (nCalced>=size_t(iAppend)) {
+                         if (!bbs[nCalced].Write(fpPV)
+                             || !fwrite(&pv.value, sizeof(pv.value), 1, fpPV)
+                             || !fwrite(&pv.pass, sizeof(pv.pass), 1, fpPV)
+                             || !fwrite(&pv.move, sizeof(pv.move), 1, fpPV)) {
+                            string fn(fnBaseDir);
+                            fn+=sPVFile;
+                            cerr << "can't write to file " << fn << "\n";
+                            QSSERT(0);
+                            _exit(1);
+                         }
+                      }
+                   });
          fclose(fpPV);
       }
-      fclose(fpCapture);
    }
    // print count
    int sum=0;
@@ -444,3 +883,309 @@ void CalcPosValues(CPlayerComputerPtr computer, bool fAppend) {
    }
    printf("%d total positions\n",sum);
 }
+
+//////////////////////////////////////////////////////////////////////
+// ProbCut statistics
+//	Each thread counts into buckets of its own. The buckets are kept after
+//	the thread ends so that its counts are in the report.
+//////////////////////////////////////////////////////////////////////
+
+int nProbCutStats=0;
+bool fTunedMPC=false;
+
+static boost::mutex mutexProbCut;	// protects probCutThreads
+static vector<CProbCutCounts*> probCutThreads;
+static TLS CProbCutCounts* probCutCounts=0;
+
+CProbCutCounts& ProbCutCounts(int height, int nEmpty, int nCut) {
+   if (!probCutCounts) {
+      probCutCounts=new CProbCutCounts[kProbCutBuckets];
+      memset(probCutCounts, 0, kProbCutBuckets*sizeof(CProbCutCounts));
+      boost::mutex::scoped_lock lock(mutexProbCut);
+      probCutThreads.push_back(probCutCounts);
+   }
+   return probCutCounts[(height*60+nEmpty)*2+nCut];
+}
+
+// call while no search is running
+void ClearProbCutStats() {
+   boost::mutex::scoped_lock lock(mutexProbCut);
+   size_t i;
+
+   for (i=0; i<probCutThreads.size(); i++)
+      memset(probCutThreads[i], 0, kProbCutBuckets*sizeof(CProbCutCounts));
+}
+
+// the counts of all threads, indexed like ProbCutCounts()
+void SumProbCutStats(vector<CProbCutCounts>& counts) {
+   boost::mutex::scoped_lock lock(mutexProbCut);
+   CProbCutCounts zero;
+   size_t i;
+   int iBucket;
+
+   memset(&zero, 0, sizeof(zero));
+   counts.assign(kProbCutBuckets, zero);
+   for (i=0; i<probCutThreads.size(); i++) {
+      for (iBucket=0; iBucket<kProbCutBuckets; iBucket++) {
+         const CProbCutCounts& b=probCutThreads[i][iBucket];
+         CProbCutCounts& a=counts[iBucket];
+         a.nAttempts+=b.nAttempts;
+         a.nCuts+=b.nCuts;
+         a.nCheckNodes+=b.nCheckNodes;
+         a.nVerified+=b.nVerified;
+         a.nFalseCuts+=b.nFalseCuts;
+         a.nVerifyNodes+=b.nVerifyNodes;
+      }
+   }
+}
+
+// write a line for each cut that was checked:
+//	height nEmpty nCut hCheck attempts cuts checkNodes verified falseCuts verifyNodes
+//	The verifying searches' nodes are about the nodes the verified cuts saved
+bool WriteProbCutReport(const char* fn, const CMPCStats* mpcs) {
+   FILE* fp;
+   vector<CProbCutCounts> counts;
+   int height, nEmpty, nCut, hCheck;
+
+   fp=fopen(fn, "w");
+   if (!fp)
+      return false;
+   SumProbCutStats(counts);
+   fprintf(fp, "# height nEmpty nCut hCheck attempts cuts checkNodes verified falseCuts verifyNodes\n");
+   for (height=0; height<kMaxMPCHeight; height++) {
+      for (nEmpty=0; nEmpty<60; nEmpty++) {
+         for (nCut=0; nCut<2; nCut++) {
+            const CProbCutCounts& c=counts[(height*60+nEmpty)*2+nCut];
+            if (!c.nAttempts)
+               continue;
+            hCheck=mpcs ? mpcs->CheckHeight(height, nCut) : kMPCCuts[height][nCut];
+            fprintf(fp, "%d %d %d %d %.0f %.0f %.0f %.0f %.0f %.0f\n", height, nEmpty, nCut, hCheck,
+                    c.nAttempts, c.nCuts, c.nCheckNodes, c.nVerified, c.nFalseCuts, c.nVerifyNodes);
+         }
+      }
+   }
+   return fclose(fp)==0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// ProbCut tuning
+//	Searches a sample of the captured positions to a fixed height with different MPC
+//	parameters, and keeps the parameters that search the fewest nodes while no more of
+//	the verified cuts are wrong than the error budget allows. First the width at the
+//	computers' prune level is found by bisection, then the first check height at each
+//	cut height is moved a step either way.
+//////////////////////////////////////////////////////////////////////
+
+// verify one cut in this many while tuning
+const int kTuneVerify=4;
+
+// the sample searched with one set of parameters
+class CTuneResult {
+public:
+   double nNodes;	// not counting the verifying searches
+   double nVerified;
+   double dErrorRate;	// of the verified cuts
+
+   bool Feasible(double dErrorBudget) const { return dErrorRate<=dErrorBudget; }
+};
+
+// stats from the rows with these check heights, and width w at iPrune
+static CMPCStats* TuneStats(const vector<CMPCRow>& rows, int hMax, const TCutPair* cutLocs, int iPrune, double w) {
+   CMPCFit* fit=new CMPCFit(cutLocs);
+   CMPCStats* mpcs;
+   size_t row;
+
+   for (row=0; row<rows.size(); row++)
+      rows[row].AddTo(*fit);
+   mpcs=new CMPCStats(*fit, hMax, kMaxMPCPrunes);
+   mpcs->Multiply(iPrune, w);
+   delete fit;
+   return mpcs;
+}
+
+static CTuneResult TuneSearch(const vector<CPlayerComputerPtr>& computers, const vector<CBitBoard>& bbs, CMPCStats* mpcs, const char* sWhat) {
+   CTuneResult result;
+   CNodeStats start, end;
+   vector<CProbCutCounts> counts;
+   double nFalseCuts=0, nVerifyNodes=0;
+   size_t i;
+
+   for (i=0; i<computers.size(); i++)
+      computers[i]->mpcs=mpcs;
+   ClearProbCutStats();
+   start.Read();
+   Calibrate(computers, bbs,
+             [&](CPlayerComputerPtr computer, int iComputer, size_t i) {
+                CQPosition pos;
+                CMVK mvk;
+                CSearchInfo si(0,0,0,0,kNeedMove+kNeedValue,1e6, 0);
+
+                pos.Initialize(bbs[i], true);
+                computer->Clear();
+                computer->GetChosen(pos, si, mvk);
+             },
+             [](size_t i) {});
+   end.Read();
+
+   SumProbCutStats(counts);
+   result.nVerified=0;
+   for (i=0; i<counts.size(); i++) {
+      result.nVerified+=counts[i].nVerified;
+      nFalseCuts+=counts[i].nFalseCuts;
+      nVerifyNodes+=counts[i].nVerifyNodes;
+   }
+   result.nNodes=(end-start).Nodes()-nVerifyNodes;
+   result.dErrorRate=result.nVerified ? nFalseCuts/result.nVerified : 0;
+   printf("%s: %.0f nodes, %.2f%% of %.0f verified cuts wrong\n", sWhat, result.nNodes, result.dErrorRate*100, result.nVerified);
+   return result;
+}
+
+// Tune the MPC parameters of the computers' evaluator for searches to height at their
+//	midgame prune level, and write them to a table of their own (<stats>.tuned.tbl), which
+//	GetMPCStats loads only if fTunedMPC is set. Prints the check heights to copy to kMPCCuts
+//	and the width to copy to kMPCWidths.
+void TuneProbCut(const vector<CPlayerComputerPtr>& computers, int height, int nPositions, double dErrorBudget) {
+   const CComputerDefaults& cd=computers[0]->cd;
+   const int iPrune=cd.iPruneMidgame;
+   string fnBase(MPCStatsBase(cd.cEval, cd.cCoeffSet));
+   vector<CMPCRow> rows;
+   vector<CBitBoard> bbsAll, bbs;
+   vector<CCalcParamsPtr> cpOlds;
+   vector<CMPCStats*> mpcsOlds;
+   std::unique_ptr<CMPCStats> mpcs;
+   TCutPair cutLocs[kMaxMPCHeight];
+   CHeightInfo hi(height, iPrune, false);
+   CTuneResult best, result;
+   FILE* fp;
+   CBitBoard bb;
+   double w, wBest, wLo, wHi;
+   bool fFeasible;
+   int hMax, h, hCheck, hCheckOld, hCheckBest, nIter, nProbCutStatsOld;
+   size_t i;
+   char sWhat[100];
+
+   if (fnBase.empty() || iPrune<1 || iPrune>kMaxMPCPrunes) {
+      cerr << "ProbCut tuning needs an evaluator with MPC stats and a midgame prune level\n";
+      return;
+   }
+   try {
+      ReadStatsFile((fnBase+".txt").c_str(), hMax, rows);
+   }
+   catch (int) {
+      return;
+   }
+
+   // the sample: positions spread evenly through the capture file, with enough empties
+   //	that the search doesn't reach the solver
+   string fn(fnBaseDir);
+   fn+=fnCapture;
+   if (fp=fopen(fn.c_str(), "rb")) {
+      while (bb.Read(fp)) {
+         if (bb.NEmpty()<=60 && bb.NEmpty()-hSolverStart>height)
+            bbsAll.push_back(bb);
+      }
+      fclose(fp);
+   }
+   if (size_t(nPositions)>bbsAll.size())
+      nPositions=int(bbsAll.size());
+   for (i=0; i<size_t(nPositions); i++)
+      bbs.push_back(bbsAll[i*bbsAll.size()/nPositions]);
+   if (bbs.empty()) {
+      cerr << "No positions with more than " << height+hSolverStart << " empties in " << fn << "\n";
+      return;
+   }
+   printf("Tuning ProbCut at prune level %d on %d positions searched to height %d, error budget %.2f%%\n",
+          iPrune, int(bbs.size()), height, dErrorBudget*100);
+
+   // search to a fixed height at the computers' prune level, verifying a sample of the cuts
+   for (i=0; i<computers.size(); i++) {
+      CCalcParamsFixedHeightPtr cp(new CCalcParamsFixedHeight(hi));
+      cpOlds.push_back(computers[i]->search_pcp);
+      mpcsOlds.push_back(computers[i]->mpcs);
+      computers[i]->search_pcp=cp;
+   }
+   nProbCutStatsOld=nProbCutStats;
+   nProbCutStats=kTuneVerify;
+
+   // the width, by bisection: the narrowest width within the error budget
+   memcpy(cutLocs, kMPCCuts, sizeof(cutLocs));
+   w=wBest=kMPCWidths[iPrune];
+   mpcs.reset(TuneStats(rows, hMax, cutLocs, iPrune, w));
+   sprintf(sWhat, "width %.3f", w);
+   best=TuneSearch(computers, bbs, mpcs.get(), sWhat);
+   fFeasible=best.Feasible(dErrorBudget);
+   if (fFeasible) {
+      wLo=w/4;
+      wHi=w;
+   }
+   else {
+      wLo=w;
+      wHi=w*4;
+   }
+   for (nIter=0; nIter<6; nIter++) {
+      w=(wLo+wHi)/2;
+      mpcs.reset(TuneStats(rows, hMax, cutLocs, iPrune, w));
+      sprintf(sWhat, "width %.3f", w);
+      result=TuneSearch(computers, bbs, mpcs.get(), sWhat);
+      if (result.Feasible(dErrorBudget)) {
+         wHi=w;
+         if (!fFeasible || result.nNodes<best.nNodes) {
+            best=result;
+            wBest=w;
+            fFeasible=true;
+         }
+      }
+      else
+         wLo=w;
+   }
+   if (!fFeasible) {
+      cerr << "No width tried was within the error budget, using the widest\n";
+      wBest=wHi;
+   }
+
+   // the first check height of each cut height, one step either way
+   for (h=khMPCMinCut; h<=hMax && h<height; h++) {
+      hCheckOld=hCheckBest=cutLocs[h][0];
+      if (!hCheckOld)
+         continue;
+      for (hCheck=hCheckOld-1; hCheck<=hCheckOld+1; hCheck+=2) {
+         if (hCheck<1 || hCheck>=h || hCheck==cutLocs[h][1])
+            continue;
+         cutLocs[h][0]=hCheck;
+         mpcs.reset(TuneStats(rows, hMax, cutLocs, iPrune, wBest));
+         sprintf(sWhat, "check height %d at height %d", hCheck, h);
+         result=TuneSearch(computers, bbs, mpcs.get(), sWhat);
+         if (result.Feasible(dErrorBudget) && (!fFeasible || result.nNodes<best.nNodes)) {
+            best=result;
+            hCheckBest=hCheck;
+            fFeasible=true;
+         }
+      }
+      cutLocs[h][0]=hCheckBest;
+   }
+
+   // report the result with its counts, and save it
+   mpcs.reset(TuneStats(rows, hMax, cutLocs, iPrune, wBest));
+   result=TuneSearch(computers, bbs, mpcs.get(), "tuned");
+   WriteProbCutReport((string(fnBaseDir)+"probcut.txt").c_str(), mpcs.get());
+   printf("kMPCWidths[%d]=%.3f (was %.3f)\nkMPCCuts:\n", iPrune, wBest, kMPCWidths[iPrune]);
+   for (h=0; h<kMaxMPCHeight; h++) {
+      printf("   {%d,%d}, // %d%s\n", cutLocs[h][0], cutLocs[h][1], h,
+             cutLocs[h][0]!=kMPCCuts[h][0] ? " (changed)" : "");
+   }
+   // beside the stats file's own table, the computers load it only if fTunedMPC is set
+   if (fFeasible) {
+      if (mpcs->WriteTable((fnBase+".tuned.tbl").c_str(), (fnBase+".txt").c_str()))
+         printf("Wrote %s.tuned.tbl, set tuned ProbCut in parameters.txt to use it\n", fnBase.c_str());
+      else
+         cerr << "can't write to file " << fnBase << ".tuned.tbl\n";
+   }
+
+   // restore the computers
+   for (i=0; i<computers.size(); i++) {
+      computers[i]->search_pcp=cpOlds[i];
+      computers[i]->mpcs=mpcsOlds[i];
+   }
+   ::mpcs=mpcsOlds[0];
+   nProbCutStats=nProbCutStatsOld;
+}
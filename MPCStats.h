@@ -8,9 +8,14 @@
 #include "Utils.h"
 #include "Fwd.h"
 
-void CalcMPCStats(CPlayerComputerPtr computer1, int nDepth);
+#include <stdio.h>
+#include <vector>
+
+// the captured positions are shared among the computers, each searching on a thread of its own
+void CalcMPCStats(const std::vector<CPlayerComputerPtr>& computers, int nDepth);
 void CalcMPCPredictions();
-void CalcPosValues(CPlayerComputerPtr computer1, bool fAppend);
+void CalcPosValues(const std::vector<CPlayerComputerPtr>& computers, bool fAppend);
+void TuneProbCut(const std::vector<CPlayerComputerPtr>& computers, int height, int nPositions, double dErrorBudget);
 
 typedef int TCutPair[2];
 typedef float TCutData[60][2];
@@ -31,27 +36,78 @@ const TCutPair kMPCCuts[]={
 
 const int kMaxMPCHeight=sizeof(kMPCCuts)/(2*sizeof(int));
 
+// Least squares sums for the MPC cuts. The value of a search to a cut's height is predicted
+//	from the value of a search to its check height, v(height) = c*v(hCheck).
+//	Sums of several sets of positions add up to the sums of all the positions.
+//	The check heights are kMPCCuts unless given.
+class CMPCFit {
+public:
+   CMPCFit(const TCutPair* anCutLocs=kMPCCuts);
+
+   void Add(int nEmpty, const double* values, int nValues);
+   CMPCFit& operator+=(const CMPCFit& b);
+   void Solve(int hMax, TCutData* crs, TCutData* sds) const;
+   void Write(FILE* fp, int hMax) const;
+   const TCutPair* CutLocs() const { return nCutLocs; }
+
+protected:
+   TCutPair nCutLocs[kMaxMPCHeight];
+   double xx[kMaxMPCHeight][60][2], xy[kMaxMPCHeight][60][2], yy[kMaxMPCHeight][60][2];
+   int nDataPoints[kMaxMPCHeight][60][2];
+};
+
+const int kMaxMPCPrunes=5;
+
+// sds[iPrune] are sds[0] multiplied by this, see CMPCStats::SetWidths()
+const double kMPCWidths[kMaxMPCPrunes+1]={1, 2.2, 1.7, 1.3, 1.0, 0.7};
+
+// an MPC cut as MPCCheck uses it. The cut's search to height is predicted to fail low
+//	if the search to hCheck is below (alpha-sd)*cr = alpha*cr-sdcr
+class CMPCCut {
+public:
+   int hCheck;	// 0 if there is no cut
+   float sdcr;	// sd*cr
+   float cr;
+};
+
+// the table holds the two cuts for each iPrune, height and nEmpty, in that order
+const int kMPCTableSize=(kMaxMPCPrunes+1)*kMaxMPCHeight*60*2;
+
 class CMPCStats;
 
 class CMPCStats {
 public:
    CMPCStats(const char* fnStats, int anPrunes);
+   CMPCStats(const CMPCFit& fit, int ahMax, int anPrunes);
    ~CMPCStats();
 
    bool BadCutHeight(int height);
-   bool GetParams(int height, int nEmpty, int nCut, int iPrune, int& hCheck, float& sd, float& cr);
+   const CMPCCut* Cuts(int height, int nEmpty, int iPrune) const;
+   int CheckHeight(int height, int nCut) const;
    void Multiply(int iPrune, double dMultiplier);
    void Multiply(int iPrune, double dMultiplier1, double dMultiplier2);
    bool Valid() const;
    int NPrunes() const;
    void Print(const char* fnStats);
+   // changes when the cuts change. Saved caches are checked against it
+   u4 Fingerprint() const;
+
+   static CMPCStats* ReadTable(const char* fnTable, const char* fnStats, int anPrunes);
+   bool WriteTable(const char* fnTable, const char* fnStats) const;
 
    static CMPCStats* GetMPCStats(char evalType,char aCoeffSet, int aPrune);
 
 protected:
+   CMPCStats(int anPrunes);
+   void Allocate(int anPrunes);
+   void SetWidths();
+   void BuildTable();
+   static int Index(int iPrune, int height, int nEmpty);
+
    int hMax,nPrunes;
-   const TCutPair *nCutLocs;
+   TCutPair nCutLocs[kMaxMPCHeight];
    TCutData *crs, **sds;
+   CMPCCut* cuts;	// kMPCTableSize cuts, built from crs and sds
 
 };
 
@@ -59,5 +115,50 @@ inline bool CMPCStats::BadCutHeight(int height) {
    return (height<khMPCMinCut || height>hMax);
 }
 
+inline int CMPCStats::Index(int iPrune, int height, int nEmpty) {
+   return ((iPrune*kMaxMPCHeight+height)*60+nEmpty)*2;
+}
+
+// the two cuts at a height; if the first has hCheck 0 there are none, if the second has, there is one
+inline const CMPCCut* CMPCStats::Cuts(int height, int nEmpty, int iPrune) const {
+   QSSERT(iPrune<=nPrunes);
+   return cuts+Index(iPrune, height, nEmpty);
+}
+
+inline int CMPCStats::CheckHeight(int height, int nCut) const {
+   return nCutLocs[height][nCut];
+}
+
+//////////////////////////////////////////////////////////////////////
+// ProbCut statistics
+//	MPCCheck() counts, for each height, nEmpty and cut, how often the cut is checked and
+//	how often it cuts, and the nodes its check searches take. If asked it also verifies a
+//	sample of the cuts with the search they replaced, which tells how often a cut is wrong
+//	and about how many nodes the cuts save.
+//////////////////////////////////////////////////////////////////////
+
+class CProbCutCounts {
+public:
+   double nAttempts;	// times the cut was checked
+   double nCuts;	// times the check cut the node off
+   double nCheckNodes;	// nodes searched by the checks
+   double nVerified;	// cuts verified by the search they replaced
+   double nFalseCuts;	// verified cuts the search disagreed with
+   double nVerifyNodes;	// nodes searched by the verifying searches
+};
+
+const int kProbCutBuckets=kMaxMPCHeight*60*2;
+
+// 0 to not count, 1 to count, n>1 to also verify one cut in n. From parameters.txt
+extern int nProbCutStats;
+// load the cuts TuneProbCut wrote (<stats>.tuned.tbl) instead of the stats file's. From parameters.txt
+extern bool fTunedMPC;
+
+// this thread's counts for a cut
+CProbCutCounts& ProbCutCounts(int height, int nEmpty, int nCut);
+void ClearProbCutStats();
+void SumProbCutStats(std::vector<CProbCutCounts>& counts);
+bool WriteProbCutReport(const char* fn, const CMPCStats* mpcs);
+
 const int kMaxPositions=50;
 const int kMaxTotPos=kMaxPositions*(NN-1);
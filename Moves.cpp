@@ -199,18 +199,16 @@ bool CMoves::GetNext(CMove& move) {
          break;
       }
    case kCorner:	// check corners before other squares
-      availableMoves[0]=all[0] & 0x81;
-      availableMoves[1]=all[1] & 0x81000000;
-      if (availableMoves[0] | availableMoves[1]) {
+      availableMoves.bits=all.bits & 0x8100000000000081ULL;
+      if (availableMoves.bits) {
          FindMove(availableMoves, move);
          QSSERT(move.Row()<8);
          break;
       }
       moveToCheck=kRegular;
    case kRegular:	// check regular squares before C&X-squares
-      availableMoves[0]=all[0] & 0xFFFF3C3C;
-      availableMoves[1]=all[1] & 0x3C3CFFFF;
-      if (availableMoves[0] | availableMoves[1]) {
+      availableMoves.bits=all.bits & 0x3C3CFFFFFFFF3C3CULL;
+      if (availableMoves.bits) {
          FindMove(availableMoves, move);
          QSSERT(move.Row()<8);
          break;
@@ -218,7 +216,7 @@ bool CMoves::GetNext(CMove& move) {
       moveToCheck=kCX;
    case kCX:		// check C and X squares
       availableMoves=all;	// no mask needed since we should have only C and X squares now
-      if (availableMoves[0] | availableMoves[1]) {
+      if (availableMoves.bits) {
          FindMove(availableMoves, move);
          QSSERT(move.Row()<8);
          break;
@@ -233,43 +231,9 @@ bool CMoves::GetNext(CMove& move) {
 }
 
 void CMoves::FindMove(u8 availableMoves, CMove& move) {
-   u4 mask4;
-   u1 square;
+   QSSERT(availableMoves.bits);
 
-   QSSERT(availableMoves[0] | availableMoves[1]);
-
-   // find a row with stuff in it
-   if (availableMoves[0]) {
-      square=0;
-      mask4=availableMoves[0];
-   }
-   else {
-      square=32;
-      mask4=availableMoves[1];
-   }
-
-   if ((mask4&((1<<16)-1))==0) {
-      square+=16;
-      mask4>>=16;
-   }
-   if ((mask4&((1<<8)-1))==0) {
-      square+=8;
-      mask4>>=8;
-   }
-   if ((mask4&((1<<4)-1))==0) {
-      square+=4;
-      mask4>>=4;
-   }
-   if ((mask4&((1<<2)-1))==0) {
-      square+=2;
-      mask4>>=2;
-   }
-   if ((mask4&((1<<1)-1))==0) {
-      square+=1;
-      mask4>>=1;
-   }
-
-   move.Set(square);
+   move.Set(u1(LowBit64(availableMoves.bits)));
 }
 
 void CMoves::Delete(const CMove& move) {
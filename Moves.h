@@ -163,10 +163,10 @@ private:
 };
 
 inline int CMoves::NMoves() const {
-   return CountBits(all);
+   return CountBits64(all.bits);
 }
 
-inline bool CMoves::HasMoves() const { return (all.u4s[0] | all.u4s[1])!=0; }
+inline bool CMoves::HasMoves() const { return all.bits!=0; }
 
 class CMoveValueMoves:public CMoveValue {
 public:
@@ -0,0 +1,161 @@
+// Copyright Chris Welty
+//	All Rights Reserved
+// This file is distributed subject to GNU GPL version 2. See the files
+// Copying.txt and GPL.txt for details.
+
+#include "PreCompile.h"
+#include "MovesSimd.h"
+
+u64 (*pSimdMoves)(u64 p, u64 o)=0;
+static const char* sSimdMoves="scalar";
+
+#if SIMD_MOVES
+
+#include <immintrin.h>
+
+// MSVC compiles intrinsics for any instruction set; gcc needs to be told per function.
+//	VS2017 is the first to have the AVX-512 intrinsics.
+#if defined(_MSC_VER)
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define SIMD_MOVES_AVX512 (_MSC_VER>=1910)
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define SIMD_MOVES_AVX512 1
+#endif
+
+// sideways and diagonal runs can't include the a or h column, or they would wrap to the next row
+static const i8 kNoWrap=0x7E7E7E7E7E7E7E7ELL;
+
+//////////////////////////////////////////////////////
+// AVX2
+//	Lane i shifts by 1, 8, 7, 9 (east-west, north-south, and the diagonals).
+//	The runs towards higher squares and lower squares are followed in separate registers.
+//////////////////////////////////////////////////////
+
+TARGET_AVX2 static u64 MovesAVX2(u64 p, u64 o) {
+   const __m256i shifts=_mm256_set_epi64x(9, 7, 8, 1);
+   const __m256i masks=_mm256_set_epi64x(kNoWrap, kNoWrap, -1, kNoWrap);
+   const __m256i P=_mm256_set1_epi64x(i8(p));
+   const __m256i O=_mm256_and_si256(_mm256_set1_epi64x(i8(o)), masks);
+   __m256i up, down, moves;
+   __m128i moves2;
+   u64 result;
+
+   // a run is at most 6 discs long
+   up  =_mm256_and_si256(O, _mm256_sllv_epi64(P, shifts));
+   down=_mm256_and_si256(O, _mm256_srlv_epi64(P, shifts));
+   up  =_mm256_or_si256(up, _mm256_and_si256(O, _mm256_sllv_epi64(up, shifts)));
+   down=_mm256_or_si256(down, _mm256_and_si256(O, _mm256_srlv_epi64(down, shifts)));
+   up  =_mm256_or_si256(up, _mm256_and_si256(O, _mm256_sllv_epi64(up, shifts)));
+   down=_mm256_or_si256(down, _mm256_and_si256(O, _mm256_srlv_epi64(down, shifts)));
+   up  =_mm256_or_si256(up, _mm256_and_si256(O, _mm256_sllv_epi64(up, shifts)));
+   down=_mm256_or_si256(down, _mm256_and_si256(O, _mm256_srlv_epi64(down, shifts)));
+   up  =_mm256_or_si256(up, _mm256_and_si256(O, _mm256_sllv_epi64(up, shifts)));
+   down=_mm256_or_si256(down, _mm256_and_si256(O, _mm256_srlv_epi64(down, shifts)));
+   up  =_mm256_or_si256(up, _mm256_and_si256(O, _mm256_sllv_epi64(up, shifts)));
+   down=_mm256_or_si256(down, _mm256_and_si256(O, _mm256_srlv_epi64(down, shifts)));
+   moves=_mm256_or_si256(_mm256_sllv_epi64(up, shifts), _mm256_srlv_epi64(down, shifts));
+
+   // combine the lanes
+   moves2=_mm_or_si128(_mm256_castsi256_si128(moves), _mm256_extracti128_si256(moves, 1));
+   moves2=_mm_or_si128(moves2, _mm_unpackhi_epi64(moves2, moves2));
+   _mm_storel_epi64((__m128i*)&result, moves2);
+   return result&~(p|o);
+}
+
+#if SIMD_MOVES_AVX512
+//////////////////////////////////////////////////////
+// AVX-512
+//	Lanes 0-3 shift towards higher squares by 1, 8, 7, 9; lanes 4-7 by the same
+//	amounts towards lower squares.
+//////////////////////////////////////////////////////
+
+TARGET_AVX512 static inline __m512i Shift8(__m512i x, __m512i shifts) {
+   return _mm512_mask_blend_epi64(0x0F, _mm512_srlv_epi64(x, shifts), _mm512_sllv_epi64(x, shifts));
+}
+
+TARGET_AVX512 static u64 MovesAVX512(u64 p, u64 o) {
+   const __m512i shifts=_mm512_set_epi64(9, 7, 8, 1, 9, 7, 8, 1);
+   const __m512i masks=_mm512_set_epi64(kNoWrap, kNoWrap, -1, kNoWrap, kNoWrap, kNoWrap, -1, kNoWrap);
+   const __m512i P=_mm512_set1_epi64(i8(p));
+   const __m512i O=_mm512_and_si512(_mm512_set1_epi64(i8(o)), masks);
+   __m512i t;
+
+   // a run is at most 6 discs long
+   //	0xF8 is t|(O&shifted t) in one instruction
+   t=_mm512_and_si512(O, Shift8(P, shifts));
+   t=_mm512_ternarylogic_epi64(t, O, Shift8(t, shifts), 0xF8);
+   t=_mm512_ternarylogic_epi64(t, O, Shift8(t, shifts), 0xF8);
+   t=_mm512_ternarylogic_epi64(t, O, Shift8(t, shifts), 0xF8);
+   t=_mm512_ternarylogic_epi64(t, O, Shift8(t, shifts), 0xF8);
+   t=_mm512_ternarylogic_epi64(t, O, Shift8(t, shifts), 0xF8);
+
+   return u64(_mm512_reduce_or_epi64(Shift8(t, shifts)))&~(p|o);
+}
+#endif // SIMD_MOVES_AVX512
+
+//////////////////////////////////////////////////////
+// CPU detection
+//	Both the CPU and the OS (which must save the wide registers on a context
+//	switch) have to support the instruction set.
+//////////////////////////////////////////////////////
+
+#if defined(_MSC_VER)
+static bool HasAVX2(bool& fAVX512) {
+   int info[4];
+   u4 xcr0;
+
+   fAVX512=false;
+   __cpuid(info, 0);
+   if (info[0]<7)
+      return false;
+
+   // OSXSAVE and AVX
+   __cpuid(info, 1);
+   if ((info[2]&0x18000000)!=0x18000000)
+      return false;
+   xcr0=u4(_xgetbv(0));
+   if ((xcr0&0x06)!=0x06)
+      return false;
+
+   __cpuidex(info, 7, 0);
+   // AVX-512 also needs the opmask and upper zmm state
+   fAVX512=(info[1]&(1<<16)) && (xcr0&0xE6)==0xE6;
+   return (info[1]&(1<<5))!=0;
+}
+#else
+static bool HasAVX2(bool& fAVX512) {
+   __builtin_cpu_init();
+   fAVX512=__builtin_cpu_supports("avx512f")!=0;
+   return __builtin_cpu_supports("avx2")!=0;
+}
+#endif
+
+void InitSimdMoves() {
+   bool fAVX512;
+
+   if (!HasAVX2(fAVX512))
+      return;
+#if SIMD_MOVES_AVX512
+   if (fAVX512) {
+      pSimdMoves=MovesAVX512;
+      sSimdMoves="avx512";
+      return;
+   }
+#endif
+   pSimdMoves=MovesAVX2;
+   sSimdMoves="avx2";
+}
+
+#else
+
+void InitSimdMoves() {
+}
+
+#endif // SIMD_MOVES
+
+const char* SimdMovesName() {
+   return sSimdMoves;
+}
@@ -0,0 +1,35 @@
+// Copyright Chris Welty
+//	All Rights Reserved
+// This file is distributed subject to GNU GPL version 2. See the files
+// Copying.txt and GPL.txt for details.
+
+// SIMD move generation
+//	NativeMoves() in BitBoard.cpp follows the 8 directions one after another.
+//	These kernels follow them in parallel, one direction per 64-bit lane: AVX2 does
+//	the 4 shift amounts in one register and the two shift directions side by side,
+//	AVX-512 does all 8 directions in one register.
+//
+//	The kernels are compiled whether or not the compiler targets a CPU that has the
+//	instructions; InitSimdMoves() picks one at startup from CPUID. If the CPU has neither,
+//	pSimdMoves stays 0 and the caller uses its own routine.
+
+#pragma once
+
+#include "Utils.h"
+
+// Compilers that can generate AVX2 code without /arch:AVX2 or -mavx2. VS2010 has no AVX2 intrinsics.
+#if (defined(_MSC_VER) && _MSC_VER>=1700 && (defined(_M_X64) || defined(_M_IX86))) \
+	|| (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#define SIMD_MOVES 1
+#else
+#define SIMD_MOVES 0
+#endif
+
+// legal moves for the player with discs p against discs o, or 0 if the CPU has no usable SIMD.
+extern u64 (*pSimdMoves)(u64 p, u64 o);
+
+// choose the move generator for this CPU. Call once at startup, before any searches.
+void InitSimdMoves();
+
+// name of the move generator in use, for test output
+const char* SimdMovesName();
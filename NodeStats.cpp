@@ -13,7 +13,9 @@
 #include "options.h"
 #include "Debug.h"
 #include "Ticks.h"
+#include "SearchThreads.h"
 
+#include <boost/thread/mutex.hpp>
 #include <iostream>
 #include <iomanip>
 #include <strstream>
@@ -54,18 +56,26 @@ extern "C" {
 
 using namespace std;
 
-u4 nEvalsQuick=0, nSNodesQuick=0;
+TLS u4 nEvalsQuick=0, nSNodesQuick=0, nBBFlipsQuick=0;
 double nEvals=0, nSNodes=0, nINodes=0, nKFlips=0, nBBFlips=0;
 
-bool abortRound;
-double qtAbort;
-double qtAbortBase;
+TLS bool abortRound;
+// per thread, so that independent searches each keep their own time
+TLS double qtAbort;
+TLS double qtAbortBase;
+
+// the totals are shared by all search threads
+static boost::mutex mutexNodeStats;
 
 void WipeNodeStats() {
+   boost::mutex::scoped_lock lock(mutexNodeStats);
+
    nEvals+=nEvalsQuick;
    nEvalsQuick=0;
    nSNodes+=nSNodesQuick;
    nSNodesQuick=0;
+   nBBFlips+=nBBFlipsQuick;
+   nBBFlipsQuick=0;
 }
 
 void CNodeStats::Read() {
@@ -191,24 +201,34 @@ void ResetAbortTime(double seconds) {
    qtAbort=qtAbortBase+(double)GetTicksPerSecond()*seconds;
 }
 
+TLS const std::atomic<bool>* pfStopSearch=0;
+
 // return true if opponent moved
 bool CheckForOpponentMove() {
    switch(moveSignalOpponent) {
    case kSignalStdin:
       return _kbhit()!=0;
    case kSignalGGS:
-      fMyMove=false;
-      QSSERT(0);
-      //while (ProcessMessage(false)) {};
-      return fMyMove;
+      // the GGS thread keeps reading the socket and stops the search through pfStopSearch
+      //	when the opponent's move makes it useless. A move we predicted is no reason to stop.
+      return false;
    default:
       return false;
    }
 }
 
 bool CheckAbortTime() {
-   abortRound = (GetTicks()>=qtAbort) || (fTooting && CheckForOpponentMove());
-   if (abortRound && fPrintAbort)
-      cout << ">> Abort round!!!\n";
+   // helper threads stop when the main search tells them to
+   if (fHelperThread)
+      return abortRound=HelpersStopped() || SplitAborted();
+
+   abortRound = (GetTicks()>=qtAbort) || (pfStopSearch && *pfStopSearch) || (fTooting && CheckForOpponentMove());
+   if (abortRound) {
+      SignalStopHelpers();
+      if (fPrintAbort)
+         cout << ">> Abort round!!!\n";
+   }
+   else
+      abortRound=SplitAborted();
    return abortRound;
 }
@@ -13,15 +13,11 @@
 #define _H_NODESTATS
 
 #include <iostream>
+#include <atomic>
+#include "Utils.h"
 
-typedef unsigned long u4;
-#if _WIN32
-typedef __int64 i8;
-#else
-typedef long long i8;
-#endif
-
-extern u4 nEvalsQuick, nSNodesQuick;
+// per-thread counters, added to the totals by WipeNodeStats()
+extern TLS u4 nEvalsQuick, nSNodesQuick, nBBFlipsQuick;
 extern double nEvals, nSNodes, nINodes, nKFlips, nBBFlips;
 
 class CNodeStats {
@@ -43,10 +39,13 @@ inline std::ostream& operator<<(std::ostream& os, const CNodeStats& ns) { ns.Out
 
 // thinking on opponent's time
 void WipeNodeStats();
-extern bool abortRound;
+extern TLS bool abortRound;
 void SetAbortTime(double seconds);
 void ResetAbortTime(double seconds);
 bool CheckAbortTime();
 bool CheckForOpponentMove();
+// a flag another thread sets to stop this thread's searches, or 0. Set in threads that search
+//	for the GGS message thread: ponder searches and the searches of each game
+extern TLS const std::atomic<bool>* pfStopSearch;
 
 #endif // _H_NODESTATS
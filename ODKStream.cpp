@@ -9,8 +9,11 @@
 #include "GDK/GGSMessage.h"
 #include "GDK/SGMessages.h"
 #include "Player.h"
+#include "NodeStats.h"
+#include "SearchThreads.h"
 
 #include <boost/algorithm/string/join.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <iostream>
@@ -25,6 +28,41 @@ void init_lists();
 static CNodeStats timer, timer2;
 static std::vector<std::string> accept_list, reject_list;
 
+//////////////////////////////////////////////////////////
+// Playing several games at once
+//	Each game gets a computer of its own, so its own caches and ponder thread, and searches
+//	our moves on a thread of its own. The computers find the same book and evaluator.
+//	The message thread keeps reading the socket meanwhile; it holds mutexStream while it
+//	handles a message, and a game thread holds it to send its move.
+//	The search threads are split among the games searching at the same time, in proportion
+//	to their remaining clock time. A share is set when a search starts.
+//////////////////////////////////////////////////////////
+
+class CGameSlot {
+public:
+   CGameSlot(CPlayerComputerPtr apComputer) : pComputer(apComputer), fStop(false), fSearching(false), tRemaining(0) {}
+
+   CPlayerComputerPtr pComputer;
+   std::shared_ptr<boost::thread> thread;	// searching our move, or done searching it
+   std::atomic<bool> fStop;	// the search thread's pfStopSearch, set when the game ends
+   bool fSearching;	// fSearching and tRemaining are protected by CSGNovello::mutexSlots
+   double tRemaining;	// our clock when the search started
+};
+
+// releases the stream while the message thread waits for a game thread, which may be sending
+class CStreamUnlock {
+public:
+   CStreamUnlock(boost::mutex& amutex) : mutex(amutex) { mutex.unlock(); }
+   ~CStreamUnlock() { mutex.lock(); }
+private:
+   boost::mutex& mutex;
+};
+
+void CODKStream::Post(string& sMsg) {
+   boost::mutex::scoped_lock lock(mutexStream);
+   ggsstream::Post(sMsg);
+}
+
 void CODKStream::Handle(const CMsg& msg) {
    std::cout << msg.sRawText << "\n";
 }
@@ -67,7 +105,12 @@ void CODKStream::HandleTell(const CMsgGGSTell& msg) {
             Logout();
          else if (msg.sText==":correct all") {
             int nSearches;
-            this->pComputer->book.lock()->CorrectAll(nSearches);
+            CSGNovello* pService=dynamic_cast<CSGNovello*>(PService("/os"));
+            // the first game's searches use the same computer
+            if (pService && pService->NGames())
+               (*this) << "tell " << msg.sFrom << " Games in progress, try again later\n";
+            else
+               this->pComputer->book.lock()->CorrectAll(nSearches);
          }
          else if (msg.sText==":reload openings") {
             InitForcedOpenings();
@@ -77,6 +120,11 @@ void CODKStream::HandleTell(const CMsgGGSTell& msg) {
             CPlayerComputer::DEFER_ANALYSIS ^= 1;
             (*this) << "tell " << msg.sFrom << " Tournament mode is " << (CPlayerComputer::DEFER_ANALYSIS?"on":"off") << '\n';
          }
+         else if( msg.sText=="ponder" ) {
+            // games in progress start or stop pondering after their next move
+            CPlayerComputer::PONDER ^= 1;
+            (*this) << "tell " << msg.sFrom << " Pondering is " << (CPlayerComputer::PONDER?"on":"off") << '\n';
+         }
          else if( msg.sText=="?" ) {
             (*this) << "tell " << msg.sFrom;
             // Get and display the name of the computer.
@@ -90,9 +138,11 @@ void CODKStream::HandleTell(const CMsgGGSTell& msg) {
             (*this) << "':reload openings' will reload openings files\\";
             (*this) << "':correct all' will correct opening book (might take some time)\\";
             (*this) << "'tournament' will toggle tournament mode\\";
+            (*this) << "'ponder' will toggle thinking on the opponent's time\\";
             (*this) << "'accept + user' will add to accept list\\";
             (*this) << "'reject + user' will add to reject list\\";
             (*this) << "Tournament mode is " << (CPlayerComputer::DEFER_ANALYSIS?"on":"off") << '\\';
+            (*this) << "Pondering is " << (CPlayerComputer::PONDER?"on":"off") << '\\';
             (*this) << "Accept list: " << boost::algorithm::join(accept_list, ",") << '\\';
             (*this) << "Reject list: " << boost::algorithm::join(reject_list, ",") << '\n';
          }
@@ -159,6 +209,108 @@ CSGBase* CODKStream::CreateService(const string& sUserLogin) {
 
 CSGNovello::CSGNovello(ggsstream* apgs) : CSG<COsRules>(apgs) {
    init_lists();
+   computersFree.push_back(PComputer());
+}
+
+// the game's slot, with a free computer if the game is new
+std::shared_ptr<CGameSlot> CSGNovello::Slot(const string& idg) {
+   std::shared_ptr<CGameSlot>& slot=slots[idg];
+
+   if (!slot) {
+      CPlayerComputerPtr pComputer;
+      if (computersFree.empty()) {
+         pComputer=CPlayerComputer::Create(PComputer()->cd, PComputer()->Online());
+         std::cout << "Playing " << slots.size() << " games at once, created another computer" << endl;
+      }
+      else {
+         pComputer=computersFree.back();
+         computersFree.pop_back();
+      }
+      slot.reset(new CGameSlot(pComputer));
+   }
+   return slot;
+}
+
+void CSGNovello::ReleaseSlot(const string& idg) {
+   std::map<string, std::shared_ptr<CGameSlot> >::iterator i=slots.find(idg);
+
+   if (i!=slots.end()) {
+      computersFree.push_back(i->second->pComputer);
+      slots.erase(i);
+   }
+}
+
+// wait for the slot's search thread to finish. It may need the stream to send its move
+void CSGNovello::WaitForSearch(CGameSlot& slot) {
+   if (slot.thread) {
+      CStreamUnlock unlock(((CODKStream*)pgs)->mutexStream);
+      slot.thread->join();
+   }
+   slot.thread.reset();
+}
+
+// share of the search threads for a game starting a search with tRemaining seconds on its clock.
+//	Called with mutexSlots locked
+int CSGNovello::ThreadShare(double tRemaining) {
+   std::map<string, std::shared_ptr<CGameSlot> >::const_iterator i;
+   double tTotal=tRemaining;
+   int nThreads;
+
+   for (i=slots.begin(); i!=slots.end(); i++) {
+      if (i->second->fSearching)
+         tTotal+=i->second->tRemaining;
+   }
+   if (tTotal<=0)
+      return nSearchThreads;
+   nThreads=int(nSearchThreads*tRemaining/tTotal+.5);
+   return nThreads<1 ? 1 : nThreads;
+}
+
+// pondering is worth less than searching our moves; each game ponders with an even share
+int CSGNovello::PonderShare() {
+   int nThreads=nSearchThreads/(slots.empty() ? 1 : int(slots.size()));
+
+   return nThreads<1 ? 1 : nThreads;
+}
+
+// runs on the game's search thread
+void CSGNovello::SearchMove(std::shared_ptr<CGameSlot> slot, string idg, COsGame game, int nThreads) {
+   CPlayerComputerPtr pComputer=slot->pComputer;
+   CSGMoveListItem mli;
+   CBookData bd;
+   std::ostringstream os;
+
+   pfStopSearch=&slot->fStop;
+   nThreadsShare=nThreads;
+
+   // the opponent's move ends pondering. If we guessed it, the ponder search has our reply
+   if (!pComputer->PonderResult(game, mli))
+      pComputer->Update(game, CPlayer::kMyMove, mli);
+
+   os << "tell /os play " << idg << " " << mli << "\n";
+   os << "tell ." << pgs->GetLogin() << " " << idg << " " << pComputer->GetSearchStats();
+   CBookPtr bp = pComputer->book.lock();
+   if (bp && bp->GetData(CQPosition(game.pos.board).BitBoard(), bd)) {
+      std::ostringstream stream;
+      bd.Out(stream, false);
+      os << ' ' << stream.str();
+      DrawCount dc = GetDrawCount(CQPosition(game.pos.board).BitBoard());
+      os << ' ' << dc.draws << "/" << dc.privateDraws << "/" << dc.edmunds;
+   }
+   os << '\n';
+
+   {
+      boost::mutex::scoped_lock lock(((CODKStream*)pgs)->mutexStream);
+      // the game may have ended while we searched
+      if (!slot->fStop) {
+         (*pgs) << os.str();
+         pgs->flush();
+      }
+   }
+   {
+      boost::mutex::scoped_lock lock(mutexSlots);
+      slot->fSearching=false;
+   }
 }
 
 void CSGNovello::HandleGameOver(const TMsgMatchDelta& msg,const string& idg) {
@@ -170,6 +322,10 @@ void CSGNovello::HandleGameOver(const TMsgMatchDelta& msg,const string& idg) {
    std::string channel = "." + pgs->GetLogin();
 
    if (msg.match.IsPlaying(pgs->GetLogin())) {
+      std::shared_ptr<CGameSlot> slot=Slot(idg);
+      slot->fStop=true;
+      WaitForSearch(*slot);
+      slot->pComputer->StopPonder();
       //SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_LOWEST);
       bool online = true;
       bool rand = msg.match.sMatchType.find('r')!=std::string::npos
@@ -207,9 +363,14 @@ void CSGNovello::HandleGameOver(const TMsgMatchDelta& msg,const string& idg) {
          CNodeStats start, end;
          start.Read();
          Timer<double> timer;
-         PComputer()->EndGame(idToGame[idg], timer);
-         CBookPtr bp = PComputer()->book.lock();
-         DrawCount dc = CountDraws(*bp, std::cout);
+         CBookPtr bp = slot->pComputer->book.lock();
+         // other games keep sending their moves while we learn from this one. The draw
+         //	count holds the book's lock, so their book stores wait for it
+         DrawCount dc = [&]() {
+            CStreamUnlock unlock(((CODKStream*)pgs)->mutexStream);
+            slot->pComputer->EndGame(idToGame[idg], timer);
+            return CountDraws(*bp, std::cout);
+         }();
          end.Read();
          if( online ) {
             (*pgs) << "tell " << channel << " " << idg << " Analysis complete in " << int((end-start).Seconds()) << " seconds\n" << std::flush;
@@ -226,6 +387,7 @@ void CSGNovello::HandleGameOver(const TMsgMatchDelta& msg,const string& idg) {
       }
       if( online )
          (*pgs) << "gameover\n" << std::flush;
+      ReleaseSlot(idg);
    }
 
    BaseGameOver(msg, idg);
@@ -314,8 +476,18 @@ void CSGNovello::MakeMoveIfNeeded(const string& idg) {
    QSSERT(pgame);
    if (pgame!=NULL) {
       bool fMyMove=pgame->ToMove(pgs->GetLogin());
+      std::shared_ptr<CGameSlot> slot=Slot(idg);
       CSGMoveListItem mli;
 
+      // GGS repeats updates; a search for this move may be under way already
+      {
+         boost::mutex::scoped_lock lock(mutexSlots);
+         if (fMyMove && slot->fSearching)
+            return;
+      }
+      // the previous search has sent its move, let it finish before using its computer
+      WaitForSearch(*slot);
+
       if( fMyMove ) {
          (*pgs) << "repeat "
                 << pgame->pos.cks[pgame->pos.board.iMover].tCurrent
@@ -327,22 +499,19 @@ void CSGNovello::MakeMoveIfNeeded(const string& idg) {
          (*pgs) << "repeat\n";
       pgs->flush();
 
-      PComputer()->Update(*pgame, fMyMove, mli);
-
       if (fMyMove) {
-         (*pgs) << "tell /os play " << idg << " " << mli << "\n";
-         (*pgs) << "tell ." << pgs->GetLogin() << " " << idg << " " << PComputer()->GetSearchStats();
-         CBookData* bd = PComputer()->book.lock()->FindAnyReflection(CQPosition(pgame->pos.board).BitBoard());
-         if( bd )
+         int nThreads;
          {
-            std::ostringstream stream;
-            bd->Out(stream, false);
-            (*pgs) << ' ' << stream.str();
-            DrawCount dc = GetDrawCount(CQPosition(pgame->pos.board).BitBoard());
-            (*pgs) << ' ' << dc.draws << "/" << dc.privateDraws << "/" << dc.edmunds;
+            boost::mutex::scoped_lock lock(mutexSlots);
+            slot->tRemaining=pgame->pos.cks[pgame->pos.board.iMover].tCurrent;
+            nThreads=ThreadShare(slot->tRemaining);
+            slot->fSearching=true;
          }
-         (*pgs) << '\n';
-         pgs->flush();
+         slot->thread.reset(new boost::thread(&CSGNovello::SearchMove, this, slot, idg, *pgame, nThreads));
+      }
+      else {
+         slot->pComputer->Update(*pgame, fMyMove, mli);
+         slot->pComputer->StartPonder(*pgame, PonderShare());
       }
    }
    else
@@ -10,6 +10,9 @@
 #include "GDK/OsObjects.h"
 #include "Fwd.h"
 
+#include <boost/thread/mutex.hpp>
+#include <map>
+
 class CODKStream: public ggsstream {
 public:
    virtual void Handle				(const CMsg& msg);
@@ -20,9 +23,17 @@ public:
 
    virtual CSGBase* CreateService(const string& sUserLogin);
 
-   CPlayerComputerPtr pComputer;
+   CPlayerComputerPtr pComputer;	// book maintenance, and the first game's searches
+
+   // held by the message thread while it handles a message, and by game threads while they send
+   boost::mutex mutexStream;
+
+protected:
+   virtual void Post(string& sMsg);
 };
 
+class CGameSlot;
+
 class CSGNovello : public CSG<COsRules> {
 public:
    CSGNovello(ggsstream* apgs);
@@ -37,4 +48,18 @@ public:
    virtual void MakeMoveIfNeeded(const string& idg);
 
    CPlayerComputerPtr PComputer() { return ((CODKStream*)pgs)->pComputer; };
+   int NGames() const { return slots.size(); }
+
+protected:
+   // games in progress, and computers free for the next game
+   std::map<string, std::shared_ptr<CGameSlot> > slots;
+   std::vector<CPlayerComputerPtr> computersFree;
+   boost::mutex mutexSlots;	// protects the slots' search state
+
+   std::shared_ptr<CGameSlot> Slot(const string& idg);
+   void ReleaseSlot(const string& idg);
+   void WaitForSearch(CGameSlot& slot);
+   int ThreadShare(double tRemaining);
+   int PonderShare();
+   void SearchMove(std::shared_ptr<CGameSlot> slot, string idg, COsGame game, int nThreads);
 };
@@ -18,6 +18,7 @@
 #include "MPCStats.h"
 #include "Pos2.h"
 #include "Book.h"
+#include "SearchThreads.h"
 
 #include <stdlib.h>
 #include <ctype.h>
@@ -28,6 +29,7 @@
 #include <fstream>
 #include <iomanip>
 #include <algorithm>
+#include <boost/thread/thread.hpp>
 
 const bool fBookWLDOnly=true;
 
@@ -373,6 +375,7 @@ CPlayerComputerPtr CPlayerComputer::Create(const CComputerDefaults& acd, bool on
 
 CPlayerComputer::~CPlayerComputer() {
    int i;
+   StopPonder();
    for (i=0; i<2; i++)
       if (caches[i])
          delete caches[i];
@@ -392,8 +395,8 @@ u4 CPlayerComputer::LogCacheSize(CCalcParamsPtr pcp, int aPrune) {
       lgCacheSize=30;
 
    // constrain lgCacheSize to fit within available RAM (from params.txt)
-   if (maxCacheMem>sizeof(CCacheData)) {
-      while (sizeof(CCacheData) > maxCacheMem>>lgCacheSize)
+   if (maxCacheMem>sizeof(CCacheEntry)) {
+      while (sizeof(CCacheEntry) > maxCacheMem>>lgCacheSize)
          lgCacheSize--;
    }
 
@@ -451,8 +454,21 @@ void CPlayerComputer::GetBookVariability(const COsGame& game, CSearchInfo& si) {
 }
 
 CCache* CPlayerComputer::GetCache(int iCache) {
-   if (caches[iCache]==NULL)
-      caches[iCache]=new CCache(1<<LogCacheSize(search_pcp, cd.iPruneMidgame && cd.iPruneEndgame));
+   if (caches[iCache]==NULL) {
+      u4 nBuckets=1<<LogCacheSize(search_pcp, cd.iPruneMidgame && cd.iPruneEndgame);
+      if (fPersistentCache) {
+         // values in the cache depend on the coefficients, the ProbCut cuts and on when
+         //	the solver starts
+         u4 id=eval->Fingerprint()^(u4(cd.cEval)<<24)^(u4(cd.cCoeffSet)<<16)^hSolverStart;
+         if (mpcs)
+            id^=mpcs->Fingerprint()*31;
+         ostringstream os;
+         os << fnBaseDir << "cache/" << cd.cEval << cd.cCoeffSet << '_' << iCache << ".tt";
+         caches[iCache]=new CCache(nBuckets, os.str().c_str(), id);
+      }
+      else
+         caches[iCache]=new CCache(nBuckets);
+   }
 
    if (caches[iCache]==NULL) {
       cerr << "out of memory allocating cache " << iCache << " for computer " << Name() << "\n";
@@ -539,11 +555,120 @@ void CPlayerComputer::GetChosen(const CQPosition& pos, const CSearchInfo& asi, C
    }
 }
 
+//////////////////////////////////////////////////
+// Pondering
+//	While the opponent thinks, a ponder thread guesses the opponent's move with a short search
+//	and then searches our reply to it, as if it were our move. The search globals are TLS, so
+//	the main thread keeps handling GGS messages meanwhile.
+//	When the opponent moves as guessed (a ponder hit) the reply search goes on and we play
+//	its move. Otherwise the ponder's fStop aborts it through pfStopSearch; the
+//	searches used this computer's caches, so the real search still finds their entries.
+//////////////////////////////////////////////////
+
+bool CPlayerComputer::PONDER=!SINGLE_THREADED_SEARCH;
+
+class CPonder {
+public:
+   CPonder(const COsGame& game, bool afInBook) : pos(game.pos.board), fInBook(afInBook), fStop(false), fReply(false), fDone(false) {}
+
+   std::shared_ptr<boost::thread> thread;
+   boost::mutex mutex;	// protects fReply, posReply, fDone and mli
+   CQPosition pos;		// position with the opponent to move
+   bool fInBook;		// CPlayerComputer::fInBook before pondering, for a miss
+   std::atomic<bool> fStop;	// the ponder thread's pfStopSearch
+   bool fReply;		// the thread is searching our reply to posReply
+   CQPosition posReply;
+   bool fDone;			// the reply search is done, mli holds our move
+   CSGMoveListItem mli;
+};
+
+void CPlayerComputer::StartPonder(const COsGame& game, int nThreads) {
+   // GGS repeats updates; keep pondering if we already are
+   if (ponder && ponder->pos==CQPosition(game.pos.board))
+      return;
+   StopPonder();
+   if (!PONDER || game.GameOver())
+      return;
+
+   ponder.reset(new CPonder(game, fInBook));
+   ponder->thread.reset(new boost::thread(&CPlayerComputer::Ponder, this, game, nThreads));
+}
+
+bool CPlayerComputer::PonderResult(const COsGame& game, CSGMoveListItem& mli) {
+   bool fHit;
+
+   if (!ponder)
+      return false;
+   {
+      boost::mutex::scoped_lock lock(ponder->mutex);
+      fHit=ponder->fReply && ponder->posReply==CQPosition(game.pos.board);
+   }
+   if (!fHit) {
+      StopPonder();
+      return false;
+   }
+
+   // let the reply search finish. It was given the time we have for this move
+   cout << "Ponder hit\n";
+   ponder->thread->join();
+   QSSERT(ponder->fDone);
+   mli=ponder->mli;
+   ponder.reset();
+   return true;
+}
+
+void CPlayerComputer::StopPonder() {
+   if (!ponder)
+      return;
+   ponder->fStop=true;
+   ponder->thread->join();
+   fInBook=ponder->fInBook;
+   ponder.reset();
+}
+
+// runs on the ponder thread
+void CPlayerComputer::Ponder(COsGame game, int nThreads) {
+   CMVK mvkGuess;
+   CSGMoveListItem mliGuess, mliReply;
+
+   fTooting=true;
+   moveSignalOpponent=kSignalGGS;
+   pfStopSearch=&ponder->fStop;
+   nThreadsShare=nThreads;
+
+   // guess the opponent's move. A short search is enough for that, the time is better spent on the reply
+   CQPosition pos(game.pos.board);
+   CSearchInfo si(0,0,0,0, kNeedMove, game.pos.cks[game.pos.board.iMover].tCurrent/8, CIdGame(game.Idg()).NIdmg()==1);
+   GetChosen(pos, si, mvkGuess, !game.mt.fRand);
+   if (ponder->fStop || !mvkGuess.move.Valid())
+      return;
+
+   mliGuess.mv=mvkGuess.move;
+   mliGuess.dEval=0;
+   mliGuess.tElapsed=0;
+   game.Update(mliGuess);
+   {
+      boost::mutex::scoped_lock lock(ponder->mutex);
+      if (ponder->fStop)
+         return;
+      ponder->posReply=CQPosition(game.pos.board);
+      ponder->fReply=true;
+   }
+
+   // search the reply with our clock, as GetMove() would after the guessed move
+   GetMove(game, kMyMove, mliReply);
+   {
+      boost::mutex::scoped_lock lock(ponder->mutex);
+      ponder->mli=mliReply;
+      ponder->fDone=true;
+   }
+}
+
 void CPlayerComputer::Clear() {
    int i;
    for (i=0; i<2; i++)
       if (caches[i])
-         caches[i]->Clear();
+         caches[i]->Clear(fBackgroundCacheClear);
    solved=false;
 }
 
@@ -20,6 +20,7 @@
 #include <sstream>
 
 typedef CSGMatch COsMatch;
+class CPonder;
 
 class CPlayer {
 public:
@@ -121,6 +122,7 @@ public:
    int movesToAdd;
 
    static bool DEFER_ANALYSIS;
+   static bool PONDER;
 
    static CPlayerComputerPtr Create(const CComputerDefaults& acd,
                                     bool online,
@@ -135,6 +137,12 @@ public:
    virtual TCheatcode GetMove(COsGame& game, int flags, CSGMoveListItem& mli);
    virtual void EndGame(const COsGame& game, Timer<double>& timer);
 
+   // thinking on the opponent's time, with nThreads search threads (0 for all). game has the opponent to move
+   void StartPonder(const COsGame& game, int nThreads=0);
+   // game has us to move. Return true and our move if pondering found it, otherwise stop pondering
+   bool PonderResult(const COsGame& game, CSGMoveListItem& mli);
+   void StopPonder();
+
    // switch search and book pcp
    void Switch();
 
@@ -156,6 +164,7 @@ public:
    virtual bool IsHuman() const;
    virtual bool FDeferAnalysis() const;
    std::string GetSearchStats() const { return stream.str(); }
+   bool Online() const { return mOnline; }
 
 protected:
    void SetParameters(const CQPosition& pos, bool fUseBook, int iCache);
@@ -167,6 +176,10 @@ protected:
    CQPosition posCached[2];
    std::stringstream stream;
    const bool mOnline;
+   std::shared_ptr<CPonder> ponder;
+
+private:
+   void Ponder(COsGame game, int nThreads);
 };
 
 CPlayerPtr GetPlayer(char c,
@@ -25,6 +25,7 @@
 #include "GDK/SGObjects.h"
 #include "Games.h"
 #include "Variation.h"
+#include "SearchThreads.h"
 
 #include <limits>
 #include <fstream>
@@ -33,6 +34,10 @@
 #include <iomanip>
 #include <ctype.h>
 #include <stdio.h>
+#if defined(__AVX2__) && !defined(_MSC_VER)
+#include <immintrin.h>
+#endif
+#include <boost/thread/thread.hpp>
 
 // debugging defines
 #define CHECK_SOLVER 0	// if true, check each NovelloSolve result using endgame.c
@@ -51,7 +56,8 @@ int nCaptureWait=0;
 // book search depths
 const int kBookReadDepth=6;	// maximum depth to read from book
 const int kBookWriteDepth=1; // maximum depth to write to book
-extern int hBookRead, hBookWrite;
+extern TLS int hBookRead;
+extern int hBookWrite;
 const int nAbortCheck=1<<14; // check for aborts every few evals
 
 // search params
@@ -72,7 +78,7 @@ const bool fPrintBookReads=false;
 extern int* nBookReads;
 extern bool fPrintMoveSearch;
 
-u4 holeParity;
+TLS u4 holeParity;
 
 /////////////////////////////////////////////////////////
 // Initialization routines
@@ -214,11 +220,11 @@ u4 Hash() {
 // position variables
 ///////////////////////////////////////////////////////////////////////////////
 
-extern CCache* cache;
+extern TLS CCache* cache;
 
 // 'global variables' stored here for customer routines but passed as parameters by internal routines
-int nEmpty_, nDiscDiff_;
-bool fBlackMove_;
+TLS int nEmpty_, nDiscDiff_;
+TLS bool fBlackMove_;
 
 
 // initialize position.
@@ -252,7 +258,7 @@ void Initialize(const char* sBoard, bool fBlackMove) {
          nEmpty_++;
 
       for (direction=0; direction<4; direction++) {
-         pConfig=sdToPConfig[square][direction];
+         pConfig=configs+sdToIConfig[square][direction];
          switch(value) {
          case 0:
             break;
@@ -416,7 +422,7 @@ void MakeMoveBB(int square, int& nFlipped, CUndoInfo& ui) {
    nEmpty_--;
    CEmpty::RemoveParity(square);
    bb.InvertColors();
-   nBBFlips++;
+   nBBFlipsQuick++;
 #if CHECBB_CONSISTENCY
    CheckConsistency();
 #endif
@@ -678,14 +684,14 @@ void PrintSquareDirectionToPattern() {
 
 inline void GetFlips(bool fBlackMove, int square, CUndoInfo& ui) {
    int cf0, cf1, cf2, cf3;
-   TConfig** dToPConfig=sdToPConfig[square];
+   const int* dToIConfig=sdToIConfig[square];
    CRowFlip*** dcToPrf=colorsdcToPrf[fBlackMove][square];
 
    // get configs
-   cf0 = *(dToPConfig[0]);
-   cf1 = *(dToPConfig[1]);
-   cf2 = *(dToPConfig[2]);
-   cf3 = *(dToPConfig[3]);
+   cf0 = configs[dToIConfig[0]];
+   cf1 = configs[dToIConfig[1]];
+   cf2 = configs[dToIConfig[2]];
+   cf3 = configs[dToIConfig[3]];
 
    // convert configs to black-to-move configs for lookup
    if (!fBlackMove) {
@@ -1258,20 +1264,20 @@ inline int CalcMobilityScan(bool fBlackMove, u4& nmp, u4& nmo) {
    nmb=nmw=0;
    int c0, c1, c2, c3;
    CRowFlip*** dcToPrf;
-   TConfig** dToPConfig;
+   const int* dToIConfig;
 
    // check for valid moves
    for (em=emptyHead.next; em!=emEOL; em=em->next)	{
 
       // get basic info
       square=em->square;
-      dToPConfig=sdToPConfig[square];
+      dToIConfig=sdToIConfig[square];
 
       // get configs
-      c0=*(dToPConfig[0]);
-      c1=*(dToPConfig[1]);
-      c2=*(dToPConfig[2]);
-      c3=*(dToPConfig[3]);
+      c0=configs[dToIConfig[0]];
+      c1=configs[dToIConfig[1]];
+      c2=configs[dToIConfig[2]];
+      c3=configs[dToIConfig[3]];
 
       dcToPrf=colorsdcToPrf[1][square];
       if (dcToPrf[0][c0]->nFlipped+dcToPrf[1][c1]->nFlipped+dcToPrf[2][c2]->nFlipped+dcToPrf[3][c3]->nFlipped)
@@ -1319,10 +1325,9 @@ void InitFFBonus() {
    }
 }
 
-inline CValue StaticValue(int iff) {
-   int pass;
-   u4 nMovesPlayer, nMovesOpponent;
-   CValue result;
+// count a static evaluation, checking the clock and capturing the position if needed.
+//	return true if time ran out
+inline bool CountStaticValue() {
    const bool fCheckAbort=true;
    QSSERT(evaluator);
    nEvalsQuick++;
@@ -1331,7 +1336,7 @@ inline CValue StaticValue(int iff) {
    if (nEvalsQuick>=nAbortCheck) {
       WipeNodeStats();
       if (fCheckAbort && CheckAbortTime())
-         return 0;
+         return true;
    }
 
    // capture position if we're doing that
@@ -1340,6 +1345,24 @@ inline CValue StaticValue(int iff) {
       bb.Write(cpFile);
       SetRandomCapture();
    }
+   return false;
+}
+
+// fastest-first bonus for a position where the player to move has nMovesPlayer moves
+inline CValue FastestFirstBonus(int iff, u4 nMovesPlayer) {
+   if (fTableFF)
+      return iff?ffBonus[nMovesPlayer]:0;
+   else
+      return (nMovesPlayer<<iff)-nMovesPlayer;
+}
+
+inline CValue StaticValue(int iff) {
+   int pass;
+   u4 nMovesPlayer, nMovesOpponent;
+   CValue result;
+
+   if (CountStaticValue())
+      return 0;
 
    // calculate mobility
    pass=CalcMobility(nMovesPlayer, nMovesOpponent);
@@ -1366,16 +1389,47 @@ inline CValue StaticValue(int iff) {
          result=kMaxHeuristic;
    }
 
-   if (fTableFF) {
-      if (iff)
-         result+=ffBonus[nMovesPlayer];
-   }
-   else
-      result+=(nMovesPlayer<<iff)-nMovesPlayer;
+   result+=FastestFirstBonus(iff, nMovesPlayer);
 
    return result;
 }
 
+// StaticValue() in two halves, so the children of a node can be evaluated together.
+//	If the value doesn't need the evaluator (the game is over or time ran out), set value and return true.
+//	Otherwise fill in leaf; once the evaluator has valued it, FinishStaticValue() gives the static value.
+inline bool StartStaticValue(int iff, CEvalLeaf& leaf, CValue& value) {
+   int pass;
+   u4 nMovesPlayer, nMovesOpponent;
+
+   if (CountStaticValue()) {
+      value=0;
+      return true;
+   }
+
+   pass=CalcMobility(nMovesPlayer, nMovesOpponent);
+   switch(pass) {
+   case 2:
+      value=TerminalValue();
+      return true;
+   case 1:
+      GetEvalLeaf(leaf, nMovesOpponent, nMovesPlayer);
+      leaf.fBlackMove=!fBlackMove_;
+      leaf.fPass=true;
+      return false;
+   default:
+      GetEvalLeaf(leaf, nMovesPlayer, nMovesOpponent);
+      return false;
+   }
+}
+
+inline CValue FinishStaticValue(int iff, const CEvalLeaf& leaf, CValue evalValue) {
+   // a player who must pass has no moves, so no fastest-first bonus
+   if (leaf.fPass)
+      return -evalValue;
+   else
+      return evalValue+FastestFirstBonus(iff, leaf.nMovesPlayer);
+}
+
 // iDebugEval prints out debugging information in the static evaluation routine.
 //	0 - none
 //	1 - final value
@@ -1589,6 +1643,226 @@ CValue ValueJMobs(const std::vector<TCoeff> pcoeffs[2], u4 nMovesPlayer, u4 nMov
    return value;
 }
 
+////////////////////////////////////////
+// J evaluation of several positions
+//	ValueJMobs() does its ~50 coefficient lookups one after another, and most of them
+//	miss the cache. ValueJBatch() first works out where every position's coefficients are
+//	and prefetches them, then adds them up, so the misses overlap.
+//	The arithmetic is the same as ValueJMobs() (without OLD_EVAL).
+////////////////////////////////////////
+
+void GetEvalLeaf(CEvalLeaf& leaf, u4 nMovesPlayer, u4 nMovesOpponent) {
+   int i;
+
+   for (i=0; i<CEvalLeaf::kNConfigs; i++)
+      leaf.configs[i]=u2(configs[i]);
+   leaf.nMovesPlayer=u1(nMovesPlayer);
+   leaf.nMovesOpponent=u1(nMovesOpponent);
+   leaf.fBlackMove=fBlackMove_;
+   leaf.fPass=false;
+}
+
+// row, column and diagonal patterns, and their coefficient offsets
+const int nLinePatternsJ=30;
+const int linePatternsJ[nLinePatternsJ]={
+   0, 7, 19, 26,   1, 6, 20, 25,   2, 5, 21, 24,   3, 4, 22, 23,
+   10, 16, 29, 35,   11, 15, 30, 34,   12, 14, 31, 33,   13, 32
+};
+const int lineOffsetsJ[nLinePatternsJ]={
+   offsetJR1, offsetJR1, offsetJR1, offsetJR1,   offsetJR2, offsetJR2, offsetJR2, offsetJR2,
+   offsetJR3, offsetJR3, offsetJR3, offsetJR3,   offsetJR4, offsetJR4, offsetJR4, offsetJR4,
+   offsetJD5, offsetJD5, offsetJD5, offsetJD5,   offsetJD6, offsetJD6, offsetJD6, offsetJD6,
+   offsetJD7, offsetJD7, offsetJD7, offsetJD7,   offsetJD8, offsetJD8
+};
+const int lineSizesJ[nLinePatternsJ]={
+   sizeJR1, sizeJR1, sizeJR1, sizeJR1,   sizeJR2, sizeJR2, sizeJR2, sizeJR2,
+   sizeJR3, sizeJR3, sizeJR3, sizeJR3,   sizeJR4, sizeJR4, sizeJR4, sizeJR4,
+   sizeJD5, sizeJD5, sizeJD5, sizeJD5,   sizeJD6, sizeJD6, sizeJD6, sizeJD6,
+   sizeJD7, sizeJD7, sizeJD7, sizeJD7,   sizeJD8, sizeJD8
+};
+
+// coefficient indices of one position.
+//	The line and triangle values carry the pot mobility in their low 16 bits, so they are summed
+//	and unpacked before the 2x5 and edge+2X values are added.
+const int nPackedIndicesJ=nLinePatternsJ+4, nEdgeIndicesJ=12;
+
+class CIndicesJ {
+public:
+   i4 packed[nPackedIndicesJ];
+   i4 edge[nEdgeIndicesJ];
+};
+
+inline void TriangleIndicesJ(const u2* c, int pattern1, int pattern2, int pattern3, int pattern4, i4* indices) {
+   u4 configsTriangle=row1ToTriangle[c[pattern1]]+row2ToTriangle[c[pattern2]]+row3ToTriangle[c[pattern3]]+row4ToTriangle[c[pattern4]];
+   indices[0]=offsetJTriangle+(configsTriangle&0xFFFF);
+   indices[1]=offsetJTriangle+(configsTriangle>>16);
+}
+
+inline void EdgeIndicesJ(const u2* c, int pattern1, int pattern2, i4* indices) {
+   TConfig config1=c[pattern1], config2=c[pattern2];
+   u4 configs2x5=row1To2x5[config1]+row2To2x5[config2];
+   indices[0]=offsetJC5+(configs2x5&0xFFFF);
+   indices[1]=offsetJC5+(configs2x5>>16);
+   indices[2]=offsetJEX+config1+(config1<<1)+row2ToXX[config2];
+}
+
+// indices of the coefficients of the position in the full table
+inline void FindIndicesJ(const CEvalLeaf& leaf, CIndicesJ& ix) {
+   const u2* c=leaf.configs;
+   int i;
+
+   for (i=0; i<nLinePatternsJ; i++)
+      ix.packed[i]=lineOffsetsJ[i]+c[linePatternsJ[i]];
+   TriangleIndicesJ(c, 0, 1, 2, 3, ix.packed+nLinePatternsJ);
+   TriangleIndicesJ(c, 7, 6, 5, 4, ix.packed+nLinePatternsJ+2);
+   EdgeIndicesJ(c, 0, 1, ix.edge);
+   EdgeIndicesJ(c, 7, 6, ix.edge+3);
+   EdgeIndicesJ(c, 19, 20, ix.edge+6);
+   EdgeIndicesJ(c, 26, 25, ix.edge+9);
+}
+
+// indices of the coefficients of the position in a CCompactCoeffsJ.
+//	White to move uses the black coefficients of the config with colors swapped.
+inline void FindCompactIndicesJ(const CEvalLeaf& leaf, CIndicesJ& ix) {
+   int i;
+
+   FindIndicesJ(leaf, ix);
+   if (!leaf.fBlackMove) {
+      for (i=0; i<nLinePatternsJ; i++)
+         ix.packed[i]=2*lineOffsetsJ[i]+lineSizesJ[i]-1-ix.packed[i];
+      for (; i<nPackedIndicesJ; i++)
+         ix.packed[i]=2*offsetJTriangle+sizeJTriangle-1-ix.packed[i];
+      for (i=0; i<nEdgeIndicesJ; i+=3) {
+         ix.edge[i]=2*offsetJC5+sizeJC5-1-ix.edge[i];
+         ix.edge[i+1]=2*offsetJC5+sizeJC5-1-ix.edge[i+1];
+         ix.edge[i+2]=2*offsetJEX+sizeJEX-1-ix.edge[i+2];
+      }
+   }
+   for (i=0; i<nEdgeIndicesJ; i++)
+      ix.edge[i]-=offsetJC5;
+}
+
+// sum of pcmove[indices[i]]. Uses gathers if the compiler targets AVX2
+inline TCoeff SumCoeffs(const TCoeff* pcmove, const i4* indices, int n) {
+   TCoeff value=0;
+   int i=0;
+#if defined(__AVX2__)
+   __m256i sum=_mm256_setzero_si256();
+   for (; i+8<=n; i+=8)
+      sum=_mm256_add_epi32(sum, _mm256_i32gather_epi32((const int*)pcmove, _mm256_loadu_si256((const __m256i*)(indices+i)), 4));
+   __m128i sum4=_mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+   sum4=_mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0x4E));
+   sum4=_mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0xB1));
+   value=_mm_cvtsi128_si32(sum4);
+#endif
+   for (; i<n; i++)
+      value+=pcmove[indices[i]];
+   return value;
+}
+
+// sum of 16-bit coefficients. The gather reads 4 bytes, so there must be a spare i2 after the last one
+inline TCoeff SumCoeffs(const i2* pc, const i4* indices, int n) {
+   TCoeff value=0;
+   int i=0;
+#if defined(__AVX2__)
+   __m256i sum=_mm256_setzero_si256();
+   for (; i+8<=n; i+=8) {
+      __m256i c=_mm256_i32gather_epi32((const int*)pc, _mm256_loadu_si256((const __m256i*)(indices+i)), 2);
+      sum=_mm256_add_epi32(sum, _mm256_srai_epi32(_mm256_slli_epi32(c, 16), 16));
+   }
+   __m128i sum4=_mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+   sum4=_mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0x4E));
+   sum4=_mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0xB1));
+   value=_mm_cvtsi128_si32(sum4);
+#endif
+   for (; i<n; i++)
+      value+=pc[indices[i]];
+   return value;
+}
+
+// unpack the pot mobility from the sum of the line and triangle coefficients.
+//	pm points to the pot mobility coefficients, with the mover's 64 followed by the opponent's.
+inline TCoeff UnpackPotMobsJ(TCoeff value, const TCoeff* pm) {
+   int nPMO=(value>>8) & 0xFF;
+   int nPMP=value&0xFF;
+   nPMO=(nPMO+potMobAdd)>>potMobShift;
+   nPMP=(nPMP+potMobAdd)>>potMobShift;
+   return (value>>16)+pm[nPMP]+pm[sizeJPMP+nPMO];
+}
+
+void ValueJBatch(const std::vector<TCoeff> pcoeffs[2], const CEvalLeaf* leaves, int n, int nEmpty, CValue* values) {
+   CIndicesJ indices[64];
+   int iLeaf, i;
+
+   QSSERT(n<=64);
+
+   // find and prefetch the coefficients
+   for (iLeaf=0; iLeaf<n; iLeaf++) {
+      const TCoeff* pcmove=&pcoeffs[leaves[iLeaf].fBlackMove][0];
+      CIndicesJ& ix=indices[iLeaf];
+
+      FindIndicesJ(leaves[iLeaf], ix);
+      for (i=0; i<nPackedIndicesJ; i++)
+         Prefetch(pcmove+ix.packed[i]);
+      for (i=0; i<nEdgeIndicesJ; i++)
+         Prefetch(pcmove+ix.edge[i]);
+   }
+
+   // add them up
+   for (iLeaf=0; iLeaf<n; iLeaf++) {
+      const CEvalLeaf& leaf=leaves[iLeaf];
+      const TCoeff* pcmove=&pcoeffs[leaf.fBlackMove][0];
+      const CIndicesJ& ix=indices[iLeaf];
+      TCoeff value;
+
+      value=UnpackPotMobsJ(SumCoeffs(pcmove, ix.packed, nPackedIndicesJ), pcmove+offsetJPMP);
+
+      // 2x5 and edge+2X, mobility and parity
+      value+=SumCoeffs(pcmove, ix.edge, nEdgeIndicesJ);
+      value+=pcmove[offsetJMP+leaf.nMovesPlayer];
+      value+=pcmove[offsetJMO+leaf.nMovesOpponent];
+      value+=pcmove[offsetJPAR+(nEmpty&1)];
+
+      values[iLeaf]=value;
+   }
+}
+
+void ValueJBatchCompact(const CCompactCoeffsJ& cc, const CEvalLeaf* leaves, int n, int nEmpty, CValue* values) {
+   CIndicesJ indices[64];
+   int iLeaf, i;
+
+   QSSERT(n<=64);
+
+   // find and prefetch the coefficients
+   for (iLeaf=0; iLeaf<n; iLeaf++) {
+      CIndicesJ& ix=indices[iLeaf];
+
+      FindCompactIndicesJ(leaves[iLeaf], ix);
+      for (i=0; i<nPackedIndicesJ; i++)
+         Prefetch(cc.packed+ix.packed[i]);
+      for (i=0; i<nEdgeIndicesJ; i++)
+         Prefetch(cc.corners+ix.edge[i]);
+   }
+
+   // add them up. The mobility, pot mobility and parity coefficients are the same for both colors
+   const TCoeff* pn=cc.numbers-offsetJMP;
+   for (iLeaf=0; iLeaf<n; iLeaf++) {
+      const CEvalLeaf& leaf=leaves[iLeaf];
+      const CIndicesJ& ix=indices[iLeaf];
+      TCoeff value;
+
+      value=UnpackPotMobsJ(SumCoeffs(cc.packed, ix.packed, nPackedIndicesJ), pn+offsetJPMP);
+
+      // 2x5 and edge+2X, mobility and parity
+      value+=SumCoeffs(cc.corners, ix.edge, nEdgeIndicesJ);
+      value+=pn[offsetJMP+leaf.nMovesPlayer];
+      value+=pn[offsetJMO+leaf.nMovesOpponent];
+      value+=pn[offsetJPAR+(nEmpty&1)];
+
+      values[iLeaf]=value;
+   }
+}
+
 #if 0 // CAN_I_REMOVE_THIS
 
 ////////////////////////////////////////
@@ -1813,6 +2087,22 @@ CValue ValueLMobs(TCoeff *const pcoeffs[2], u4 nMovesPlayer, u4 nMovesOpponent)
 //	 Does not output best move and value since book won't contain best move
 ///////////////////////////////////////////////////////////////////////
 
+// start loading the book entries of the subpositions, which are read when the moves are searched.
+//	Their minimal reflections are found together, and are kept so Load() doesn't find them again.
+static void PrepareBookChildren(const CBook& book, CMoves moves) {
+   CBitBoard children[64];
+   CMove move;
+   CUndoInfo ui;
+   int nFlipped, pass, n;
+
+   for (n=0, move.Set(-1); n<64 && moves.GetNext(move); n++) {
+      MakeMoveAndPassBB(move, nFlipped, ui, pass);
+      children[n]=bb;
+      UndoMoveAndPassBB(move, nFlipped, ui, pass);
+   }
+   book.PrepareProbes(children, n);
+}
+
 CValue ValueBookCacheOrTree(int height, CValue alpha, CValue beta, CMoves& moves,
                             int iPrune) {
 
@@ -1820,11 +2110,14 @@ CValue ValueBookCacheOrTree(int height, CValue alpha, CValue beta, CMoves& moves
 
    if (height>=hBookRead) {
       CHeightInfo hi(height, iPrune, false);
-      if (book.lock()->Load(bb, hi, alpha, beta, best.value, nEmpty_)) {
+      CBookPtr pBook=book.lock();
+      if (pBook->Load(bb, hi, alpha, beta, best.value, nEmpty_)) {
          if (fPrintBookReads)
             printf("br%d!",height-hBookRead);
          return best.value;
       }
+      if (height-1>=hBookRead)
+         PrepareBookChildren(*pBook, moves);
    }
 
    ValueCacheOrTree(height, alpha, beta, moves, iPrune, best);
@@ -1839,8 +2132,8 @@ CValue ValueBookCacheOrTree(int height, CValue alpha, CValue beta, CMoves& moves
 void ValueCacheOrTree(int height, CValue alpha, CValue beta, CMoves& moves,
                       int iPrune, CMoveValue& best) {
    CValue searchAlpha, searchBeta;
-   CCacheData* cd;
-   u4 hash;
+   CCacheData cd;
+   i8 hash;
    int iffCache;
 
    // initialize search values
@@ -1851,21 +2144,18 @@ void ValueCacheOrTree(int height, CValue alpha, CValue beta, CMoves& moves,
       iPrune=false;
 
    // Check if the position is in cache
-   const bool fNewHash=false;
-   if (fNewHash)
-      hash=Hash();
-   else
-      hash=bb.Hash();
+   hash=bb.Hash64();
 
-   if (cd=cache->FindOld(bb, hash)) {
+   if (cache->FindOld(hash, cd)) {
       // cutoff if we can; otherwise update searchAlpha, searchBeta and set the best move
-      if (cd->Load(height, iPrune, nEmpty_, alpha, beta, best.move, iffCache, searchAlpha, searchBeta, best.value)) {
+      if (cd.Load(height, iPrune, nEmpty_, alpha, beta, best.move, iffCache, searchAlpha, searchBeta, best.value)) {
          TREEDEBUG_CACHE;
          return;
       }
       QSSERT(searchAlpha<searchBeta);
-      moves.SetBest(best.move);
-      QSSERT(bb==cd->Board());	// consistency check
+      // the cache only stores a hash of the board, so check the move is legal here
+      if (best.move.Valid() && moves.IsValid(best.move))
+         moves.SetBest(best.move);
    }
    else {
       iffCache=0;
@@ -1878,15 +2168,49 @@ void ValueCacheOrTree(int height, CValue alpha, CValue beta, CMoves& moves,
 
    // Add to cache if we can
    if (!abortRound) {
-      cd=cache->FindNew(bb,hash,height,iPrune, nEmpty_);
-      if (cd) {
-         cd->Store(height, iPrune, nEmpty_, best.move, iffCache, searchAlpha, searchBeta, best.value);
+      cache->Store(hash, height, iPrune, nEmpty_, best.move, iffCache, searchAlpha, searchBeta, best.value);
 #ifdef _DEBUG
-         QSSERT(cd->Board()==bb);
-         CalcMoves(moves);
-         QSSERT(moves.IsValid(best.move));
+      CalcMoves(moves);
+      QSSERT(moves.IsValid(best.move));
 #endif
-      }
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// ProbCut statistics, counted when nProbCutStats is set
+///////////////////////////////////////////////////////////////////////
+
+static TLS bool fProbCutVerifying=false;	// in a search verifying a cut. Its cuts aren't counted
+static TLS u4 nProbCutCuts=0;	// cuts counted by this thread, to pick the ones to verify
+
+inline u4 NodesQuick() {
+   return nSNodesQuick+nBBFlipsQuick;
+}
+
+// count a cut whose check searches started at nNodesStart. One cut in nProbCutStats is
+//	verified with the search it saved; the cut was false if that search doesn't fail
+//	low (fAlpha) or high.
+static void CountProbCut(CProbCutCounts& counts, u4 nNodesStart, int height, CValue alpha, CValue beta,
+                         const CMoves& moves, int iPrune, bool fAlpha) {
+   CMoves movesCopy;
+   CMoveValue mvFull;
+   int iffVerify=0;
+   u4 nNodesVerify;
+
+   counts.nCheckNodes+=NodesQuick()-nNodesStart;
+   counts.nCuts++;
+   if (nProbCutStats>1 && ++nProbCutCuts%nProbCutStats==0) {
+      nNodesVerify=NodesQuick();
+      movesCopy=moves;
+      fProbCutVerifying=true;
+      ValueTree(height, alpha, beta, movesCopy, iffVerify, iPrune, mvFull);
+      fProbCutVerifying=false;
+      if (abortRound)
+         return;
+      counts.nVerified++;
+      if (fAlpha ? mvFull.value>alpha : mvFull.value<beta)
+         counts.nFalseCuts++;
+      counts.nVerifyNodes+=NodesQuick()-nNodesVerify;
    }
 }
 
@@ -1898,25 +2222,36 @@ void ValueCacheOrTree(int height, CValue alpha, CValue beta, CMoves& moves,
 
 inline bool MPCCheck(int height, CValue alpha, CValue beta, const CMoves& moves, int& iPrune, CMoveValue& best) {
    CMoves movesCopy;
-   float sd, cr;
+   const CMPCCut* cuts;
+   CProbCutCounts* counts;
    CValue bound;
-   int nCut, hCheck;
+   u4 nNodesStart=0;
+   int nCut;
 
    if (mpcs->BadCutHeight(height))
       return false;
 
-   for (nCut=0; nCut<2; nCut++) {
-      if (!mpcs->GetParams(height, nEmpty_, nCut, iPrune, hCheck, sd, cr))
-         break;
+   cuts=mpcs->Cuts(height, nEmpty_, iPrune);
+   for (nCut=0; nCut<2 && cuts[nCut].hCheck; nCut++) {
+      const CMPCCut& cut=cuts[nCut];
+
+      counts=0;
+      if (nProbCutStats && !fProbCutVerifying) {
+         counts=&ProbCutCounts(height, nEmpty_, nCut);
+         counts->nAttempts++;
+         nNodesStart=NodesQuick();
+      }
 
       // check alpha cutoff
       if (alpha>-kInfinity) {
-         bound=(alpha-sd)*cr;
+         bound=alpha*cut.cr-cut.sdcr;
          movesCopy=moves;
-         ValueCacheOrTree(hCheck, bound-1, bound, movesCopy, 0, best);
+         ValueCacheOrTree(cut.hCheck, bound-1, bound, movesCopy, 0, best);
          if (abortRound)
             return false;
          if (best.value<bound) {
+            if (counts)
+               CountProbCut(*counts, nNodesStart, height, alpha, beta, moves, iPrune, true);
             best.value=alpha;
             return true;
          }
@@ -1924,16 +2259,21 @@ inline bool MPCCheck(int height, CValue alpha, CValue beta, const CMoves& moves,
 
       // check beta cutoff
       if (beta<kInfinity) {
-         bound=(beta+sd)*cr;
+         bound=beta*cut.cr+cut.sdcr;
          movesCopy=moves;
-         ValueCacheOrTree(hCheck, bound, bound+1, movesCopy, 0, best);
+         ValueCacheOrTree(cut.hCheck, bound, bound+1, movesCopy, 0, best);
          if (abortRound)
             return false;
          if (best.value>bound) {
+            if (counts)
+               CountProbCut(*counts, nNodesStart, height, alpha, beta, moves, iPrune, false);
             best.value=beta;
             return true;
          }
       }
+
+      if (counts)
+         counts->nCheckNodes+=NodesQuick()-nNodesStart;
    }
 
    return false;
@@ -2036,6 +2376,29 @@ inline bool ValueMove(int height, int hChild, CValue alpha, CValue beta, CMove&
    return false;
 }
 
+///////////////////////////////////////////////////////////////////////
+// SearchSplitPoint - value moves from a split point until there are none left.
+//	Called by each thread working on the split point, with the split point's position set.
+///////////////////////////////////////////////////////////////////////
+
+void SearchSplitPoint(CSplitPoint& sp) {
+   int index;
+   CValue vSearchAlpha;
+   bool fNegascout;
+   CMoveValue mv;
+   CMoves moves;
+   CMove move;
+
+   while (sp.GetNext(index, vSearchAlpha, fNegascout)) {
+      move=sp.moves[index].move;
+      mv.value=-kInfinity;
+      ValueMove(sp.height, sp.height-1, vSearchAlpha, sp.beta, move, moves, sp.iPrune, fNegascout, mv);
+      if (abortRound)
+         break;
+      sp.Report(index, vSearchAlpha, mv);
+   }
+}
+
 ///////////////////////////////////////////////////////////////////////
 // ValueTree - do a tree search to find the best move and value.
 ///////////////////////////////////////////////////////////////////////
@@ -2071,6 +2434,9 @@ inline void ValueTree(int height, CValue alpha, CValue beta, CMoves& moves, int&
    GetSearchParameters(height, moves.HasBest(), iPrune, iff, iffCache, fSort, fSortQuick, fPresearch, fUseBest, fNegascout);
    best.value=-kInfinity;
 
+   // split full-width solves among threads once the first move has been searched
+   bool fSplit=!iPrune && height>=nEmpty_-hSolverStart && nEmpty_>=nEmptySplitMin;
+
    int hChild=height-1;
    int i, nMoves, nChecked=0;
 
@@ -2098,6 +2464,9 @@ inline void ValueTree(int height, CValue alpha, CValue beta, CMoves& moves, int&
       CMoveValue moveValues[64];
       iffCache=iff;
       CMoves submoves;
+      // children that need the evaluator are valued together once all have been visited
+      CEvalLeaf leaves[64];
+      int iLeafMoves[64], nLeaves=0;
       //cout << "--- sort ---\n";
       QSSERT(moves.Consistent());
       for (nMoves=0; moves.GetNext(move); nMoves++) {
@@ -2110,9 +2479,12 @@ inline void ValueTree(int height, CValue alpha, CValue beta, CMoves& moves, int&
                vSubnode++;
          }
          else {
-            vSubnode=StaticValue(iff);
-            CCacheData* pcd = cache->FindOld(bb,bb.Hash());
-            if (pcd && pcd->AlphaCutoff(height-1, iPrune, nEmpty_, -beta)) {
+            if (!StartStaticValue(iff, leaves[nLeaves], vSubnode)) {
+               iLeafMoves[nLeaves++]=nMoves;
+               vSubnode=0;
+            }
+            CCacheData cd;
+            if (cache->FindOld(bb.Hash64(), cd) && cd.AlphaCutoff(height-1, iPrune, nEmpty_, -beta)) {
                vSubnode-=5000;
             }
          }
@@ -2126,10 +2498,24 @@ inline void ValueTree(int height, CValue alpha, CValue beta, CMoves& moves, int&
          return;
       }
 
+      if (nLeaves) {
+         CValue leafValues[64];
+         evaluator->EvalMobsBatch(leaves, nLeaves, nEmpty_-1, leafValues);
+         for (i=0; i<nLeaves; i++)
+            moveValues[iLeafMoves[i]].value-=FinishStaticValue(iff, leaves[i], leafValues[i]);
+      }
+
       sort(moveValues, moveValues+nMoves);
 
       // test remaining moves in order
       for (i=0; i<nMoves; i++) {
+         if (fSplit && nChecked && SplitAvailable()) {
+            CSplitPoint sp(height, alpha, beta, iPrune, fNegascout, moveValues+i, nMoves-i, best);
+            SplitSearch(sp);
+            if (!abortRound)
+               best=sp.best;
+            return;
+         }
          move=moveValues[i].move;
          bool fCutoff=ValueMove(height, hChild, alpha, beta, move, moves, iPrune, fNegascout && nChecked && best.value>=alpha, best);
          if (fCutoff) {
@@ -2251,6 +2637,9 @@ void ValueMulti(int height,
    vector<CMoveValue>::const_iterator i;
    bool fNegascout=height>=hNegascout;
    const bool fDebugPrint=false;
+   // split full-width solves among threads once the first move has been searched
+   bool fSplit=nBest==1 && fBetaCutoff && !iPrune && height>=nEmpty_-hSolverStart && nEmpty_>=nEmptySplitMin;
+   vector<CMoveValue> mvsUnsearched;
 
    if (fDebugPrint) {
       cout << "ValueMulti(" <<height<< "," <<alpha<< "," <<beta<< "," <<iPrune<< "," <<nBest<< ")\n";
@@ -2271,6 +2660,43 @@ void ValueMulti(int height,
          if (vSearchAlpha>=beta)
             break;
       }
+
+      if (fSplit && i!=mvs.begin() && SplitAvailable()) {
+         CMoveValue mvBest;
+         if (mvsEvaluated.empty())
+            mvBest.value=-kInfinity;
+         else
+            mvBest=mvsEvaluated[0];
+         CSplitPoint sp(height, alpha, beta, iPrune, fNegascout, &*i, mvs.end()-i, mvBest);
+         SplitSearch(sp);
+
+         // add the results in move order, as if we had searched them one at a time
+         vector<bool> fSearched(sp.nMoves, false);
+         vector<CSplitResult>::iterator r;
+         sort(sp.results.begin(), sp.results.end());
+         for (r=sp.results.begin(); r!=sp.results.end(); r++) {
+            const CMoveValue& mvOld=sp.moves[r->index];
+            fSearched[r->index]=true;
+            mv=r->mv;
+            if (mv.value>r->vSearchAlpha) {
+               if (mv.value>=beta && mvOld.value>mv.value)
+                  mv.value=mvOld.value;
+               mvsEvaluated.insert(upper_bound(mvsEvaluated.begin(),mvsEvaluated.end(),mv),mv);
+            }
+            else {
+               if (mvOld.value<mv.value)
+                  mv.value=mvOld.value;
+               mvsLow.push_back(mv);
+            }
+         }
+         for (int j=0; j<sp.nMoves; j++) {
+            if (!fSearched[j])
+               mvsUnsearched.push_back(sp.moves[j]);
+         }
+         i=mvs.end();
+         break;
+      }
+
       move=i->move;
 
       if (fDebugPrint)
@@ -2339,6 +2765,7 @@ void ValueMulti(int height,
    mvsEvaluated.insert(mvsEvaluated.end(),mvsLow.begin(),mvsLow.end());
    QSSERT(mvsEvaluated.size() || abortRound);
    // If we had a beta cutoff,some moves weren't even tried, put them last.
+   mvsEvaluated.insert(mvsEvaluated.end(),mvsUnsearched.begin(),mvsUnsearched.end());
    mvsEvaluated.insert(mvsEvaluated.end(),i,mvs.end());
 }
 
@@ -2413,6 +2840,8 @@ void SaveIterativeResultInBook(int nBest,
 
 int iffMidgame=5;
 
+TLS std::vector<CValue>* pMPCValues=0;
+
 // calculate height, pruning, fWLD for next round
 void IterativeValue(CMoves moves,
                     const CCalcParams& cp,
@@ -2438,8 +2867,12 @@ void IterativeValue(CMoves moves,
    //QSSERT(mpcs && mpcs->Valid());
 
    // print MPC stat static value?
-   if (si.fNeeds & kNeedMPCStats)
-      cout << "\t" << StaticValue(0);
+   if (si.fNeeds & kNeedMPCStats) {
+      if (pMPCValues)
+         pMPCValues->push_back(StaticValue(0));
+      else
+         cout << "\t" << StaticValue(0);
+   }
 
    // initialize cache and book read height
    InitializeCache(si.fNeeds);
@@ -2462,6 +2895,9 @@ void IterativeValue(CMoves moves,
    if (nEmpty_>36 && (si.fNeeds&kNeedRandSearch) && (si.iPruneMidgame>1))
       hi.iPrune--;
 
+   // helpers fill the cache while we search
+   StartHelperThreads(mvsOld, hi, si);
+
    // iterate
    Timer<double> timer;
    while( !mvk.move.Valid() || cp.RoundOK(hi, nEmpty_, tElapsed, si.tRemaining) ) {
@@ -2525,8 +2961,12 @@ void IterativeValue(CMoves moves,
          mvk.hiFull=hi;
 
       // special checks when calculating mpc stats
-      if (si.fNeeds&kNeedMPCStats)
-         printf("\t%d",mvk.value);
+      if (si.fNeeds&kNeedMPCStats) {
+         if (pMPCValues)
+            pMPCValues->push_back(mvk.value);
+         else
+            printf("\t%d",mvk.value);
+      }
 
       // print out results for logistello comparison
       if (si.PrintSearchStats() /*&& timer.elapsed()>1*/)
@@ -2547,6 +2987,13 @@ void IterativeValue(CMoves moves,
       mvsOld=mvsNew;
    }
 
+   StopHelperThreads();
+
+   if (fPrintCacheStats) {
+      cache->PrintStats();
+      cache->ClearStats();
+   }
+
    QSSERT(mvk.move.Valid());
    //QSSERT(hi.Valid());
    SaveIterativeResultInBook(nBest, nEvalOld,nEvalNew,mvsOld,mvsNew,mvk, fFull);
@@ -2647,9 +3094,176 @@ void InitForcedOpenings() {
    cerr << "Map Size: Black: " << foms[1].size() << ", White: " << foms[0].size() << "\n";
 }
 
+//////////////////////////////////////////////////////
+// Draw counts
+//	The draw count of a book position with value 0 is summed over its successors in the book.
+//	A drawn successor is one draw. A successor with value 0 adds its own count, unless it has
+//	no draws below it: then it is an edmund node and counts as one edmund. A successor that
+//	an earlier line of the same count already reached (a transposition) isn't added again;
+//	each of the three counts takes the maximum of its value so far and the successor's.
+//
+//	Counts are memoized by minimal reflection, so each position is counted once however many
+//	lines reach it. Each count has a pass number, and the memo records which pass last
+//	reached each position, so the first line of a pass to reach a position adds it and
+//	later lines take the maximum. Reaching a position reaches the ones below it too.
+//	Several threads count at once: the top of the tree is split into subtrees, the threads
+//	count the subtrees with their own copy of the position (the position globals are TLS)
+//	and share the memo, then the top is counted from the memo. The subtrees' roots are
+//	counted without being reached, so the top still adds them.
+//
+//	The memo is kept between counts. CountDraws(book, out) only recounts the positions the
+//	book has changed since the last count, and the positions that lead to them. It may run
+//	while other threads play games with the book: it holds the book's lock (CBook::CWalkLock)
+//	for the whole count, so their stores wait until it's done, and its threads only use the
+//	lookups that don't lock.
+//////////////////////////////////////////////////////
+
 namespace
 {
-   Draws draws;
+   // a memoized draw count, and the successors it was counted from
+   class CDrawNode {
+   public:
+      CDrawNode(const DrawCount& adc, int anPass) : dc(adc), nPass(anPass) {}
+
+      DrawCount dc;
+      std::vector<CBitBoard> successors;	// minimal reflections
+      int nPass;	// pass of the last count that reached the position, 0 if none
+   };
+
+   //////////////////////////////////////////////////////
+   // CDrawMemo
+   //	Draw counts by minimal reflection, shared by the counting threads.
+   //	The map is split into shards with a lock each, so the threads rarely wait on each other.
+   //	Find() copies the count under the shard's lock, since games look counts up while
+//	CountDraws() clears or invalidates the memo.
+   //////////////////////////////////////////////////////
+   class CDrawMemo {
+   public:
+      // A copy of the memoized count. fFound is false, and the count 0, if the position
+      //	hasn't been counted. Counts may be looked up while a count runs.
+      DrawCount Find(const CBitBoard& key, bool& fFound) const {
+         const CShard& shard=Shard(key);
+         boost::mutex::scoped_lock lock(shard.mutex);
+         Nodes::const_iterator it=shard.nodes.find(key);
+         fFound=it!=shard.nodes.end();
+         return fFound ? it->second.dc : DrawCount();
+      }
+
+      bool Contains(const CBitBoard& key) const {
+         bool fFound;
+         Find(key, fFound);
+         return fFound;
+      }
+
+      enum TClaim { kNotCounted, kFirst, kAgain };
+
+      // Mark the position reached by pass nPass, and return its count. claim is kFirst if
+      //	no line of the pass reached it before; then the positions below it are marked too.
+      DrawCount Claim(const CBitBoard& key, int nPass, TClaim& claim) {
+         std::vector<CBitBoard> stack;
+         std::size_t draws, privateDraws, edmunds;
+         {
+            CShard& shard=Shard(key);
+            boost::mutex::scoped_lock lock(shard.mutex);
+            Nodes::iterator it=shard.nodes.find(key);
+            if (it==shard.nodes.end()) {
+               claim=kNotCounted;
+               return DrawCount();
+            }
+            CDrawNode& node=it->second;
+            draws=node.dc.draws;
+            privateDraws=node.dc.privateDraws;
+            edmunds=node.dc.edmunds;
+            if (node.nPass==nPass)
+               claim=kAgain;
+            else {
+               node.nPass=nPass;
+               stack=node.successors;
+               claim=kFirst;
+            }
+         }
+
+         while (!stack.empty()) {
+            CBitBoard successor=stack.back();
+            stack.pop_back();
+            CShard& shard=Shard(successor);
+            boost::mutex::scoped_lock lock(shard.mutex);
+            Nodes::iterator it=shard.nodes.find(successor);
+            if (it!=shard.nodes.end() && it->second.nPass!=nPass) {
+               it->second.nPass=nPass;
+               stack.insert(stack.end(), it->second.successors.begin(), it->second.successors.end());
+            }
+         }
+         return DrawCount(draws, privateDraws, edmunds);
+      }
+
+      // Return false if another thread counted the position first
+      bool Insert(const CBitBoard& key, const CDrawNode& node) {
+         CShard& shard=Shard(key);
+         boost::mutex::scoped_lock lock(shard.mutex);
+         return shard.nodes.insert(std::make_pair(key, node)).second;
+      }
+
+      void Clear() {
+         for (int i=0; i<kNShards; i++) {
+            boost::mutex::scoped_lock lock(shards[i].mutex);
+            shards[i].nodes.clear();
+         }
+      }
+
+      // Erase the positions and every position whose count depends on them.
+      //	Lookups may run meanwhile, but call it between counts.
+      void Invalidate(const std::vector<CBitBoard>& keys) {
+         typedef boost::unordered_map<CBitBoard, std::vector<CBitBoard>, CBitBoardHash> Parents;
+         Parents parents;
+         boost::unordered_set<CBitBoard, CBitBoardHash> erased;
+         std::vector<CBitBoard> stack(keys);
+         int i;
+
+         for (i=0; i<kNShards; i++) {
+            boost::mutex::scoped_lock lock(shards[i].mutex);
+            foreach(const Nodes::value_type& node, shards[i].nodes) {
+               foreach(const CBitBoard& successor, node.second.successors)
+                  parents[successor].push_back(node.first);
+            }
+         }
+
+         // changed positions need not be in the memo (e.g. draws), but their parents may be
+         while (!stack.empty()) {
+            CBitBoard key=stack.back();
+            stack.pop_back();
+            if (!erased.insert(key).second)
+               continue;
+            CShard& shard=Shard(key);
+            boost::mutex::scoped_lock lock(shard.mutex);
+            shard.nodes.erase(key);
+            Parents::const_iterator it=parents.find(key);
+            if (it!=parents.end())
+               stack.insert(stack.end(), it->second.begin(), it->second.end());
+         }
+      }
+
+   private:
+      typedef boost::unordered_map<CBitBoard, CDrawNode, CBitBoardHash> Nodes;
+      enum { kShardBits=6, kNShards=1<<kShardBits };
+
+      class CShard {
+      public:
+         mutable boost::mutex mutex;
+         Nodes nodes;
+      };
+      CShard shards[kNShards];
+
+      CShard& Shard(const CBitBoard& key) { return shards[key.FastHash()>>(32-kShardBits)]; }
+      const CShard& Shard(const CBitBoard& key) const { return shards[key.FastHash()>>(32-kShardBits)]; }
+   };
+
+   CDrawMemo drawMemo;
+   const CBook* pBookCounted=0;	// book the memo was counted from
+   int nLoadsCounted=0;	// its NLoads() and NChanges() at the time
+   std::size_t nChangesCounted=0;
+   int nDrawPass=0;	// of the count running now, see CDrawNode::nPass
+   boost::mutex drawCountMutex;	// one count at a time, lookups don't take it
 
    int CountSuccessors(const CBook& book, CMove& move)
    {
@@ -2672,12 +3286,35 @@ namespace
       return successors;
    }
 
-   DrawCount CountDraws2(const CBook& book, std::vector<CMove>& pv, VariationCollection& variations)
+   DrawCount CountDraws2(const CBook& book, std::vector<CMove>& pv, VariationCollection& variations, bool fClaim, bool& fFirst);
+
+   // Draw count of the successor key, which pv+move leads to. fFirst is set if no earlier
+   //	line of this count reached it.
+   DrawCount CountSuccessor(const CBook& book, const CBitBoard& key, const CMove& move, std::vector<CMove>& pv, VariationCollection& variations, bool& fFirst)
+   {
+      CDrawMemo::TClaim claim;
+      DrawCount dc = drawMemo.Claim(key, nDrawPass, claim);
+      if( claim!=CDrawMemo::kNotCounted ) {
+         fFirst = claim==CDrawMemo::kFirst;
+         return dc;
+      }
+      pv.push_back(move);
+      DrawCount dcCounted = CountDraws2(book, pv, variations, true, fFirst);
+      pv.pop_back();
+      return dcCounted;
+   }
+
+   // Draw count of the position in bb, which pv leads to. Positions this thread counts first are
+   //	added to the memo, and the edmund nodes among them to variations.
+   //	With fClaim the position is marked reached by this count, and fFirst is set if no
+   //	other line reached it first. Without, it's only counted (see CountDrawsFromRoot()).
+   DrawCount CountDraws2(const CBook& book, std::vector<CMove>& pv, VariationCollection& variations, bool fClaim, bool& fFirst)
    {
       CMove	move;
       std::size_t n_draws = 0;
       std::size_t n_privateDraws = 0;
       std::size_t n_edmunds = 0;
+      std::vector<CBitBoard> successors;
 
       CMoves moves;
       bb.CalcMoves(moves);
@@ -2686,69 +3323,222 @@ namespace
          int nFlipped;
          CUndoInfo ui;
          MakeMoveBB(move.Square(), nFlipped, ui);
-         Draws::const_iterator it = draws.find(bb.MinimalReflection());
-         if( it==draws.end() ) {
-            const CBookData* bd = book.FindAnyReflection(bb);
-            if( bd ) {
-               if( bd->Values().Draw() ) {
-                  n_draws ++;
-                  if( bd->IsPrivate() )
-                     n_privateDraws ++;
+         CBitBoard key = bb.MinimalReflection();
+         successors.push_back(key);
+         const CBookData* bd = book.FindMinimal(key);
+         if( bd ) {
+            if( bd->Values().Draw() ) {
+               n_draws ++;
+               if( bd->IsPrivate() )
+                  n_privateDraws ++;
+            }
+            else if( bd->Values().vHeuristic==0 ) {
+               bool fFirstChild;
+               DrawCount dc = CountSuccessor(book, key, move, pv, variations, fFirstChild);
+               if( !fFirstChild ) {
+                  // a transposition
+                  n_draws = (std::max)(n_draws, dc.draws);
+                  n_privateDraws = (std::max)(n_privateDraws, dc.privateDraws);
+                  n_edmunds = (std::max)(n_edmunds, dc.edmunds);
                }
-               else if( bd->Values().vHeuristic==0 ) {
-                  pv.push_back(move);
-                  DrawCount dc = CountDraws2(book, pv, variations);
-                  if( dc.draws==0 ) {
-                     variations.push_back(Variation(0, 0, pv));
-                     //std::ostringstream stream;
-                     //std::ofstream stream("edmunds.txt", std::ios::app);
-                     //std::copy(pv.begin(), pv.end(), std::ostream_iterator<CMove>(stream, " "));
-                     //stream << "\n";
-                     //std::string pvAsString = stream.str();
-                     n_edmunds ++;
-                     n_draws = (std::max)(n_draws, n_edmunds);
-                  }
-                  else {
-                     n_draws += dc.draws;
-                     n_privateDraws += dc.privateDraws;
-                     n_edmunds += dc.edmunds;
-                  }
-                  pv.pop_back();
+               else if( dc.draws==0 ) {
+                  n_edmunds ++;
+                  n_draws = (std::max)(n_draws, n_edmunds);
+               }
+               else {
+                  n_draws += dc.draws;
+                  n_privateDraws += dc.privateDraws;
+                  n_edmunds += dc.edmunds;
                }
             }
          }
-         else {
-            DrawCount dc = it->second;
-            n_draws = (std::max)(n_draws, dc.draws);
-            n_privateDraws = (std::max)(n_privateDraws, dc.privateDraws);
-            n_edmunds = (std::max)(n_edmunds, dc.edmunds);
-         }
          UndoMoveBB(move.Square(),nFlipped, ui);
       }
       DrawCount dc(n_draws, n_privateDraws, n_edmunds);
-      draws.insert(std::make_pair(bb.MinimalReflection(), dc));
+      CDrawNode node(dc, fClaim ? nDrawPass : 0);
+      node.successors.swap(successors);
+      CBitBoard key = bb.MinimalReflection();
+      fFirst = drawMemo.Insert(key, node);
+      if( fFirst ) {
+         if( dc.draws==0 && !pv.empty() )
+            variations.push_back(Variation(0, 0, pv));
+      }
+      else if( fClaim ) {
+         // another thread counted it at the same time
+         CDrawMemo::TClaim claim;
+         drawMemo.Claim(key, nDrawPass, claim);
+         fFirst = claim==CDrawMemo::kFirst;
+      }
       return dc;
    }
 
-   void ExtractDraws(const CBook& book, VariationCollection& variations, std::vector<CMove>& variation, bool parentSolved)
+   // a subtree for one of the threads: its root and the moves that lead to it
+   class CSubtree {
+   public:
+      CBitBoard board;
+      std::vector<CMove> pv;
+   };
+
+   // Split the tree below the current position into at least nWanted subtrees, if it is big enough.
+   //	The walk goes through the book positions fExpand accepts, and returns the first level
+   //	that is wide enough, with one subtree per minimal reflection.
+   //	Changes the current position.
+   template<class TExpand>
+   std::vector<CSubtree> SplitTree(const CBook& book, TExpand fExpand, std::size_t nWanted)
+   {
+      std::vector<CSubtree> level(1), next;
+      level[0].board = bb;
+
+      for (int depth=0; depth<16 && level.size()<nWanted; depth++) {
+         boost::unordered_set<CBitBoard, CBitBoardHash> seen;
+         next.clear();
+         foreach(const CSubtree& subtree, level) {
+            CMove move;
+            CMoves moves;
+            Initialize(subtree.board, true);
+            bb.CalcMoves(moves);
+            while(moves.GetNext(move)) {
+               int nFlipped;
+               CUndoInfo ui;
+               MakeMoveBB(move.Square(), nFlipped, ui);
+               CBitBoard key = bb.MinimalReflection();
+               const CBookData* bd = book.FindMinimal(key);
+               if( bd && fExpand(*bd) && seen.insert(key).second ) {
+                  next.push_back(CSubtree());
+                  next.back().board = bb;
+                  next.back().pv = subtree.pv;
+                  next.back().pv.push_back(move);
+               }
+               UndoMoveBB(move.Square(),nFlipped, ui);
+            }
+         }
+         if( next.empty() )
+            break;
+         level.swap(next);
+      }
+      return level;
+   }
+
+   // Call fn(subtree) for each of the subtrees, spread over nThreads threads including this one
+   template<class TFn>
+   void ForEachSubtree(const std::vector<CSubtree>& subtrees, int nThreads, TFn fn)
+   {
+      boost::mutex mutex;
+      std::size_t iNext = 0;
+      std::vector<std::shared_ptr<boost::thread> > threads;
+
+      auto worker = [&]() {
+         for (;;) {
+            std::size_t i;
+            {
+               boost::mutex::scoped_lock lock(mutex);
+               if( iNext>=subtrees.size() )
+                  return;
+               i = iNext++;
+            }
+            fn(subtrees[i]);
+         }
+      };
+      for (int i=1; i<nThreads; i++)
+         threads.push_back(std::shared_ptr<boost::thread>(new boost::thread(worker)));
+      worker();
+      foreach(const std::shared_ptr<boost::thread>& thread, threads)
+         thread->join();
+   }
+
+   int NDrawThreads()
+   {
+      return SINGLE_THREADED_SEARCH ? 1 : (std::max)(nSearchThreads, 1);
+   }
+
+   // Count the positions below the start position that aren't in the memo. The memo is then
+   //	up to date with the book's first nChanges changes.
+   DrawCount CountDrawsFromRoot(const CBook& book, VariationCollection& variations, std::size_t nChanges)
+   {
+      boost::mutex mutex;
+      int nThreads = NDrawThreads();
+      bool fFirst;
+
+      nDrawPass++;
+      if( nThreads>1 ) {
+         Initialize();
+         std::vector<CSubtree> subtrees = SplitTree(book, [](const CBookData& bd) {
+            return !bd.Values().Draw() && bd.Values().vHeuristic==0;
+         }, 16*nThreads);
+         ForEachSubtree(subtrees, nThreads, [&](const CSubtree& subtree) {
+            Initialize(subtree.board, true);
+            if( drawMemo.Contains(bb.MinimalReflection()) )
+               return;
+            std::vector<CMove> pv(subtree.pv);
+            VariationCollection found;
+            bool fFirstSubtree;
+            CountDraws2(book, pv, found, false, fFirstSubtree);
+            boost::mutex::scoped_lock lock(mutex);
+            variations.insert(variations.end(), found.begin(), found.end());
+         });
+      }
+
+      // the top of the tree, from the memo
+      Initialize();
+      std::vector<CMove> pv;
+      DrawCount dc = CountDraws2(book, pv, variations, true, fFirst);
+
+      pBookCounted = &book;
+      nLoadsCounted = book.NLoads();
+      nChangesCounted = nChanges;
+      return dc;
+   }
+
+   // The positions ExtractDraws() has walked. A line reaching a position that an earlier line
+   //	reached doesn't walk it again, and the position isn't a successor of the second line's
+   //	node. Threads walk subtrees ahead of the lines that reach them; the first line to reach
+   //	such a subtree has it as a successor but doesn't walk it again.
+   class CVisited {
+   public:
+      enum TReach { kNew, kWalkedAhead, kReached };
+
+      TReach Reach(const CBitBoard& key) {
+         boost::mutex::scoped_lock lock(mutex);
+         std::pair<Keys::iterator, bool> inserted=keys.insert(std::make_pair(key, true));
+         if (inserted.second)
+            return kNew;
+         if (!inserted.first->second) {
+            inserted.first->second=true;
+            return kWalkedAhead;
+         }
+         return kReached;
+      }
+
+      // Return false if the position was walked already
+      bool WalkAhead(const CBitBoard& key) {
+         boost::mutex::scoped_lock lock(mutex);
+         return keys.insert(std::make_pair(key, false)).second;
+      }
+   private:
+      typedef boost::unordered_map<CBitBoard, bool, CBitBoardHash> Keys;	// true once a line reached it
+      boost::mutex mutex;
+      Keys keys;
+   };
+
+   void ExtractDraws(const CBook& book, CVisited& visited, VariationCollection& variations, std::vector<CMove>& variation, bool parentSolved)
    {
       CMove	move;
       CMoves moves;
       bb.CalcMoves(moves);
       bool terminalNode = true;
-      draws.insert(std::make_pair(bb.MinimalReflection(), DrawCount()));
 
       while(moves.GetNext(move)) {
          int nFlipped;
          CUndoInfo ui;
          MakeMoveBB(move.Square(), nFlipped, ui);
-         Draws::const_iterator it = draws.find(bb.MinimalReflection());
-         if( it==draws.end() ) {
-            const CBookData* bd = book.FindAnyReflection(bb);
-            if( bd ) {
+         const CBookData* bd = book.FindAnyReflection(bb);
+         if( bd ) {
+            CVisited::TReach reach = visited.Reach(bb.MinimalReflection());
+            if( reach!=CVisited::kReached )
                terminalNode = false;
+            if( reach==CVisited::kNew ) {
                variation.push_back(move);
-               ExtractDraws(book, variations, variation, bd->Values().IsSolved());
+               ExtractDraws(book, visited, variations, variation, bd->Values().IsSolved());
                variation.pop_back();
             }
          }
@@ -2762,15 +3552,13 @@ namespace
 
 DrawCount CountDraws(const CBook& book, std::ostream& out, VariationCollection& variations)
 {
+   boost::mutex::scoped_lock lock(drawCountMutex);
+   CBook::CWalkLock bookLock(book);
    out << "Counting draws..." << std::endl;
-   Initialize();
 
-   draws.clear();
-   std::vector<CMove> pv;
-   DrawCount dc = CountDraws2(book, pv, variations);
-
-   assert(dc.draws==draws[bb].draws);
-   assert(dc.privateDraws==draws[bb].privateDraws);
+   std::size_t nChanges = book.NChanges();
+   drawMemo.Clear();
+   DrawCount dc = CountDrawsFromRoot(book, variations, nChanges);
 
    out << "Draws: " << dc.draws << " (" << dc.privateDraws << "), edmunds = " << dc.edmunds << std::endl;
    return dc;
@@ -2779,27 +3567,64 @@ DrawCount CountDraws(const CBook& book, std::ostream& out, VariationCollection&
 DrawCount CountDraws(const CBook& book, std::ostream& out)
 {
    VariationCollection variations;
+   {
+      boost::mutex::scoped_lock lock(drawCountMutex);
+      // other threads may store positions, hold the book's lock for the changes and the walk
+      CBook::CWalkLock bookLock(book);
+      std::vector<CBitBoard> changed;
+      std::size_t nChanges;
+      if( pBookCounted==&book && nLoadsCounted==book.NLoads() && book.ChangesSince(nChangesCounted, changed, nChanges) ) {
+         out << "Counting draws, " << changed.size() << " positions changed..." << std::endl;
+
+         drawMemo.Invalidate(changed);
+         DrawCount dc = CountDrawsFromRoot(book, variations, nChanges);
+
+         out << "Draws: " << dc.draws << " (" << dc.privateDraws << "), edmunds = " << dc.edmunds << std::endl;
+         return dc;
+      }
+   }
    return CountDraws(book, out, variations);
 }
 
 VariationCollection ExtractDraws(const CBook& book)
 {
    std::cout << "Extracting draws..." << std::endl;
-   Initialize();
-   draws.clear();
 
    VariationCollection variations;
+   CVisited visited;
+   boost::mutex mutex;
+   int nThreads = NDrawThreads();
+   CBook::CWalkLock bookLock(book);
+
+   // walk subtrees in parallel first, then the top of the tree skips them
+   if( nThreads>1 ) {
+      Initialize();
+      std::vector<CSubtree> subtrees = SplitTree(book, [](const CBookData&) { return true; }, 16*nThreads);
+      ForEachSubtree(subtrees, nThreads, [&](const CSubtree& subtree) {
+         Initialize(subtree.board, true);
+         if( subtree.pv.empty() || !visited.WalkAhead(bb.MinimalReflection()) )
+            return;
+         std::vector<CMove> variation(subtree.pv);
+         VariationCollection found;
+         ExtractDraws(book, visited, found, variation, book.FindAnyReflection(bb)->Values().IsSolved());
+         boost::mutex::scoped_lock lock(mutex);
+         variations.insert(variations.end(), found.begin(), found.end());
+      });
+   }
+
+   Initialize();
    std::vector<CMove> variation;
-   ExtractDraws(book, variations, variation, false);
+   ExtractDraws(book, visited, variations, variation, false);
+
+   // the order the threads found them in varies
+   std::sort(variations.begin(), variations.end());
    return variations;
 }
 
 DrawCount GetDrawCount(CBitBoard board)
 {
-   Draws::const_iterator it = draws.find(board.MinimalReflection());
-   if( it!=draws.end() )
-      return it->second;
-   return DrawCount(0, 0, 0);
+   bool fFound;
+   return drawMemo.Find(board.MinimalReflection(), fFound);
 }
 
 namespace
@@ -3057,7 +3882,7 @@ void TimedMVK(const CCalcParams& cp, const CSearchInfo& si, CMVK& mvk, bool onli
          mvk.fBook=true;
          QSSERT(mvk.move.Valid());
 
-         if (draws.find(bb.MinimalReflection())!=draws.end()) {
+         if (drawMemo.Contains(bb.MinimalReflection())) {
             std::vector<CMove> validMoves;
             CMove	move;
 
@@ -3069,9 +3894,9 @@ void TimedMVK(const CCalcParams& cp, const CSearchInfo& si, CMVK& mvk, bool onli
                int nFlipped;
                CUndoInfo ui;
                MakeMoveBB(move.Square(), nFlipped, ui);
-               Draws::const_iterator it = draws.find(bb.MinimalReflection());
-               if( it!=draws.end() ) {
-                  DrawCount dc = it->second;
+               bool fFound;
+               DrawCount dc = drawMemo.Find(bb.MinimalReflection(), fFound);
+               if( fFound ) {
                   std::cout << move << ": " << dc.draws << " (" << dc.privateDraws << "), edmunds = " << dc.edmunds << std::endl;
                   double privateDraws = dc.privateDraws;
                   double edmunds = dc.edmunds;
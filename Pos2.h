@@ -67,9 +67,9 @@ class CEmptyValue;
 class CEmpty;
 class CUndoInfo;
 
-// global variables
-extern int nEmpty_,nDiscDiff_;
-extern bool fBlackMove_;
+// global variables, one copy per search thread
+extern TLS int nEmpty_,nDiscDiff_;
+extern TLS bool fBlackMove_;
 
 // set up a given position. Initialize the global variables nEmpty_, nDiscDiff_, fBlackMove_
 // these are updated by most of the 'customer' routines here but are passed as parameters to most internal routines
@@ -128,6 +128,9 @@ int CalcMovesAndPassBB(CMoves& moves); // calc moves, then pass if a pass is nee
 void GetIDsJ(u2 ids[nPatternsJ]);
 void GetIDsL(u2 ids[nPatternsL]);
 CValue ValueJMobs(const std::vector<TCoeff> pcoeffs[2] , u4 nMovesPlayer, u4 nMovesOpponent);
+void GetEvalLeaf(CEvalLeaf& leaf, u4 nMovesPlayer, u4 nMovesOpponent);
+void ValueJBatch(const std::vector<TCoeff> pcoeffs[2], const CEvalLeaf* leaves, int n, int nEmpty, CValue* values);
+void ValueJBatchCompact(const CCompactCoeffsJ& cc, const CEvalLeaf* leaves, int n, int nEmpty, CValue* values);
 CValue ValueLMobs(const TCoeff* pcoeffs[2] , u4 nMovesPlayer, u4 nMovesOpponent);
 
 // evaluation control schemes
@@ -139,6 +142,8 @@ double IterativeRound(int height, CValue alpha, CValue beta, const CMoves& moves
                       bool fNeedMove, bool fSubset, const CNodeStats& start, CMVK& mvk);
 void SetBookHeights(int height);
 void InitializeCache(bool fNeedMove, bool fSubset);
+void ValueMulti(int height, CValue alpha, CValue beta, int iPrune, int nBest, const std::vector<CMoveValue>& mvs,
+                bool fBetaCutoff, std::vector<CMoveValue>& mvsEvaluated, int& nValued);
 
 // fixed-height evaluators
 void ValueBookCacheOrTree(int height, CValue alpha, CValue beta, CMoves& moves, int iPrune, CMoveValue& best);
@@ -146,6 +151,9 @@ void ValueCacheOrTree(int height, CValue alpha, CValue beta, CMoves& moves, int
 void ValueTree(int height, CValue alpha, CValue beta, CMoves& moves, int& iFastestFirst, int iPrune, CMoveValue& best);
 CValue ChildValue(int height, CValue alpha, CValue beta, int iPrune);
 CValue StaticValue(int iff);
+// if set, a search with kNeedMPCStats appends the static value and the value after each height here
+//	instead of printing them
+extern TLS std::vector<CValue>* pMPCValues;
 bool MPCCheck(int height, CValue alpha, CValue beta, const CMoves& moves, int& iPrune, CMoveValue& best);
 void ValueTreeNoSort(int height, int hChild, CValue alpha, CValue beta, CMoves& moves, int iPrune, CMoveValue& best);
 bool ValueMove(int height, int hChild, CValue alpha, CValue beta, CMove& move, CMoves& moves, int iPrune,
@@ -176,11 +184,12 @@ struct DrawCount
    const std::size_t edmunds;
 };
 
-typedef boost::unordered_map<CBitBoard, DrawCount> Draws;
-
 class CGame;
 
+// Count the draws below the start position. Only the positions the book has changed since
+//	the last count are counted again, see the notes in Pos2.cpp.
 DrawCount CountDraws(const CBook& book, std::ostream& out);
+// draw count of a position from the last count, or 0 if it wasn't counted
 DrawCount GetDrawCount(CBitBoard board);
 void ExtractLines(const CBook& book, VariationCollection& variations, int bound);
 void ExpandLine(const std::vector<CMove>& moves);
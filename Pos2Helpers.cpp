@@ -11,7 +11,7 @@
 // CEmptyList
 ///////////////////////////////////////////////////////////////////////////////
 
-CEmpty emptyHead, empties[64];
+TLS CEmpty emptyHead, empties[64];
 
 // fixed preference ordering of squares for endgame solver.
 //	best to worst order. Carped from endgame.c. Note constants are octal.
@@ -28,7 +28,7 @@ int CEmpty::orderToSquare[NN]= {
    /*D4*/      033, 034, 043, 044,
 };
 
-CEmpty* CEmpty::squareToEmpty[NN];
+TLS CEmpty* CEmpty::squareToEmpty[NN];
 
 void CEmpty::Initialize(const char *sBoard) {
    CEmpty* emLast=&emptyHead, *pem;
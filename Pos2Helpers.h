@@ -11,7 +11,7 @@
 #define PARITY_USAGE 1
 
 #if PARITY_USAGE
-extern u4 holeParity;
+extern TLS u4 holeParity;
 #endif
 
 ///////////////////////////////////////////////////////////////////////////
@@ -55,7 +55,7 @@ public:
 
 protected:
    static int orderToSquare[NN];	// best-to-worst order
-   static CEmpty* squareToEmpty[NN];
+   static TLS CEmpty* squareToEmpty[NN];
 };
 
 inline CEmpty* CEmpty::SquareToEmpty(int square) {
@@ -66,7 +66,7 @@ inline int CEmpty::SquareToParity(int square) {
    return SquareToEmpty(square)->holeMask & holeParity;
 }
 
-extern CEmpty emptyHead, empties[NN];
+extern TLS CEmpty emptyHead, empties[NN];
 inline void CEmpty::Remove(int square) {squareToEmpty[square]->Remove();};
 inline void CEmpty::Add(int square) {squareToEmpty[square]->Add();};
 inline void CEmpty::RemoveParity(int square) {squareToEmpty[square]->RemoveParity();};
@@ -77,7 +77,7 @@ inline void CEmpty::AddParity(int square) {squareToEmpty[square]->AddParity();};
 #define CIRCULAR_EMPTIES 1
 
 #if CIRCULAR_EMPTIES
-CEmpty* const emEOL=&emptyHead;
+#define emEOL (&emptyHead)	// not a constant: emptyHead is thread-local
 #else
 CEmpty* const emEOL=0;
 #endif
@@ -57,7 +57,7 @@ void CreateFlipListText();
 void CreateABText();
 
 // eval functions
-extern CBitBoard bb;
+extern TLS CBitBoard bb;
 inline int CalcMobility(u4& nMovesPlayer, u4& nMovesOpponent) {
    return bb.CalcMobility(nMovesPlayer,nMovesOpponent);
 }
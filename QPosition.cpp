@@ -192,7 +192,7 @@ int CQPosition::CalcMobility(u4& nMovesPlayer, u4& nMovesOpponent) const {
 
 // Set down a piece and flip opposing pieces. Change board.blacks.
 void CQPosition::MakeMove(CMove move) {
-   extern CBitBoard bb;
+   extern TLS CBitBoard bb;
 
 #if _DEBUG
    CMoves movesTest;
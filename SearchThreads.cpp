@@ -0,0 +1,295 @@
+// Copyright Chris Welty
+//	All Rights Reserved
+// This file is distributed subject to GNU GPL version 2. See the files
+// Copying.txt and GPL.txt for details.
+
+//////////////////////////////////////////////////////
+// Lazy SMP
+//	Each helper thread has its own copy of the position (the position globals are TLS)
+//	and runs its own iterative deepening on the root position. The threads share the
+//	cache, so a helper that finishes a subtree first saves the other threads the work.
+//	Odd-numbered helpers search one ply deeper than the others so the threads
+//	don't all walk the tree in lockstep.
+//
+// Solve rounds use young brothers wait instead, see the split points below.
+//////////////////////////////////////////////////////
+
+#include "PreCompile.h"
+#include "SearchThreads.h"
+#include "Pos2Internal.h"
+#include "NodeStats.h"
+#include "options.h"
+#include "Debug.h"
+
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using namespace std;
+
+extern TLS int hBookRead;
+
+int nSearchThreads=1;
+TLS int nThreadsShare=0;
+int nEmptySplitMin=14;
+TLS bool fHelperThread=false;
+TLS bool fSoloSearch=false;
+
+int SearchThreadCount() {
+   return nThreadsShare ? nThreadsShare : nSearchThreads;
+}
+
+static TLS volatile bool fStopOwn=false;	// stops the helpers of searches this thread runs
+static TLS volatile bool* pfStopHelpers=0;	// in helpers, the flag of the search they help. 0 for fStopOwn
+
+static volatile bool& StopFlag() {
+   return pfStopHelpers ? *pfStopHelpers : fStopOwn;
+}
+
+bool HelpersStopped() {
+   return StopFlag();
+}
+
+void SignalStopHelpers() {
+   StopFlag()=true;
+}
+
+CSearchContext::CSearchContext() : book(::book), cache(::cache) {
+}
+
+void CSearchContext::Apply() const {
+   ::book=book;
+   ::cache=cache;
+}
+
+// helpers of the search this thread runs
+static TLS vector<std::shared_ptr<boost::thread> > helpers;
+
+static void HelperSearch(int iHelper, CSearchContext context, volatile bool* pfStop, CBitBoard bbRoot, bool fBlackMove, vector<CMoveValue> mvs, CHeightInfo hi, CSearchInfo si) {
+   vector<CMoveValue> mvsNew;
+   int nValued;
+   CValue alpha, beta;
+
+   fHelperThread=true;
+   pfStopHelpers=pfStop;
+   abortRound=false;
+   context.Apply();
+   Initialize(bbRoot, fBlackMove);
+
+   if ((iHelper&1) && hi.height<nEmpty_)
+      hi.height++;
+
+   while (!HelpersStopped()) {
+      // solve rounds are split among the pool threads instead
+      if (!hi.iPrune && hi.height>=nEmpty_-hSolverStart && nEmpty_>=nEmptySplitMin)
+         break;
+
+      SetBookHeights(hi.height);
+      if (hi.fWLD) {
+         alpha=-kStoneValue;
+         beta=kStoneValue;
+      }
+      else {
+         alpha=-kWipeout;
+         beta=kWipeout;
+      }
+      ValueMulti(hi.height, alpha, beta, hi.iPrune, 1, mvs, !hi.iPrune, mvsNew, nValued);
+      if (abortRound || !hi.NextRound(nEmpty_, si))
+         break;
+
+      // search the next round in the order found by this one
+      mvs=mvsNew;
+   }
+
+   WipeNodeStats();
+}
+
+static void StartPoolThreads();
+
+void StartHelperThreads(const vector<CMoveValue>& mvs, const CHeightInfo& hi, const CSearchInfo& si) {
+   int i;
+
+   if (SINGLE_THREADED_SEARCH || fPrintTree || fSoloSearch)
+      return;
+
+   QSSERT(!fHelperThread);
+   fStopOwn=false;
+   StartPoolThreads();
+   for (i=1; i<SearchThreadCount(); i++)
+      helpers.push_back(std::shared_ptr<boost::thread>(new boost::thread(HelperSearch, i, CSearchContext(), &fStopOwn, bb, fBlackMove_, mvs, hi, si)));
+}
+
+void StopHelperThreads() {
+   size_t i;
+
+   if (fSoloSearch)
+      return;
+   fStopOwn=true;
+   for (i=0; i<helpers.size(); i++)
+      helpers[i]->join();
+   helpers.clear();
+}
+
+//////////////////////////////////////////////////////
+// Split points (young brothers wait)
+//	The pool threads sleep until some thread opens a split point. They then copy the
+//	split point's position and search its moves through SearchSplitPoint().
+//	A split point stops when a move causes a beta cutoff or the owner aborts; every
+//	thread working below it notices through CheckAbortTime() -> SplitAborted().
+//	The pool threads live until the program exits. They help the split points of any search,
+//	so searches running at once share them.
+//////////////////////////////////////////////////////
+
+static boost::mutex mutexPool;	// protects everything below
+static boost::condition_variable cvPool;
+static vector<CSplitPoint*> spsOpen;	// split points that would take more help
+static volatile int nIdle=0;
+static int nPoolThreads=0;
+
+static TLS CSplitPoint* spCurrent=0;	// split point this thread is searching moves from
+
+CSplitPoint::CSplitPoint(int aheight, CValue aalpha, CValue abeta, int aiPrune, bool afNegascout,
+                         const CMoveValue* amoves, int anMoves, const CMoveValue& abest) :
+   bb(::bb), fBlackMove(fBlackMove_), hBookRead(::hBookRead), pfStopHelpers(&StopFlag()), height(aheight), iPrune(aiPrune), alpha(aalpha), beta(abeta),
+   fNegascout(afNegascout), moves(amoves), nMoves(anMoves), iNext(0), best(abest), fStop(false),
+   nActive(0), parent(0) {
+}
+
+bool CSplitPoint::GetNext(int& index, CValue& vSearchAlpha, bool& afNegascout) {
+   boost::mutex::scoped_lock lock(mutex);
+
+   if (fStop || iNext>=nMoves)
+      return false;
+   index=iNext++;
+   vSearchAlpha=Max(best.value, alpha);
+   afNegascout=fNegascout && best.value>=alpha;
+   return true;
+}
+
+void CSplitPoint::Report(int index, CValue vSearchAlpha, const CMoveValue& mv) {
+   boost::mutex::scoped_lock lock(mutex);
+   CSplitResult result;
+
+   result.index=index;
+   result.vSearchAlpha=vSearchAlpha;
+   result.mv=mv;
+   results.push_back(result);
+   if (mv.value>best.value) {
+      best=mv;
+      if (best.value>=beta)
+         fStop=true;
+   }
+}
+
+bool SplitAvailable() {
+   return nIdle>0 && SearchThreadCount()>1 && !HelpersStopped() && !fPrintTree && !fSoloSearch;
+}
+
+bool SplitAborted() {
+   CSplitPoint* sp;
+
+   for (sp=spCurrent; sp; sp=sp->parent) {
+      if (sp->fStop)
+         return true;
+   }
+   return false;
+}
+
+// find an open split point with moves left and join it. Called with mutexPool locked
+static CSplitPoint* JoinSplitPoint() {
+   vector<CSplitPoint*>::reverse_iterator i;
+
+   // the most recent split point is the deepest, so the quickest to finish
+   for (i=spsOpen.rbegin(); i!=spsOpen.rend(); i++) {
+      CSplitPoint* sp=*i;
+      boost::mutex::scoped_lock lock(sp->mutex);
+      if (!sp->fStop && sp->iNext<sp->nMoves) {
+         sp->nActive++;
+         return sp;
+      }
+   }
+   return 0;
+}
+
+static void PoolWorker() {
+   CSplitPoint* sp;
+
+   fHelperThread=true;
+   boost::mutex::scoped_lock lockPool(mutexPool);
+   for (;;) {
+      sp=JoinSplitPoint();
+      if (!sp) {
+         nIdle++;
+         cvPool.wait(lockPool);
+         nIdle--;
+         continue;
+      }
+      lockPool.unlock();
+
+      abortRound=false;
+      spCurrent=sp;
+      Initialize(sp->bb, sp->fBlackMove);
+      hBookRead=sp->hBookRead;
+      sp->context.Apply();
+      pfStopHelpers=sp->pfStopHelpers;
+      SearchSplitPoint(*sp);
+      spCurrent=0;
+      pfStopHelpers=0;
+      WipeNodeStats();
+      {
+         boost::mutex::scoped_lock lock(sp->mutex);
+         if (--sp->nActive==0)
+            sp->cvDone.notify_all();
+      }
+
+      lockPool.lock();
+   }
+}
+
+static void StartPoolThreads() {
+   boost::mutex::scoped_lock lock(mutexPool);
+
+   for (; nPoolThreads<nSearchThreads-1; nPoolThreads++)
+      boost::thread(PoolWorker).detach();
+}
+
+void SplitSearch(CSplitPoint& sp) {
+   // open the split point and wake the idle threads
+   sp.parent=spCurrent;
+   sp.nActive=1;
+   {
+      boost::mutex::scoped_lock lock(mutexPool);
+      spsOpen.push_back(&sp);
+      cvPool.notify_all();
+   }
+
+   // search moves ourselves
+   spCurrent=&sp;
+   SearchSplitPoint(sp);
+
+   // close the split point so no more threads join
+   {
+      boost::mutex::scoped_lock lock(mutexPool);
+      spsOpen.erase(find(spsOpen.begin(), spsOpen.end(), &sp));
+   }
+
+   // wait for the threads that did join. Keep checking the clock while we wait
+   {
+      boost::mutex::scoped_lock lock(sp.mutex);
+      sp.nActive--;
+      while (sp.nActive) {
+         if (abortRound)
+            sp.fStop=true;
+         sp.cvDone.timed_wait(lock, boost::posix_time::milliseconds(10));
+         if (sp.nActive && !abortRound) {
+            lock.unlock();
+            CheckAbortTime();
+            lock.lock();
+         }
+      }
+   }
+   spCurrent=sp.parent;
+
+   // a beta cutoff stops the split point through abortRound. That isn't an abort for our caller
+   if (abortRound && !HelpersStopped() && !SplitAborted())
+      abortRound=false;
+}
@@ -0,0 +1,123 @@
+// Copyright Chris Welty
+//	All Rights Reserved
+// This file is distributed subject to GNU GPL version 2. See the files
+// Copying.txt and GPL.txt for details.
+
+// Helper threads for the search.
+//	Midgame rounds use lazy SMP helpers.
+//	Solve rounds split nodes among a pool of threads (young brothers wait).
+
+#pragma once
+
+#include "Utils.h"
+#include "Moves.h"
+#include "BitBoard.h"
+#include "Fwd.h"
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// total number of search threads, including the main thread. Set from parameters.txt
+extern int nSearchThreads;
+// threads the searches on this thread may use, including itself. 0 for nSearchThreads.
+//	Set when several searches run at once, such as one per GGS game
+extern TLS int nThreadsShare;
+int SearchThreadCount();
+// don't split nodes with fewer empties than this; the split costs more than it saves
+extern int nEmptySplitMin;
+
+// true in helper threads. Helpers never check the clock or the opponent, they wait for
+//	the search they help to stop them
+extern TLS bool fHelperThread;
+// Each thread that runs searches has a flag that stops its helpers when the search aborts or
+//	finishes. Helpers and split point threads use the flag of the search they work for.
+bool HelpersStopped();
+void SignalStopHelpers();
+// true in threads that run many small searches side by side, such as the book correction
+//	threads. Their searches don't start helpers or split; one thread each is enough.
+extern TLS bool fSoloSearch;
+
+// The search globals that aren't part of the position: the book and the cache (see options.h).
+//	Like the position they are per thread, so a thread that searches for another copies them.
+class CSearchContext {
+public:
+   CSearchContext();	// the current thread's
+   void Apply() const;	// make them the current thread's
+
+private:
+   std::weak_ptr<CBook> book;
+   CCache* cache;
+};
+
+// Start helpers searching the current position. mvs is the root move list.
+//	The helpers only share their work through the cache; their results are discarded.
+void StartHelperThreads(const std::vector<CMoveValue>& mvs, const CHeightInfo& hi, const CSearchInfo& si);
+// Stop the helpers and wait for them to finish. Safe to call if no helpers are running.
+void StopHelperThreads();
+
+//////////////////////////////////////////////////////
+// Split points
+//	Once the first move at a node has been searched, the remaining moves can be
+//	searched in parallel. The thread that owns the node searches moves too, and waits
+//	for the others to finish before returning.
+//////////////////////////////////////////////////////
+
+class CSplitResult {
+public:
+   int index;	// index of the move in the split point's move list
+   CValue vSearchAlpha;	// alpha the move was searched with
+   CMoveValue mv;
+
+   bool operator<(const CSplitResult& b) const { return index<b.index; }
+};
+
+class CSplitPoint {
+public:
+   // the position is the current position
+   CSplitPoint(int height, CValue alpha, CValue beta, int iPrune, bool fNegascout,
+                const CMoveValue* moves, int nMoves, const CMoveValue& best);
+
+   // get the next move to search. Returns false if there are none left or the search was stopped
+   bool GetNext(int& index, CValue& vSearchAlpha, bool& fNegascout);
+   // report the value of a move
+   void Report(int index, CValue vSearchAlpha, const CMoveValue& mv);
+
+   // position
+   CBitBoard bb;
+   bool fBlackMove;
+   int hBookRead;
+   CSearchContext context;
+   volatile bool* pfStopHelpers;	// stop flag of the search that opened the split point
+
+   // search parameters
+   int height, iPrune;
+   CValue alpha, beta;
+   bool fNegascout;
+
+   // moves to search
+   const CMoveValue* moves;
+   int nMoves, iNext;
+
+   // results
+   CMoveValue best;
+   std::vector<CSplitResult> results;
+
+   // true if there was a beta cutoff or the owner aborted
+   volatile bool fStop;
+
+   // threads
+   int nActive;	// number of threads searching moves from this split point
+   CSplitPoint* parent;	// split point the owner was working on when it split
+   boost::mutex mutex;
+   boost::condition_variable cvDone;
+};
+
+// true if there's an idle thread to help at a split point
+bool SplitAvailable();
+// search the moves of the split point, with help from any idle threads
+void SplitSearch(CSplitPoint& sp);
+// true if the split point this thread is working on (or one of its parents) has been stopped
+bool SplitAborted();
+
+// search moves from the split point until none are left. Defined in Pos2.cpp
+void SearchSplitPoint(CSplitPoint& sp);
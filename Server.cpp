@@ -14,15 +14,24 @@
 #include "Commands.h"
 #include "Book.h"
 #include "Player.h"
+#include "BookDelta.h"
+#include "WorkQueue.h"
 
+#include <boost/version.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/asio.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
-#include <boost/circular_buffer.hpp>
 #include <boost/format.hpp>
 #include <boost/algorithm/string/trim.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <functional>
+#include <chrono>
+#include <deque>
+#include <set>
+#include <sstream>
 
 struct is_drawn : public std::unary_function<Variation, bool>
 {
@@ -32,22 +41,6 @@ struct is_drawn : public std::unary_function<Variation, bool>
    }
 };
 
-struct is_in
-{
-   const VariationCollection& variations;
-
-   is_in(const VariationCollection& variations)
-      : variations(variations)
-   {}
-
-   bool operator()(const Variation& variation) const
-   {
-      return std::find(variations.begin(),
-                       variations.end(),
-                       variation)!=variations.end();
-   }
-};
-
 std::pair<double, double> StandardDeviation(VariationCollection::const_iterator begin, VariationCollection::const_iterator end)
 {
    double sum = 0;
@@ -127,106 +120,259 @@ void server_fetch(std::iostream& stream,
    stream << std::flush;
 }
 
+//! A client gets this long for each step of a request: sending it, and reading the reply.
+const long kSessionTimeoutSeconds = 15*60;
+//! Once the listener stops, sessions still running this long are cut off.
+const long kShutdownSeconds = 5*60;
+
+//! Make the stream's operations fail once kSessionTimeoutSeconds have passed.
+void set_timeout(boost::asio::ip::tcp::iostream& stream)
+{
+#if BOOST_VERSION >= 106600
+   stream.expires_after(std::chrono::seconds(kSessionTimeoutSeconds));
+#else
+   stream.expires_from_now(boost::posix_time::seconds(kSessionTimeoutSeconds));
+#endif
+}
+
+//! Give the client another kSessionTimeoutSeconds to read the reply, after the
+//! server took its time working on the request.
+void refresh_timeout(std::iostream& stream)
+{
+   boost::asio::ip::tcp::iostream* tcpStream = dynamic_cast<boost::asio::ip::tcp::iostream*>(&stream);
+   if( tcpStream )
+      set_timeout(*tcpStream);
+}
+
+// The server's book and variation queue. Only the book writer changes them.
+struct server_state
+{
+   server_state(CBookPtr bp, int bounds, bool isS26)
+      : bp(bp),
+        bounds(bounds),
+        isS26(isS26),
+        // changes are numbered from the start of this run. Clients that
+        // synced with an earlier run can't use the numbers and start over
+        idBook(u4(time(0))),
+        // clients should come back about every 15 minutes
+        queue(15*60)
+   {}
+
+   CBookPtr bp;
+   const int bounds;
+   const bool isS26;
+   const u4 idBook;
+   WorkQueue queue;
+};
+
+// correct the book and queue new variations. Variations on lease aren't queued again
+void server_refill(server_state& state)
+{
+   int searches;
+   state.bp->CorrectAll(searches);
+   // the old size heuristics, in units of a typical lease
+   const std::size_t typical = state.queue.TypicalLease();
+   VariationCollection variations;
+   extractVariations(*state.bp, state.bounds, variations, 30*typical, typical);
+   state.queue.Refill(variations);
+}
+
+//////////////////////////////////////////////////////
+// book_writer
+//	Runs the jobs that change the server's book and variation queue, one at a
+//	time and in the order they were posted, so client sessions never change the
+//	book themselves. A job holds the book lock exclusively while it runs;
+//	sessions that read the book take it shared.
+//////////////////////////////////////////////////////
+
+class book_writer
+{
+public:
+
+   typedef std::function<void()> job;
+
+   book_writer()
+      : stopping(false),
+        thread(&book_writer::run, this)
+   {}
+
+   ~book_writer()
+   {
+      stop();
+   }
+
+   // run the job after the ones already posted
+   void post(const job& j)
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      jobs.push_back(j);
+      cvJobs.notify_one();
+   }
+
+   // post the job and wait for it. Exceptions from the job are thrown again here
+   void call(const job& j)
+   {
+      boost::mutex mutexDone;
+      boost::condition_variable cvDone;
+      bool done = false;
+      std::string error;
+
+      post([&]() {
+         try {
+            j();
+         }
+         catch( std::exception& ex ) {
+            error = ex.what();
+         }
+         boost::mutex::scoped_lock lock(mutexDone);
+         done = true;
+         cvDone.notify_all();
+      });
+      boost::mutex::scoped_lock lock(mutexDone);
+      while( !done )
+         cvDone.wait(lock);
+      if( !error.empty() )
+         throw std::runtime_error(error);
+   }
+
+   // run the jobs posted so far, then stop
+   void stop()
+   {
+      {
+         boost::mutex::scoped_lock lock(mutex);
+         stopping = true;
+         cvJobs.notify_one();
+      }
+      if( thread.joinable() )
+         thread.join();
+   }
+
+   boost::shared_mutex& book_mutex()
+   {
+      return bookMutex;
+   }
+
+private:
+
+   void run()
+   {
+      for( ;; ) {
+         job j;
+         {
+            boost::mutex::scoped_lock lock(mutex);
+            while( jobs.empty() && !stopping )
+               cvJobs.wait(lock);
+            if( jobs.empty() )
+               return;
+            j = jobs.front();
+            jobs.pop_front();
+         }
+         try {
+            boost::unique_lock<boost::shared_mutex> lock(bookMutex);
+            j();
+         }
+         catch( std::exception& ex ) {
+            std::cerr << ex.what() << std::endl;
+         }
+      }
+   }
+
+   boost::mutex mutex;   // protects jobs and stopping
+   boost::condition_variable cvJobs;
+   std::deque<job> jobs;
+   bool stopping;
+   boost::shared_mutex bookMutex;
+   boost::thread thread;   // last, it starts running in the constructor
+};
+
 void server_fetch2(std::iostream& stream,
-                   const CBook& serverBook,
-                   VariationCollection& variations,
-                   const std::size_t varToSend,
-                   const std::size_t maxVariations,
-                   bool isS26)
+                   const std::string& command,
+                   server_state& state,
+                   book_writer& writer)
 {
-   std::size_t linesToSend = std::min(varToSend, variations.size());
-   Log(std::cout)
-      << "Sending "
-      << linesToSend
-      << " variations to client ("
-      << variations.size()
-      << " in queue)."
-      << std::endl
-      ;
+   // fetch2 <client name>
+   std::string clientName = boost::algorithm::trim_copy(command.substr(FETCH2_COMMAND.size()));
+   if( clientName.empty() )
+      clientName = "unknown";
 
-   // extract variations and book
-   VariationCollection subCollection
-      = VariationCollection(variations.begin(), variations.begin()+linesToSend);
-   variations.erase(variations.begin(), variations.begin()+linesToSend);
+   // lease variations to the client, and take the positions it needs
+   VariationCollection subCollection;
    CBookPtr bookExtract;
-   if( isS26 ) {
-      struct null_deleter {
-         void operator()(void*) const {}
-      };
-      bookExtract.reset(&const_cast<CBook&>(serverBook), null_deleter());
+   writer.call([&]() {
+      // rather wait for a refill than leave the client idle
+      if( state.queue.Waiting()==0 )
+         server_refill(state);
+      subCollection = state.queue.Lease(clientName);
+      if( !state.isS26 )
+         bookExtract = state.bp->ExtractPositions(subCollection);
+   });
+
+   refresh_timeout(stream);
+   if( state.isS26 ) {
+      // writing the whole book unpacks it, nothing else may use it meanwhile.
+      // Serialize into memory and send after releasing the lock, so a slow
+      // client doesn't hold up the others.
+      std::stringstream reply(std::ios::in | std::ios::out | std::ios::binary);
+      {
+         boost::unique_lock<boost::shared_mutex> lock(writer.book_mutex());
+         FetchCommand command(*state.bp, subCollection);
+         boost::archive::binary_oarchive oa(reply);
+         oa << command;
+      }
+      refresh_timeout(stream);
+      stream << reply.rdbuf();
    }
    else {
-      bookExtract = serverBook.ExtractPositions(subCollection);
+      FetchCommand command(*bookExtract, subCollection);
+      boost::archive::binary_oarchive oa(stream);
+      oa << command;
    }
-
-   FetchCommand command(*bookExtract, subCollection);
-   boost::archive::binary_oarchive oa(stream);
-   oa << command;
-
    stream << std::flush;
+
+   writer.post([&state]() {
+      if( state.queue.RunningLow() )
+         server_refill(state);
+   });
 }
 
 void server_sync(std::iostream& stream,
-                 CBook& computerBook,
-                 const int bounds,
-                 VariationCollection& variations,
-                 const std::size_t maxVariations,
-                 const std::size_t startCount,
-                 std::size_t& varToSend,
-                 bool isS26)
+                 server_state& state,
+                 book_writer& writer)
 {
-   const std::string joinBook("Coefficients/join.book");
-   const std::string oldJoinBook = joinBook + ".old";
-   ::remove(oldJoinBook.c_str());
-   ::rename(joinBook.c_str(), oldJoinBook.c_str());
-   CBook clientBook(joinBook.c_str(), no_save);
+   std::shared_ptr<CBook> clientBook(new CBook(0, no_save));
    Log(std::cout)
       << "Receiving book..."
       << std::endl
       ;
-   boost::archive::binary_iarchive ia(stream);
-   ia >> clientBook;
-   // prune clientBook from low-ply positions
-   clientBook.Prune(computerBook.GetPruneHeight());
+   {
+      boost::archive::binary_iarchive ia(stream);
+      ia >> *clientBook;
+   }
    Log(std::cout)
       << "Done"
       << std::endl
       ;
-   Log(std::cout)
-      << "Joining books..."
-      << std::endl
-      ;
-   computerBook.JoinBook(clientBook);
-   computerBook.Prune();
-   Log(std::cout)
-      << "Done. Book contains "
-      << computerBook.Positions()
-      << " positions."
-      << std::endl
-      ;
-   // save book
-   computerBook.Mirror();
-   //// filter variations, remove those that are in book already
-   //VariationCollection::iterator it
-   //   = std::remove_if(variations.begin(), variations.end(), has_all_deviations(computerBook));
-   //if( it!=variations.end() ) {
-   //   int filteredVariations = std::distance(it, variations.end());
-   //   variations.erase(it, variations.end());
-   //   Log(std::cout)
-   //      << "Filtered "
-   //      << filteredVariations
-   //      << " variations that are in book already."
-   //      << std::endl;
-   //}
-   // extract variations if necessary
-   if( variations.size()<varToSend ) {
-      int searches;
-      computerBook.CorrectAll(searches);
-      extractVariations(computerBook, bounds, variations, maxVariations, startCount);
-      // adjust varToSend to allow faster processing of first few
-      // lines, which are probably mostly endsolve lines anyway
-      varToSend = 5U;
-   }
+   writer.post([&state, clientBook]() {
+      CBook& computerBook = *state.bp;
+      // prune clientBook from low-ply positions
+      clientBook->Prune(computerBook.GetPruneHeight());
+      Log(std::cout)
+         << "Joining books..."
+         << std::endl
+         ;
+      computerBook.JoinBook(*clientBook);
+      computerBook.Prune();
+      Log(std::cout)
+         << "Done. Book contains "
+         << computerBook.Positions()
+         << " positions."
+         << std::endl
+         ;
+      // save book
+      computerBook.Mirror();
+      if( state.queue.RunningLow() )
+         server_refill(state);
+   });
 }
 
 void UpdateStats(const std::string& clientName, std::size_t inc)
@@ -252,282 +398,359 @@ void UpdateStats(const std::string& clientName, std::size_t inc)
    out << total + inc;
 }
 
+// save the book after a client's positions were joined into it, close the
+// client's lease, and extract new variations if the queue runs low
+void server_sync_finish(const VariationCollection& clientVariations,
+                        std::size_t positionsBeforeMerge,
+                        const std::string& clientName,
+                        server_state& state)
+{
+   CBook& computerBook = *state.bp;
+   computerBook.Prune();
+   std::size_t positionsAfterMerge = computerBook.Positions();
+   Log(std::cout)
+      << boost::format("Done. Book contains %1% positions.")
+      % positionsAfterMerge
+      << std::endl
+      ;
+   // save book
+   computerBook.Mirror();
+   UpdateStats(clientName, positionsAfterMerge > positionsBeforeMerge ? positionsAfterMerge - positionsBeforeMerge : 0);
+   state.queue.Complete(clientName, clientVariations);
+   if( state.queue.RunningLow() )
+      server_refill(state);
+}
+
 template<class SyncCommand>
-void server_sync_common(SyncCommand& syncCommand,
-                        std::iostream& stream,
-                        CBook& clientBook,
-                        CBook& computerBook,
-                        const int bounds,
-                        VariationCollection& variations,
-                        const std::size_t maxVariations,
-                        std::size_t& varToSend,
+void server_sync_common(std::iostream& stream,
                         const std::string& clientName,
-                        std::size_t startCount)
+                        server_state& state,
+                        book_writer& writer)
 {
+   std::shared_ptr<CBook> clientBook(new CBook(0, no_save));
+   std::shared_ptr<SyncCommand> syncCommand(new SyncCommand(*clientBook));
    Log(std::cout)
       << "Receiving book..."
       << std::endl
       ;
-   boost::archive::binary_iarchive ia(stream);
-   ia >> syncCommand;
-   // prune clientBook from low-ply positions
-   clientBook.Prune(computerBook.GetPruneHeight());
+   {
+      boost::archive::binary_iarchive ia(stream);
+      ia >> *syncCommand;
+   }
    Log(std::cout)
       << boost::format("Done. Finished %1% variations.")
-      % syncCommand.GetVariations().size()
+      % syncCommand->GetVariations().size()
       << std::endl
       ;
+   writer.post([&state, clientBook, syncCommand, clientName]() {
+      CBook& computerBook = *state.bp;
+      // prune clientBook from low-ply positions
+      clientBook->Prune(computerBook.GetPruneHeight());
+      Log(std::cout)
+         << "Joining books..."
+         << std::endl
+         ;
+      // number of positions before merge
+      std::size_t positionsBeforeMerge = computerBook.Positions();
+      computerBook.JoinBook(*clientBook);
+      server_sync_finish(syncCommand->GetVariations(), positionsBeforeMerge, clientName, state);
+   });
+}
+
+void server_sync4(std::iostream& stream,
+                  const std::string& command,
+                  server_state& state,
+                  book_writer& writer)
+{
+   // sync4 <client name> <book id> <next change>
+   std::istringstream args(command.substr(SYNC4_COMMAND.size()));
+   std::string clientName;
+   u4 idClientBook = 0;
+   std::size_t iFrom = 0;
+   args >> clientName >> idClientBook >> iFrom;
+
    Log(std::cout)
-      << "Joining books..."
+      << "Receiving changes..."
       << std::endl
       ;
-   // number of positions before merge
-   std::size_t positionsBeforeMerge = computerBook.Positions();
-   computerBook.JoinBook(clientBook);
-   computerBook.Prune();
-   std::size_t positionsAfterMerge = computerBook.Positions();
+   std::shared_ptr<CBook> clientBook(new CBook(0, no_save));
+   CBookDeltaHeader header;
+   CBookDeltaStats received = ReadBookDelta(stream, *clientBook, 0, header);
+   std::shared_ptr<VariationCollection> clientVariations(new VariationCollection);
+   {
+      boost::archive::binary_iarchive ia(stream);
+      ia >> *clientVariations;
+   }
    Log(std::cout)
-      << boost::format("Done. Book contains %1% positions.")
-      % positionsAfterMerge
+      << boost::format("Done. Received %1% positions (%2% bytes). Finished %3% variations.")
+      % received.nPositions % received.nBytes % clientVariations->size()
       << std::endl
       ;
-   // save book
-   computerBook.Mirror();
-   UpdateStats(clientName, positionsAfterMerge > positionsBeforeMerge ? positionsAfterMerge - positionsBeforeMerge : 0);
-   // filter variations, remove those that are in book already
-   VariationCollection::iterator it
-      = std::remove_if(variations.begin(),
-                       variations.end(),
-                       is_in(syncCommand.GetVariations()));
-   if( it!=variations.end() ) {
-      int filteredVariations = std::distance(it, variations.end());
-      variations.erase(it, variations.end());
-      Log(std::cout)
-         << "Filtered "
-         << filteredVariations
-         << " variations that are in book already."
-         << std::endl;
-   }
-   // extract variations if necessary
-   if( variations.size()<varToSend ) {
-      int searches;
-      computerBook.CorrectAll(searches);
-      extractVariations(computerBook, bounds, variations, maxVariations, startCount);
-      // adjust varToSend to allow faster processing of first few
-      // lines, which are probably mostly endsolve lines anyway
-      varToSend = startCount;
-   }
-}
 
-void server_sync2(std::iostream& stream,
-                  CBook& computerBook,
-                  const int bounds,
-                  VariationCollection& variations,
-                  const std::size_t maxVariations,
-                  std::size_t& varToSend,
-                  bool isS26,
-                  const std::string& clientName,
-                  std::size_t startCount)
-{
-   const std::string joinBook("Coefficients/join.book");
-   const std::string oldJoinBook = joinBook + ".old";
-   ::remove(oldJoinBook.c_str());
-   ::rename(joinBook.c_str(), oldJoinBook.c_str());
-   CBook clientBook(joinBook.c_str(), no_save);
-   SyncCommand syncCommand(clientBook);
-   server_sync_common(syncCommand, stream, clientBook, computerBook, bounds, variations, maxVariations, varToSend, clientName, startCount);
-}
+   // join the positions, and collect what changed since the client's last sync
+   // but not what it just sent. A client that hasn't synced with this run of
+   // the server starts from here.
+   std::size_t positionsBeforeMerge = 0;
+   std::stringstream reply(std::ios::in | std::ios::out | std::ios::binary);
+   CBookDeltaStats sent;
+   writer.call([&]() {
+      CBook& computerBook = *state.bp;
+      clientBook->Prune(computerBook.GetPruneHeight());
+      positionsBeforeMerge = computerBook.Positions();
+      std::size_t nChangesBefore = computerBook.NChanges();
+      computerBook.JoinBook(*clientBook);
+      if( idClientBook!=state.idBook || iFrom>nChangesBefore )
+         iFrom = nChangesBefore;
+      // the changes the client hasn't seen were dropped from the list, send it the whole book
+      if( iFrom<computerBook.FirstChange() )
+         sent = WriteBookFull(reply, computerBook, state.idBook, computerBook.NChanges(), true);
+      else
+         sent = WriteBookDelta(reply, computerBook, state.idBook, iFrom, nChangesBefore, computerBook.NChanges(), true);
+   });
+   refresh_timeout(stream);
+   stream << reply.rdbuf() << std::flush;
+   Log(std::cout)
+      << boost::format("Sent %1% positions (%2% bytes).")
+      % sent.nPositions % sent.nBytes
+      << std::endl
+      ;
 
-void server_sync3(std::iostream& stream,
-                  CBook& computerBook,
-                  const int bounds,
-                  VariationCollection& variations,
-                  const std::size_t maxVariations,
-                  std::size_t& varToSend,
-                  bool isS26,
-                  const std::string& clientName,
-                  std::size_t startCount)
-{
-   const std::string joinBook("Coefficients/join.book");
-   const std::string oldJoinBook = joinBook + ".old";
-   ::remove(oldJoinBook.c_str());
-   ::rename(joinBook.c_str(), oldJoinBook.c_str());
-   CBook clientBook(joinBook.c_str(), no_save);
-   SyncCommand2 syncCommand(clientBook);
-   server_sync_common(syncCommand, stream, clientBook, computerBook, bounds, variations, maxVariations, varToSend, clientName, startCount);
+   writer.post([&state, clientVariations, positionsBeforeMerge, clientName]() {
+      server_sync_finish(*clientVariations, positionsBeforeMerge, clientName, state);
+   });
 }
 
-void server_merge(std::iostream& stream, const CBook& book)
+void server_merge(std::iostream& stream, server_state& state, book_writer& writer)
 {
-   boost::archive::binary_oarchive oa(stream);
    Log(std::cout)
       << "Sending book..."
       << std::endl
       ;
-   oa << book;
+   // writing the whole book unpacks it, nothing else may use it meanwhile.
+   // Serialize into memory and send after releasing the lock.
+   std::stringstream reply(std::ios::in | std::ios::out | std::ios::binary);
+   {
+      boost::unique_lock<boost::shared_mutex> lock(writer.book_mutex());
+      boost::archive::binary_oarchive oa(reply);
+      oa << *state.bp;
+   }
+   refresh_timeout(stream);
+   stream << reply.rdbuf() << std::flush;
    Log(std::cout)
       << "Done"
       << std::endl
       ;
 }
 
-struct acceptor;
-typedef std::shared_ptr<acceptor> acceptor_ptr;
-
-struct acceptor
+void server_merge2(std::iostream& stream, const std::string& command, server_state& state, book_writer& writer)
 {
-   boost::asio::io_service io_service;
-   boost::asio::ip::tcp::acceptor accept;
-
-   static acceptor_ptr create(int port)
+   // merge2 <client name> <book id> <next change>
+   std::istringstream args(command.substr(MERGE2_COMMAND.size()));
+   std::string clientName;
+   u4 idClientBook = 0;
+   std::size_t iFrom = 0;
+   args >> clientName >> idClientBook >> iFrom;
+
+   // build the reply under the lock, send it after releasing the lock
+   std::stringstream reply(std::ios::in | std::ios::out | std::ios::binary);
+   CBookDeltaStats sent;
    {
-      return acceptor_ptr(new acceptor(port));
+      boost::shared_lock<boost::shared_mutex> lock(writer.book_mutex());
+      const CBook& book = *state.bp;
+      if( idClientBook==state.idBook && iFrom>=book.FirstChange() && iFrom<=book.NChanges() ) {
+         Log(std::cout)
+            << "Sending changes..."
+            << std::endl
+            ;
+         sent = WriteBookDelta(reply, book, state.idBook, iFrom, book.NChanges(), book.NChanges(), true);
+      }
+      else {
+         Log(std::cout)
+            << "Sending book..."
+            << std::endl
+            ;
+         sent = WriteBookFull(reply, book, state.idBook, book.NChanges(), true);
+      }
    }
+   refresh_timeout(stream);
+   stream << reply.rdbuf() << std::flush;
+   Log(std::cout)
+      << boost::format("Done. Sent %1% positions (%2% bytes).")
+      % sent.nPositions % sent.nBytes
+      << std::endl
+      ;
+}
 
-private:
+//////////////////////////////////////////////////////
+// server_listener
+//	Accepts clients asynchronously and talks to each one in its own session
+//	thread, so a slow client doesn't keep the others waiting. Each step of a
+//	session times out (kSessionTimeoutSeconds), so a client that stalls can't
+//	hold its thread, or the server's shutdown, forever.
+//////////////////////////////////////////////////////
 
-   acceptor(int server_port)
-      : accept(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), server_port))
+class server_listener
+{
+public:
+
+   server_listener(int server_port, server_state& state, book_writer& writer)
+      : acceptor(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), server_port)),
+        deadline(io_service),
+        server_port(server_port),
+        state(state),
+        writer(writer),
+        nSessions(0)
    {}
-};
 
-int server(int server_port, CComputerDefaults cd1, int bounds, bool isS26)
-{
-   int success = EXIT_SUCCESS;
-   CPlayerComputerPtr computer = CPlayerComputer::Create(cd1, false);
-   CBookPtr bp = computer->book.lock();
-   if (!bp) {
-      cerr << "ERR: You need a book to use Expand mode\n";
-      return EXIT_FAILURE;
-   }
-#if !defined(_DEBUG)
+   // accept clients until one says quit or the time is up, then wait for the sessions to end
+   void run(long seconds)
    {
-      int searches;
-      bp->CorrectAll(searches);
+      deadline.expires_from_now(boost::posix_time::seconds(seconds));
+      deadline.async_wait([this](const boost::system::error_code& error) {
+         if( !error )
+            io_service.stop();
+      });
+      start_accept();
+      Log(std::cout) << "Waiting for clients to connect on port " << server_port << "." << std::endl;
+      io_service.run();
+
+      // sessions still talking to a client by the deadline are cut off; those waiting for
+      // the book writer end once it has done their job
+      boost::mutex::scoped_lock lock(mutex);
+      boost::system_time tShutdown = boost::get_system_time()+boost::posix_time::seconds(kShutdownSeconds);
+      bool cutOff = false;
+      while( nSessions ) {
+         if( cutOff )
+            cvSessions.wait(lock);
+         else if( !cvSessions.timed_wait(lock, tShutdown) && nSessions ) {
+            Log(std::cout) << "Closing " << nSessions << " sessions that didn't end in time." << std::endl;
+            for( auto& stream : streams ) {
+               boost::system::error_code ignored;
+               stream->rdbuf()->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+            }
+            cutOff = true;
+         }
+      }
    }
-#endif
 
-   std::size_t startCount = 5U;
-   std::size_t varToSend = startCount;
-   bool increaseStartCount = false;
-   // try to keep maxVariations 30 times varToSend, or more
-   std::size_t maxVariations = 30*varToSend;
-   VariationCollection variations;
-   extractVariations(*bp, bounds, variations, maxVariations, startCount);
-
-   // this timer is used to control fetch&sync times, not too often
-   // and not too seldom
-   Timer<double> timer;
-   // drop out after a long time, to enable
-   // updates of the exe for example
-   Timer<double> totalTimer;
-
-   boost::circular_buffer<double> timeHistory(20);
-   // adjust slowly by starting with an hour average
-   timeHistory.push_back(3600);
-
-   bool keepRunning = true;
-
-   using boost::asio::ip::tcp;
+private:
 
-   acceptor_ptr acceptor = acceptor::create(server_port);
+   void start_accept()
+   {
+      std::shared_ptr<boost::asio::ip::tcp::iostream> stream(new boost::asio::ip::tcp::iostream);
+      acceptor.async_accept(*stream->rdbuf(), [this, stream](const boost::system::error_code& error) {
+         if( error==boost::asio::error::operation_aborted )
+            return;
+         if( error ) {
+            std::cerr << error.message() << std::endl;
+         }
+         else {
+            set_timeout(*stream);
+            boost::mutex::scoped_lock lock(mutex);
+            nSessions++;
+            streams.insert(stream);
+            boost::thread(&server_listener::session, this, stream).detach();
+         }
+         start_accept();
+      });
+   }
 
-   // 1 day
-   while( keepRunning && totalTimer.elapsed()<24*3600 ) {
+   void session(std::shared_ptr<boost::asio::ip::tcp::iostream> stream)
+   {
       try {
-         Log(std::cout) << "Waiting for client to connect on port " << server_port << "." << std::endl;
-         tcp::iostream stream;
-         acceptor->accept.accept(*stream.rdbuf());
          Log(std::cout) << "Client connected." << std::endl;
-
          std::string command;
-         if( std::getline(stream, command) ) {
+         if( std::getline(*stream, command) ) {
             boost::algorithm::trim(command);
             Log(std::cout) << "Received from client: " << command << std::endl;
-            if( command.substr(0, SYNC3_COMMAND.size())==SYNC3_COMMAND ) {
+            if( command.substr(0, SYNC4_COMMAND.size())==SYNC4_COMMAND ) {
+               server_sync4(*stream, command, state, writer);
+            }
+            else if( command.substr(0, SYNC3_COMMAND.size())==SYNC3_COMMAND ) {
                std::string clientName = command.substr(SYNC3_COMMAND.size()+1);
-               server_sync3(stream, *bp, bounds, variations, maxVariations, varToSend, isS26, clientName, startCount);
-               stream.close();
+               server_sync_common<SyncCommand2>(*stream, clientName, state, writer);
             }
             else if( command.substr(0, SYNC2_COMMAND.size())==SYNC2_COMMAND ) {
                std::string clientName = command.substr(SYNC2_COMMAND.size()+1);
-               server_sync2(stream, *bp, bounds, variations, maxVariations, varToSend, isS26, clientName, startCount);
-               stream.close();
+               server_sync_common<SyncCommand>(*stream, clientName, state, writer);
             }
             else if( command.substr(0, SYNC_COMMAND.size())==SYNC_COMMAND ) {
-               server_sync(stream, *bp, bounds, variations, maxVariations, startCount, varToSend, isS26);
-               stream.close();
+               server_sync(*stream, state, writer);
             }
             else if( command.substr(0, FETCH2_COMMAND.size())==FETCH2_COMMAND ) {
-               server_fetch2(stream, *bp, variations, varToSend, maxVariations, isS26);
-               stream.close();
-               // extract variations if necessary
-               if( variations.size()<varToSend ) {
-                  int searches;
-                  bp->CorrectAll(searches);
-                  extractVariations(*bp, bounds, variations, maxVariations, startCount);
-                  if( increaseStartCount )
-                     startCount = (std::size_t)std::max(startCount + 2., startCount * 1.1);
-                  else
-                     startCount = std::max(5U, startCount - 2);
-                  Log(std::cout) << "Start count adjusted to " << startCount << std::endl;
-                  varToSend = startCount;
-                  increaseStartCount = true;
-               }
-               timeHistory.push_back(timer.elapsed());
-               // compute mean sync time
-               std::vector<double> times(timeHistory.begin(), timeHistory.end());
-               std::sort(times.begin(), times.end());
-               double meanTime = times.at(times.size()/2);
-               Log(std::cout) << "Mean sync time is " << static_cast<int>(meanTime) << " seconds." << std::endl;
-               // try to adjust varToSend so that time between fetches is around 15 minutes
-               int drawnVariations = std::count_if(variations.begin(), variations.end(), is_drawn());
-               if( drawnVariations<5 ) {
-                  if( meanTime<10*60 ) {
-                     varToSend += 2;
-                  }
-                  else if( meanTime>20*60 ) {
-                     increaseStartCount = false;
-                     varToSend -= 2;
-                  }
-                  else  {
-                     increaseStartCount = false;
-                  }
-
-                  // never less than 5
-                  varToSend = std::max(5U, varToSend);
-                  // keep maxVariations at 30 times varToSend, or more
-                  maxVariations = std::max(30*varToSend, maxVariations);
-                  Log(std::cout) << "Adjusted varToSend to " << varToSend << " and maxVariations to " << maxVariations << std::endl;
-               }
-               else {
-                  Log(std::cout) << boost::format("%1% draws remaining in queue") % drawnVariations << std::endl;
-               }
-               // reset timer
-               timer.start();
+               server_fetch2(*stream, command, state, writer);
             }
             else if( command.substr(0, FETCH_COMMAND.size())==FETCH_COMMAND ) {
                Log(std::cout) << "Client needs upgrade." << std::endl;
-               stream.close();
-               //acceptor.reset();
+            }
+            else if( command.substr(0, MERGE2_COMMAND.size())==MERGE2_COMMAND ) {
+               Log(std::cout) << "Client requests changes." << std::endl;
+               server_merge2(*stream, command, state, writer);
             }
             else if( command.substr(0, MERGE_COMMAND.size())==MERGE_COMMAND ) {
                Log(std::cout) << "Client requests merge." << std::endl;
-               server_merge(stream, *bp);
-               stream.close();
-               //acceptor.reset();
+               server_merge(*stream, state, writer);
                Log(std::cout) << "Sent book to client for merging." << std::endl;
             }
             else if( command.substr(0, QUIT_COMMAND.size())==QUIT_COMMAND ) {
-               keepRunning = false;
+               io_service.stop();
             }
          }
+         stream->close();
       }
-      catch( std::exception& ex )
-      {
+      catch( std::exception& ex ) {
          std::cerr << ex.what() << std::endl;
       }
+
+      boost::mutex::scoped_lock lock(mutex);
+      streams.erase(stream);
+      if( --nSessions==0 )
+         cvSessions.notify_all();
+   }
+
+   boost::asio::io_service io_service;
+   boost::asio::ip::tcp::acceptor acceptor;
+   boost::asio::deadline_timer deadline;
+   const int server_port;
+   server_state& state;
+   book_writer& writer;
+   boost::mutex mutex;   // protects nSessions and streams
+   boost::condition_variable cvSessions;
+   int nSessions;
+   std::set<std::shared_ptr<boost::asio::ip::tcp::iostream> > streams;   // of the sessions running
+};
+
+int server(int server_port, CComputerDefaults cd1, int bounds, bool isS26)
+{
+   int success = EXIT_SUCCESS;
+   CPlayerComputerPtr computer = CPlayerComputer::Create(cd1, false);
+   CBookPtr bp = computer->book.lock();
+   if (!bp) {
+      cerr << "ERR: You need a book to use Expand mode\n";
+      return EXIT_FAILURE;
+   }
+#if !defined(_DEBUG)
+   {
+      int searches;
+      bp->CorrectAll(searches);
+   }
+#endif
+
+   server_state state(bp, bounds, isS26);
+   {
+      VariationCollection variations;
+      extractVariations(*bp, bounds, variations, 30*state.queue.TypicalLease(), state.queue.TypicalLease());
+      state.queue.Refill(variations);
+   }
+
+   book_writer writer;
+   {
+      server_listener listener(server_port, state, writer);
+      // drop out after a long time, to enable
+      // updates of the exe for example. 1 day
+      listener.run(24*3600);
    }
+   writer.stop();
    bp->Write();
 
    return success;
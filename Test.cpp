@@ -23,8 +23,16 @@
 #include <string>
 #include <iomanip>
 #include "off.h"
+#include "SearchThreads.h"
+#include "MovesSimd.h"
+#include "Book.h"
+#include "BookDelta.h"
+#include "timer.h"
+#include <sstream>
+#include <boost/archive/binary_oarchive.hpp>
 
 extern int iff;
+extern string fnOpening;
 
 //////////////////////////////////////////
 // Test parameters
@@ -214,7 +222,7 @@ void TestMidgameSpeed(int nEmpty, CHeightInfo hi, int nGames, int flags) {
 
    // print header info
    if (flags&kPrintTestHeader) {
-      cout << "Testing midgame from " << nEmpty << " empties\n";
+      cout << "Testing midgame from " << nEmpty << " empties, " << SimdMovesName() << " moves\n";
       cout << hi << "\n";
    }
    else {
@@ -366,6 +374,14 @@ void TestEvaluator() {
       v= peval->EvalMobs(nMovesPlayer, nMovesOpponent);
       cout << "\nValue = " << v << "\n";
 
+      // the batch evaluator must agree
+      CEvalLeaf leaf;
+      CValue vBatch;
+      GetEvalLeaf(leaf, nMovesPlayer, nMovesOpponent);
+      peval->EvalMobsBatch(&leaf, 1, nEmpty_, &vBatch);
+      if (vBatch!=v)
+         cout << "Batch value = " << vBatch << " doesn't match\n";
+
       // get ids
       GetIDsJ(ids);
       cout << "========= GetIDsJ =============\n";
@@ -604,7 +620,8 @@ const int nEndgames = sizeof(bds)/sizeof(bds[0]);
 #define PD(x)
 #endif
 
-void TestEndgameAccuracy(){
+// solve the endgame test positions, return the nodes and time taken
+static CNodeStats SolveEndgames(){
    int i;
    CNodeStats start,end, start1,end1,delta1;
    CValue value;
@@ -654,15 +671,258 @@ void TestEndgameAccuracy(){
 
    end.Read();
    cout << end-start << "\n";
+   return end-start;
+}
+
+// solve the endgame test positions. If there are several search threads, solve them
+//	with one thread first and report the speedup.
+void TestEndgameAccuracy(){
+   int nThreads=nSearchThreads;
+   double tSerial, tParallel;
+
+   if (nThreads>1) {
+      nSearchThreads=1;
+      cout << "Solving with 1 thread\n";
+      tSerial=SolveEndgames().Seconds();
+      nSearchThreads=nThreads;
+      cout << "Solving with " << nThreads << " threads\n";
+   }
+   tParallel=SolveEndgames().Seconds();
+   if (nThreads>1)
+      cout << "Speedup with " << nThreads << " threads: " << tSerial/tParallel << "\n";
+}
+
+//////////////////////////////////////////
+// SIMD move generation
+//	Solve the endgame test positions with the scalar move generator and then with the SIMD one
+//	and print the nodes/sec of each.
+//
+//	Run as "ntest ts <params>".
+//////////////////////////////////////////
+
+void TestEndgameSimd(){
+   u64 (*pSimd)(u64 p, u64 o)=pSimdMoves;
+   double nps[2];
+
+   if (!pSimd) {
+      cout << "No SIMD move generator on this processor\n";
+      return;
+   }
+   for (int i=0; i<2; i++) {
+      pSimdMoves=i?pSimd:0;
+      cout << "Solving with " << (i?SimdMovesName():"scalar") << " moves\n";
+      CNodeStats delta=SolveEndgames();
+      nps[i]=delta.Nodes()/delta.Seconds();
+   }
+   pSimdMoves=pSimd;
+   cout << "scalar: " << nps[0]*1e-6 << " MN/s, " << SimdMovesName() << ": " << nps[1]*1e-6 << " MN/s. Speedup " << nps[1]/nps[0] << "\n";
 }
 
 extern bool fPrintMoveSearch;
 
+//////////////////////////////////////////
+// Compact coefficients
+//	Load the JA coefficients in the full and the compact format, check that they value the
+//	positions of random games the same, and time the batch evaluator with each.
+//	Run as "ntest tc <params> <nGames>".
+//////////////////////////////////////////
+
+void TestCompactCoeffs(int nGames) {
+   vector<CEvalLeaf> leaves[60];
+   CQPosition pos;
+   CMoves moves;
+   CMove move, moveList[NN];
+   CEvalLeaf leaf;
+   u4 nMovesPlayer, nMovesOpponent;
+   CValue vFull, vCompact;
+   int iGame, nMoves, nEmpty, iRepeat, nPositions, nMismatches;
+   size_t i;
+   double tFull, tCompact;
+   vector<CValue> values;
+   const int nRepeats=20;
+
+   CEvaluatorJ* pFull=dynamic_cast<CEvaluatorJ*>(CEvaluator::Create('J', 'A', false));
+   CEvaluatorJ* pCompact=dynamic_cast<CEvaluatorJ*>(CEvaluator::Create('J', 'A', true));
+   if (!pCompact->Compact())
+      cout << "The coefficients couldn't be made compact, comparing two full evaluators\n";
+
+   // both colors to move, all stages
+   srand(1);
+   nPositions=nMismatches=0;
+   for (iGame=0; iGame<nGames; iGame++) {
+      pos.Initialize();
+      while (pos.CalcMovesAndPass(moves)<2) {
+         Initialize(pos.BitBoard(), pos.BlackMove());
+         CalcMobility(nMovesPlayer, nMovesOpponent);
+         vFull=pFull->EvalMobs(nMovesPlayer, nMovesOpponent);
+         vCompact=pCompact->EvalMobs(nMovesPlayer, nMovesOpponent);
+         if (vFull!=vCompact) {
+            if (nMismatches++<10)
+               cout << "Game " << iGame << ", " << nEmpty_ << " empties: full " << vFull << ", compact " << vCompact << "\n";
+         }
+         GetEvalLeaf(leaf, nMovesPlayer, nMovesOpponent);
+         leaves[nEmpty_].push_back(leaf);
+         nPositions++;
+
+         for (nMoves=0; moves.GetNext(move); nMoves++)
+            moveList[nMoves]=move;
+         pos.MakeMove(moveList[rand()%nMoves]);
+      }
+   }
+   cout << nPositions << " positions, " << nMismatches << " valued differently\n";
+
+   // the batches, as the search evaluates leaves
+   Timer<double> timer;
+   for (iRepeat=0; iRepeat<nRepeats; iRepeat++) {
+      for (nEmpty=0; nEmpty<60; nEmpty++) {
+         values.resize(leaves[nEmpty].size());
+         for (i=0; i<leaves[nEmpty].size(); i+=16)
+            pFull->EvalMobsBatch(&leaves[nEmpty][i], int(Min(leaves[nEmpty].size()-i, size_t(16))), nEmpty, &values[i]);
+      }
+   }
+   tFull=timer.elapsed();
+   timer.start();
+   for (iRepeat=0; iRepeat<nRepeats; iRepeat++) {
+      for (nEmpty=0; nEmpty<60; nEmpty++) {
+         values.resize(leaves[nEmpty].size());
+         for (i=0; i<leaves[nEmpty].size(); i+=16)
+            pCompact->EvalMobsBatch(&leaves[nEmpty][i], int(Min(leaves[nEmpty].size()-i, size_t(16))), nEmpty, &values[i]);
+      }
+   }
+   tCompact=timer.elapsed();
+   cout << "full: " << tFull*1e9/Max(nPositions*nRepeats, 1) << " ns per eval, compact: "
+        << tCompact*1e9/Max(nPositions*nRepeats, 1) << " ns per eval\n";
+
+   delete pFull;
+   delete pCompact;
+}
+
+//////////////////////////////////////////
+// Book speed
+//	Load a book into memory and look up the positions of random games in it.
+//	Run as "ntest tb <params> <nGames> <book file>".
+//	Random games leave the book within a few moves, so this times both hits and misses.
+//////////////////////////////////////////
+
+void TestBookSpeed(const char* fn, int nGames) {
+   vector<CBitBoard> boards;
+   CQPosition pos;
+   CMoves moves;
+   CMove move, moveList[NN];
+   int iGame, nMoves, nHits, iPass;
+   size_t i;
+   double tLoad, tJoin, tLookup;
+
+   if (!fn || !*fn) {
+      cerr << "Usage: ntest tb <params> <nGames> <book file>\n";
+      return;
+   }
+   srand(1);
+   for (iGame=0; iGame<nGames; iGame++) {
+      pos.Initialize();
+      while ((iPass=pos.CalcMovesAndPass(moves))<2) {
+         boards.push_back(pos.BitBoard());
+         for (nMoves=0; moves.GetNext(move); nMoves++)
+            moveList[nMoves]=move;
+         pos.MakeMove(moveList[rand()%nMoves]);
+      }
+   }
+
+   Timer<double> timer;
+   CBook book(fn, no_save);
+   // a version 2 book is mapped; read it into memory so the in-memory tables are timed
+   CBook bookMemory(0, no_save);
+   tLoad=timer.elapsed();
+   timer.start();
+   bookMemory.JoinBook(book);
+   tJoin=timer.elapsed();
+
+   timer.start();
+   nHits=0;
+   const CBook& bookConst=bookMemory;
+   for (i=0; i<boards.size(); i++) {
+      if (bookConst.FindAnyReflection(boards[i]))
+         nHits++;
+   }
+   tLookup=timer.elapsed();
+
+   cout << fn << ": " << bookMemory.Positions() << " positions, " << bookMemory.MemoryUsed()/(1<<20) << " MB of tables\n";
+   cout << "load " << tLoad << "s, join into an empty book " << tJoin << "s\n";
+   cout << boards.size() << " lookups, " << nHits << " hits: " << tLookup*1e9/Max(boards.size(), size_t(1)) << " ns per lookup\n";
+}
+
+//////////////////////////////////////////
+// Book delta
+//	Time the delta protocol that syncs the expand-book server and its clients.
+//	Run as "ntest td <params> <nChanged> <book file>".
+//	Sends the whole book, then the last nChanged positions joined into the copy as a
+//	stand-in for one sync, then the whole book as a boost archive as the older commands do.
+//////////////////////////////////////////
+
+void TestBookDelta(const char* fn, int nChanged) {
+   CBookDeltaHeader header;
+   CBookDeltaStats stats;
+   double tWrite, tRead;
+
+   if (!fn || !*fn) {
+      cerr << "Usage: ntest td <params> <nChanged> <book file>\n";
+      return;
+   }
+
+   CBook book(fn, no_save);
+   CBook copy(0, no_save);
+   Timer<double> timer;
+
+   std::stringstream full(std::ios::in | std::ios::out | std::ios::binary);
+   stats=WriteBookFull(full, book, 1, 0, false);
+   tWrite=timer.elapsed();
+   cout << "whole book: " << stats.nPositions << " positions, " << stats.nBytes << " bytes, write " << tWrite << "s\n";
+   full.str(std::string());
+
+   std::stringstream compressed(std::ios::in | std::ios::out | std::ios::binary);
+   timer.start();
+   stats=WriteBookFull(compressed, book, 1, 0, true);
+   tWrite=timer.elapsed();
+   timer.start();
+   ReadBookDelta(compressed, copy, 0, header);
+   tRead=timer.elapsed();
+   cout << "whole book, compressed: " << stats.nBytes << " bytes, write " << tWrite << "s, read and join " << tRead << "s\n";
+   compressed.str(std::string());
+
+   size_t iTo=copy.NChanges();
+   size_t iFrom=iTo-Min(size_t(Max(nChanged, 0)), iTo);
+   std::stringstream delta(std::ios::in | std::ios::out | std::ios::binary);
+   timer.start();
+   stats=WriteBookDelta(delta, copy, 1, iFrom, iTo, iTo, true);
+   tWrite=timer.elapsed();
+   timer.start();
+   stats=ReadBookDelta(delta, book, 0, header);
+   tRead=timer.elapsed();
+   cout << "delta: " << stats.nPositions << " positions, " << stats.nBytes << " bytes, write " << tWrite << "s, read and join " << tRead << "s\n";
+
+   std::ostringstream archive(std::ios::out | std::ios::binary);
+   timer.start();
+   {
+      boost::archive::binary_oarchive oa(archive);
+      oa << book;
+   }
+   tWrite=timer.elapsed();
+   cout << "boost archive: " << archive.tellp() << " bytes, write " << tWrite << "s\n";
+}
+
 void TestMoveSpeed(int hSolveFrom, int nGames, char* sMode) {
    CHeightInfo hi(hSolveFrom-hSolverStart, 0,true);
    //if (!LoadTestGames())
    //   return;
-   if (false) {
+   if (sMode && *sMode=='b')
+      TestBookSpeed(fnOpening.c_str(), nGames);
+   else if (sMode && *sMode=='d')
+      TestBookDelta(fnOpening.c_str(), nGames);
+   else if (sMode && *sMode=='c')
+      TestCompactCoeffs(nGames);
+   else if (sMode && *sMode=='s')
+      TestEndgameSimd();
+   else if (false) {
       fPrintMoveSearch=true;
       //FFOTest();
       // if the mode contains an e it is endgame only
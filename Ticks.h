@@ -16,4 +16,15 @@
 i8 GetTicks();
 i8 GetTicksPerSecond();
 
+// processor cycle counter, for timing short stretches of code
+#if defined(_MSC_VER)
+#include <intrin.h>
+inline i8 GetCycles() { return __rdtsc(); }
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+inline i8 GetCycles() { return __rdtsc(); }
+#else
+inline i8 GetCycles() { return GetTicks(); }
+#endif
+
 #endif
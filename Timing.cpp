@@ -314,9 +314,6 @@ bool CCalcParamsMatchTime::RoundOK(const CHeightInfo& hi, int nEmpty, double tEl
 double CCalcParamsMatchTime::TTypical(int nEmpty, double tRemaining) const {
    double t;
 
-   // subtract buffer for clearing cache
-   tRemaining-=nEmpty*tSetStale;
-
    // adjust remaining time if we are running out
    if(tRemaining<=6)
       tRemaining=2;
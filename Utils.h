@@ -11,6 +11,7 @@
 #define _H_UTILS
 
 #include <iostream>
+#include <stdint.h>
 
 /////////////////////////////////////////
 // Generic types
@@ -32,6 +33,11 @@ typedef signed char i1;
 typedef signed short i2;
 typedef signed long i4;
 typedef __int64 i8;
+#ifdef _MSC_VER
+typedef unsigned __int64 u64;
+#else
+typedef unsigned long long u64;
+#endif
 
 inline void CHECKNEW(bool x) {
    if (!x) {
@@ -40,15 +46,109 @@ inline void CHECKNEW(bool x) {
    }
 }
 
+/////////////////////////////////////////
+// Thread-local storage
+//	The position being searched lives in globals (bb, configs, the empty list...).
+//	Each search thread needs its own copy, so those globals are declared TLS.
+//	Older MSVC only has __declspec(thread), which can't hold objects with constructors,
+//	so there the globals stay shared and the search runs single-threaded.
+/////////////////////////////////////////
+
+#if defined(_MSC_VER) && _MSC_VER<1900
+#define TLS
+#define SINGLE_THREADED_SEARCH 1
+#else
+#define TLS thread_local
+#define SINGLE_THREADED_SEARCH 0
+#endif
+
+/////////////////////////////////////////
+// Native 64-bit bit routines
+//	Intrinsics are chosen at compile time. popcnt is used only if the compiler
+//	targets a CPU that has it (/arch:AVX or -mpopcnt), likewise tzcnt (/arch:AVX2 or -mbmi);
+//	otherwise these fall back to bsf and arithmetic that every x86 has.
+/////////////////////////////////////////
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// number of set bits
+inline int CountBits64(u64 a) {
+#if defined(_MSC_VER) && defined(_M_X64) && defined(__AVX__)
+   return int(__popcnt64(a));
+#elif defined(_MSC_VER) && defined(__AVX__)
+   return int(__popcnt(u4(a))+__popcnt(u4(a>>32)));
+#elif defined(__GNUC__) && defined(__POPCNT__)
+   return __builtin_popcountll(a);
+#else
+   a=a-((a>>1)&0x5555555555555555ULL);
+   a=(a&0x3333333333333333ULL)+((a>>2)&0x3333333333333333ULL);
+   a=(a+(a>>4))&0x0F0F0F0F0F0F0F0FULL;
+   return int((a*0x0101010101010101ULL)>>56);
+#endif
+}
+
+// index of the lowest set bit. a must not be 0
+inline int LowBit64(u64 a) {
+#if defined(_MSC_VER) && defined(_M_X64) && defined(__AVX2__)
+   return int(_tzcnt_u64(a));
+#elif defined(_MSC_VER) && defined(_M_X64)
+   unsigned long i;
+   _BitScanForward64(&i, a);
+   return int(i);
+#elif defined(_MSC_VER)
+   unsigned long i;
+   if (_BitScanForward(&i, u4(a)))
+      return int(i);
+   _BitScanForward(&i, u4(a>>32));
+   return int(i)+32;
+#elif defined(__GNUC__)
+   return __builtin_ctzll(a);
+#else
+   int i;
+   for (i=0; !(a&1); i++)
+      a>>=1;
+   return i;
+#endif
+}
+
+// hint that the memory at p will be read soon
+inline void Prefetch(const void* p) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+   _mm_prefetch((const char*)p, _MM_HINT_T0);
+#elif defined(__GNUC__)
+   __builtin_prefetch(p);
+#endif
+}
+
+// reverse the order of the bytes (rows of a bitboard)
+inline u64 ByteSwap64(u64 a) {
+#if defined(_MSC_VER)
+   return _byteswap_uint64(a);
+#elif defined(__GNUC__)
+   return __builtin_bswap64(a);
+#else
+   a=((a>>8)&0x00FF00FF00FF00FFULL)|((a&0x00FF00FF00FF00FFULL)<<8);
+   a=((a>>16)&0x0000FFFF0000FFFFULL)|((a&0x0000FFFF0000FFFFULL)<<16);
+   return (a>>32)|(a<<32);
+#endif
+}
+
 /////////////////////////////////////////
 // u8 data type
+//	A 64-bit bitboard. The operators work on the native 64-bit value; the
+//	u4/u2/u1 views are there for code that works a row or half at a time.
+//	The u4 view is uint32_t, not u4, which is 8 bytes where long is. u8 has to stay
+//	8 bytes because it's in book files.
 /////////////////////////////////////////
 
 class u8 {
 public:
    union {
       i8 i8s;
-      u4 u4s[2];
+      u64 bits;
+      uint32_t u4s[2];
       u2 u2s[4];
       u1 u1s[8];
    };
@@ -60,39 +160,39 @@ public:
    }
 
    // access operator
-   const u4& operator[](int a)const {return u4s[a];};
-   u4& operator[](int a) {return u4s[a];};
+   const uint32_t& operator[](int a)const {return u4s[a];};
+   uint32_t& operator[](int a) {return u4s[a];};
 
    // bit operators
-   u8 operator&(const u8& b) const { u8 result; result[0]=u4s[0]&b[0]; result[1]=u4s[1]&b[1]; return result;};
-   u8 operator|(const u8& b) const { u8 result; result[0]=u4s[0]|b[0]; result[1]=u4s[1]|b[1]; return result;};
-   u8 operator^(const u8& b) const { u8 result; result[0]=u4s[0]^b[0]; result[1]=u4s[1]^b[1]; return result;};
-   u8 operator~() const { u8 result; result[0]=~u4s[0]; result[1]=~u4s[1]; return result;};
-   u8 operator<<(int n) const {u8 result; result[1]=(u4s[1]<<n)|(u4s[0]>>(32-n)); result[0]=u4s[0]<<n; return result;}
-   u8 operator>>(int n) const {u8 result; result[0]=(u4s[0]>>n)|(u4s[1]<<(32-n)); result[1]=u4s[1]>>n; return result;}
+   u8 operator&(const u8& b) const { u8 result; result.bits=bits&b.bits; return result;};
+   u8 operator|(const u8& b) const { u8 result; result.bits=bits|b.bits; return result;};
+   u8 operator^(const u8& b) const { u8 result; result.bits=bits^b.bits; return result;};
+   u8 operator~() const { u8 result; result.bits=~bits; return result;};
+   u8 operator<<(int n) const {u8 result; result.bits=bits<<n; return result;}
+   u8 operator>>(int n) const {u8 result; result.bits=bits>>n; return result;}
 
    // assignment operators
-   u8 operator&=(const u8& b) { u4s[0]&=b[0]; u4s[1]&=b[1]; return *this;};
-   u8 operator|=(const u8& b) { u4s[0]|=b[0]; u4s[1]|=b[1]; return *this;};
-   u8 operator^=(const u8& b) { u4s[0]^=b[0]; u4s[1]^=b[1]; return *this;};
-   u8 operator=(const u8& b) { u4s[0] =b[0]; u4s[1] =b[1]; return *this;};
-   u8 operator<<=(int n) {u4s[1]=(u4s[1]<<n)|(u4s[0]>>(32-n)); u4s[0]<<=n; return *this;}
-   u8 operator>>=(int n) {u4s[0]=(u4s[0]>>n)|(u4s[1]<<(32-n)); u4s[1]>>=n; return *this;}
+   u8 operator&=(const u8& b) { bits&=b.bits; return *this;};
+   u8 operator|=(const u8& b) { bits|=b.bits; return *this;};
+   u8 operator^=(const u8& b) { bits^=b.bits; return *this;};
+   u8 operator=(const u8& b) { bits=b.bits; return *this;};
+   u8 operator<<=(int n) {bits<<=n; return *this;}
+   u8 operator>>=(int n) {bits>>=n; return *this;}
 
    // comparison operators
-   bool operator==(const u8& b) const { return u4s[0]==b[0] && u4s[1]==b[1];}
-   bool operator!=(const u8& b) const { return !(*this==b);}
-   bool operator<(const u8& b) const { return (u4s[1]==b[1])?(u4s[0]<b[0]):(u4s[1]<b[1]);};
+   bool operator==(const u8& b) const { return bits==b.bits;}
+   bool operator!=(const u8& b) const { return bits!=b.bits;}
+   bool operator<(const u8& b) const { return bits<b.bits;};
    bool operator>(const u8& b) const { return (u4s[0]==b[0])?(u4s[1]>b[1]):(u4s[0]>b[0]);};
 
    // other operators
-   bool operator!() const { return u4s[0]==0 && u4s[1]==0; };
+   bool operator!() const { return bits==0; };
 
-   void SetBit(int n)		{ u4s[n>>5]|=(1<<(n&31)); }
-   void FlipBit(int n)		{ u4s[n>>5]^=(1<<(n&31)); }
-   void ClearBit(int n)	{ u4s[n>>5]&=~(1<<(n&31)); }
+   void SetBit(int n)		{ bits|=u64(1)<<n; }
+   void FlipBit(int n)		{ bits^=u64(1)<<n; }
+   void ClearBit(int n)	{ bits&=~(u64(1)<<n); }
 
-   int GetBit(int n) const { return u4s[n>>5]&(1<<(n&31)); }	// returns nonzero if bit is set, but not guaranteed to be 1
+   int GetBit(int n) const { return (bits>>n)&1; }	// returns nonzero if bit is set
 };
 
 /////////////////////////////////////////
@@ -145,18 +245,7 @@ inline u2 CountBitsInline(u4 a)  {
 }
 
 inline u2 CountBitsInline(u8 a) {
-   u4 count;
-
-   a[0]=(a[0]&cbmask1)+((a[0]>>1)&cbmask1);
-   a[0]=(a[0]&cbmask2)+((a[0]>>2)&cbmask2);
-   a[1]=(a[1]&cbmask1)+((a[1]>>1)&cbmask1);
-   a[1]=(a[1]&cbmask2)+((a[1]>>2)&cbmask2);
-   count=a[0]+a[1];
-   count=(count&cbmask4)+((count>>4)&cbmask4);
-   count=(count&0xFFFF)+(count>>16);
-   count=(count&0xFF)+(count>>8);
-
-   return (u2)count;
+   return (u2)CountBits64(a.bits);
 }
 
 //////////////////////////////////////////
@@ -0,0 +1,221 @@
+// Copyright Daniel Lidstrom
+//	All Rights Reserved
+// This file is distributed subject to GNU GPL version 2. See the files
+// Copying.txt and GPL.txt for details.
+
+#include "PreCompile.h"
+#include "WorkQueue.h"
+#include "Log.h"
+
+#include <boost/format.hpp>
+#include <algorithm>
+#include <set>
+
+namespace
+{
+   // lease size for a client whose throughput isn't known yet
+   const std::size_t kFirstLease = 5;
+   const std::size_t kMinLease = 2;
+   const std::size_t kMaxLease = 200;
+
+   bool Contains(const VariationCollection& variations, const Variation& variation)
+   {
+      return std::find(variations.begin(), variations.end(), variation)!=variations.end();
+   }
+
+   // remove the variations that are in finished, return how many were removed
+   std::size_t RemoveFinished(VariationCollection& variations, const VariationCollection& finished)
+   {
+      VariationCollection::iterator it
+         = std::remove_if(variations.begin(),
+                          variations.end(),
+                          [&finished](const Variation& variation) {
+                             return Contains(finished, variation);
+                          });
+      std::size_t n = std::distance(it, variations.end());
+      variations.erase(it, variations.end());
+      return n;
+   }
+}
+
+WorkQueue::WorkQueue(double targetSeconds)
+   : targetSeconds(targetSeconds)
+{}
+
+void WorkQueue::Refill(const VariationCollection& variations)
+{
+   waiting.clear();
+   foreach(const Variation& variation, variations) {
+      bool onLease = false;
+      foreach(const lease& l, leases) {
+         if( Contains(l.variations, variation) ) {
+            onLease = true;
+            break;
+         }
+      }
+      if( !onLease )
+         waiting.push_back(variation);
+   }
+   std::sort(waiting.begin(), waiting.end());
+   Log(std::cout)
+      << boost::format("Queued %1% variations, %2% draws. %3% on lease.")
+      % waiting.size() % WaitingDraws() % OnLease()
+      << std::endl
+      ;
+}
+
+VariationCollection WorkQueue::Lease(const std::string& client)
+{
+   Reclaim();
+
+   VariationCollection variations;
+   std::size_t n = std::min(LeaseSize(client), waiting.size());
+   if( n==0 )
+      return variations;
+
+   lease l;
+   l.client = client;
+   l.variations.assign(waiting.begin(), waiting.begin()+n);
+   l.tStart = clock.elapsed();
+   // give a client with a known rate three times its expected time, at least twice the target
+   const client_stats& stats = clients[client];
+   double expected = stats.rate>0 ? n/stats.rate : 2*targetSeconds;
+   l.tDeadline = l.tStart + std::max(2*targetSeconds, 3*expected);
+   leases.push_back(l);
+   waiting.erase(waiting.begin(), waiting.begin()+n);
+
+   Log(std::cout)
+      << boost::format("Leased %1% variations to %2% for %3$.0f minutes (%4% in queue, %5% on lease).")
+      % n % client % ((l.tDeadline-l.tStart)/60) % waiting.size() % OnLease()
+      << std::endl
+      ;
+   return l.variations;
+}
+
+void WorkQueue::Complete(const std::string& client, const VariationCollection& finished)
+{
+   const double now = clock.elapsed();
+   client_stats& stats = clients[client];
+   stats.nFinished += finished.size();
+
+   // close the client's oldest lease with any of the finished variations.
+   // The client's newer leases, and leases that expired, are left alone
+   std::list<lease>::iterator it;
+   for( it=leases.begin(); it!=leases.end(); ++it ) {
+      if( it->client!=client )
+         continue;
+      VariationCollection unfinished = it->variations;
+      std::size_t nDone = RemoveFinished(unfinished, finished);
+      if( nDone==0 )
+         continue;
+      double t = std::max(now - it->tStart, 1.);
+      double sample = nDone/t;
+      stats.rate = stats.rate>0 ? 0.7*stats.rate + 0.3*sample : sample;
+      Log(std::cout)
+         << boost::format("%1% finished %2% of %3% variations in %4$.0f seconds, %5$.2f per minute. Next lease %6%.")
+         % client % nDone % it->variations.size() % t % (60*stats.rate) % LeaseSize(client)
+         << std::endl
+         ;
+      leases.erase(it);
+      Requeue(unfinished);
+      break;
+   }
+
+   // no one else needs to expand the finished variations
+   std::size_t nRemoved = RemoveFinished(waiting, finished);
+   foreach(lease& l, leases)
+      nRemoved += RemoveFinished(l.variations, finished);
+   if( nRemoved ) {
+      Log(std::cout)
+         << "Removed "
+         << nRemoved
+         << " variations that are in book already."
+         << std::endl
+         ;
+   }
+}
+
+std::size_t WorkQueue::Reclaim()
+{
+   const double now = clock.elapsed();
+   std::size_t n = 0;
+   std::list<lease>::iterator it = leases.begin();
+   while( it!=leases.end() ) {
+      if( it->tDeadline<now ) {
+         Log(std::cout)
+            << boost::format("Lease of %1% variations to %2% expired.")
+            % it->variations.size() % it->client
+            << std::endl
+            ;
+         // the client was slower than measured, give it less next time
+         clients[it->client].rate /= 2;
+         n += it->variations.size();
+         Requeue(it->variations);
+         it = leases.erase(it);
+      }
+      else {
+         ++it;
+      }
+   }
+   return n;
+}
+
+std::size_t WorkQueue::Waiting() const
+{
+   return waiting.size();
+}
+
+std::size_t WorkQueue::OnLease() const
+{
+   std::size_t n = 0;
+   foreach(const lease& l, leases)
+      n += l.variations.size();
+   return n;
+}
+
+std::size_t WorkQueue::WaitingDraws() const
+{
+   return std::count_if(waiting.begin(), waiting.end(), [](const Variation& variation) {
+      return variation.IsDraw();
+   });
+}
+
+std::size_t WorkQueue::TypicalLease() const
+{
+   if( clients.empty() )
+      return kFirstLease;
+   std::size_t sum = 0;
+   std::map<std::string, client_stats>::const_iterator it;
+   for( it=clients.begin(); it!=clients.end(); ++it )
+      sum += LeaseSize(it->first);
+   return std::max<std::size_t>(sum/clients.size(), kMinLease);
+}
+
+bool WorkQueue::RunningLow() const
+{
+   std::set<std::string> busy;
+   std::size_t needed = 0;
+   foreach(const lease& l, leases) {
+      if( busy.insert(l.client).second )
+         needed += LeaseSize(l.client);
+   }
+   return waiting.size()<std::max(needed, TypicalLease());
+}
+
+std::size_t WorkQueue::LeaseSize(const std::string& client) const
+{
+   std::map<std::string, client_stats>::const_iterator it = clients.find(client);
+   if( it==clients.end() || it->second.rate<=0 )
+      return kFirstLease;
+   std::size_t n = static_cast<std::size_t>(it->second.rate*targetSeconds + 0.5);
+   return std::min(std::max(n, kMinLease), kMaxLease);
+}
+
+void WorkQueue::Requeue(const VariationCollection& variations)
+{
+   foreach(const Variation& variation, variations) {
+      if( !Contains(waiting, variation) )
+         waiting.push_back(variation);
+   }
+   std::sort(waiting.begin(), waiting.end());
+}
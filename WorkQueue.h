@@ -0,0 +1,118 @@
+// $Id$
+// Copyright Daniel Lidstrom
+//	All Rights Reserved
+// This file is distributed subject to GNU GPL version 2. See the files
+// Copying.txt and GPL.txt for details.
+//! @file
+//! The expand-book server's queue of variations, and the leases of the
+//! clients expanding them.
+//!
+//! Waiting variations are kept in priority order, the order of
+//! Variation::operator<: draws first, then by book value delta. A fetch
+//! leases the first variations to the client. The lease is closed when
+//! the client syncs the finished variations. A lease that isn't closed
+//! by its deadline expires, and its variations go back in the queue for
+//! another client.
+//!
+//! Each client's throughput is measured from its closed leases, and
+//! sizes its next lease so that it comes back after about the target
+//! time.
+//! @ingroup
+//!
+
+#if !defined(WORKQUEUE_H__20240318T0930)
+#define WORKQUEUE_H__20240318T0930
+
+#include "Fwd.h"
+#include "Variation.h"
+#include "timer.h"
+#include <list>
+#include <map>
+#include <string>
+
+//!
+//! Variations waiting to be expanded, and the variations on lease.
+//! Not thread safe; the server changes it from its book writer only.
+//!
+class WorkQueue
+{
+public:
+
+   //!
+   //! Constructor.
+   //! @param targetSeconds  time a client should take to finish a lease
+   //!
+   WorkQueue(double targetSeconds);
+
+   //!
+   //! Replace the waiting variations with these. Variations on lease are left out,
+   //! so they aren't sent twice.
+   //!
+   void Refill(const VariationCollection& variations);
+
+   //!
+   //! Lease the next variations to the client. Expired leases are reclaimed first.
+   //! Empty if nothing is waiting.
+   //!
+   VariationCollection Lease(const std::string& client);
+
+   //!
+   //! The client has finished these variations. Closes the client's oldest
+   //! lease and measures its throughput. Finished variations are removed
+   //! wherever they are, also from other clients' leases.
+   //!
+   void Complete(const std::string& client, const VariationCollection& finished);
+
+   //!
+   //! Put the variations of expired leases back in the queue.
+   //! @return number of variations put back
+   //!
+   std::size_t Reclaim();
+
+   std::size_t Waiting() const;
+   std::size_t OnLease() const;
+   std::size_t WaitingDraws() const;
+
+   //!
+   //! Average lease size of the clients, to size refills.
+   //!
+   std::size_t TypicalLease() const;
+
+   //!
+   //! True if the waiting variations won't cover the next fetch
+   //! of each client with a lease.
+   //!
+   bool RunningLow() const;
+
+private:
+
+   struct lease
+   {
+      std::string client;
+      VariationCollection variations;
+      double tStart;
+      double tDeadline;
+   };
+
+   struct client_stats
+   {
+      client_stats()
+         : rate(0),
+           nFinished(0)
+      {}
+
+      double rate;   // variations per second, 0 until measured
+      std::size_t nFinished;
+   };
+
+   std::size_t LeaseSize(const std::string& client) const;
+   void Requeue(const VariationCollection& variations);
+
+   const double targetSeconds;
+   Timer<double> clock;
+   VariationCollection waiting;   // in priority order
+   std::list<lease> leases;   // oldest first
+   std::map<std::string, client_stats> clients;
+};
+
+#endif
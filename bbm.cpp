@@ -19,6 +19,9 @@
 #include "PreCompile.h"
 #include "bbm.h"
 
+// MMX inline assembly; other targets use NativeMoves() in BitBoard.cpp
+#if defined(_MSC_VER) && defined(_M_IX86)
+
 typedef unsigned __int64 u64;
 
 static const u64 c55555555					= 0x5555555555555555;
@@ -901,3 +904,5 @@ int DimaMobility(const __int64 my_bits, const __int64 opp_bits) {
       emms;
    }
 }
+
+#endif // _M_IX86
@@ -26,6 +26,8 @@
 #include "Client.h"
 #include "ExtractDraws.h"
 #include "ExtractLines.h"
+#include "SearchThreads.h"
+#include "MovesSimd.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,6 +50,7 @@ enum modality
    kSpeedTest,
    kCalcMPC,
    kPosValues,
+   kTuneProbCut,
    kGetStartPos,
    kAssignBook,
    kEdmundBook,
@@ -83,6 +86,7 @@ void Init() {
 
    extern void InitNewFF();
    InitNewFF();
+   InitSimdMoves();
 
 #ifdef _DEBUG
    int tmpFlag = _CrtSetDbgFlag( _CRTDBG_REPORT_FLAG );
@@ -113,6 +117,20 @@ void Test() {
    CBitBoard::Test();
 }
 
+// a computer per search thread, each with a slice of the cache memory
+std::vector<CPlayerComputerPtr> CalibrationComputers(const CComputerDefaults& cd) {
+   int nComputers = SINGLE_THREADED_SEARCH ? 1 : std::max(nSearchThreads, 1);
+   if( nComputers>1 ) {
+      // the cache files would clash
+      maxCacheMem /= nComputers;
+      fPersistentCache = false;
+   }
+   std::vector<CPlayerComputerPtr> computers;
+   for( int i=0; i<nComputers; i++ )
+      computers.push_back(CPlayerComputer::Create(cd, false));
+   return computers;
+}
+
 int __cdecl main(int argc, char**argv, char**envp) {
    //_CrtSetBreakAlloc(516625);
    time_t end_time;
@@ -161,7 +179,7 @@ int __cdecl main(int argc, char**argv, char**envp) {
       case kExpandBook:
       {
          if( argc<6 ) {
-            cerr << "Usage: " << argv[0] << " b11 sXX bound skip-count [server server-port] | [client server-address server-port]" << std::endl;
+            cerr << "Usage: " << argv[0] << " b11 sXX bound skip-count [server server-port] | [client server-address server-port [workers]] | [loadtest server-address server-port [clients] [rounds]]" << std::endl;
             success = EXIT_FAILURE;
          }
          else {
@@ -172,6 +190,9 @@ int __cdecl main(int argc, char**argv, char**envp) {
             else if( submode=="client" ) {
                success = Client(argc, argv, cd1);
             }
+            else if( submode=="loadtest" ) {
+               success = LoadTest(argc, argv);
+            }
             else {
                cerr << "Unknown sub-mode: " << submode << std::endl;
                success = EXIT_FAILURE;
@@ -230,14 +251,19 @@ int __cdecl main(int argc, char**argv, char**envp) {
       }
       case kCalcMPC: {
          cd1.booklevel=CComputerDefaults::kNoBook;
-         CPlayerComputerPtr computer1 = CPlayerComputer::Create(cd1, false);
-         CalcMPCStats(computer1, cd1.MinutesOrDepth());
+         CalcMPCStats(CalibrationComputers(cd1), cd1.MinutesOrDepth());
          break;
       }
       case kPosValues: {
          cd1.booklevel=CComputerDefaults::kNoBook;
-         CPlayerComputerPtr computer1 = CPlayerComputer::Create(cd1, false);
-         CalcPosValues(computer1, submode[0]=='a');
+         CalcPosValues(CalibrationComputers(cd1), submode[0]=='a');
+         break;
+      }
+      case kTuneProbCut: {
+         // arguments: search depth, positions to search, fraction of verified cuts allowed to be wrong
+         cd1.booklevel=CComputerDefaults::kNoBook;
+         PrintStuff(false);
+         TuneProbCut(CalibrationComputers(cd1), cd1.MinutesOrDepth(), argc>3 ? nGames : 200, argc>4 ? atof(argv[4]) : 0.05);
          break;
       }
       case kEdmundBook: {
@@ -281,6 +307,13 @@ int __cdecl main(int argc, char**argv, char**envp) {
             exploreEdmunds = true;
             cd1.fEdmundAfter = true;
          }
+         // games played at once, 2 unless given so both games of a synchro match fit.
+         //	Each has its own cache; they share the memory from parameters.txt, and the cache files would clash
+         int nGamesAtOnce = argc>3 ? std::max(nGames, 1) : 2;
+         if( nGamesAtOnce>1 ) {
+            maxCacheMem /= nGamesAtOnce;
+            fPersistentCache = false;
+         }
          CPlayerComputerPtr computer1 = CPlayerComputer::Create(cd1, !exploreEdmunds);
          CBookPtr bp = computer1->book.lock();
 #if !defined(_DEBUG)
@@ -420,6 +453,8 @@ int __cdecl main(int argc, char**argv, char**envp) {
 
    cout << nProven << " / " << nStableChecks << " = " << (double)nProven*100/(std::max)(1, nStableChecks) << "% stable checks proved WLD\n";
    //PrintBookReadData();
+   if (nProbCutStats)
+      WriteProbCutReport((string(fnBaseDir)+"probcut.txt").c_str(), mpcs);
    time(&end_time);
    printf("\n\nRun completed at GMT %s\n",asctime(gmtime(&end_time)));
    end.Read();
@@ -462,6 +497,7 @@ void ParseCommandLine(int argc,
       case 'm': mode=kCalcMPC; break;
       case 'n': mode=kAssignBook; break;
       case 'p': mode=kPosValues; break;
+      case 'u': mode=kTuneProbCut; break;
          //case 's': mode=kGetStartPos; break;
       case 't': mode=kSpeedTest; break;
       case 'x': mode=kExtractLines; break;
@@ -511,12 +547,26 @@ void ReadMachineParameters(istream& isBig) {
    // read the following parameters:
    //	int maxCacheMem - size in bytes available for cache (in file in MB,converted here to bytes)
    //	double dGHz - Approx processor speed
+   //	int nSearchThreads - number of search threads (optional)
+   //	bool fPersistentCache - 1 to keep the cache in files between runs (optional)
+   //	bool fCompactCoeffs - 1 to store the evaluator coefficients in the compact format (optional)
+   //	int nProbCutStats - 1 to count ProbCut cuts, n>1 to also verify one cut in n; written to probcut.txt (optional)
+   //	bool fTunedMPC - 1 to use the ProbCut cuts TuneProbCut wrote (optional)
 
    //	first set default values in case we can't read for some reason
    maxCacheMem=10;
    dGHz=0.4;
-
-   is >> maxCacheMem >> dGHz;
+   nSearchThreads=1;
+   fPersistentCache=false;
+   fCompactCoeffs=false;
+   nProbCutStats=0;
+   fTunedMPC=false;
+
+   is >> maxCacheMem >> dGHz >> nSearchThreads >> fPersistentCache >> fCompactCoeffs >> nProbCutStats >> fTunedMPC;
+   if (nProbCutStats<0)
+      nProbCutStats=0;
+   if (nSearchThreads<1)
+      nSearchThreads=1;
 
    // convert MBytes to bytes in maxCacheMem
    maxCacheMem<<=20;
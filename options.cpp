@@ -25,22 +25,24 @@ double dGHz;	//	double dGHz - Approx processor speed
 
 // maximum memory for cache
 int maxCacheMem=25<<20; // can be up to 90<<20 on 128MB NT machine
-double tSetStale=0.17;	// time to SetStale() in seconds... so we don't lose on time
+bool fBackgroundCacheClear=true;
+bool fPersistentCache=false;
+bool fCompactCoeffs=false;
 
 // opponent's move?
-bool fTooting=false;
+TLS bool fTooting=false;
 bool fMyMove=false;
-TMoveSignal moveSignalOpponent=kSignalStdin;
+TLS TMoveSignal moveSignalOpponent=kSignalStdin;
 
 // book-do solved nodes count as minimal nodes?
 bool fSolvedAreMinimal=true;
 
 // search parameters
-std::weak_ptr<CBook> book;
-CCache* cache=0;
+TLS std::weak_ptr<CBook> book;
+TLS CCache* cache=0;
 CEvaluator* evaluate=0;
 CMPCStats* mpcs=0;
-int hBookRead=0;
+TLS int hBookRead=0;
 
 bool fPrintAbort=true;
 
@@ -50,6 +52,7 @@ bool fPrintTree=false;
 bool fPrintTimeUsed=false;
 bool fPrintWLD=false;
 bool fPrintMoveSearch=false;
+bool fPrintCacheStats=false;
 bool fCompareMode=false;
 
 void SetMatchTime(double aMatchTime) {
@@ -12,6 +12,7 @@
 
 #include <stdio.h>
 #include "Fwd.h"
+#include "Utils.h"
 
 // if COUNTNODES is 1, we count a node every time we flip a disc
 //	if it is 2, we also count a node when nEmpty==1 and we merely
@@ -32,12 +33,15 @@ extern bool fPrintTimeUsed;
 extern bool fPrintWLD;
 extern bool fPrintMPCStats;
 extern bool fPrintMoveSearch;
+extern bool fPrintCacheStats;	// print cache probe timings after each search
 extern bool fCompareMode;
 extern int treeNEmpty;
-extern std::weak_ptr<CBook> book;
+// book and cache of the search. They are per thread, so that independent searches
+//	can each use their own cache; threads that help a search copy them, see CSearchContext
+extern TLS std::weak_ptr<CBook> book;
 
 // search parameters
-extern CCache* cache;
+extern TLS CCache* cache;
 extern CEvaluator* evaluate;
 extern CMPCStats* mpcs;
 
@@ -52,12 +56,19 @@ extern bool fPrintAbort;	// print abort message when aborting search?
 // maximum amount of memory to allocate to cache table.
 //	should be a bit less than the total RAM on the computer.
 extern int maxCacheMem;
-extern double tSetStale;
-
-// is it my move? Am I thinking on opponent's time?
-extern bool fMyMove, fTooting;
+// clear the cache table in a helper thread rather than stalling the search
+extern bool fBackgroundCacheClear;
+// keep the cache tables in files in the cache/ directory so they survive between runs
+extern bool fPersistentCache;
+// store evaluator coefficients in the compact format, see CCompactCoeffsJ
+extern bool fCompactCoeffs;
+
+// is it my move? Am I thinking on opponent's time? Per thread, so a ponder thread can think
+//	on the opponent's time while the main thread handles GGS messages.
+extern bool fMyMove;
+extern TLS bool fTooting;
 typedef enum {kSignalNone, kSignalStdin, kSignalGGS} TMoveSignal;
-extern TMoveSignal moveSignalOpponent;
+extern TLS TMoveSignal moveSignalOpponent;
 
 void SetMatchTime(double atMatch);
 